@@ -1,9 +1,24 @@
+/* declare posix functions such as fileno, and madvise from the default
+   set, under -std=c99. this has to come before the first include */
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 /* using quotes means it searches the current directory first */
 #include "mpc.h"
+#include <limits.h>
+#include <stdint.h>
+
+/* simd kernels for packed vectors are built for x86-64 with gcc or clang */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define LVEC_X86
+#include <immintrin.h>
+#endif
 
 /* include methods for if we compile this on windows */
 #ifdef _WIN32
 #include <string.h>
+#include <io.h>
+#include <fcntl.h>
 
 static char buffer[2048];
 
@@ -21,8 +36,15 @@ void add_history(char* unused) {}
 /* otherwise include editline headers for if running on MacOS*/
 #else
 #include<editline/readline.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #endif
 
+#include <errno.h>
+
 /* forward declare parsers  */
 
 mpc_parser_t* Number;
@@ -31,18 +53,42 @@ mpc_parser_t* String;
 mpc_parser_t* Comment;
 mpc_parser_t* Sexpr;
 mpc_parser_t* Qexpr;
+mpc_parser_t* Vector;
 mpc_parser_t* Expr;
 mpc_parser_t* aLisp;
 
 /* forward declare lval and lenv structs to avoid cyclic dependency */
 struct lval;
 struct lenv;
+struct lmemo;
+struct lopt;
+struct ltable;
+struct lhamt;
+struct lseq;
+struct lstrbuf;
+struct lmap;
+struct lgram;
+struct lport;
+struct lframe;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lmemo lmemo;
+typedef struct lopt lopt;
+typedef struct ltable ltable;
+typedef struct lhamt lhamt;
+typedef struct lseq lseq;
+typedef struct lstrbuf lstrbuf;
+typedef struct lmap lmap;
+typedef struct lgram lgram;
+typedef struct lport lport;
+typedef struct lframe lframe;
 
 /* create enum of possible lval types */
 enum { LVAL_ERR, LVAL_NUM,   LVAL_SYM, LVAL_STR,
-       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+       LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_BIG,
+       LVAL_DBL, LVAL_VEC, LVAL_TABLE, LVAL_MAP,
+       LVAL_SET, LVAL_SEQ, LVAL_RECUR, LVAL_GRAMMAR,
+       LVAL_PORT, LVAL_FRAME };
 
 /* define pointer-to-function lbuiltin */
 typedef lval*(*lbuiltin)(lenv*, lval*);
@@ -58,15 +104,66 @@ struct lval {
   char* sym;
   char* str;
 
+  /* for strings, the buffer holding the bytes, which str points
+     into. it is shared by every copy of the string and by strings
+     appended onto it, each of which sees only its first count bytes */
+  lstrbuf* sbuf;
+
+  /* for symbols, set on the last use of a parameter in a function
+     body, whose value can then be moved out of the environment */
+  int last_use;
+  /* for symbols in a loop body prepared by lopt_loop, a copy of the
+     global value found for it, used for as long as that holds */
+  lval* bound;
+
+  /* for big numbers, the magnitude as count base 10^9 limbs, least
+     significant first, with the sign (1 or -1) kept in num. a number
+     which fits in a long is always a plain number instead */
+  uint32_t* limbs;
+
+  /* for floating point numbers */
+  double dbl;
+
+  /* for packed vectors, count unboxed elements in exactly one of
+     these arrays, longs for integer vectors or doubles for floats */
+  long* ivec;
+  double* dvec;
+
+  /* for hash maps, the table shared by every copy of the map */
+  ltable* table;
+
+  /* for persistent maps and sets, the root of the trie, or NULL
+     when empty, with the number of entries in count */
+  lhamt* hamt;
+
+  /* for lazy sequences, the last stage of the pipeline */
+  lseq* seq;
+
+  /* for grammars, the compiled rules */
+  lgram* gram;
+
+  /* for ports, the buffered file or string */
+  lport* port;
+
+  /* for frames, the columns of the table */
+  lframe* frame;
+
   /* for function type lvals */
   lbuiltin builtin;
   lenv* env;
   lval* formals;
   lval* body;
+  /* shared result cache, set for functions wrapped by memo */
+  lmemo* memo;
+  /* optimizer record, set for lambdas whose body was optimized */
+  lopt* opt;
 
   /* for expression type lvals (s and q expressions)*/
   int count;
   lval** cell;
+  /* a q-expression holding only plain numbers keeps them unboxed
+     here instead of in cell, until anything else is added to it */
+  long* packed;
 };
 
 /* constructor for a pointer to a number type lval */
@@ -77,6 +174,36 @@ lval* lval_num(long x) {
   return v;
 }
 
+/* constructor for a pointer to a floating point number type lval */
+lval* lval_dbl(double x) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_DBL;
+  v->dbl = x;
+  return v;
+}
+
+/* constructor for a pointer to a big number type lval,
+   with room for count limbs all set to zero */
+lval* lval_big(long sign, int count) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_BIG;
+  v->num = sign;
+  v->count = count;
+  v->limbs = calloc(count ? count : 1, sizeof(uint32_t));
+  return v;
+}
+
+/* constructor for a pointer to a packed vector type lval, with
+   room for count longs, or doubles if dbl is set */
+lval* lval_vec(int dbl, int count) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_VEC;
+  v->count = count;
+  v->ivec = dbl ? NULL : malloc(sizeof(long) * (count ? count : 1));
+  v->dvec = dbl ? malloc(sizeof(double) * (count ? count : 1)) : NULL;
+  return v;
+}
+
 /* constructor for a pointer to an error type lval */
 lval* lval_err(char* fmt, ...) {
   lval* v =  malloc(sizeof(lval));
@@ -107,23 +234,214 @@ lval* lval_sym(char* s) {
   v->type = LVAL_SYM;
   v->sym = malloc(strlen(s) + 1);
   strcpy(v->sym, s);
+  v->last_use = 0;
+  v->bound = NULL;
   return v;
 }
 
-/* constructor for a pointer to a new string type lval */
-lval* lval_str(char* s) {
+/* a string buffer only ever grows at its end, so a string whose
+   bytes run to the end of the buffer can be appended onto in place,
+   without disturbing the shorter strings sharing it. the bytes are
+   null terminated at len, the length of the longest of them */
+struct lstrbuf {
+  int refs;
+  int len;
+  int cap;
+  /* for a view into a mapped file, the mapping holding the bytes */
+  lmap* map;
+  char data[];
+};
+
+/* a file mapped read only, kept while any string views into it. the
+   file is expected not to change while it is being read */
+struct lmap {
+  int refs;
+  char* data;
+  size_t len;
+  /* the bytes before this have been read through and handed back */
+  size_t released;
+};
+
+/* once this much of a mapping has been read through, its pages are
+   handed back so a long walk over a file doesn't keep all of it */
+#define LMAP_RELEASE (8 << 20)
+
+void lmap_release(lmap* m) {
+  if (--m->refs > 0) { return; }
+#ifdef _WIN32
+  free(m->data);
+#else
+  if (m->len) { munmap(m->data, m->len); }
+#endif
+  free(m);
+}
+
+/* map a file for reading, or return NULL with errno set. windows
+   has no mmap, so there the file is read into memory instead */
+lmap* lmap_open(char* name) {
+#ifdef _WIN32
+  int fd = open(name, O_RDONLY | O_BINARY);
+#else
+  int fd = open(name, O_RDONLY);
+#endif
+  if (fd < 0) { return NULL; }
+  lmap* m = calloc(1, sizeof(lmap));
+  m->refs = 1;
+#ifdef _WIN32
+  size_t cap = 0;
+  long n;
+  do {
+    if (m->len == cap) {
+      cap = cap ? cap * 2 : 1 << 16;
+      m->data = realloc(m->data, cap);
+    }
+    n = read(fd, m->data + m->len, cap - m->len);
+    if (n > 0) { m->len += n; }
+  } while (n > 0 || (n < 0 && errno == EINTR));
+#else
+  struct stat st;
+  int ok = fstat(fd, &st) == 0;
+  if (ok && st.st_size > 0) {
+    m->len = st.st_size;
+    m->data = mmap(NULL, m->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    ok = m->data != MAP_FAILED;
+#ifdef MADV_SEQUENTIAL
+    if (ok) { madvise(m->data, m->len, MADV_SEQUENTIAL); }
+#endif
+  }
+  if (!ok) {
+    int err = errno;
+    close(fd);
+    free(m);
+    errno = err;
+    return NULL;
+  }
+#endif
+  close(fd);
+  return m;
+}
+
+/* hand back the pages of a mapping before offset upto. they are read
+   back in from the file should anything still viewing them look again */
+void lmap_advance(lmap* m, size_t upto) {
+#if !defined(_WIN32) && defined(MADV_DONTNEED)
+  if (upto < m->released || upto - m->released < LMAP_RELEASE) { return; }
+  size_t page = sysconf(_SC_PAGESIZE);
+  upto -= upto % page;
+  madvise(m->data + m->released, upto - m->released, MADV_DONTNEED);
+  m->released = upto;
+#endif
+}
+
+lstrbuf* lstrbuf_new(int cap) {
+  lstrbuf* b = malloc(sizeof(lstrbuf) + cap + 1);
+  b->refs = 1;
+  b->len = 0;
+  b->cap = cap;
+  b->map = NULL;
+  b->data[0] = '\0';
+  return b;
+}
+
+void lstrbuf_release(lstrbuf* b) {
+  if (--b->refs > 0) { return; }
+  if (b->map) { lmap_release(b->map); }
+  free(b);
+}
+
+/* constructor for an empty string lval with room for cap bytes */
+lval* lval_str_cap(int cap) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_STR;
+  v->count = 0;
+  v->sbuf = lstrbuf_new(cap);
+  v->str = v->sbuf->data;
+  return v;
+}
+
+/* append n bytes onto the end of a string. this is done in place
+   when the string ends where the bytes in its buffer do and there is
+   room, otherwise the string moves to a new buffer of at least twice
+   the size, so building a string up piece by piece costs O(1)
+   amortized per byte however many copies of it are kept along the
+   way. a string may also be a slice from the middle of a buffer it
+   shares, whose bytes after it belong to others */
+void lval_str_append(lval* v, char* s, int n) {
+  lstrbuf* b = v->sbuf;
+  if (b->refs == 1 && !b->map && v->str == b->data) { b->len = v->count; }
+  int tail = b->len >= 0 && v->str + v->count == b->data + b->len;
+  if (!tail || b->cap - b->len < n) {
+    long cap = tail ? (long)b->cap * 2 : 0;
+    if (cap < (long)v->count + n) { cap = (long)v->count + n; }
+    if (cap > INT_MAX) { cap = INT_MAX; }
+    lstrbuf* nb = lstrbuf_new(cap);
+    memcpy(nb->data, v->str, v->count);
+    nb->len = v->count;
+    /* s may point into the old buffer, so keep it until copied */
+    memcpy(nb->data + nb->len, s, n);
+    lstrbuf_release(b);
+    b = v->sbuf = nb;
+    v->str = b->data;
+  } else {
+    memcpy(b->data + b->len, s, n);
+  }
+  v->count += n;
+  b->len = v->count;
+  b->data[b->len] = '\0';
+}
+
+/* the bytes of a string as a null terminated c string. a string
+   sharing its buffer with a longer one is moved to a buffer of its
+   own first, as the bytes after it aren't its to overwrite */
+char* lval_cstr(lval* v) {
+  if (v->sbuf->len != v->count) {
+    lstrbuf* b = lstrbuf_new(v->count);
+    memcpy(b->data, v->str, v->count);
+    b->len = v->count;
+    b->data[b->len] = '\0';
+    lstrbuf_release(v->sbuf);
+    v->sbuf = b;
+    v->str = b->data;
+  }
+  return v->str;
+}
+
+/* constructor for a string lval holding the first len bytes of s.
+   strings keep their length in count, so it never has to be found
+   again */
+lval* lval_str_len(char* s, int len) {
+  lval* v = lval_str_cap(len);
+  lval_str_append(v, s, len);
+  return v;
+}
+
+/* constructor for a string viewing len bytes of a mapped file in
+   place. its buffer holds none of the bytes and never matches the
+   length, so appending or asking for a c string copies them out */
+lval* lval_str_view(lmap* m, char* s, int len) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_STR;
-  v->str = malloc(strlen(s) + 1);
-  strcpy(v->str, s);
+  v->count = len;
+  v->sbuf = lstrbuf_new(0);
+  v->sbuf->len = -1;
+  v->sbuf->map = m;
+  m->refs++;
+  v->str = s;
   return v;
 }
 
+/* constructor for a pointer to a new string type lval */
+lval* lval_str(char* s) {
+  return lval_str_len(s, strlen(s));
+}
+
 /* constructor for a pointer to a new function type lval */
 lval* lval_builtin(lbuiltin func) {
   lval* v = malloc(sizeof(lval));
   v->type = LVAL_FUN;
   v->builtin = func;
+  v->memo = NULL;
+  v->opt = NULL;
   return v;
 }
 
@@ -139,6 +457,8 @@ lval* lval_lambda(lval* formals, lval* body) {
   v->type = LVAL_FUN;
   /* differentiates between user defined and builtin functions */
   v->builtin = NULL;
+  v->memo = NULL;
+  v->opt = NULL;
   /* initialize new environment for variables to be set */
   v->env = lenv_new();
 
@@ -153,6 +473,7 @@ lval* lval_sexpr(void) {
   v->type = LVAL_SEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->packed = NULL;
   return v;
 }
 
@@ -162,6 +483,7 @@ lval* lval_qexpr(void) {
   v->type = LVAL_QEXPR;
   v->count = 0;
   v->cell = NULL;
+  v->packed = NULL;
   return v;
 }
 
@@ -169,26 +491,69 @@ lval* lval_qexpr(void) {
    used to clean up user defined functions */
 void lenv_del(lenv* e);
 
+/* forward declare memo cache release and acquire for
+   use in deleting and copying memoized functions */
+void lmemo_release(lmemo* m);
+lmemo* lmemo_retain(lmemo* m);
+
+/* likewise for the optimizer record of optimized lambdas */
+void lopt_release(lopt* o);
+lopt* lopt_retain(lopt* o);
+
+/* and for the tables of hash maps, tries of persistent maps
+   and the stages of lazy sequences */
+void ltable_release(ltable* t);
+ltable* ltable_retain(ltable* t);
+void lhamt_release(lhamt* t);
+lhamt* lhamt_retain(lhamt* t);
+void lseq_release(lseq* s);
+lseq* lseq_retain(lseq* s);
+void lgram_release(lgram* g);
+lgram* lgram_retain(lgram* g);
+void lport_release(lport* p);
+lport* lport_retain(lport* p);
+void lframe_release(lframe* f);
+lframe* lframe_retain(lframe* f);
+
 /* method to delete an lval, depending on type */
 void lval_del(lval* v) {
   switch(v->type) {
   /* do nothing for number type, no nested malloc calls */
-  case LVAL_NUM: break;
+  case LVAL_NUM: case LVAL_DBL: break;
+  case LVAL_BIG: free(v->limbs); break;
+  case LVAL_VEC: free(v->ivec); free(v->dvec); break;
+  case LVAL_TABLE: ltable_release(v->table); break;
+  case LVAL_MAP: case LVAL_SET: lhamt_release(v->hamt); break;
+  case LVAL_SEQ: lseq_release(v->seq); break;
+  case LVAL_GRAMMAR: lgram_release(v->gram); break;
+  case LVAL_PORT: lport_release(v->port); break;
+  case LVAL_FRAME: lframe_release(v->frame); break;
   /* only nested malloc calls for user defined functions, not builtins */
   case LVAL_FUN:
-    if (!v->builtin) {
+    if (v->memo) {
+      lmemo_release(v->memo);
+    } else if (!v->builtin) {
       lenv_del(v->env);
       lval_del(v->formals);
       lval_del(v->body);
+      if (v->opt) { lopt_release(v->opt); }
     }
     break;
   /* free string data for errors and symbols */
   case LVAL_ERR: free(v->err); break;
-  case LVAL_SYM: free(v->sym); break;
-  case LVAL_STR: free(v->str); break;
+  case LVAL_SYM:
+    free(v->sym);
+    if (v->bound) { lval_del(v->bound); }
+    break;
+  case LVAL_STR: lstrbuf_release(v->sbuf); break;
   /* delete all lval elements recursively for s-expressions */
   case LVAL_QEXPR:
   case LVAL_SEXPR:
+  case LVAL_RECUR:
+    if (v->packed) {
+      free(v->packed);
+      break;
+    }
     for (int i = 0; i < v->count; i++) {
       lval_del(v->cell[i]);
     }
@@ -211,17 +576,53 @@ lval* lval_copy(lval* v) {
 
   switch (v->type) {
     case LVAL_FUN:
-      if (v->builtin) {
+      /* memoized functions share one cache between all copies */
+      x->memo = v->memo ? lmemo_retain(v->memo) : NULL;
+      if (v->builtin || v->memo) {
         x->builtin = v->builtin;
+        x->opt = NULL;
       } else {
         x->builtin = NULL;
         x->env = lenv_copy(v->env);
         x->formals = lval_copy(v->formals);
         x->body = lval_copy(v->body);
+        x->opt = v->opt ? lopt_retain(v->opt) : NULL;
       }
     break;
     /* for non-nested lval, just copy contents directly */
     case LVAL_NUM: x->num = v->num; break;
+    case LVAL_DBL: x->dbl = v->dbl; break;
+    case LVAL_BIG:
+      x->num = v->num;
+      x->count = v->count;
+      x->limbs = malloc(sizeof(uint32_t) * (v->count ? v->count : 1));
+      memcpy(x->limbs, v->limbs, sizeof(uint32_t) * v->count);
+      break;
+    /* hash maps share their table, copied when written if shared */
+    case LVAL_TABLE: x->table = ltable_retain(v->table); break;
+    /* persistent maps and sets share the whole trie */
+    case LVAL_MAP:
+    case LVAL_SET:
+      x->hamt = lhamt_retain(v->hamt);
+      x->count = v->count;
+      break;
+    /* as do lazy sequences, which are never changed once built */
+    case LVAL_SEQ: x->seq = lseq_retain(v->seq); break;
+    case LVAL_GRAMMAR: x->gram = lgram_retain(v->gram); break;
+    case LVAL_PORT: x->port = lport_retain(v->port); break;
+    case LVAL_FRAME: x->frame = lframe_retain(v->frame); break;
+    case LVAL_VEC:
+      x->count = v->count;
+      x->ivec = NULL;
+      x->dvec = NULL;
+      if (v->dvec) {
+        x->dvec = malloc(sizeof(double) * (v->count ? v->count : 1));
+        memcpy(x->dvec, v->dvec, sizeof(double) * v->count);
+      } else {
+        x->ivec = malloc(sizeof(long) * (v->count ? v->count : 1));
+        memcpy(x->ivec, v->ivec, sizeof(long) * v->count);
+      }
+      break;
 
     /* copy string-containing lvals with strcpy */
     case LVAL_ERR:
@@ -229,15 +630,28 @@ lval* lval_copy(lval* v) {
       strcpy(x->err, v->err); break;
     case LVAL_SYM:
       x->sym = malloc(strlen(v->sym) + 1);
-      strcpy(x->sym, v->sym); break;
+      strcpy(x->sym, v->sym);
+      x->last_use = v->last_use;
+      x->bound = NULL; break;
+    /* strings share their buffer, so copying them is O(1) */
     case LVAL_STR:
-      x->str = malloc(strlen(v->str) + 1);
-      strcpy(x->str, v->str); break;
+      x->count = v->count;
+      x->sbuf = v->sbuf;
+      x->sbuf->refs++;
+      x->str = v->str; break;
 
     /* for nested lvals, copy sub expressions recursively */
     case LVAL_SEXPR:
     case LVAL_QEXPR:
+    case LVAL_RECUR:
       x->count = v->count;
+      x->packed = NULL;
+      if (v->packed) {
+        x->cell = NULL;
+        x->packed = malloc(sizeof(long) * (x->count ? x->count : 1));
+        memcpy(x->packed, v->packed, sizeof(long) * x->count);
+        break;
+      }
       x->cell = malloc(sizeof(lval*) * x->count);
       for (int i = 0; i < x->count; i++) {
         x->cell[i] = lval_copy(v->cell[i]);
@@ -248,8 +662,48 @@ lval* lval_copy(lval* v) {
   return x;
 }
 
+/* move the numbers of a packed q-expression out into boxed cells,
+   for code which needs to work on the cells themselves */
+lval* lval_unpack(lval* v) {
+  if (!v->packed) { return v; }
+  v->cell = malloc(sizeof(lval*) * (v->count ? v->count : 1));
+  for (int i = 0; i < v->count; i++) { v->cell[i] = lval_num(v->packed[i]); }
+  free(v->packed);
+  v->packed = NULL;
+  return v;
+}
+
+/* pack a q-expression if it holds only plain numbers */
+lval* lval_pack(lval* v) {
+  if (v->type != LVAL_QEXPR || v->packed || v->count <= 0) { return v; }
+  for (int i = 0; i < v->count; i++) {
+    if (v->cell[i]->type != LVAL_NUM) { return v; }
+  }
+  v->packed = malloc(sizeof(long) * v->count);
+  for (int i = 0; i < v->count; i++) {
+    v->packed[i] = v->cell[i]->num;
+    lval_del(v->cell[i]);
+  }
+  free(v->cell);
+  v->cell = NULL;
+  return v;
+}
+
 /* method to add one lval to the lvals of another lval */
 lval* lval_add(lval* v, lval* x) {
+  /* numbers added to an empty or packed q-expression stay unboxed */
+  if (v->type == LVAL_QEXPR && x->type == LVAL_NUM
+      && (v->packed || v->count == 0)) {
+    if (!v->packed) {
+      free(v->cell);
+      v->cell = NULL;
+    }
+    v->packed = realloc(v->packed, sizeof(long) * (v->count + 1));
+    v->packed[v->count++] = x->num;
+    lval_del(x);
+    return v;
+  }
+  lval_unpack(v);
   v->count++;
   v->cell = realloc(v->cell, sizeof(lval*) * v->count);
   v->cell[v->count-1] = x;
@@ -258,6 +712,14 @@ lval* lval_add(lval* v, lval* x) {
 
 /* method to return the lval at index i of a given lval */
 lval* lval_pop(lval* v, int i) {
+  /* packed numbers are boxed on the way out */
+  if (v->packed) {
+    lval* x = lval_num(v->packed[i]);
+    memmove(&v->packed[i], &v->packed[i+1], sizeof(long) * (v->count-i-1));
+    v->count--;
+    return x;
+  }
+
   /* get the item at index i */
   lval* x = v->cell[i];
 
@@ -274,11 +736,31 @@ lval* lval_pop(lval* v, int i) {
 
 /* takes two lvals and adds all lvals from one to the other */
 lval* lval_join(lval* x, lval* y) {
-  /* add all cells in y to x */
-  while (y->count) {
-    x = lval_add(x, lval_pop(y, 0));
+  /* joining packed numbers onto packed numbers stays packed */
+  if (y->packed && (x->packed || x->count == 0)) {
+    if (!x->packed) {
+      free(x->cell);
+      x->cell = NULL;
+    }
+    x->packed = realloc(x->packed, sizeof(long) * (x->count + y->count + 1));
+    memcpy(x->packed + x->count, y->packed, sizeof(long) * y->count);
+    x->count += y->count;
+    lval_del(y);
+    return x;
   }
+  if (y->count == 0) {
+    lval_del(y);
+    return x;
+  }
+
+  /* otherwise move all cells of y over to the end of x at once */
+  lval_unpack(x);
+  lval_unpack(y);
+  x->cell = realloc(x->cell, sizeof(lval*) * (x->count + y->count));
+  memcpy(x->cell + x->count, y->cell, sizeof(lval*) * y->count);
+  x->count += y->count;
   /* y is now empty, x has all its values */
+  y->count = 0;
   lval_del(y);
   return x;
 }
@@ -290,60 +772,446 @@ lval* lval_take(lval* v, int i) {
   return x;
 }
 
-/* forward declare lval print so it can be called from lval_expr_print */
+/* printed output is collected in a buffer and handed to stdio in
+   large writes, rather than a call per character or number */
+typedef struct {
+  char* data;
+  size_t len;
+  size_t cap;
+  /* the file or file descriptor the buffer is flushed to. with
+     neither the buffer only collects bytes, growing to fit them */
+  FILE* file;
+  int fd;
+  /* set to flush after every line, when writing to a terminal */
+  int line;
+} lbuf;
+
+#define LBUF_SIZE 65536
+
+/* the buffer standard output goes through */
+lbuf lout;
+
+void lbuf_flush(lbuf* b) {
+  if (b->file) {
+    fwrite(b->data, 1, b->len, b->file);
+    fflush(b->file);
+  } else if (b->fd >= 0) {
+    for (size_t done = 0; done < b->len; ) {
+      long n = write(b->fd, b->data + done, b->len - done);
+      if (n < 0 && errno == EINTR) { continue; }
+      if (n <= 0) { break; }
+      done += n;
+    }
+  } else {
+    return;
+  }
+  b->len = 0;
+}
+
+/* make room for n more bytes, flushing or growing the buffer */
+void lbuf_reserve(lbuf* b, size_t n) {
+  if (b->len + n <= b->cap) { return; }
+  if (b->file || b->fd >= 0) {
+    lbuf_flush(b);
+    if (n <= b->cap) { return; }
+  }
+  size_t cap = b->cap ? b->cap * 2 : 64;
+  while (cap < b->len + n) { cap *= 2; }
+  b->data = realloc(b->data, cap);
+  b->cap = cap;
+}
+
+void lbuf_write(lbuf* b, char* s, size_t n) {
+  lbuf_reserve(b, n);
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+}
+
+void lbuf_putc(lbuf* b, char c) {
+  if (b->len == b->cap) { lbuf_reserve(b, 1); }
+  b->data[b->len++] = c;
+}
+
+void lbuf_puts(lbuf* b, char* s) { lbuf_write(b, s, strlen(s)); }
+
+/* the decimal digits of every number below 100, in pairs */
+static const char ldigits[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+/* write the digits of u, ending at end, returning where they start.
+   at least min digits are written, padding with zeros */
+char* ldigits_of(unsigned long u, char* end, int min) {
+  char* p = end;
+  while (u >= 100) {
+    p -= 2;
+    memcpy(p, ldigits + (u % 100) * 2, 2);
+    u /= 100;
+  }
+  if (u >= 10) {
+    p -= 2;
+    memcpy(p, ldigits + u * 2, 2);
+  } else {
+    *--p = '0' + u;
+  }
+  while (end - p < min) { *--p = '0'; }
+  return p;
+}
+
+void lbuf_long(lbuf* b, long n) {
+  char tmp[24];
+  char* end = tmp + sizeof(tmp);
+  char* p = ldigits_of(n < 0 ? -(unsigned long)n : (unsigned long)n, end, 1);
+  if (n < 0) { *--p = '-'; }
+  lbuf_write(b, p, end - p);
+}
+
+/* forward declare lval write so it can be called from lval_write_expr */
 /* resolves circular dependency */
-void lval_print(lval* v);
+void lval_write(lbuf* b, lval* v);
 
-/* recursively prints out a string representation of a nested lval */
-void lval_print_expr(lval* v, char open, char close) {
-  putchar(open);
+/* recursively writes out a string representation of a nested lval */
+void lval_write_expr(lbuf* b, lval* v, char open, char close) {
+  lbuf_putc(b, open);
+  if (v->packed) {
+    for (int i = 0; i < v->count; i++) {
+      if (i) { lbuf_putc(b, ' '); }
+      lbuf_long(b, v->packed[i]);
+    }
+    lbuf_putc(b, close);
+    return;
+  }
   for (int i = 0; i < v->count; i++) {
-    /* print the contained value */
-    lval_print(v->cell[i]);
+    /* write the contained value */
+    lval_write(b, v->cell[i]);
 
-    /* don't print trailing space if last element */
+    /* don't write trailing space if last element */
     if (i != (v->count-1)) {
-      putchar(' ');
+      lbuf_putc(b, ' ');
     }
   }
-  putchar(close);
+  lbuf_putc(b, close);
 }
 
-/* how to print a string lval, ensures characters are escaped correctly */
-void lval_print_str(lval* v) {
-  char* escaped = malloc(strlen(v->str)+1);
-  strcpy(escaped, v->str);
-  escaped = mpcf_escape(escaped);
-  /* print the lval string field between quotes */
-  printf("\"%s\"", escaped);
+/* how to write a string lval, ensures characters are escaped correctly.
+   the bytes are copied straight out between the ones needing an
+   escape, rather than building an escaped copy of the whole string */
+void lval_write_str(lbuf* b, lval* v) {
+  static const char input[] = "\a\b\f\n\r\t\v\\\'\"";
+  static char* output[] = { "\\a", "\\b", "\\f", "\\n", "\\r",
+                            "\\t", "\\v", "\\\\", "\\'", "\\\"" };
+  lbuf_putc(b, '"');
+  int run = 0;
+  for (int i = 0; i < v->count; i++) {
+    char c = v->str[i];
+    char* esc = c ? memchr(input, c, sizeof(input) - 1) : NULL;
+    if (!esc && c) { continue; }
+    lbuf_write(b, v->str + run, i - run);
+    lbuf_write(b, esc ? output[esc - input] : "\\0", 2);
+    run = i + 1;
+  }
+  lbuf_write(b, v->str + run, v->count - run);
+  lbuf_putc(b, '"');
+}
 
-  /* cleanup */
-  free(escaped);
+/* write a big number in decimal, one limb of nine digits at a time */
+void lval_write_big(lbuf* b, lval* v) {
+  char tmp[24];
+  char* end = tmp + sizeof(tmp);
+  if (v->num < 0) { lbuf_putc(b, '-'); }
+  lbuf_long(b, v->limbs[v->count-1]);
+  for (int i = v->count-2; i >= 0; i--) {
+    lbuf_write(b, ldigits_of(v->limbs[i], end, 9), 9);
+  }
+}
+
+/* floating point numbers are printed with the fewest digits which
+   read back as the same value, using the grisu2 algorithm. a double
+   is scaled by a cached power of ten into a 64 bit fixed point window,
+   and digits are generated until the value is pinned down within the
+   rounding boundaries of its neighbours */
+
+/* a 64 bit significand f and binary exponent e, the value f * 2^e */
+typedef struct { uint64_t f; int e; } ldiyfp;
+
+/* normalized significands and binary exponents of 10^k,
+   for k from -348 to 340 in steps of 8 */
+uint64_t lgrisu_pow_f[] = {
+  0xfa8fd5a0081c0288UL, 0xbaaee17fa23ebf76UL, 0x8b16fb203055ac76UL,
+  0xcf42894a5dce35eaUL, 0x9a6bb0aa55653b2dUL, 0xe61acf033d1a45dfUL,
+  0xab70fe17c79ac6caUL, 0xff77b1fcbebcdc4fUL, 0xbe5691ef416bd60cUL,
+  0x8dd01fad907ffc3cUL, 0xd3515c2831559a83UL, 0x9d71ac8fada6c9b5UL,
+  0xea9c227723ee8bcbUL, 0xaecc49914078536dUL, 0x823c12795db6ce57UL,
+  0xc21094364dfb5637UL, 0x9096ea6f3848984fUL, 0xd77485cb25823ac7UL,
+  0xa086cfcd97bf97f4UL, 0xef340a98172aace5UL, 0xb23867fb2a35b28eUL,
+  0x84c8d4dfd2c63f3bUL, 0xc5dd44271ad3cdbaUL, 0x936b9fcebb25c996UL,
+  0xdbac6c247d62a584UL, 0xa3ab66580d5fdaf6UL, 0xf3e2f893dec3f126UL,
+  0xb5b5ada8aaff80b8UL, 0x87625f056c7c4a8bUL, 0xc9bcff6034c13053UL,
+  0x964e858c91ba2655UL, 0xdff9772470297ebdUL, 0xa6dfbd9fb8e5b88fUL,
+  0xf8a95fcf88747d94UL, 0xb94470938fa89bcfUL, 0x8a08f0f8bf0f156bUL,
+  0xcdb02555653131b6UL, 0x993fe2c6d07b7facUL, 0xe45c10c42a2b3b06UL,
+  0xaa242499697392d3UL, 0xfd87b5f28300ca0eUL, 0xbce5086492111aebUL,
+  0x8cbccc096f5088ccUL, 0xd1b71758e219652cUL, 0x9c40000000000000UL,
+  0xe8d4a51000000000UL, 0xad78ebc5ac620000UL, 0x813f3978f8940984UL,
+  0xc097ce7bc90715b3UL, 0x8f7e32ce7bea5c70UL, 0xd5d238a4abe98068UL,
+  0x9f4f2726179a2245UL, 0xed63a231d4c4fb27UL, 0xb0de65388cc8ada8UL,
+  0x83c7088e1aab65dbUL, 0xc45d1df942711d9aUL, 0x924d692ca61be758UL,
+  0xda01ee641a708deaUL, 0xa26da3999aef774aUL, 0xf209787bb47d6b85UL,
+  0xb454e4a179dd1877UL, 0x865b86925b9bc5c2UL, 0xc83553c5c8965d3dUL,
+  0x952ab45cfa97a0b3UL, 0xde469fbd99a05fe3UL, 0xa59bc234db398c25UL,
+  0xf6c69a72a3989f5cUL, 0xb7dcbf5354e9beceUL, 0x88fcf317f22241e2UL,
+  0xcc20ce9bd35c78a5UL, 0x98165af37b2153dfUL, 0xe2a0b5dc971f303aUL,
+  0xa8d9d1535ce3b396UL, 0xfb9b7cd9a4a7443cUL, 0xbb764c4ca7a44410UL,
+  0x8bab8eefb6409c1aUL, 0xd01fef10a657842cUL, 0x9b10a4e5e9913129UL,
+  0xe7109bfba19c0c9dUL, 0xac2820d9623bf429UL, 0x80444b5e7aa7cf85UL,
+  0xbf21e44003acdd2dUL, 0x8e679c2f5e44ff8fUL, 0xd433179d9c8cb841UL,
+  0x9e19db92b4e31ba9UL, 0xeb96bf6ebadf77d9UL, 0xaf87023b9bf0ee6bUL
+};
+
+int lgrisu_pow_e[] = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+  -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+  -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+  -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+  -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+  109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+  641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+  907, 933, 960, 986, 1013, 1039, 1066
+};
+
+ldiyfp ldiyfp_mul(ldiyfp x, ldiyfp y) {
+  unsigned __int128 p = (unsigned __int128)x.f * y.f;
+  ldiyfp r;
+  /* keep the upper half, rounding on the lower */
+  r.f = (uint64_t)(p >> 64) + (((uint64_t)p >> 63) & 1);
+  r.e = x.e + y.e + 64;
+  return r;
+}
+
+ldiyfp ldiyfp_norm(ldiyfp x) {
+  int s = __builtin_clzll(x.f);
+  x.f <<= s;
+  x.e -= s;
+  return x;
+}
+
+/* nudge the last digit towards the exact value while staying in range */
+void lgrisu_round(char* buf, int len, uint64_t delta, uint64_t rest,
+                  uint64_t ten_kappa, uint64_t wp_w) {
+  while (rest < wp_w && delta - rest >= ten_kappa
+         && (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w)) {
+    buf[len-1]--;
+    rest += ten_kappa;
+  }
+}
+
+/* write the shortest digits of a positive finite double to buf,
+   returning how many. the value is those digits times 10^*k */
+int lgrisu(double value, char* buf, int* k) {
+  static const uint32_t pow10[] = { 1, 10, 100, 1000, 10000, 100000,
+    1000000, 10000000, 100000000, 1000000000 };
+
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(double));
+  int biased = (bits >> 52) & 0x7ff;
+  ldiyfp v;
+  v.f = bits & 0xfffffffffffffUL;
+  if (biased) {
+    v.f += 1UL << 52;
+    v.e = biased - 1075;
+  } else {
+    v.e = -1074;
+  }
+
+  /* boundaries halfway to the neighbouring doubles */
+  ldiyfp plus = { (v.f << 1) + 1, v.e - 1 };
+  plus = ldiyfp_norm(plus);
+  ldiyfp minus;
+  if (v.f == 1UL << 52) {
+    minus.f = (v.f << 2) - 1;
+    minus.e = v.e - 2;
+  } else {
+    minus.f = (v.f << 1) - 1;
+    minus.e = v.e - 1;
+  }
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+
+  /* pick the cached power which brings plus into the target window */
+  double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+  int ki = (int)dk;
+  if (dk - ki > 0.0) { ki++; }
+  int index = (ki >> 3) + 1;
+  *k = -(-348 + (index << 3));
+  ldiyfp c = { lgrisu_pow_f[index], lgrisu_pow_e[index] };
+
+  ldiyfp w = ldiyfp_mul(ldiyfp_norm(v), c);
+  ldiyfp wp = ldiyfp_mul(plus, c);
+  ldiyfp wm = ldiyfp_mul(minus, c);
+  wm.f++;
+  wp.f--;
+  uint64_t delta = wp.f - wm.f;
+
+  /* split wp into integral and fractional parts and generate digits */
+  ldiyfp one = { 1UL << -wp.e, wp.e };
+  uint64_t wp_w = wp.f - w.f;
+  uint32_t p1 = wp.f >> -one.e;
+  uint64_t p2 = wp.f & (one.f - 1);
+  int kappa = 0;
+  while (kappa < 10 && p1 >= pow10[kappa]) { kappa++; }
+
+  int len = 0;
+  while (kappa > 0) {
+    uint32_t d = p1 / pow10[kappa-1];
+    p1 %= pow10[kappa-1];
+    if (d || len) { buf[len++] = '0' + d; }
+    kappa--;
+    uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+    if (rest <= delta) {
+      *k += kappa;
+      lgrisu_round(buf, len, delta, rest, (uint64_t)pow10[kappa] << -one.e, wp_w);
+      return len;
+    }
+  }
+  for (;;) {
+    p2 *= 10;
+    delta *= 10;
+    char d = p2 >> -one.e;
+    if (d || len) { buf[len++] = '0' + d; }
+    p2 &= one.f - 1;
+    kappa--;
+    if (p2 < delta) {
+      *k += kappa;
+      lgrisu_round(buf, len, delta, p2, one.f, wp_w * (-kappa < 10 ? pow10[-kappa] : 0));
+      return len;
+    }
+  }
+}
+
+/* format a double so it reads back as the same double. there is
+   always a decimal point, so it reads back as a float at all, and
+   infinities and nan are spelt inf.0, -inf.0 and nan.0 which the
+   reader takes as numbers rather than symbols */
+void ldbl_format(double x, char* out) {
+  if (isnan(x)) { strcpy(out, "nan.0"); return; }
+  if (isinf(x)) { strcpy(out, x < 0 ? "-inf.0" : "inf.0"); return; }
+  if (signbit(x)) { *out++ = '-'; x = -x; }
+  if (x == 0) { strcpy(out, "0.0"); return; }
+
+  char digits[24];
+  int k;
+  int n = lgrisu(x, digits, &k);
+
+  /* the value is 0.digits times 10^point */
+  int point = n + k;
+  if (point > 0 && point <= 21) {
+    if (n <= point) {
+      memcpy(out, digits, n);
+      memset(out + n, '0', point - n);
+      strcpy(out + point, ".0");
+    } else {
+      memcpy(out, digits, point);
+      out[point] = '.';
+      memcpy(out + point + 1, digits + point, n - point);
+      out[n + 1] = '\0';
+    }
+  } else if (point <= 0 && point > -6) {
+    out[0] = '0';
+    out[1] = '.';
+    memset(out + 2, '0', -point);
+    memcpy(out + 2 - point, digits, n);
+    out[2 - point + n] = '\0';
+  } else {
+    out[0] = digits[0];
+    out[1] = '.';
+    if (n > 1) {
+      memcpy(out + 2, digits + 1, n - 1);
+    } else {
+      out[2] = '0';
+      n = 2;
+    }
+    sprintf(out + n + 1, "e%d", point - 1);
+  }
+}
+
+/* write a vector as its literal, #[1 2 3] */
+void lval_write_vec(lbuf* b, lval* v) {
+  char buf[32];
+  lbuf_puts(b, "#[");
+  for (int i = 0; i < v->count; i++) {
+    if (i) { lbuf_putc(b, ' '); }
+    if (v->dvec) {
+      ldbl_format(v->dvec[i], buf);
+      lbuf_puts(b, buf);
+    } else {
+      lbuf_long(b, v->ivec[i]);
+    }
+  }
+  lbuf_putc(b, ']');
 }
 
-/* how to print an lval. for s-expr and q-expr recursively call
-   to print out all lvals nested in the cell */
-void lval_print(lval* v) {
+void lval_write_table(lbuf* b, lval* v);
+void lval_write_hamt(lbuf* b, lval* v);
+
+/* how to write an lval. for s-expr and q-expr recursively call
+   to write out all lvals nested in the cell */
+void lval_write(lbuf* b, lval* v) {
   switch (v->type) {
     case LVAL_FUN:
-      if (v->builtin) {
-        printf("<builtin>");
+      if (v->memo) {
+        lbuf_puts(b, "<memo>");
+      } else if (v->builtin) {
+        lbuf_puts(b, "<builtin>");
       } else {
-        printf("(\\ "); lval_print(v->formals);
-        putchar(' '); lval_print(v->body); putchar(')');
+        lbuf_puts(b, "(\\ "); lval_write(b, v->formals);
+        lbuf_putc(b, ' '); lval_write(b, v->body); lbuf_putc(b, ')');
       }
       break;
-    case LVAL_NUM:   printf("%li", v->num); break;
-    case LVAL_ERR:   printf("Error: %s", v->err); break;
-    case LVAL_SYM:   printf("%s", v->sym); break;
-    case LVAL_STR:   lval_print_str(v); break;
-    case LVAL_SEXPR: lval_print_expr(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_print_expr(v, '{', '}'); break;
+    case LVAL_NUM:   lbuf_long(b, v->num); break;
+    case LVAL_BIG:   lval_write_big(b, v); break;
+    case LVAL_DBL: {
+      char buf[32];
+      ldbl_format(v->dbl, buf);
+      lbuf_puts(b, buf);
+      break;
+    }
+    case LVAL_VEC:   lval_write_vec(b, v); break;
+    case LVAL_TABLE: lval_write_table(b, v); break;
+    case LVAL_MAP:   lval_write_hamt(b, v); break;
+    case LVAL_SET:   lval_write_hamt(b, v); break;
+    case LVAL_SEQ:   lbuf_puts(b, "<sequence>"); break;
+    case LVAL_GRAMMAR: lbuf_puts(b, "<grammar>"); break;
+    case LVAL_PORT:  lbuf_puts(b, "<port>"); break;
+    case LVAL_FRAME: lbuf_puts(b, "<frame>"); break;
+    case LVAL_ERR:   lbuf_puts(b, "Error: "); lbuf_puts(b, v->err); break;
+    case LVAL_SYM:   lbuf_puts(b, v->sym); break;
+    case LVAL_STR:   lval_write_str(b, v); break;
+    case LVAL_SEXPR: lval_write_expr(b, v, '(', ')'); break;
+    case LVAL_QEXPR: lval_write_expr(b, v, '{', '}'); break;
+    case LVAL_RECUR: lbuf_puts(b, "<recur>"); break;
   }
 }
 
-/* println for lvals */
-void lval_println(lval* v) { lval_print(v); putchar('\n'); }
+/* print an lval to standard output */
+void lval_print(lval* v) { lval_write(&lout, v); }
+
+/* println for lvals, flushing the line out when writing to a terminal */
+void lval_println(lval* v) {
+  lval_write(&lout, v);
+  lbuf_putc(&lout, '\n');
+  if (lout.line) { lbuf_flush(&lout); }
+}
+
+int ltable_eq(ltable* x, ltable* y);
+unsigned long ltable_hash(ltable* t);
+int lhamt_sub(lhamt* a, lhamt* b, int shift);
+unsigned long lhamt_hash(lhamt* t);
+int lseq_eq(lseq* x, lseq* y);
+unsigned long lseq_hash(lseq* s);
 
 /* comparison method for lvals. compare all relevant fields for each type */
 int lval_eq(lval* x, lval* y) {
@@ -353,14 +1221,42 @@ int lval_eq(lval* x, lval* y) {
   switch (x->type) {
     /* numbers compare value */
     case LVAL_NUM: return (x->num == y->num);
+    case LVAL_DBL: return (x->dbl == y->dbl);
+    case LVAL_BIG:
+      return x->num == y->num && x->count == y->count
+        && memcmp(x->limbs, y->limbs, sizeof(uint32_t) * x->count) == 0;
+    case LVAL_TABLE: return ltable_eq(x->table, y->table);
+    /* with the same number of entries, all of x being in y is enough */
+    case LVAL_MAP:
+    case LVAL_SET:
+      return x->count == y->count && lhamt_sub(x->hamt, y->hamt, 0);
+    /* sequences are equal if they are built the same way */
+    case LVAL_SEQ: return lseq_eq(x->seq, y->seq);
+    /* grammars and ports are only equal to copies of themselves */
+    case LVAL_GRAMMAR: return x->gram == y->gram;
+    case LVAL_PORT: return x->port == y->port;
+    case LVAL_FRAME: return x->frame == y->frame;
+    /* vectors of the same kind compare elements */
+    case LVAL_VEC:
+      if (x->count != y->count || !x->dvec != !y->dvec) { return 0; }
+      for (int i = 0; i < x->count; i++) {
+        if (x->dvec ? x->dvec[i] != y->dvec[i] : x->ivec[i] != y->ivec[i]) {
+          return 0;
+        }
+      }
+      return 1;
 
     /* string-containing lvals compare string values */
     case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
     case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
-    case LVAL_STR: return (strcmp(x->str, y->str) == 0);
+    case LVAL_STR:
+      return x->count == y->count && memcmp(x->str, y->str, x->count) == 0;
 
     /* for functions, compare builtin if builtin, otherwise compare formals and args individually */
     case LVAL_FUN:
+      if (x->memo || y->memo) {
+        return x->memo == y->memo;
+      }
       if (x->builtin || y->builtin) {
         return x->builtin == y->builtin;
       } else {
@@ -369,7 +1265,22 @@ int lval_eq(lval* x, lval* y) {
       /* if list, compare each element */
     case LVAL_QEXPR:
     case LVAL_SEXPR:
+    case LVAL_RECUR:
       if (x->count != y->count) { return 0; }
+      if (x->packed && y->packed) {
+        return memcmp(x->packed, y->packed, sizeof(long) * x->count) == 0;
+      }
+      /* a packed number equals a boxed plain number of the same value */
+      if (x->packed || y->packed) {
+        lval* p = x->packed ? x : y;
+        lval* b = x->packed ? y : x;
+        for (int i = 0; i < x->count; i++) {
+          if (b->cell[i]->type != LVAL_NUM || b->cell[i]->num != p->packed[i]) {
+            return 0;
+          }
+        }
+        return 1;
+      }
       for (int i = 0; i < x->count; i++) {
         /* return false as soon as any values don't equal each other */
         if (!lval_eq(x->cell[i], y->cell[i])) { return 0; }
@@ -379,16 +1290,111 @@ int lval_eq(lval* x, lval* y) {
   }
   return 0;
 }
+
+/* finalizer to spread the bits of a hash value */
+unsigned long lhash_mix(unsigned long h) {
+  h ^= h >> 33; h *= 0xff51afd7ed558ccdUL;
+  h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53UL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* hash of n bytes, continuing from h. the bytes are mixed in eight
+   at a time, with the length folded into the final word */
+unsigned long lhash_bytes(unsigned long h, char* s, size_t n) {
+  uint64_t w;
+  for (; n >= 8; n -= 8, s += 8) {
+    memcpy(&w, s, 8);
+    h = (h ^ w) * 0x9e3779b97f4a7c15UL;
+    h ^= h >> 29;
+  }
+  w = 0;
+  memcpy(&w, s, n);
+  return lhash_mix(h ^ w ^ ((uint64_t)n << 56));
+}
+
+/* hash of a null terminated string, continuing from h */
+unsigned long lhash_str(unsigned long h, char* s) {
+  return lhash_bytes(h, s, strlen(s));
+}
+
+/* hash of a plain number */
+unsigned long lhash_num(long x) {
+  return lhash_mix((0xcbf29ce484222325UL ^ LVAL_NUM) ^ (unsigned long)x);
+}
+
+/* structural hash of an lval. lvals which are equal
+   under lval_eq always hash to the same value */
+unsigned long lval_hash(lval* v) {
+  unsigned long h = 0xcbf29ce484222325UL ^ v->type;
+  switch (v->type) {
+    case LVAL_NUM: return lhash_num(v->num);
+    case LVAL_DBL: {
+      /* 0.0 and -0.0 are equal so must hash the same */
+      double d = v->dbl == 0 ? 0 : v->dbl;
+      uint64_t bits;
+      memcpy(&bits, &d, sizeof(double));
+      return lhash_mix(h ^ bits);
+    }
+    case LVAL_BIG:
+      for (int i = 0; i < v->count; i++) { h = lhash_mix(h ^ v->limbs[i]); }
+      return lhash_mix(h ^ (unsigned long)v->num);
+    case LVAL_VEC:
+      for (int i = 0; i < v->count; i++) {
+        uint64_t bits = v->ivec ? (uint64_t)v->ivec[i] : 0;
+        if (v->dvec) {
+          double d = v->dvec[i] == 0 ? 0 : v->dvec[i];
+          memcpy(&bits, &d, sizeof(double));
+        }
+        h = lhash_mix(h ^ bits);
+      }
+      return lhash_mix(h ^ (v->dvec != NULL));
+    case LVAL_TABLE: return lhash_mix(h ^ ltable_hash(v->table));
+    case LVAL_MAP:
+    case LVAL_SET: return lhash_mix(h ^ lhamt_hash(v->hamt));
+    case LVAL_SEQ: return lhash_mix(h ^ lseq_hash(v->seq));
+    case LVAL_GRAMMAR: return lhash_mix(h ^ (unsigned long)v->gram);
+    case LVAL_PORT: return lhash_mix(h ^ (unsigned long)v->port);
+    case LVAL_FRAME: return lhash_mix(h ^ (unsigned long)v->frame);
+    case LVAL_ERR: return lhash_str(h, v->err);
+    case LVAL_SYM: return lhash_str(h, v->sym);
+    case LVAL_STR: return lhash_bytes(h, v->str, v->count);
+    case LVAL_FUN:
+      if (v->memo)    { return lhash_mix(h ^ (unsigned long)v->memo); }
+      if (v->builtin) { return lhash_mix(h ^ (unsigned long)v->builtin); }
+      return lhash_mix(h ^ lval_hash(v->formals) ^ (lval_hash(v->body) << 1));
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+    case LVAL_RECUR:
+      for (int i = 0; i < v->count; i++) {
+        h = lhash_mix(h ^ (v->packed ? lhash_num(v->packed[i]) : lval_hash(v->cell[i])));
+      }
+      return h;
+  }
+  return h;
+}
+
 /* method to translate lval enum into human-readable names */
 char* ltype_name(int t) {
   switch (t) {
     case LVAL_FUN: return "Function";
     case LVAL_NUM: return "Number";
+    case LVAL_BIG: return "Big Number";
+    case LVAL_DBL: return "Float";
+    case LVAL_VEC: return "Vector";
+    case LVAL_TABLE: return "Hash Map";
+    case LVAL_MAP: return "Map";
+    case LVAL_SET: return "Set";
+    case LVAL_SEQ: return "Sequence";
+    case LVAL_GRAMMAR: return "Grammar";
+    case LVAL_PORT: return "Port";
+    case LVAL_FRAME: return "Frame";
     case LVAL_ERR: return "Error";
     case LVAL_SYM: return "Symbol";
     case LVAL_STR: return "String";
     case LVAL_SEXPR: return "S-Expression";
     case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_RECUR: return "Recur";
     default: return "Unknown";
   }
 }
@@ -408,6 +1414,17 @@ struct lenv {
   lval** vals;
 };
 
+/* bumped whenever a global binding is overwritten or a name is first
+   bound locally, so optimized functions know to recheck the bindings
+   they relied on */
+long lenv_generation = 0;
+
+/* counts of copies avoided by moving values into and out of
+   function environments, reported by escape-stats */
+long lesc_bound = 0;
+long lesc_moved = 0;
+long lesc_cells = 0;
+
 /* constructor for empty environment */
 lenv* lenv_new(void) {
   lenv* e = malloc(sizeof(lenv));
@@ -425,7 +1442,7 @@ void lenv_del(lenv* e) {
      of the strings used to name the variables */
   for (int i = 0; i < e->count; i++) {
     free(e->syms[i]);
-    lval_del(e->vals[i]);
+    if (e->vals[i]) { lval_del(e->vals[i]); }
   }
   free(e->syms);
   free(e->vals);
@@ -444,7 +1461,7 @@ lenv* lenv_copy(lenv* e) {
   for (int i = 0; i < e->count; i++) {
     n->syms[i] = malloc(strlen(e->syms[i]) + 1);
     strcpy(n->syms[i], e->syms[i]);
-    n->vals[i] = lval_copy(e->vals[i]);
+    n->vals[i] = e->vals[i] ? lval_copy(e->vals[i]) : NULL;
   }
   return n;
 }
@@ -456,6 +1473,9 @@ lval* lenv_get(lenv* e, lval* k) {
      return an error because that variable was not defined */
   for (int i = 0; i < e->count; i++) {
     if (strcmp(e->syms[i], k->sym) == 0) {
+      if (!e->vals[i]) {
+        return lval_err("parameter '%s' used after its last use", k->sym);
+      }
       return lval_copy(e->vals[i]);
     }
   }
@@ -468,16 +1488,55 @@ lval* lenv_get(lenv* e, lval* k) {
   }
 }
 
+/* method to look up a value in the environment without copying it.
+   returns NULL if the symbol is not defined */
+lval* lenv_peek(lenv* e, lval* k) {
+  while (e) {
+    for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], k->sym) == 0) { return e->vals[i]; }
+    }
+    e = e->par;
+  }
+  return NULL;
+}
+
+/* number of lvals a move avoided copying, counting only the top
+   level of lists so keeping the statistics stays cheap */
+long lesc_cells_of(lval* v) {
+  if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) { return 1 + v->count; }
+  return 1;
+}
 
-/* method to put a new variable definition into the local environment */
-void lenv_put(lenv* e, lval* k, lval* v) {
+/* method to move a value out of the environment for the last use of
+   a parameter. the slot is left empty for the rest of the call */
+lval* lenv_move(lenv* e, lval* k) {
+  for (int i = 0; i < e->count; i++) {
+    if (strcmp(e->syms[i], k->sym) == 0) {
+      if (!e->vals[i]) {
+        return lval_err("parameter '%s' used after its last use", k->sym);
+      }
+      lval* x = e->vals[i];
+      e->vals[i] = NULL;
+      return x;
+    }
+  }
+  if (e->par) {
+    return lenv_move(e->par, k);
+  } else {
+    return lval_err("unbound symbol '%s'", k->sym);
+  }
+}
+
+/* method to bind a value in the local environment, taking ownership
+   of it rather than copying */
+void lenv_bind(lenv* e, lval* k, lval* v) {
   /* if the current variable name is already defined, overwrite
-     the lval. otherwise, allocate space for a new entry, and
-     copy the new variable into the environment */
+     the lval. otherwise, allocate space for a new entry */
   for (int i = 0; i < e->count; i++) {
     if (strcmp(e->syms[i], k->sym) == 0) {
-      lval_del(e->vals[i]);
-      e->vals[i] = lval_copy(v);
+      if (e->vals[i]) { lval_del(e->vals[i]); }
+      e->vals[i] = v;
+      if (!e->par) { lenv_generation++; }
       return;
     }
   }
@@ -487,12 +1546,16 @@ void lenv_put(lenv* e, lval* k, lval* v) {
   e->vals = realloc(e->vals, sizeof(lval*) * e->count);
   e->syms = realloc(e->syms, sizeof(char*) * e->count);
 
-  /* perform copy over into new location */
-  e->vals[e->count-1] = lval_copy(v);
+  e->vals[e->count-1] = v;
   e->syms[e->count-1] = malloc(strlen(k->sym)+1);
   strcpy(e->syms[e->count-1], k->sym);
 }
 
+/* method to put a new variable definition into the local environment */
+void lenv_put(lenv* e, lval* k, lval* v) {
+  lenv_bind(e, k, lval_copy(v));
+}
+
 /* method to put a new variable definiton to the global environment */
 void lenv_def(lenv* e, lval* k, lval* v) {
   /* iterate up to the global environment */
@@ -520,6 +1583,14 @@ void lenv_def(lenv* e, lval* k, lval* v) {
     "function %s passed incorrect number of arguments. got %i, expected %i", \
     func, args->count, num)
 
+/* macro to confirm that a function is passed a number of either size */
+#define LASSERT_NUMBER(func, args, index) \
+  LASSERT(args, args->cell[index]->type == LVAL_NUM \
+          || args->cell[index]->type == LVAL_BIG \
+          || args->cell[index]->type == LVAL_DBL, \
+    "function '%s' passed incorrect type for argument %i. got %s, expected %s.", \
+          func, index, ltype_name(args->cell[index]->type), ltype_name(LVAL_NUM))
+
 /* method to confirm that a function is passed in an expression at all */
 #define LASSERT_NOT_EMPTY(func, args, index) \
   LASSERT(args, args->cell[index]->count != 0, \
@@ -527,6 +1598,8 @@ void lenv_def(lenv* e, lval* k, lval* v) {
 
 /* forward declare to avoid cyclic dependency */
 lval* lval_eval(lenv* e, lval* v);
+void lopt_lambda(lenv* e, lval* f);
+void lopt_local(lval* k);
 
 /* builtin method to create a user defined function out of two q-expressions as input */
 lval* builtin_lambda(lenv* e, lval* a) {
@@ -534,6 +1607,8 @@ lval* builtin_lambda(lenv* e, lval* a) {
   LASSERT_NUM("\\", a, 2);
   LASSERT_TYPE("\\", a, 0, LVAL_QEXPR);
   LASSERT_TYPE("\\", a, 1, LVAL_QEXPR);
+  lval_unpack(a->cell[0]);
+  lval_unpack(a->cell[1]);
 
   /* assert that the first q-expression contains only symbols */
   for (int i = 0; i < a->cell[0]->count; i++) {
@@ -546,13 +1621,17 @@ lval* builtin_lambda(lenv* e, lval* a) {
   lval* body = lval_pop(a, 0);
   lval_del(a);
 
-  return lval_lambda(formals, body);
+  /* every formal will be bound locally when the function is called */
+  for (int i = 0; i < formals->count; i++) { lopt_local(formals->cell[i]); }
+  lval* f = lval_lambda(formals, body);
+  lopt_lambda(e, f);
+  return f;
 }
 
 /* method to convert an lval into a q-expression */
 lval* builtin_list(lenv* e, lval* a) {
   a->type = LVAL_QEXPR;
-  return a;
+  return lval_pack(a);
 }
 
 /* method to retrieve the first element of an lval */
@@ -568,7 +1647,10 @@ lval* builtin_head(lenv* e, lval* a) {
   LASSERT_NOT_EMPTY("head", a, 0);
 
   lval* v = lval_take(a, 0);
-  while (v->count > 1) { lval_del(lval_pop(v, 1)); }
+  if (!v->packed) {
+    for (int i = 1; i < v->count; i++) { lval_del(v->cell[i]); }
+  }
+  v->count = 1;
   return v;
 }
 
@@ -594,7 +1676,7 @@ lval* builtin_eval(lenv* e, lval* a) {
   LASSERT_NUM("eval", a, 1);
   LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
 
-  lval* x = lval_take(a, 0);
+  lval* x = lval_unpack(lval_take(a, 0));
   x->type = LVAL_SEXPR;
   return lval_eval(e, x);
 }
@@ -615,279 +1697,8172 @@ lval* builtin_join(lenv* e, lval* a) {
   return x;
 }
 
-/* method to perform basic mathematical operators */
-lval* builtin_op(lenv* e, lval* a, char* op) {
+/* takes an lval, gets and returns its first element. unlike
+   lval_take, the rest are deleted without shifting the cells */
+lval* lval_first(lval* v) {
+  lval* x = v->cell[0];
+  for (int i = 1; i < v->count; i++) { lval_del(v->cell[i]); }
+  free(v->cell);
+  free(v);
+  return x;
+}
 
-  /* ensure arguments are numbers */
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE(op, a, i, LVAL_NUM);
-  }
+/* big number magnitudes are arrays of base 10^9 limbs, least
+   significant first. these helpers work on raw limb arrays */
+#define LBIG_BASE 1000000000u
+/* size in limbs above which multiplication switches to karatsuba */
+#define LBIG_KARATSUBA 32
 
-  lval* x = lval_pop(a, 0);
+/* length of a magnitude ignoring leading zero limbs */
+int lmag_len(uint32_t* a, int n) {
+  while (n > 0 && a[n-1] == 0) { n--; }
+  return n;
+}
 
-  /* if no arguments and it's subtraction, perform unary negation */
-  if ((strcmp(op, "-") == 0) && a->count == 0) {
-    x->num = -x->num;
+int lmag_cmp(uint32_t* a, int na, uint32_t* b, int nb) {
+  na = lmag_len(a, na);
+  nb = lmag_len(b, nb);
+  if (na != nb) { return na < nb ? -1 : 1; }
+  for (int i = na-1; i >= 0; i--) {
+    if (a[i] != b[i]) { return a[i] < b[i] ? -1 : 1; }
   }
+  return 0;
+}
 
-  /* while there are still elements */
-  while (a->count > 0) {
-    /* get the next element */
-    lval* y = lval_pop(a, 0);
-    /* perform operations */
-    if (strcmp(op, "+") == 0) { x->num += y->num; }
-    if (strcmp(op, "-") == 0) { x->num -= y->num; }
-    if (strcmp(op, "*") == 0) { x->num *= y->num; }
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-        lval_del(x); lval_del(y);
-        x = lval_err("Division By Zero!"); break;
-      }
-      x->num /= y->num;
-    }
-    lval_del(y);
+/* r = a + b. r needs room for max(na, nb)+1 limbs and may alias a */
+int lmag_add(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb) {
+  if (na < nb) {
+    uint32_t* t = a; a = b; b = t;
+    int n = na; na = nb; nb = n;
   }
-  lval_del(a);
-  return x;
+  uint32_t carry = 0;
+  for (int i = 0; i < na; i++) {
+    uint32_t x = a[i] + (i < nb ? b[i] : 0) + carry;
+    carry = x >= LBIG_BASE;
+    r[i] = carry ? x - LBIG_BASE : x;
+  }
+  r[na] = carry;
+  return na+1;
+}
+
+/* r = a - b, where a >= b. r needs room for na limbs and may alias a */
+int lmag_sub(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb) {
+  int32_t borrow = 0;
+  for (int i = 0; i < na; i++) {
+    int64_t x = (int64_t)a[i] - (i < nb ? b[i] : 0) - borrow;
+    borrow = x < 0;
+    r[i] = borrow ? x + LBIG_BASE : x;
+  }
+  return na;
+}
+
+/* r += a * B^off, where r has room for the result */
+void lmag_add_at(uint32_t* r, int nr, uint32_t* a, int na, int off) {
+  uint32_t carry = 0;
+  int i;
+  for (i = 0; i < na || carry; i++) {
+    if (off + i >= nr) { break; }
+    uint32_t x = r[off+i] + (i < na ? a[i] : 0) + carry;
+    carry = x >= LBIG_BASE;
+    r[off+i] = carry ? x - LBIG_BASE : x;
+  }
+}
+
+/* r = a * b by schoolbook multiplication, r zeroed with na+nb limbs */
+void lmag_mul_school(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb) {
+  for (int i = 0; i < na; i++) {
+    uint64_t carry = 0;
+    for (int j = 0; j < nb; j++) {
+      uint64_t x = r[i+j] + (uint64_t)a[i] * b[j] + carry;
+      r[i+j] = x % LBIG_BASE;
+      carry = x / LBIG_BASE;
+    }
+    for (int k = i+nb; carry; k++) {
+      uint64_t x = r[k] + carry;
+      r[k] = x % LBIG_BASE;
+      carry = x / LBIG_BASE;
+    }
+  }
+}
+
+/* r = a * b, r zeroed with na+nb limbs. large operands are split in
+   two, and the product found with three half size multiplications */
+void lmag_mul(uint32_t* r, uint32_t* a, int na, uint32_t* b, int nb) {
+  if (na < nb) {
+    uint32_t* t = a; a = b; b = t;
+    int n = na; na = nb; nb = n;
+  }
+  if (nb < LBIG_KARATSUBA) {
+    lmag_mul_school(r, a, na, b, nb);
+    return;
+  }
+
+  int m = na / 2;
+  /* b is too short to split at m, so multiply by each half of a */
+  if (nb <= m) {
+    uint32_t* t = calloc(na - m + nb, sizeof(uint32_t));
+    lmag_mul(r, a, m, b, nb);
+    lmag_mul(t, a+m, na-m, b, nb);
+    lmag_add_at(r, na+nb, t, na-m+nb, m);
+    free(t);
+    return;
+  }
+
+  /* z0 = a0 * b0 and z2 = a1 * b1 go straight into the result */
+  lmag_mul(r, a, m, b, m);
+  lmag_mul(r + 2*m, a+m, na-m, b+m, nb-m);
+
+  /* z1 = (a0 + a1)(b0 + b1) - z0 - z2 */
+  int ns = na - m + 1;
+  uint32_t* sa = calloc(ns, sizeof(uint32_t));
+  uint32_t* sb = calloc(ns, sizeof(uint32_t));
+  int la = lmag_add(sa, a, m, a+m, na-m);
+  int lb = lmag_add(sb, b, m, b+m, nb-m);
+  uint32_t* z1 = calloc(la + lb, sizeof(uint32_t));
+  lmag_mul(z1, sa, la, sb, lb);
+  int l1 = lmag_sub(z1, z1, la+lb, r, 2*m);
+  l1 = lmag_sub(z1, z1, l1, r + 2*m, na+nb - 2*m);
+
+  lmag_add_at(r, na+nb, z1, lmag_len(z1, l1), m);
+  free(sa); free(sb); free(z1);
+}
+
+/* q = a / b, discarding the remainder. b has no leading zero limbs,
+   q is zeroed with na limbs. long division, estimating each quotient
+   limb from the leading limbs as in knuth's algorithm d */
+void lmag_div(uint32_t* q, uint32_t* a, int na, uint32_t* b, int nb) {
+  if (nb == 1) {
+    uint64_t rem = 0;
+    for (int i = na-1; i >= 0; i--) {
+      uint64_t x = rem * LBIG_BASE + a[i];
+      q[i] = x / b[0];
+      rem = x % b[0];
+    }
+    return;
+  }
+  if (na < nb) { return; }
+
+  /* scale both so the divisor's top limb is at least half the base,
+     which keeps each estimate within two of the true quotient limb */
+  uint32_t f = LBIG_BASE / ((uint64_t)b[nb-1] + 1);
+  uint32_t* u = calloc(na + 1, sizeof(uint32_t));
+  uint32_t* v = calloc(nb, sizeof(uint32_t));
+  lmag_mul_school(u, a, na, &f, 1);
+  lmag_mul_school(v, b, nb, &f, 1);
+
+  for (int j = na - nb; j >= 0; j--) {
+    uint64_t num = (uint64_t)u[j+nb] * LBIG_BASE + u[j+nb-1];
+    uint64_t qhat = num / v[nb-1];
+    uint64_t rhat = num % v[nb-1];
+    while (qhat >= LBIG_BASE
+           || qhat * v[nb-2] > rhat * LBIG_BASE + u[j+nb-2]) {
+      qhat--;
+      rhat += v[nb-1];
+      if (rhat >= LBIG_BASE) { break; }
+    }
+
+    /* subtract qhat * v from the current window of u */
+    uint64_t carry = 0;
+    int64_t borrow = 0;
+    for (int i = 0; i < nb; i++) {
+      uint64_t p = qhat * v[i] + carry;
+      carry = p / LBIG_BASE;
+      int64_t x = (int64_t)u[i+j] - (int64_t)(p % LBIG_BASE) - borrow;
+      borrow = x < 0;
+      u[i+j] = borrow ? x + LBIG_BASE : x;
+    }
+    int64_t top = (int64_t)u[j+nb] - (int64_t)carry - borrow;
+
+    /* the estimate was one too large, so add v back */
+    if (top < 0) {
+      qhat--;
+      uint32_t c = 0;
+      for (int i = 0; i < nb; i++) {
+        uint32_t x = u[i+j] + v[i] + c;
+        c = x >= LBIG_BASE;
+        u[i+j] = c ? x - LBIG_BASE : x;
+      }
+      top += c;
+    }
+    u[j+nb] = top;
+    q[j] = qhat;
+  }
+  free(u);
+  free(v);
+}
+
+/* convert a number of either size to a big number lval */
+lval* lbig_of(lval* v) {
+  if (v->type == LVAL_BIG) { return lval_copy(v); }
+  /* negate in unsigned arithmetic so LONG_MIN is handled */
+  unsigned long m = v->num < 0 ? -(unsigned long)v->num : (unsigned long)v->num;
+  lval* x = lval_big(v->num < 0 ? -1 : 1, 3);
+  for (int i = 0; i < 3; i++) {
+    x->limbs[i] = m % LBIG_BASE;
+    m /= LBIG_BASE;
+  }
+  x->count = lmag_len(x->limbs, 3);
+  return x;
+}
+
+/* strip leading zeros from a big number, turning
+   it into a plain number if it fits in a long */
+lval* lbig_norm(lval* v) {
+  v->count = lmag_len(v->limbs, v->count);
+  if (v->count > 3 || (v->count == 3 && v->limbs[2] > 9)) { return v; }
+
+  unsigned long m = 0;
+  for (int i = v->count-1; i >= 0; i--) { m = m * LBIG_BASE + v->limbs[i]; }
+  if (v->num > 0 && m > LONG_MAX) { return v; }
+  if (v->num < 0 && m > (unsigned long)LONG_MAX + 1) { return v; }
+
+  free(v->limbs);
+  v->type = LVAL_NUM;
+  v->num = v->num < 0 ? (long)(0 - m) : (long)m;
+  return v;
+}
+
+/* compare two numbers of either size, returning -1, 0 or 1 */
+int lbig_cmp(lval* x, lval* y) {
+  if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+    return (x->num > y->num) - (x->num < y->num);
+  }
+  lval* a = lbig_of(x);
+  lval* b = lbig_of(y);
+  /* signs are compared first, with zero between the two */
+  int sa = a->count == 0 ? 0 : (int)a->num;
+  int sb = b->count == 0 ? 0 : (int)b->num;
+  int r = sa != sb ? (sa < sb ? -1 : 1)
+        : sa * lmag_cmp(a->limbs, a->count, b->limbs, b->count);
+  lval_del(a);
+  lval_del(b);
+  return r;
+}
+
+/* signed addition of big numbers, negating y when subtracting */
+lval* lbig_add(lval* x, lval* y, int negate) {
+  long ysign = negate ? -y->num : y->num;
+  int n = (x->count > y->count ? x->count : y->count) + 1;
+  if (x->num == ysign) {
+    lval* r = lval_big(x->num, n);
+    r->count = lmag_add(r->limbs, x->limbs, x->count, y->limbs, y->count);
+    return r;
+  }
+  if (lmag_cmp(x->limbs, x->count, y->limbs, y->count) >= 0) {
+    lval* r = lval_big(x->num, n);
+    r->count = lmag_sub(r->limbs, x->limbs, x->count, y->limbs, y->count);
+    return r;
+  }
+  lval* r = lval_big(ysign, n);
+  r->count = lmag_sub(r->limbs, y->limbs, y->count, x->limbs, x->count);
+  return r;
+}
+
+lval* lbig_mul(lval* x, lval* y) {
+  lval* r = lval_big(x->num * y->num, x->count + y->count);
+  lmag_mul(r->limbs, x->limbs, x->count, y->limbs, y->count);
+  return r;
+}
+
+/* truncating division, y must not be zero */
+lval* lbig_div(lval* x, lval* y) {
+  lval* r = lval_big(x->num * y->num, x->count);
+  lmag_div(r->limbs, x->limbs, x->count, y->limbs, lmag_len(y->limbs, y->count));
+  return r;
+}
+
+/* arithmetic kernels. each works over a list of plain numbers in
+   place, leaving the result in the first cell. if the result would
+   overflow, they stop and leave the arguments untouched so they can
+   be redone as big numbers. two arguments is by far the most common
+   case, so it is handled before the loop */
+enum { LKERNEL_OK, LKERNEL_OVERFLOW, LKERNEL_DIVZERO };
+typedef int(*lkernel)(lval*);
+
+int lkernel_add(lval* a) {
+  long r;
+  if (__builtin_add_overflow(a->cell[0]->num, a->cell[1]->num, &r)) {
+    return LKERNEL_OVERFLOW;
+  }
+  for (int i = 2; i < a->count; i++) {
+    if (__builtin_add_overflow(r, a->cell[i]->num, &r)) {
+      return LKERNEL_OVERFLOW;
+    }
+  }
+  a->cell[0]->num = r;
+  return LKERNEL_OK;
+}
+
+int lkernel_sub(lval* a) {
+  long r;
+  if (__builtin_sub_overflow(a->cell[0]->num, a->cell[1]->num, &r)) {
+    return LKERNEL_OVERFLOW;
+  }
+  for (int i = 2; i < a->count; i++) {
+    if (__builtin_sub_overflow(r, a->cell[i]->num, &r)) {
+      return LKERNEL_OVERFLOW;
+    }
+  }
+  a->cell[0]->num = r;
+  return LKERNEL_OK;
+}
+
+int lkernel_mul(lval* a) {
+  long r;
+  if (__builtin_mul_overflow(a->cell[0]->num, a->cell[1]->num, &r)) {
+    return LKERNEL_OVERFLOW;
+  }
+  for (int i = 2; i < a->count; i++) {
+    if (__builtin_mul_overflow(r, a->cell[i]->num, &r)) {
+      return LKERNEL_OVERFLOW;
+    }
+  }
+  a->cell[0]->num = r;
+  return LKERNEL_OK;
+}
+
+int lkernel_div(lval* a) {
+  long r = a->cell[0]->num;
+  for (int i = 1; i < a->count; i++) {
+    long y = a->cell[i]->num;
+    if (y == 0) { return LKERNEL_DIVZERO; }
+    /* the one quotient which does not fit */
+    if (y == -1 && r == LONG_MIN) { return LKERNEL_OVERFLOW; }
+    r /= y;
+  }
+  a->cell[0]->num = r;
+  return LKERNEL_OK;
+}
+
+/* the general path for arithmetic, used when any argument is a big
+   number or the plain kernel overflowed */
+lval* lbig_op(lval* a, lkernel kernel) {
+  lval* x = lbig_of(a->cell[0]);
+  if (a->count == 1 && kernel == lkernel_sub) { x->num = -x->num; }
+
+  for (int i = 1; i < a->count; i++) {
+    lval* y = lbig_of(a->cell[i]);
+    lval* r = NULL;
+    if (kernel == lkernel_add) { r = lbig_add(x, y, 0); }
+    else if (kernel == lkernel_sub) { r = lbig_add(x, y, 1); }
+    else if (kernel == lkernel_mul) { r = lbig_mul(x, y); }
+    else if (kernel == lkernel_div) {
+      if (lmag_len(y->limbs, y->count) == 0) {
+        lval_del(x); lval_del(y); lval_del(a);
+        return lval_err("Division By Zero!");
+      }
+      r = lbig_div(x, y);
+    } else {
+      lval_del(x); lval_del(y); lval_del(a);
+      return lval_err("No big number form for this operator!");
+    }
+    lval_del(x);
+    lval_del(y);
+    x = r;
+    x->count = lmag_len(x->limbs, x->count);
+  }
+  lval_del(a);
+  return lbig_norm(x);
+}
+
+/* convert a number of any kind to a double */
+double ldbl_of(lval* v) {
+  if (v->type == LVAL_DBL) { return v->dbl; }
+  if (v->type == LVAL_NUM) { return v->num; }
+  double x = 0;
+  for (int i = v->count-1; i >= 0; i--) { x = x * LBIG_BASE + v->limbs[i]; }
+  return v->num * x;
+}
+
+/* arithmetic on doubles, used as soon as any argument is a float */
+lval* ldbl_op(lval* a, lkernel kernel) {
+  double x = ldbl_of(a->cell[0]);
+  if (a->count == 1 && kernel == lkernel_sub) { x = -x; }
+
+  for (int i = 1; i < a->count; i++) {
+    double y = ldbl_of(a->cell[i]);
+    if (kernel == lkernel_add) { x += y; }
+    if (kernel == lkernel_sub) { x -= y; }
+    if (kernel == lkernel_mul) { x *= y; }
+    if (kernel == lkernel_div) {
+      if (y == 0) {
+        lval_del(a);
+        return lval_err("Division By Zero!");
+      }
+      x /= y;
+    }
+  }
+  lval_del(a);
+  return lval_dbl(x);
+}
+
+/* elementwise vector operations, defined with the vector builtins */
+lval* lvec_arith(lval* a, char* op, lkernel kernel);
+lval* lvec_ord(lval* a, char* op, int accept);
+
+/* method to perform basic mathematical operators */
+lval* builtin_op(lenv* e, lval* a, char* op, lkernel kernel) {
+
+  /* ensure arguments are numbers, and note any big ones or floats */
+  int big = 0;
+  int dbl = 0;
+  for (int i = 0; i < a->count; i++) {
+    if (a->cell[i]->type == LVAL_VEC) { return lvec_arith(a, op, kernel); }
+    LASSERT_NUMBER(op, a, i);
+    big |= a->cell[i]->type == LVAL_BIG;
+    dbl |= a->cell[i]->type == LVAL_DBL;
+  }
+  LASSERT(a, a->count > 0, "function %s passed no arguments.", op);
+  if (dbl) { return ldbl_op(a, kernel); }
+
+  if (!big && a->count == 1) {
+    /* if no arguments and it's subtraction, perform unary negation */
+    if (kernel == lkernel_sub) {
+      if (a->cell[0]->num == LONG_MIN) { return lbig_op(a, kernel); }
+      a->cell[0]->num = -a->cell[0]->num;
+    }
+    return lval_first(a);
+  }
+
+  if (!big) {
+    int status = kernel(a);
+    if (status == LKERNEL_OK) { return lval_first(a); }
+    if (status == LKERNEL_DIVZERO) {
+      lval_del(a);
+      return lval_err("Division By Zero!");
+    }
+  }
+
+  /* promote to big numbers */
+  return lbig_op(a, kernel);
 }
 
 /* all builtin basic math operations */
 lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a, "+");
+  return builtin_op(e, a, "+", lkernel_add);
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+  return builtin_op(e, a, "-", lkernel_sub);
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+  return builtin_op(e, a, "*", lkernel_mul);
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+  return builtin_op(e, a, "/", lkernel_div);
+}
+
+/* method to add a new variable to the environment */
+lval* builtin_var(lenv* e, lval* a, char* func) {
+  /* if input isn't a q-expression the compiler will attempt
+     to evaluate it immediately, so confirm input is q-expression */
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+  /* after definition, must be followed by a symbol list */
+  lval* syms = lval_unpack(a->cell[0]);
+
+  /* ensure all elements in first symbol list are symbols */
+  for (int i = 0; i < syms->count; i++) {
+    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+            "function '%s' cannot define non-symbol. "
+            "got %s, expected %s",
+            func, ltype_name(LVAL_SYM), ltype_name(syms->cell[i]->type));
+  }
+
+  /* ensure that the method receives count-1
+     inputs, where the -1 comes from removing the
+     method name */
+  LASSERT(a, (syms->count == a->count-1),
+          "function '%s' passed wrong number of arguments. "
+          "got %i, expected %i",
+          func, a->count-1, syms->count);
+
+  /* assign variable names for each value in a */
+  for (int i = 0; i < syms->count; i++) {
+    /* if 'def' define globally, if 'put' define locally */
+    if (strcmp(func, "def") == 0) {
+      lenv_def(e, syms->cell[i], a->cell[i+1]);
+    }
+    if (strcmp(func, "=") == 0) {
+      if (e->par) { lopt_local(syms->cell[i]); }
+      lenv_put(e, syms->cell[i], a->cell[i+1]);
+    }
+  }
+
+  /* clean up */
+  lval_del(a);
+  /* return an empty s-expression on success */
+  return lval_sexpr();
+}
+
+/* builtin method to put a variable to the global scope */
+lval* builtin_def(lenv* e, lval* a) {
+  return builtin_var(e, a, "def");
+}
+
+/* builtin method to put a variable to the local scope */
+lval* builtin_put(lenv* e, lval* a) {
+  return builtin_var(e, a, "=");
+}
+
+/* orderings accepted by each comparison, as bits indexed by the
+   sign of the comparison plus one */
+#define LORD_LT 1
+#define LORD_EQ 2
+#define LORD_GT 4
+
+/* method to compare numbers */
+lval* builtin_ord(lenv* e, lval* a, char* op, int accept) {
+  LASSERT_NUM(op, a, 2);
+  if (a->cell[0]->type == LVAL_VEC || a->cell[1]->type == LVAL_VEC) {
+    return lvec_ord(a, op, accept);
+  }
+  LASSERT_NUMBER(op, a, 0);
+  LASSERT_NUMBER(op, a, 1);
+
+  int r;
+  if (a->cell[0]->type == LVAL_DBL || a->cell[1]->type == LVAL_DBL) {
+    /* nothing is ordered with respect to nan */
+    double x = ldbl_of(a->cell[0]);
+    double y = ldbl_of(a->cell[1]);
+    int sign = (x > y) - (x < y);
+    r = isnan(x) || isnan(y) ? 0 : (accept >> (sign + 1)) & 1;
+  } else {
+    int sign = lbig_cmp(a->cell[0], a->cell[1]);
+    r = (accept >> (sign + 1)) & 1;
+  }
+
+  /* reuse the first argument to hold the result */
+  if (a->cell[0]->type == LVAL_NUM) {
+    a->cell[0]->num = r;
+    return lval_first(a);
+  }
+  lval_del(a);
+  return lval_num(r);
+}
+
+/* builtins for comparison operators */
+lval* builtin_gt(lenv* e, lval* a) {
+  return builtin_ord(e, a, ">", LORD_GT);
+}
+
+lval* builtin_lt(lenv* e, lval* a) {
+  return builtin_ord(e, a, "<", LORD_LT);
+}
+
+
+lval* builtin_ge(lenv* e, lval* a) {
+  return builtin_ord(e, a, ">=", LORD_GT | LORD_EQ);
+}
+
+lval* builtin_le(lenv* e, lval* a) {
+  return builtin_ord(e, a, "<=", LORD_LT | LORD_EQ);
+}
+
+/* builtin method to compare equality between two lvals */
+/* equality as == sees it, where a float equals an integer of the
+   same value */
+int lval_same(lval* x, lval* y) {
+  int tx = x->type, ty = y->type;
+  if ((tx == LVAL_DBL || ty == LVAL_DBL) && tx != ty
+      && (tx == LVAL_NUM || tx == LVAL_BIG || tx == LVAL_DBL)
+      && (ty == LVAL_NUM || ty == LVAL_BIG || ty == LVAL_DBL)) {
+    return ldbl_of(x) == ldbl_of(y);
+  }
+  return lval_eq(x, y);
+}
+
+lval* builtin_cmp(lenv* e, lval* a, char* op, int equal) {
+  /* ensure two inputs to compare equality for */
+  LASSERT_NUM(op, a, 2);
+
+  /* numbers are compared directly and the first reused for the result */
+  if (a->cell[0]->type == LVAL_NUM && a->cell[1]->type == LVAL_NUM) {
+    a->cell[0]->num = (a->cell[0]->num == a->cell[1]->num) == equal;
+    return lval_first(a);
+  }
+
+  int r = lval_same(a->cell[0], a->cell[1]) == equal;
+  lval_del(a);
+  return lval_num(r);
+}
+
+/* builtins for equals and not equals */
+lval* builtin_eq(lenv* e, lval* a) {
+  return builtin_cmp(e, a, "==", 1);
+}
+
+lval* builtin_ne(lenv* e, lval* a) {
+  return builtin_cmp(e, a, "!=", 0);
+}
+
+/* packed vectors keep their elements unboxed in one array, so the
+   elementwise and reducing builtins run over plain memory. each
+   operation has a portable scalar kernel, and on x86-64 sse2 and avx2
+   kernels as well. the best set the cpu supports is chosen at startup */
+typedef struct {
+  char* name;
+  void (*add)(double* r, double* x, double* y, int n);
+  void (*sub)(double* r, double* x, double* y, int n);
+  void (*mul)(double* r, double* x, double* y, int n);
+  void (*div)(double* r, double* x, double* y, int n);
+  /* integer kernels return nonzero if any element overflowed */
+  int (*iadd)(long* r, long* x, long* y, int n);
+  int (*isub)(long* r, long* x, long* y, int n);
+  double (*sum)(double* x, int n);
+  int (*isum)(long* r, long* x, int n);
+  double (*dot)(double* x, double* y, int n);
+  double (*min)(double* x, int n);
+  double (*max)(double* x, int n);
+  long (*imin)(long* x, int n);
+  long (*imax)(long* x, int n);
+  /* comparisons write 1 or 0 per element, for the orderings in accept */
+  void (*ord)(long* r, double* x, double* y, int n, int accept);
+  void (*iord)(long* r, long* x, long* y, int n, int accept);
+} lvec_kernels;
+
+void lvec_add_scalar(double* r, double* x, double* y, int n) {
+  for (int i = 0; i < n; i++) { r[i] = x[i] + y[i]; }
+}
+
+void lvec_sub_scalar(double* r, double* x, double* y, int n) {
+  for (int i = 0; i < n; i++) { r[i] = x[i] - y[i]; }
+}
+
+void lvec_mul_scalar(double* r, double* x, double* y, int n) {
+  for (int i = 0; i < n; i++) { r[i] = x[i] * y[i]; }
+}
+
+void lvec_div_scalar(double* r, double* x, double* y, int n) {
+  for (int i = 0; i < n; i++) { r[i] = x[i] / y[i]; }
+}
+
+int lvec_iadd_scalar(long* r, long* x, long* y, int n) {
+  int over = 0;
+  for (int i = 0; i < n; i++) { over |= __builtin_add_overflow(x[i], y[i], &r[i]); }
+  return over;
+}
+
+int lvec_isub_scalar(long* r, long* x, long* y, int n) {
+  int over = 0;
+  for (int i = 0; i < n; i++) { over |= __builtin_sub_overflow(x[i], y[i], &r[i]); }
+  return over;
+}
+
+double lvec_sum_scalar(double* x, int n) {
+  double s = 0;
+  for (int i = 0; i < n; i++) { s += x[i]; }
+  return s;
+}
+
+int lvec_isum_scalar(long* r, long* x, int n) {
+  long s = 0;
+  for (int i = 0; i < n; i++) {
+    if (__builtin_add_overflow(s, x[i], &s)) { return 1; }
+  }
+  *r = s;
+  return 0;
+}
+
+double lvec_dot_scalar(double* x, double* y, int n) {
+  double s = 0;
+  for (int i = 0; i < n; i++) { s += x[i] * y[i]; }
+  return s;
+}
+
+/* nan in a vector makes its minimum and maximum nan */
+double lvec_min_scalar(double* x, int n) {
+  double m = x[0];
+  for (int i = 1; i < n; i++) { m = x[i] < m || isnan(x[i]) ? x[i] : m; }
+  return m;
+}
+
+double lvec_max_scalar(double* x, int n) {
+  double m = x[0];
+  for (int i = 1; i < n; i++) { m = x[i] > m || isnan(x[i]) ? x[i] : m; }
+  return m;
+}
+
+long lvec_imin_scalar(long* x, int n) {
+  long m = x[0];
+  for (int i = 1; i < n; i++) { m = x[i] < m ? x[i] : m; }
+  return m;
+}
+
+long lvec_imax_scalar(long* x, int n) {
+  long m = x[0];
+  for (int i = 1; i < n; i++) { m = x[i] > m ? x[i] : m; }
+  return m;
+}
+
+void lvec_ord_scalar(long* r, double* x, double* y, int n, int accept) {
+  for (int i = 0; i < n; i++) {
+    /* nothing is ordered with respect to nan */
+    int sign = (x[i] > y[i]) - (x[i] < y[i]);
+    r[i] = !isnan(x[i]) && !isnan(y[i]) && ((accept >> (sign + 1)) & 1);
+  }
+}
+
+void lvec_iord_scalar(long* r, long* x, long* y, int n, int accept) {
+  for (int i = 0; i < n; i++) {
+    int sign = (x[i] > y[i]) - (x[i] < y[i]);
+    r[i] = (accept >> (sign + 1)) & 1;
+  }
+}
+
+lvec_kernels lvec_scalar = {
+  "scalar",
+  lvec_add_scalar, lvec_sub_scalar, lvec_mul_scalar, lvec_div_scalar,
+  lvec_iadd_scalar, lvec_isub_scalar,
+  lvec_sum_scalar, lvec_isum_scalar, lvec_dot_scalar,
+  lvec_min_scalar, lvec_max_scalar, lvec_imin_scalar, lvec_imax_scalar,
+  lvec_ord_scalar, lvec_iord_scalar
+};
+
+#ifdef LVEC_X86
+
+/* sse2 is part of x86-64, so these need no runtime check. there are
+   no 64 bit integer comparisons before sse4.2, so integer minimum,
+   maximum and ordering keep the scalar kernels */
+
+/* elementwise kernels share one loop shape, with the
+   leftover elements finished by the scalar kernel */
+#define LVEC_MAP_SSE2(name, op) \
+  void lvec_##name##_sse2(double* r, double* x, double* y, int n) { \
+    int i = 0; \
+    for (; i + 2 <= n; i += 2) { \
+      _mm_storeu_pd(r+i, op(_mm_loadu_pd(x+i), _mm_loadu_pd(y+i))); \
+    } \
+    lvec_##name##_scalar(r+i, x+i, y+i, n-i); \
+  }
+
+LVEC_MAP_SSE2(add, _mm_add_pd)
+LVEC_MAP_SSE2(sub, _mm_sub_pd)
+LVEC_MAP_SSE2(mul, _mm_mul_pd)
+LVEC_MAP_SSE2(div, _mm_div_pd)
+
+/* a sum overflowed when it has a different sign to both operands,
+   and a difference when it differs from x with x and y differing */
+int lvec_iadd_sse2(long* r, long* x, long* y, int n) {
+  __m128i over = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((__m128i*)(x+i));
+    __m128i b = _mm_loadu_si128((__m128i*)(y+i));
+    __m128i s = _mm_add_epi64(a, b);
+    over = _mm_or_si128(over, _mm_and_si128(_mm_xor_si128(a, s), _mm_xor_si128(b, s)));
+    _mm_storeu_si128((__m128i*)(r+i), s);
+  }
+  return _mm_movemask_pd(_mm_castsi128_pd(over)) | lvec_iadd_scalar(r+i, x+i, y+i, n-i);
+}
+
+int lvec_isub_sse2(long* r, long* x, long* y, int n) {
+  __m128i over = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((__m128i*)(x+i));
+    __m128i b = _mm_loadu_si128((__m128i*)(y+i));
+    __m128i s = _mm_sub_epi64(a, b);
+    over = _mm_or_si128(over, _mm_and_si128(_mm_xor_si128(a, s), _mm_xor_si128(a, b)));
+    _mm_storeu_si128((__m128i*)(r+i), s);
+  }
+  return _mm_movemask_pd(_mm_castsi128_pd(over)) | lvec_isub_scalar(r+i, x+i, y+i, n-i);
+}
+
+/* reductions keep two accumulators to overlap the add latency, so
+   float sums may round differently to the scalar kernel */
+double lvec_sum_sse2(double* x, int n) {
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 = _mm_add_pd(s0, _mm_loadu_pd(x+i));
+    s1 = _mm_add_pd(s1, _mm_loadu_pd(x+i+2));
+  }
+  double s[2];
+  _mm_storeu_pd(s, _mm_add_pd(s0, s1));
+  return s[0] + s[1] + lvec_sum_scalar(x+i, n-i);
+}
+
+/* lanes may overflow where the true total does not. that is
+   reported as overflow, and the caller redoes the sum exactly */
+int lvec_isum_sse2(long* r, long* x, int n) {
+  __m128i s = _mm_setzero_si128(), over = _mm_setzero_si128();
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i a = _mm_loadu_si128((__m128i*)(x+i));
+    __m128i t = _mm_add_epi64(s, a);
+    over = _mm_or_si128(over, _mm_and_si128(_mm_xor_si128(s, t), _mm_xor_si128(a, t)));
+    s = t;
+  }
+  long lanes[2], tail;
+  _mm_storeu_si128((__m128i*)lanes, s);
+  if (_mm_movemask_pd(_mm_castsi128_pd(over))
+      || lvec_isum_scalar(&tail, x+i, n-i)
+      || __builtin_add_overflow(lanes[0], lanes[1], r)
+      || __builtin_add_overflow(*r, tail, r)) {
+    return 1;
+  }
+  return 0;
+}
+
+double lvec_dot_sse2(double* x, double* y, int n) {
+  __m128d s0 = _mm_setzero_pd(), s1 = _mm_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    s0 = _mm_add_pd(s0, _mm_mul_pd(_mm_loadu_pd(x+i), _mm_loadu_pd(y+i)));
+    s1 = _mm_add_pd(s1, _mm_mul_pd(_mm_loadu_pd(x+i+2), _mm_loadu_pd(y+i+2)));
+  }
+  double s[2];
+  _mm_storeu_pd(s, _mm_add_pd(s0, s1));
+  return s[0] + s[1] + lvec_dot_scalar(x+i, y+i, n-i);
+}
+
+/* minpd and maxpd drop nans, so they are tracked separately */
+double lvec_min_sse2(double* x, int n) {
+  if (n < 2) { return lvec_min_scalar(x, n); }
+  __m128d m = _mm_loadu_pd(x), nan = _mm_cmpunord_pd(m, m);
+  int i = 2;
+  for (; i + 2 <= n; i += 2) {
+    __m128d a = _mm_loadu_pd(x+i);
+    m = _mm_min_pd(m, a);
+    nan = _mm_or_pd(nan, _mm_cmpunord_pd(a, a));
+  }
+  if (_mm_movemask_pd(nan)) { return NAN; }
+  double l[3];
+  _mm_storeu_pd(l, m);
+  l[2] = i < n ? lvec_min_scalar(x+i, n-i) : l[0];
+  return lvec_min_scalar(l, 3);
+}
+
+double lvec_max_sse2(double* x, int n) {
+  if (n < 2) { return lvec_max_scalar(x, n); }
+  __m128d m = _mm_loadu_pd(x), nan = _mm_cmpunord_pd(m, m);
+  int i = 2;
+  for (; i + 2 <= n; i += 2) {
+    __m128d a = _mm_loadu_pd(x+i);
+    m = _mm_max_pd(m, a);
+    nan = _mm_or_pd(nan, _mm_cmpunord_pd(a, a));
+  }
+  if (_mm_movemask_pd(nan)) { return NAN; }
+  double l[3];
+  _mm_storeu_pd(l, m);
+  l[2] = i < n ? lvec_max_scalar(x+i, n-i) : l[0];
+  return lvec_max_scalar(l, 3);
+}
+
+/* the ordered comparisons are false for nan, as in builtin_ord */
+void lvec_ord_sse2(long* r, double* x, double* y, int n, int accept) {
+  __m128i one = _mm_set1_epi64x(1);
+  int i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d a = _mm_loadu_pd(x+i), b = _mm_loadu_pd(y+i), m;
+    switch (accept) {
+      case LORD_LT:           m = _mm_cmplt_pd(a, b); break;
+      case LORD_LT | LORD_EQ: m = _mm_cmple_pd(a, b); break;
+      case LORD_GT:           m = _mm_cmpgt_pd(a, b); break;
+      default:                m = _mm_cmpge_pd(a, b); break;
+    }
+    _mm_storeu_si128((__m128i*)(r+i), _mm_and_si128(_mm_castpd_si128(m), one));
+  }
+  lvec_ord_scalar(r+i, x+i, y+i, n-i, accept);
+}
+
+lvec_kernels lvec_sse2 = {
+  "sse2",
+  lvec_add_sse2, lvec_sub_sse2, lvec_mul_sse2, lvec_div_sse2,
+  lvec_iadd_sse2, lvec_isub_sse2,
+  lvec_sum_sse2, lvec_isum_sse2, lvec_dot_sse2,
+  lvec_min_sse2, lvec_max_sse2, lvec_imin_scalar, lvec_imax_scalar,
+  lvec_ord_sse2, lvec_iord_scalar
+};
+
+/* avx2 kernels are compiled for avx2 whatever the build flags, and
+   only called once the cpu has been checked for it */
+#define LVEC_AVX2 __attribute__((target("avx2")))
+
+#define LVEC_MAP_AVX2(name, op) \
+  LVEC_AVX2 void lvec_##name##_avx2(double* r, double* x, double* y, int n) { \
+    int i = 0; \
+    for (; i + 4 <= n; i += 4) { \
+      _mm256_storeu_pd(r+i, op(_mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i))); \
+    } \
+    lvec_##name##_scalar(r+i, x+i, y+i, n-i); \
+  }
+
+LVEC_MAP_AVX2(add, _mm256_add_pd)
+LVEC_MAP_AVX2(sub, _mm256_sub_pd)
+LVEC_MAP_AVX2(mul, _mm256_mul_pd)
+LVEC_MAP_AVX2(div, _mm256_div_pd)
+
+LVEC_AVX2 int lvec_iadd_avx2(long* r, long* x, long* y, int n) {
+  __m256i over = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((__m256i*)(x+i));
+    __m256i b = _mm256_loadu_si256((__m256i*)(y+i));
+    __m256i s = _mm256_add_epi64(a, b);
+    over = _mm256_or_si256(over, _mm256_and_si256(_mm256_xor_si256(a, s), _mm256_xor_si256(b, s)));
+    _mm256_storeu_si256((__m256i*)(r+i), s);
+  }
+  return _mm256_movemask_pd(_mm256_castsi256_pd(over)) | lvec_iadd_scalar(r+i, x+i, y+i, n-i);
+}
+
+LVEC_AVX2 int lvec_isub_avx2(long* r, long* x, long* y, int n) {
+  __m256i over = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((__m256i*)(x+i));
+    __m256i b = _mm256_loadu_si256((__m256i*)(y+i));
+    __m256i s = _mm256_sub_epi64(a, b);
+    over = _mm256_or_si256(over, _mm256_and_si256(_mm256_xor_si256(a, s), _mm256_xor_si256(a, b)));
+    _mm256_storeu_si256((__m256i*)(r+i), s);
+  }
+  return _mm256_movemask_pd(_mm256_castsi256_pd(over)) | lvec_isub_scalar(r+i, x+i, y+i, n-i);
+}
+
+LVEC_AVX2 double lvec_sum_avx2(double* x, int n) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = _mm256_add_pd(s0, _mm256_loadu_pd(x+i));
+    s1 = _mm256_add_pd(s1, _mm256_loadu_pd(x+i+4));
+  }
+  double s[4];
+  _mm256_storeu_pd(s, _mm256_add_pd(s0, s1));
+  return (s[0] + s[1]) + (s[2] + s[3]) + lvec_sum_scalar(x+i, n-i);
+}
+
+LVEC_AVX2 int lvec_isum_avx2(long* r, long* x, int n) {
+  __m256i s = _mm256_setzero_si256(), over = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((__m256i*)(x+i));
+    __m256i t = _mm256_add_epi64(s, a);
+    over = _mm256_or_si256(over, _mm256_and_si256(_mm256_xor_si256(s, t), _mm256_xor_si256(a, t)));
+    s = t;
+  }
+  long lanes[5];
+  _mm256_storeu_si256((__m256i*)lanes, s);
+  return _mm256_movemask_pd(_mm256_castsi256_pd(over))
+    || lvec_isum_scalar(&lanes[4], x+i, n-i)
+    || lvec_isum_scalar(r, lanes, 5);
+}
+
+LVEC_AVX2 double lvec_dot_avx2(double* x, double* y, int n) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = _mm256_add_pd(s0, _mm256_mul_pd(_mm256_loadu_pd(x+i), _mm256_loadu_pd(y+i)));
+    s1 = _mm256_add_pd(s1, _mm256_mul_pd(_mm256_loadu_pd(x+i+4), _mm256_loadu_pd(y+i+4)));
+  }
+  double s[4];
+  _mm256_storeu_pd(s, _mm256_add_pd(s0, s1));
+  return (s[0] + s[1]) + (s[2] + s[3]) + lvec_dot_scalar(x+i, y+i, n-i);
+}
+
+LVEC_AVX2 double lvec_min_avx2(double* x, int n) {
+  if (n < 4) { return lvec_min_scalar(x, n); }
+  __m256d m = _mm256_loadu_pd(x), nan = _mm256_cmp_pd(m, m, _CMP_UNORD_Q);
+  int i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256d a = _mm256_loadu_pd(x+i);
+    m = _mm256_min_pd(m, a);
+    nan = _mm256_or_pd(nan, _mm256_cmp_pd(a, a, _CMP_UNORD_Q));
+  }
+  if (_mm256_movemask_pd(nan)) { return NAN; }
+  double l[5];
+  _mm256_storeu_pd(l, m);
+  l[4] = i < n ? lvec_min_scalar(x+i, n-i) : l[0];
+  return lvec_min_scalar(l, 5);
+}
+
+LVEC_AVX2 double lvec_max_avx2(double* x, int n) {
+  if (n < 4) { return lvec_max_scalar(x, n); }
+  __m256d m = _mm256_loadu_pd(x), nan = _mm256_cmp_pd(m, m, _CMP_UNORD_Q);
+  int i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256d a = _mm256_loadu_pd(x+i);
+    m = _mm256_max_pd(m, a);
+    nan = _mm256_or_pd(nan, _mm256_cmp_pd(a, a, _CMP_UNORD_Q));
+  }
+  if (_mm256_movemask_pd(nan)) { return NAN; }
+  double l[5];
+  _mm256_storeu_pd(l, m);
+  l[4] = i < n ? lvec_max_scalar(x+i, n-i) : l[0];
+  return lvec_max_scalar(l, 5);
+}
+
+LVEC_AVX2 long lvec_imin_avx2(long* x, int n) {
+  if (n < 4) { return lvec_imin_scalar(x, n); }
+  __m256i m = _mm256_loadu_si256((__m256i*)x);
+  int i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((__m256i*)(x+i));
+    m = _mm256_blendv_epi8(m, a, _mm256_cmpgt_epi64(m, a));
+  }
+  long l[5];
+  _mm256_storeu_si256((__m256i*)l, m);
+  l[4] = i < n ? lvec_imin_scalar(x+i, n-i) : l[0];
+  return lvec_imin_scalar(l, 5);
+}
+
+LVEC_AVX2 long lvec_imax_avx2(long* x, int n) {
+  if (n < 4) { return lvec_imax_scalar(x, n); }
+  __m256i m = _mm256_loadu_si256((__m256i*)x);
+  int i = 4;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((__m256i*)(x+i));
+    m = _mm256_blendv_epi8(m, a, _mm256_cmpgt_epi64(a, m));
+  }
+  long l[5];
+  _mm256_storeu_si256((__m256i*)l, m);
+  l[4] = i < n ? lvec_imax_scalar(x+i, n-i) : l[0];
+  return lvec_imax_scalar(l, 5);
+}
+
+LVEC_AVX2 void lvec_ord_avx2(long* r, double* x, double* y, int n, int accept) {
+  __m256i one = _mm256_set1_epi64x(1);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d a = _mm256_loadu_pd(x+i), b = _mm256_loadu_pd(y+i), m;
+    switch (accept) {
+      case LORD_LT:           m = _mm256_cmp_pd(a, b, _CMP_LT_OQ); break;
+      case LORD_LT | LORD_EQ: m = _mm256_cmp_pd(a, b, _CMP_LE_OQ); break;
+      case LORD_GT:           m = _mm256_cmp_pd(a, b, _CMP_GT_OQ); break;
+      default:                m = _mm256_cmp_pd(a, b, _CMP_GE_OQ); break;
+    }
+    _mm256_storeu_si256((__m256i*)(r+i), _mm256_and_si256(_mm256_castpd_si256(m), one));
+  }
+  lvec_ord_scalar(r+i, x+i, y+i, n-i, accept);
+}
+
+/* with only a greater than comparison, less or equal is its negation */
+LVEC_AVX2 void lvec_iord_avx2(long* r, long* x, long* y, int n, int accept) {
+  __m256i one = _mm256_set1_epi64x(1);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i a = _mm256_loadu_si256((__m256i*)(x+i));
+    __m256i b = _mm256_loadu_si256((__m256i*)(y+i));
+    __m256i m;
+    switch (accept) {
+      case LORD_LT: m = _mm256_and_si256(_mm256_cmpgt_epi64(b, a), one); break;
+      case LORD_GT: m = _mm256_and_si256(_mm256_cmpgt_epi64(a, b), one); break;
+      case LORD_LT | LORD_EQ: m = _mm256_andnot_si256(_mm256_cmpgt_epi64(a, b), one); break;
+      default:      m = _mm256_andnot_si256(_mm256_cmpgt_epi64(b, a), one); break;
+    }
+    _mm256_storeu_si256((__m256i*)(r+i), m);
+  }
+  lvec_iord_scalar(r+i, x+i, y+i, n-i, accept);
+}
+
+lvec_kernels lvec_avx2 = {
+  "avx2",
+  lvec_add_avx2, lvec_sub_avx2, lvec_mul_avx2, lvec_div_avx2,
+  lvec_iadd_avx2, lvec_isub_avx2,
+  lvec_sum_avx2, lvec_isum_avx2, lvec_dot_avx2,
+  lvec_min_avx2, lvec_max_avx2, lvec_imin_avx2, lvec_imax_avx2,
+  lvec_ord_avx2, lvec_iord_avx2
+};
+
+#endif
+
+/* the kernels in use, set by lvec_init */
+lvec_kernels* lvec_k = &lvec_scalar;
+
+/* select kernels by name, refusing any the cpu cannot run */
+int lvec_select(char* name) {
+  if (strcmp(name, "scalar") == 0) { lvec_k = &lvec_scalar; return 1; }
+#ifdef LVEC_X86
+  if (strcmp(name, "sse2") == 0) { lvec_k = &lvec_sse2; return 1; }
+  if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+    lvec_k = &lvec_avx2;
+    return 1;
+  }
+#endif
+  return 0;
+}
+
+void lvec_init(void) {
+#ifdef LVEC_X86
+  __builtin_cpu_init();
+  if (!lvec_select("avx2")) { lvec_select("sse2"); }
+#endif
+}
+
+/* convert a vector or scalar to a vector of n elements of the given
+   kind, broadcasting scalars. the argument is consumed */
+lval* lvec_as(lval* v, int dbl, int n) {
+  if (v->type == LVAL_VEC && (v->dvec != NULL) == dbl) { return v; }
+  lval* r = lval_vec(dbl, n);
+  if (v->type == LVAL_VEC) {
+    for (int i = 0; i < n; i++) { r->dvec[i] = v->ivec[i]; }
+  } else if (dbl) {
+    double x = ldbl_of(v);
+    for (int i = 0; i < n; i++) { r->dvec[i] = x; }
+  } else {
+    for (int i = 0; i < n; i++) { r->ivec[i] = v->num; }
+  }
+  lval_del(v);
+  return r;
+}
+
+/* check arguments of an elementwise operation and convert them all to
+   vectors of one length and kind. returns an error, or NULL on success */
+lval* lvec_args(lval* a, char* op) {
+  int n = -1;
+  int dbl = 0;
+  for (int i = 0; i < a->count; i++) {
+    lval* x = a->cell[i];
+    if (x->type != LVAL_VEC && x->type != LVAL_NUM && x->type != LVAL_DBL) {
+      return lval_err("function '%s' passed incorrect type for argument %i. "
+                      "got %s, expected %s.",
+                      op, i, ltype_name(x->type), ltype_name(LVAL_VEC));
+    }
+    if (x->type == LVAL_VEC) {
+      if (n != -1 && x->count != n) {
+        return lval_err("function '%s' passed vectors of different lengths. "
+                        "got %i, expected %i.", op, x->count, n);
+      }
+      n = x->count;
+    }
+    dbl |= x->type == LVAL_DBL || (x->type == LVAL_VEC && x->dvec);
+  }
+  for (int i = 0; i < a->count; i++) {
+    a->cell[i] = lvec_as(a->cell[i], dbl, n);
+  }
+  return NULL;
+}
+
+/* apply an arithmetic kernel to two vectors of one kind, in place in x */
+int lvec_apply(lval* x, lval* y, lkernel kernel) {
+  int n = x->count;
+  if (x->dvec) {
+    /* division by zero is an error, as it is for single floats */
+    if (kernel == lkernel_div) {
+      for (int i = 0; i < n; i++) {
+        if (y->dvec[i] == 0) { return LKERNEL_DIVZERO; }
+      }
+    }
+    if (kernel == lkernel_add) { lvec_k->add(x->dvec, x->dvec, y->dvec, n); }
+    if (kernel == lkernel_sub) { lvec_k->sub(x->dvec, x->dvec, y->dvec, n); }
+    if (kernel == lkernel_mul) { lvec_k->mul(x->dvec, x->dvec, y->dvec, n); }
+    if (kernel == lkernel_div) { lvec_k->div(x->dvec, x->dvec, y->dvec, n); }
+    return LKERNEL_OK;
+  }
+
+  long* r = x->ivec;
+  long* b = y->ivec;
+  if (kernel == lkernel_add) {
+    return lvec_k->iadd(r, r, b, n) ? LKERNEL_OVERFLOW : LKERNEL_OK;
+  }
+  if (kernel == lkernel_sub) {
+    return lvec_k->isub(r, r, b, n) ? LKERNEL_OVERFLOW : LKERNEL_OK;
+  }
+  /* there is no packed 64 bit multiply or divide below avx-512 */
+  int over = 0;
+  if (kernel == lkernel_mul) {
+    for (int i = 0; i < n; i++) { over |= __builtin_mul_overflow(r[i], b[i], &r[i]); }
+  }
+  if (kernel == lkernel_div) {
+    for (int i = 0; i < n; i++) {
+      if (b[i] == 0) { return LKERNEL_DIVZERO; }
+      if (b[i] == -1 && r[i] == LONG_MIN) { return LKERNEL_OVERFLOW; }
+      r[i] /= b[i];
+    }
+  }
+  return over ? LKERNEL_OVERFLOW : LKERNEL_OK;
+}
+
+/* elementwise arithmetic, used when any argument to + - * / is a
+   vector. scalars are broadcast and integers promoted to floats as
+   needed. vector elements have no room for big numbers, so integer
+   overflow is an error */
+lval* lvec_arith(lval* a, char* op, lkernel kernel) {
+  lval* err = lvec_args(a, op);
+  if (err) {
+    lval_del(a);
+    return err;
+  }
+
+  /* unary minus negates every element */
+  if (a->count == 1 && kernel == lkernel_sub) {
+    lval* x = a->cell[0];
+    for (int i = 0; i < x->count; i++) {
+      if (x->dvec) { x->dvec[i] = -x->dvec[i]; continue; }
+      if (x->ivec[i] == LONG_MIN) {
+        lval_del(a);
+        return lval_err("function '%s' overflowed a vector element.", op);
+      }
+      x->ivec[i] = -x->ivec[i];
+    }
+  }
+
+  for (int i = 1; i < a->count; i++) {
+    int status = lvec_apply(a->cell[0], a->cell[i], kernel);
+    if (status != LKERNEL_OK) {
+      lval_del(a);
+      return status == LKERNEL_DIVZERO
+        ? lval_err("Division By Zero!")
+        : lval_err("function '%s' overflowed a vector element.", op);
+    }
+  }
+  return lval_first(a);
+}
+
+/* elementwise ordering, giving a vector of 1s and 0s */
+lval* lvec_ord(lval* a, char* op, int accept) {
+  lval* err = lvec_args(a, op);
+  if (err) {
+    lval_del(a);
+    return err;
+  }
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+  lval* r = lval_vec(0, x->count);
+  if (x->dvec) {
+    lvec_k->ord(r->ivec, x->dvec, y->dvec, x->count, accept);
+  } else {
+    lvec_k->iord(r->ivec, x->ivec, y->ivec, x->count, accept);
+  }
+  lval_del(a);
+  return r;
+}
+
+/* builtin method to build a vector from a q-expression of numbers */
+lval* builtin_vec(lenv* e, lval* a) {
+  LASSERT_NUM("vec", a, 1);
+  LASSERT_TYPE("vec", a, 0, LVAL_QEXPR);
+
+  lval* q = a->cell[0];
+
+  /* packed numbers copy straight across */
+  if (q->packed) {
+    lval* v = lval_vec(0, q->count);
+    memcpy(v->ivec, q->packed, sizeof(long) * q->count);
+    lval_del(a);
+    return v;
+  }
+
+  int dbl = 0;
+  for (int i = 0; i < q->count; i++) {
+    int t = q->cell[i]->type;
+    LASSERT(a, t == LVAL_NUM || t == LVAL_DBL,
+            "function 'vec' passed incorrect type for element %i. "
+            "got %s, expected %s.", i, ltype_name(t), ltype_name(LVAL_NUM));
+    dbl |= t == LVAL_DBL;
+  }
+
+  lval* v = lval_vec(dbl, q->count);
+  for (int i = 0; i < q->count; i++) {
+    if (dbl) {
+      v->dvec[i] = ldbl_of(q->cell[i]);
+    } else {
+      v->ivec[i] = q->cell[i]->num;
+    }
+  }
+  lval_del(a);
+  return v;
+}
+
+/* builtin method to unpack a vector into a q-expression of numbers */
+lval* builtin_vec_list(lenv* e, lval* a) {
+  LASSERT_NUM("vec-list", a, 1);
+  LASSERT_TYPE("vec-list", a, 0, LVAL_VEC);
+
+  lval* v = a->cell[0];
+  lval* q = lval_qexpr();
+  q->count = v->count;
+  if (v->ivec) {
+    q->packed = malloc(sizeof(long) * (v->count ? v->count : 1));
+    memcpy(q->packed, v->ivec, sizeof(long) * v->count);
+  } else {
+    q->cell = malloc(sizeof(lval*) * v->count);
+    for (int i = 0; i < v->count; i++) { q->cell[i] = lval_dbl(v->dvec[i]); }
+  }
+  lval_del(a);
+  return q;
+}
+
+/* builtin method to build the vector of integers 0 to n-1 */
+lval* builtin_vec_range(lenv* e, lval* a) {
+  LASSERT_NUM("vec-range", a, 1);
+  LASSERT_TYPE("vec-range", a, 0, LVAL_NUM);
+  long n = a->cell[0]->num;
+  LASSERT(a, n >= 0 && n <= INT_MAX,
+          "function 'vec-range' passed invalid length %li.", n);
+
+  lval* v = lval_vec(0, n);
+  for (long i = 0; i < n; i++) { v->ivec[i] = i; }
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_vec_len(lenv* e, lval* a) {
+  LASSERT_NUM("vec-len", a, 1);
+  LASSERT_TYPE("vec-len", a, 0, LVAL_VEC);
+  lval* r = lval_num(a->cell[0]->count);
+  lval_del(a);
+  return r;
+}
+
+/* builtin method to get the nth element of a vector */
+lval* builtin_vec_nth(lenv* e, lval* a) {
+  LASSERT_NUM("vec-nth", a, 2);
+  LASSERT_TYPE("vec-nth", a, 0, LVAL_NUM);
+  LASSERT_TYPE("vec-nth", a, 1, LVAL_VEC);
+
+  long i = a->cell[0]->num;
+  lval* v = a->cell[1];
+  LASSERT(a, i >= 0 && i < v->count,
+          "function 'vec-nth' passed index %li out of range for length %i.",
+          i, v->count);
+  lval* r = v->dvec ? lval_dbl(v->dvec[i]) : lval_num(v->ivec[i]);
+  lval_del(a);
+  return r;
+}
+
+/* exact integer reduction with big numbers, for when a kernel overflowed */
+lval* lvec_big_reduce(lval* v, lkernel kernel) {
+  lval* args = lval_sexpr();
+  for (int i = 0; i < v->count; i++) { lval_add(args, lval_num(v->ivec[i])); }
+  return lbig_op(args, kernel);
+}
+
+lval* builtin_vec_sum(lenv* e, lval* a) {
+  LASSERT_NUM("vec-sum", a, 1);
+  LASSERT_TYPE("vec-sum", a, 0, LVAL_VEC);
+
+  lval* v = a->cell[0];
+  lval* r;
+  long s = 0;
+  if (v->dvec) {
+    r = lval_dbl(lvec_k->sum(v->dvec, v->count));
+  } else if (v->count == 0 || !lvec_k->isum(&s, v->ivec, v->count)) {
+    r = lval_num(v->count ? s : 0);
+  } else {
+    r = lvec_big_reduce(v, lkernel_add);
+  }
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_vec_product(lenv* e, lval* a) {
+  LASSERT_NUM("vec-product", a, 1);
+  LASSERT_TYPE("vec-product", a, 0, LVAL_VEC);
+
+  lval* v = a->cell[0];
+  lval* r = NULL;
+  if (v->dvec) {
+    double p = 1;
+    for (int i = 0; i < v->count; i++) { p *= v->dvec[i]; }
+    r = lval_dbl(p);
+  } else {
+    long p = 1;
+    for (int i = 0; i < v->count && !r; i++) {
+      if (__builtin_mul_overflow(p, v->ivec[i], &p)) {
+        r = lvec_big_reduce(v, lkernel_mul);
+      }
+    }
+    if (!r) { r = lval_num(p); }
+  }
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_vec_extreme(lenv* e, lval* a, char* op, int max) {
+  LASSERT_NUM(op, a, 1);
+  LASSERT_TYPE(op, a, 0, LVAL_VEC);
+  LASSERT_NOT_EMPTY(op, a, 0);
+
+  lval* v = a->cell[0];
+  lval* r;
+  if (v->dvec) {
+    r = lval_dbl((max ? lvec_k->max : lvec_k->min)(v->dvec, v->count));
+  } else {
+    r = lval_num((max ? lvec_k->imax : lvec_k->imin)(v->ivec, v->count));
+  }
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_vec_min(lenv* e, lval* a) {
+  return builtin_vec_extreme(e, a, "vec-min", 0);
+}
+
+lval* builtin_vec_max(lenv* e, lval* a) {
+  return builtin_vec_extreme(e, a, "vec-max", 1);
+}
+
+/* builtin method for the dot product of two vectors */
+lval* builtin_vec_dot(lenv* e, lval* a) {
+  LASSERT_NUM("vec-dot", a, 2);
+  LASSERT_TYPE("vec-dot", a, 0, LVAL_VEC);
+  LASSERT_TYPE("vec-dot", a, 1, LVAL_VEC);
+  lval* err = lvec_args(a, "vec-dot");
+  if (err) {
+    lval_del(a);
+    return err;
+  }
+
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+  if (x->dvec) {
+    lval* r = lval_dbl(lvec_k->dot(x->dvec, y->dvec, x->count));
+    lval_del(a);
+    return r;
+  }
+
+  long s = 0;
+  int i = 0;
+  for (; i < x->count; i++) {
+    long p;
+    if (__builtin_mul_overflow(x->ivec[i], y->ivec[i], &p)
+        || __builtin_add_overflow(s, p, &s)) {
+      break;
+    }
+  }
+  if (i == x->count) {
+    lval_del(a);
+    return lval_num(s);
+  }
+
+  /* redo the products as big numbers, summing them into one */
+  lval* r = lval_num(0);
+  for (i = 0; i < x->count; i++) {
+    lval* p = lval_add(lval_sexpr(), lval_num(x->ivec[i]));
+    lval_add(p, lval_num(y->ivec[i]));
+    r = lbig_op(lval_add(lval_add(lval_sexpr(), r), lbig_op(p, lkernel_mul)),
+                lkernel_add);
+  }
+  lval_del(a);
+  return r;
+}
+
+/* builtin method to select the vector kernels by name, or with
+   any other argument to report which are in use */
+lval* builtin_vec_isa(lenv* e, lval* a) {
+  LASSERT_NUM("vec-isa", a, 1);
+  if (a->cell[0]->type == LVAL_STR) {
+    LASSERT(a, lvec_select(lval_cstr(a->cell[0])),
+            "function 'vec-isa' cannot use kernels '%s' on this cpu.",
+            a->cell[0]->str);
+  }
+  lval_del(a);
+  return lval_str(lvec_k->name);
+}
+
+/* method to add builtin method to the environment */
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+  lval* k = lval_sym(name);
+  lval* v = lval_builtin(func);
+  lenv_put(e, k, v);
+  lval_del(k); lval_del(v);
+}
+
+/* recur is only meaningful as the last thing a loop body evaluates.
+   wherever else its value turns up it would be dropped or escape the
+   loop, so it becomes an error instead */
+lval* lrecur_escaped(lval* v) {
+  if (v->type != LVAL_RECUR) { return v; }
+  lval_del(v);
+  return lval_err("function 'recur' must be the last thing "
+                  "evaluated by a loop body.");
+}
+
+/* evaluate argument i of a special form in place, so the
+   usual LASSERT checks can be applied to the result */
+lval* lval_eval_arg(lenv* e, lval* a, int i) {
+  a->cell[i] = lrecur_escaped(lval_eval(e, a->cell[i]));
+  return a->cell[i];
+}
+
+/* special form, only the condition and the chosen branch are evaluated */
+lval* builtin_if(lenv* e, lval* a) {
+  /* verify that there are three inputs, a number 0 or 1 */
+  /* and two possible q-expressions to evaluate */
+  LASSERT_NUM("if", a, 3);
+  if (lval_eval_arg(e, a, 0)->type == LVAL_ERR) { return lval_take(a, 0); }
+  LASSERT_TYPE("if", a, 0, LVAL_NUM);
+
+  /* if the boolean is true, evaluate the first expression,
+     otherwise evaluate the second. the other is never touched */
+  int i = a->cell[0]->num ? 1 : 2;
+  if (lval_eval_arg(e, a, i)->type == LVAL_ERR) { return lval_take(a, i); }
+  LASSERT_TYPE("if", a, i, LVAL_QEXPR);
+
+  /* mark the expression as an s-expression to make it evaluable */
+  lval* x = lval_unpack(lval_take(a, i));
+  x->type = LVAL_SEXPR;
+  return lval_eval(e, x);
+}
+
+/* special form, for 0+ pairs of {condition expression}, evaluate each
+   condition in turn and for the first true, evaluate its expression */
+lval* builtin_select(lenv* e, lval* a) {
+  for (int i = 0; i < a->count; i++) {
+    if (lval_eval_arg(e, a, i)->type == LVAL_ERR) { return lval_take(a, i); }
+    LASSERT_TYPE("select", a, i, LVAL_QEXPR);
+    LASSERT(a, a->cell[i]->count >= 2,
+            "function select passed incomplete selection for argument %i.", i);
+
+    lval* arm = lval_unpack(a->cell[i]);
+    if (lval_eval_arg(e, arm, 0)->type == LVAL_ERR) {
+      lval* err = lval_pop(arm, 0);
+      lval_del(a);
+      return err;
+    }
+    LASSERT(a, arm->cell[0]->type == LVAL_NUM,
+            "function 'select' passed incorrect condition for argument %i. "
+            "got %s, expected %s.",
+            i, ltype_name(arm->cell[0]->type), ltype_name(LVAL_NUM));
+
+    if (arm->cell[0]->num) {
+      lval* x = lval_pop(arm, 1);
+      lval_del(a);
+      return lval_eval(e, x);
+    }
+  }
+  lval_del(a);
+  return lval_err("no selection found");
+}
+
+/* special form, compare a value against the first element of each
+   {constant expression} pair and evaluate the expression of the match */
+lval* builtin_case(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1, "function case passed no value to match.");
+  if (lval_eval_arg(e, a, 0)->type == LVAL_ERR) { return lval_take(a, 0); }
+
+  for (int i = 1; i < a->count; i++) {
+    if (lval_eval_arg(e, a, i)->type == LVAL_ERR) { return lval_take(a, i); }
+    LASSERT_TYPE("case", a, i, LVAL_QEXPR);
+    LASSERT(a, a->cell[i]->count >= 2,
+            "function case passed incomplete case for argument %i.", i);
+
+    lval* arm = lval_unpack(a->cell[i]);
+    if (lval_eval_arg(e, arm, 0)->type == LVAL_ERR) {
+      lval* err = lval_pop(arm, 0);
+      lval_del(a);
+      return err;
+    }
+
+    if (lval_same(a->cell[0], arm->cell[0])) {
+      lval* x = lval_pop(arm, 1);
+      lval_del(a);
+      return lval_eval(e, x);
+    }
+  }
+  lval_del(a);
+  return lval_err("no cases found");
+}
+
+/* special form, perform several things in sequence
+   and return the result of the last one */
+lval* builtin_do(lenv* e, lval* a) {
+  if (a->count == 0) {
+    lval_del(a);
+    return lval_qexpr();
+  }
+
+  for (int i = 0; i < a->count-1; i++) {
+    if (lval_eval_arg(e, a, i)->type == LVAL_ERR) { return lval_take(a, i); }
+  }
+  /* the last is evaluated as the result of the do, so may be a recur */
+  return lval_eval(e, lval_take(a, a->count-1));
+}
+
+/* special form, evaluate a q-expression in a new scope */
+lval* builtin_let(lenv* e, lval* a) {
+  LASSERT_NUM("let", a, 1);
+  if (lval_eval_arg(e, a, 0)->type == LVAL_ERR) { return lval_take(a, 0); }
+  LASSERT_TYPE("let", a, 0, LVAL_QEXPR);
+
+  /* the new scope only lives as long as the body is being evaluated */
+  lenv* scope = lenv_new();
+  scope->par = e;
+
+  lval* x = lval_unpack(lval_take(a, 0));
+  x->type = LVAL_SEXPR;
+  lval* r = lval_eval(scope, x);
+
+  lenv_del(scope);
+  return r;
+}
+
+/* evaluate a copy of a block of code, leaving the block as it is to
+   run again */
+lval* lval_eval_block(lenv* e, lval* q) {
+  lval* x = lval_copy(q);
+  x->type = LVAL_SEXPR;
+  return lval_eval(e, x);
+}
+
+/* forward declarations for walking loop bodies */
+int lval_is_special(lval* f);
+lval* builtin_recur(lenv* e, lval* a);
+lval* lval_call_sexpr(lenv* e, lval* v);
+lval* lopt_loop(lenv* e, lval* body, lopt** o);
+int lopt_valid(lopt* o);
+
+/* the body of a loop, while or dotimes is walked where it is stored
+   each time round rather than copied and consumed. it is prepared
+   first by lopt_loop, which looks up the builtins it calls and the
+   global numbers it reads once, and their names are looked up as
+   usual again as soon as any of those bindings changes. numbers
+   computed only to be compared or passed to recur are kept unboxed,
+   so a counting loop runs without allocating anything */
+typedef struct {
+  lenv* scope;
+  /* the {symbol init ...} bindings recur rebinds, or NULL when the
+     body isn't a loop's */
+  lval* binds;
+  /* the prepared body, and the bindings it relied on */
+  lval* body;
+  lopt* opt;
+} lloop;
+
+/* the value of a tail call to recur which has already rebound the
+   loop's symbols in place */
+lval lloop_again;
+
+void lloop_init(lloop* l, lenv* scope, lval* binds, lval* body) {
+  l->scope = scope;
+  l->binds = binds;
+  l->body = lopt_loop(scope, body, &l->opt);
+}
+
+void lloop_done(lloop* l) {
+  lval_del(l->body);
+  lopt_release(l->opt);
+}
+
+/* the value of a symbol in a loop body, without copying it */
+lval* lloop_peek(lloop* l, lenv* e, lval* k) {
+  if (k->bound && lopt_valid(l->opt)) { return k->bound; }
+  return lenv_peek(e, k);
+}
+
+/* evaluate x to a plain number without allocating anything, when it
+   is built only from numbers, bound names and integer arithmetic or
+   comparison. gives up on anything else, or an overflow or division
+   by zero, having had no effect, so x can then be evaluated in full */
+int lloop_num(lloop* l, lenv* e, lval* x, long* out) {
+  if (x->type == LVAL_NUM) {
+    *out = x->num;
+    return 1;
+  }
+  if (x->type == LVAL_SYM) {
+    lval* v = lloop_peek(l, e, x);
+    if (!v || v->type != LVAL_NUM) { return 0; }
+    *out = v->num;
+    return 1;
+  }
+  if (x->type != LVAL_SEXPR || x->count == 0 || x->count > 9) { return 0; }
+  if (x->count == 1) { return lloop_num(l, e, x->cell[0], out); }
+
+  lval* f = x->cell[0];
+  if (f->type == LVAL_SYM) { f = lloop_peek(l, e, f); }
+  if (!f || f->type != LVAL_FUN) { return 0; }
+  lbuiltin b = f->builtin;
+  lkernel kernel = b == builtin_add ? lkernel_add : b == builtin_sub ? lkernel_sub
+    : b == builtin_mul ? lkernel_mul : b == builtin_div ? lkernel_div : NULL;
+  int accept = b == builtin_gt ? LORD_GT : b == builtin_lt ? LORD_LT
+    : b == builtin_ge ? LORD_GT | LORD_EQ : b == builtin_le ? LORD_LT | LORD_EQ : 0;
+  int equal = b == builtin_eq ? 1 : b == builtin_ne ? 0 : -1;
+  if (!kernel && !accept && equal < 0) { return 0; }
+
+  /* the arguments are laid out as for a call, so the kernels apply */
+  lval nums[8];
+  lval* cells[8];
+  lval args;
+  args.count = x->count - 1;
+  args.cell = cells;
+  for (int i = 0; i < args.count; i++) {
+    if (!lloop_num(l, e, x->cell[i+1], &nums[i].num)) { return 0; }
+    cells[i] = &nums[i];
+  }
+
+  if (kernel) {
+    if (args.count == 1) {
+      if (kernel != lkernel_sub) { *out = nums[0].num; return 1; }
+      if (nums[0].num == LONG_MIN) { return 0; }
+      *out = -nums[0].num;
+      return 1;
+    }
+    if (kernel(&args) != LKERNEL_OK) { return 0; }
+    *out = nums[0].num;
+    return 1;
+  }
+  if (args.count != 2) { return 0; }
+  long p = nums[0].num, q = nums[1].num;
+  if (accept) {
+    int sign = (p > q) - (p < q);
+    *out = (accept >> (sign + 1)) & 1;
+  } else {
+    *out = (p == q) == equal;
+  }
+  return 1;
+}
+
+lval* lloop_expr(lloop* l, lenv* e, lval* x, int tail);
+
+/* evaluate part of a loop body as lval_eval would a copy of it. tail
+   is set where a recur would end the body */
+lval* lloop_walk(lloop* l, lenv* e, lval* x, int tail) {
+  if (x->type == LVAL_SYM) {
+    if (x->bound && lopt_valid(l->opt)) { return lval_copy(x->bound); }
+    return lenv_get(e, x);
+  }
+  if (x->type == LVAL_SEXPR) { return lloop_expr(l, e, x, tail); }
+  return lval_copy(x);
+}
+
+/* hand a copy of the arguments of x to a special form */
+lval* lloop_special(lenv* e, lval* x, lbuiltin special) {
+  lval* a = lval_copy(x);
+  a->type = LVAL_SEXPR;
+  lval_del(lval_pop(a, 0));
+  return special(e, a);
+}
+
+/* if, with the condition and the chosen branch walked in place */
+lval* lloop_if(lloop* l, lenv* e, lval* x, int tail) {
+  if (x->count != 4) { return lloop_special(e, x, builtin_if); }
+
+  long c;
+  if (!lloop_num(l, e, x->cell[1], &c)) {
+    lval* v = lrecur_escaped(lloop_walk(l, e, x->cell[1], 0));
+    if (v->type == LVAL_ERR) { return v; }
+    if (v->type != LVAL_NUM) {
+      lval* err = lval_err("function '%s' passed incorrect type for argument %i. "
+                           "got %s, expected %s.", "if", 0,
+                           ltype_name(v->type), ltype_name(LVAL_NUM));
+      lval_del(v);
+      return err;
+    }
+    c = v->num;
+    lval_del(v);
+  }
+
+  int i = c ? 2 : 3;
+  if (x->cell[i]->type == LVAL_QEXPR) { return lloop_expr(l, e, x->cell[i], tail); }
+  lval* v = lrecur_escaped(lloop_walk(l, e, x->cell[i], 0));
+  if (v->type == LVAL_ERR) { return v; }
+  if (v->type != LVAL_QEXPR) {
+    lval* err = lval_err("function '%s' passed incorrect type for argument %i. "
+                         "got %s, expected %s.", "if", i - 1,
+                         ltype_name(v->type), ltype_name(LVAL_QEXPR));
+    lval_del(v);
+    return err;
+  }
+  lval_unpack(v)->type = LVAL_SEXPR;
+  return lval_eval(e, v);
+}
+
+/* do, stopping at the first error as builtin_do does */
+lval* lloop_do(lloop* l, lenv* e, lval* x, int tail) {
+  if (x->count == 1) { return lval_qexpr(); }
+  for (int i = 1; i < x->count - 1; i++) {
+    lval* v = lrecur_escaped(lloop_walk(l, e, x->cell[i], 0));
+    if (v->type == LVAL_ERR) { return v; }
+    lval_del(v);
+  }
+  return lloop_walk(l, e, x->cell[x->count - 1], tail);
+}
+
+/* a tail call to recur whose arguments are all plain numbers rebinds
+   the loop's symbols in place. if any argument is anything else,
+   nothing is done and recur is called as usual */
+int lloop_recur(lloop* l, lval* x) {
+  int n = x->count - 1;
+  if (n != l->binds->count / 2 || n > 8) { return 0; }
+  long v[8];
+  for (int i = 0; i < n; i++) {
+    if (!lloop_num(l, l->scope, x->cell[i+1], &v[i])) { return 0; }
+  }
+  for (int i = 0; i < n; i++) {
+    lval* k = l->binds->cell[2*i];
+    lval* slot = lenv_peek(l->scope, k);
+    if (slot && slot->type == LVAL_NUM) {
+      slot->num = v[i];
+    } else {
+      lenv_bind(l->scope, k, lval_num(v[i]));
+    }
+  }
+  return 1;
+}
+
+/* evaluate the expressions of x, an s-expression or block of a loop
+   body, as lval_eval_sexpr would a copy of them */
+lval* lloop_expr(lloop* l, lenv* e, lval* x, int tail) {
+  lval_unpack(x);
+  if (x->count == 0) { return lval_sexpr(); }
+  if (x->count == 1) { return lloop_walk(l, e, x->cell[0], tail); }
+
+  /* special forms are found by name, as in lval_eval_sexpr */
+  lval* f = x->cell[0];
+  if (f->type == LVAL_SYM) {
+    f = lloop_peek(l, e, f);
+    if (f && lval_is_special(f)) {
+      if (f->builtin == builtin_if) { return lloop_if(l, e, x, tail); }
+      if (f->builtin == builtin_do) { return lloop_do(l, e, x, tail); }
+      return lloop_special(e, x, f->builtin);
+    }
+  }
+  if (f && f->type == LVAL_FUN) {
+    if (f->builtin == builtin_recur && tail && l->binds && e == l->scope
+        && lloop_recur(l, x)) {
+      return &lloop_again;
+    }
+    long n;
+    if (lloop_num(l, e, x, &n)) { return lval_num(n); }
+  }
+
+  lval* v = lval_sexpr();
+  for (int i = 0; i < x->count; i++) {
+    lval_add(v, lloop_walk(l, e, x->cell[i], 0));
+  }
+  return lval_call_sexpr(e, v);
+}
+
+/* run a loop body once, from the top */
+lval* lloop_run(lloop* l) {
+  return lloop_expr(l, l->scope, l->body, 1);
+}
+
+/* the truth of a loop condition, if it is a plain number found
+   without allocating, as for lloop_num */
+int lloop_holds(lloop* l, long* c) {
+  return lloop_num(l, l->scope, l->body, c);
+}
+
+/* special form, while a condition holds evaluate a body, both given
+   as q-expressions and run in the calling scope. returns the result
+   of the last run of the body, or {} if it never ran */
+lval* builtin_while(lenv* e, lval* a) {
+  LASSERT_NUM("while", a, 2);
+  for (int i = 0; i < 2; i++) {
+    if (lval_eval_arg(e, a, i)->type == LVAL_ERR) { return lval_take(a, i); }
+    LASSERT_TYPE("while", a, i, LVAL_QEXPR);
+    lval_unpack(a->cell[i]);
+  }
+
+  lloop cond, body;
+  lloop_init(&cond, e, NULL, a->cell[0]);
+  lloop_init(&body, e, NULL, a->cell[1]);
+  lval* r = lval_qexpr();
+  for (;;) {
+    long holds;
+    if (!lloop_holds(&cond, &holds)) {
+      lval* c = lloop_run(&cond);
+      if (c->type != LVAL_NUM) {
+        lval_del(r);
+        r = c->type == LVAL_ERR ? c : lval_err(
+          "function 'while' passed a condition giving %s, expected %s.",
+          ltype_name(c->type), ltype_name(LVAL_NUM));
+        if (r != c) { lval_del(c); }
+        break;
+      }
+      holds = c->num;
+      lval_del(c);
+    }
+    if (!holds) { break; }
+
+    lval_del(r);
+    r = lrecur_escaped(lloop_run(&body));
+    if (r->type == LVAL_ERR) { break; }
+  }
+  lloop_done(&cond);
+  lloop_done(&body);
+  lval_del(a);
+  return r;
+}
+
+/* special form, (dotimes {i n} {body}) evaluates body n times with i
+   bound to 0 up to n-1. i lives in a new scope of its own, bound once
+   and then updated in place each time round. anything else the body
+   binds with = is handed back to the calling scope after each run, so
+   like while the body can update the caller's variables */
+lval* builtin_dotimes(lenv* e, lval* a) {
+  LASSERT_NUM("dotimes", a, 2);
+  for (int i = 0; i < 2; i++) {
+    if (lval_eval_arg(e, a, i)->type == LVAL_ERR) { return lval_take(a, i); }
+    LASSERT_TYPE("dotimes", a, i, LVAL_QEXPR);
+    lval_unpack(a->cell[i]);
+  }
+  lval* spec = a->cell[0];
+  LASSERT(a, spec->count == 2 && spec->cell[0]->type == LVAL_SYM,
+          "function 'dotimes' passed invalid binding. expected {symbol count}.");
+  if (lval_eval_arg(e, spec, 1)->type == LVAL_ERR) {
+    lval* err = lval_pop(spec, 1);
+    lval_del(a);
+    return err;
+  }
+  LASSERT(a, spec->cell[1]->type == LVAL_NUM,
+          "function 'dotimes' passed a count of type %s, expected %s.",
+          ltype_name(spec->cell[1]->type), ltype_name(LVAL_NUM));
+
+  lenv* scope = lenv_new();
+  scope->par = e;
+  lopt_local(spec->cell[0]);
+  lloop body;
+  lloop_init(&body, scope, NULL, a->cell[1]);
+
+  lval* r = lval_qexpr();
+  for (long i = 0; i < spec->cell[1]->num; i++) {
+    /* the body may have rebound the counter to something else */
+    if (scope->count == 0 || scope->vals[0]->type != LVAL_NUM) {
+      lenv_bind(scope, spec->cell[0], lval_num(i));
+    }
+    scope->vals[0]->num = i;
+
+    lval_del(r);
+    r = lrecur_escaped(lloop_run(&body));
+
+    for (int j = 1; j < scope->count; j++) {
+      lval* k = lval_sym(scope->syms[j]);
+      lenv_bind(e, k, scope->vals[j]);
+      lval_del(k);
+      free(scope->syms[j]);
+    }
+    scope->count = scope->count ? 1 : 0;
+    if (r->type == LVAL_ERR) { break; }
+  }
+  lloop_done(&body);
+  lenv_del(scope);
+  lval_del(a);
+  return r;
+}
+
+/* special form, (loop {sym init ...} {body}) binds each symbol to its
+   initial value in a new scope and evaluates body. if body ends in a
+   call to recur, the symbols are rebound to its arguments in the same
+   scope and body runs again, otherwise its result is returned */
+lval* builtin_loop(lenv* e, lval* a) {
+  LASSERT_NUM("loop", a, 2);
+  for (int i = 0; i < 2; i++) {
+    if (lval_eval_arg(e, a, i)->type == LVAL_ERR) { return lval_take(a, i); }
+    LASSERT_TYPE("loop", a, i, LVAL_QEXPR);
+    lval_unpack(a->cell[i]);
+  }
+  lval* binds = a->cell[0];
+  LASSERT(a, binds->count % 2 == 0,
+          "function 'loop' passed an odd number of binding forms.");
+  for (int i = 0; i < binds->count; i += 2) {
+    LASSERT(a, binds->cell[i]->type == LVAL_SYM,
+            "function 'loop' cannot bind %s. expected %s.",
+            ltype_name(binds->cell[i]->type), ltype_name(LVAL_SYM));
+  }
+
+  /* initial values are evaluated in turn, seeing those before them */
+  lenv* scope = lenv_new();
+  scope->par = e;
+  for (int i = 0; i < binds->count; i += 2) {
+    lval* v = lrecur_escaped(lval_eval(scope, lval_copy(binds->cell[i+1])));
+    if (v->type == LVAL_ERR) {
+      lenv_del(scope);
+      lval_del(a);
+      return v;
+    }
+    lopt_local(binds->cell[i]);
+    lenv_bind(scope, binds->cell[i], v);
+  }
+
+  lloop body;
+  lloop_init(&body, scope, binds, a->cell[1]);
+  lval* r;
+  for (;;) {
+    r = lloop_run(&body);
+    if (r == &lloop_again) { continue; }
+    if (r->type != LVAL_RECUR) { break; }
+    if (r->count != binds->count / 2) {
+      lval* err = lval_err("function 'recur' passed %i arguments, expected %i.",
+                           r->count, binds->count / 2);
+      lval_del(r);
+      r = err;
+      break;
+    }
+    for (int i = 0; i < r->count; i++) {
+      lenv_bind(scope, binds->cell[2*i], r->cell[i]);
+    }
+    r->count = 0;
+    lval_del(r);
+  }
+  lloop_done(&body);
+  lenv_del(scope);
+  lval_del(a);
+  return r;
+}
+
+/* rebind the symbols of the innermost loop and run its body again.
+   must be the last thing evaluated by the body, anywhere else its
+   value is turned into an error by lrecur_escaped */
+lval* builtin_recur(lenv* e, lval* a) {
+  a->type = LVAL_RECUR;
+  return a;
+}
+
+/* special forms are builtins which evaluate their own arguments */
+int lval_is_special(lval* f) {
+  return f->type == LVAL_FUN && (f->builtin == builtin_if
+    || f->builtin == builtin_select || f->builtin == builtin_case
+    || f->builtin == builtin_do || f->builtin == builtin_let
+    || f->builtin == builtin_while || f->builtin == builtin_dotimes
+    || f->builtin == builtin_loop);
+}
+
+lval* lval_read(mpc_ast_t* t);
+
+/* load and evaluate a file */
+lval* builtin_load(lenv* e, lval* a) {
+  LASSERT_NUM("load", a, 1);
+  LASSERT_TYPE("load", a, 0, LVAL_STR);
+
+  /* parse file given by string name */
+  mpc_result_t r;
+  if (mpc_parse_contents(lval_cstr(a->cell[0]), aLisp, &r)) {
+
+    /* read file contents */
+    lval* expr = lval_read(r.output);
+    mpc_ast_delete(r.output);
+
+    /* evaluate each expression */
+    while (expr->count) {
+      lval* x = lrecur_escaped(lval_eval(e, lval_pop(expr, 0)));
+      /* print any errors encountered */
+      if (x->type == LVAL_ERR) { lval_println(x); }
+      lval_del(x);
+    }
+
+    /* cleanup */
+    lval_del(expr);
+    lval_del(a);
+
+    return lval_sexpr();
+
+  } else {
+    /* get parse error as a string */
+    char* err_msg = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+
+    /* create a new error message using the parse error */
+    lval* err = lval_err("could not load Library %s", err_msg);
+    free(err_msg);
+    lval_del(a);
+
+    return err;
+  }
+}
+
+lval* builtin_print(lenv* e, lval* a) {
+  for (int i = 0; i < a->count; i++) {
+    lval_write(&lout, a->cell[i]); lbuf_putc(&lout, ' ');
+  }
+
+  lbuf_putc(&lout, '\n');
+  if (lout.line) { lbuf_flush(&lout); }
+  lval_del(a);
+
+  return lval_sexpr();
+}
+
+/* (flush ()) writes out anything printed but still buffered */
+lval* builtin_flush(lenv* e, lval* a) {
+  lbuf_flush(&lout);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* (to-string v), v as print would write it */
+lval* builtin_to_string(lenv* e, lval* a) {
+  LASSERT_NUM("to-string", a, 1);
+
+  lbuf b = { NULL, 0, 0, NULL, -1, 0 };
+  lval_write(&b, a->cell[0]);
+  lval_del(a);
+  if (b.len > INT_MAX) {
+    free(b.data);
+    return lval_err("function 'to-string' result is too long.");
+  }
+  lval* r = lval_str_len(b.data ? b.data : "", b.len);
+  free(b.data);
+  return r;
+}
+/* ports read and write files a large buffer at a time, with read and
+   write calls straight to the file descriptor rather than through
+   stdio. input from a string is a port whose buffer already holds all
+   of the input, and the standard output port writes through lout */
+enum { LPORT_IN, LPORT_OUT };
+
+#define LPORT_SIZE (1 << 18)
+
+struct lport {
+  int refs;
+  int dir;
+  /* the file descriptor, or -1 for a string */
+  int fd;
+  int closed;
+  /* set once there is nothing more to read into the buffer */
+  int eof;
+  /* for input, the unread bytes are data[pos] up to data[len] */
+  char* data;
+  size_t pos;
+  size_t len;
+  size_t cap;
+  /* for output, the buffer written through */
+  lbuf* out;
+};
+
+lport* lport_new(int dir, int fd) {
+  lport* p = calloc(1, sizeof(lport));
+  p->refs = 1;
+  p->dir = dir;
+  p->fd = fd;
+  if (dir == LPORT_IN) {
+    p->cap = LPORT_SIZE;
+    p->data = malloc(p->cap);
+  } else if (fd == 1) {
+    p->out = &lout;
+  } else {
+    p->out = calloc(1, sizeof(lbuf));
+    p->out->cap = LPORT_SIZE;
+    p->out->data = malloc(LPORT_SIZE);
+    p->out->fd = fd;
+  }
+  return p;
+}
+
+lport* lport_retain(lport* p) {
+  p->refs++;
+  return p;
+}
+
+/* write out anything buffered, closing the file unless it is one of
+   the standard streams */
+void lport_close(lport* p) {
+  if (p->closed) { return; }
+  if (p->out) { lbuf_flush(p->out); }
+  if (p->fd > 2) { close(p->fd); }
+  p->closed = 1;
+}
+
+/* ports are closed once the last copy of them is deleted */
+void lport_release(lport* p) {
+  if (--p->refs > 0) { return; }
+  lport_close(p);
+  free(p->data);
+  if (p->out && p->out != &lout) {
+    free(p->out->data);
+    free(p->out);
+  }
+  free(p);
+}
+
+lval* lval_port(lport* p) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_PORT;
+  v->port = p;
+  return v;
+}
+
+/* read more of the input onto the end of the buffer, moving the
+   unread bytes to the front and growing it when they fill it.
+   returns 0 at the end of the input */
+int lport_fill(lport* p) {
+  if (p->eof) { return 0; }
+  if (p->pos) {
+    memmove(p->data, p->data + p->pos, p->len - p->pos);
+    p->len -= p->pos;
+    p->pos = 0;
+  }
+  if (p->len == p->cap) {
+    p->cap *= 2;
+    p->data = realloc(p->data, p->cap);
+  }
+  long n;
+  do {
+    n = read(p->fd, p->data + p->len, p->cap - p->len);
+  } while (n < 0 && errno == EINTR);
+  if (n <= 0) { p->eof = 1; return 0; }
+  p->len += n;
+  return 1;
+}
+
+/* check an argument is a port for reading or writing, and still open */
+#define LASSERT_PORT(func, args, index, want) \
+  LASSERT_TYPE(func, args, index, LVAL_PORT); \
+  LASSERT(args, args->cell[index]->port->dir == want, \
+          "function '%s' passed an %s port, expected an %s port.", func, \
+          want == LPORT_IN ? "output" : "input", want == LPORT_IN ? "input" : "output"); \
+  LASSERT(args, !args->cell[index]->port->closed, \
+          "function '%s' passed a closed port.", func)
+
+/* (open filename mode), a port reading the file for mode "r", or
+   writing it for "w", or appending to it for "a" */
+lval* builtin_open(lenv* e, lval* a) {
+  LASSERT_NUM("open", a, 2);
+  LASSERT_TYPE("open", a, 0, LVAL_STR);
+  LASSERT_TYPE("open", a, 1, LVAL_STR);
+
+  char* mode = lval_cstr(a->cell[1]);
+  int flags;
+  if (strcmp(mode, "r") == 0)      { flags = O_RDONLY; }
+  else if (strcmp(mode, "w") == 0) { flags = O_WRONLY | O_CREAT | O_TRUNC; }
+  else if (strcmp(mode, "a") == 0) { flags = O_WRONLY | O_CREAT | O_APPEND; }
+  else {
+    lval* err = lval_err("function 'open' passed unknown mode '%s'. "
+                         "expected r, w or a", mode);
+    lval_del(a);
+    return err;
+  }
+
+  char* name = lval_cstr(a->cell[0]);
+  int fd = open(name, flags, 0666);
+  if (fd < 0) {
+    lval* err = lval_err("function 'open' could not open '%s'. %s", name, strerror(errno));
+    lval_del(a);
+    return err;
+  }
+  lval_del(a);
+  return lval_port(lport_new(flags == O_RDONLY ? LPORT_IN : LPORT_OUT, fd));
+}
+
+/* (open-string s), a port reading the bytes of a string */
+lval* builtin_open_string(lenv* e, lval* a) {
+  LASSERT_NUM("open-string", a, 1);
+  LASSERT_TYPE("open-string", a, 0, LVAL_STR);
+
+  lport* p = lport_new(LPORT_IN, -1);
+  lval* s = a->cell[0];
+  if (s->count > p->cap) {
+    p->cap = s->count;
+    p->data = realloc(p->data, p->cap);
+  }
+  memcpy(p->data, s->str, s->count);
+  p->len = s->count;
+  p->eof = 1;
+  lval_del(a);
+  return lval_port(p);
+}
+
+/* (read-line p), the next line of input without its newline, or {}
+   at the end of the input */
+lval* builtin_read_line(lenv* e, lval* a) {
+  LASSERT_NUM("read-line", a, 1);
+  LASSERT_PORT("read-line", a, 0, LPORT_IN);
+
+  lport* p = a->cell[0]->port;
+  size_t from = 0;
+  char* nl;
+  while (!(nl = memchr(p->data + p->pos + from, '\n', p->len - p->pos - from))) {
+    from = p->len - p->pos;
+    if (!lport_fill(p)) { break; }
+  }
+  size_t n = nl ? (size_t)(nl - (p->data + p->pos)) : p->len - p->pos;
+  if (!nl && n == 0) { lval_del(a); return lval_qexpr(); }
+  LASSERT(a, n <= INT_MAX, "function 'read-line' read a line that is too long.");
+
+  lval* r = lval_str_len(p->data + p->pos, n);
+  p->pos += n + (nl != NULL);
+  lval_del(a);
+  return r;
+}
+
+/* (read-bytes p n), a string of the next n bytes of input, or fewer
+   at the end of the input, or {} if there are none left */
+lval* builtin_read_bytes(lenv* e, lval* a) {
+  LASSERT_NUM("read-bytes", a, 2);
+  LASSERT_PORT("read-bytes", a, 0, LPORT_IN);
+  LASSERT_TYPE("read-bytes", a, 1, LVAL_NUM);
+  long want = a->cell[1]->num;
+  LASSERT(a, want >= 0 && want <= INT_MAX,
+          "function 'read-bytes' passed invalid count %li.", want);
+
+  lport* p = a->cell[0]->port;
+  while (p->len - p->pos < (size_t)want && lport_fill(p)) {}
+  size_t n = p->len - p->pos;
+  if (n > (size_t)want) { n = want; }
+  if (n == 0 && want > 0) { lval_del(a); return lval_qexpr(); }
+
+  lval* r = lval_str_len(p->data + p->pos, n);
+  p->pos += n;
+  lval_del(a);
+  return r;
+}
+
+/* (write p v...) writes the bytes of strings, and anything else as
+   print would, to an output port */
+lval* builtin_write(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1, "function 'write' passed no port.");
+  LASSERT_PORT("write", a, 0, LPORT_OUT);
+
+  lbuf* b = a->cell[0]->port->out;
+  for (int i = 1; i < a->count; i++) {
+    lval* v = a->cell[i];
+    if (v->type == LVAL_STR) { lbuf_write(b, v->str, v->count); }
+    else { lval_write(b, v); }
+  }
+  if (b->line) { lbuf_flush(b); }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* (close p) writes out anything buffered for a port and closes it */
+lval* builtin_close(lenv* e, lval* a) {
+  LASSERT_NUM("close", a, 1);
+  LASSERT_TYPE("close", a, 0, LVAL_PORT);
+
+  lport_close(a->cell[0]->port);
+  lval_del(a);
+  return lval_sexpr();
+}
+
+/* (with-output-to-string {body}) evaluates body, returning everything
+   it printed or wrote to the standard output as a string */
+lval* builtin_with_output_to_string(lenv* e, lval* a) {
+  LASSERT_NUM("with-output-to-string", a, 1);
+  LASSERT_TYPE("with-output-to-string", a, 0, LVAL_QEXPR);
+  lval_unpack(a->cell[0]);
+
+  lbuf saved = lout;
+  lout = (lbuf){ NULL, 0, 0, NULL, -1, 0 };
+  lval* x = lval_eval_block(e, a->cell[0]);
+  lbuf b = lout;
+  lout = saved;
+  lval_del(a);
+
+  if (x->type != LVAL_ERR && b.len > INT_MAX) {
+    lval_del(x);
+    x = lval_err("function 'with-output-to-string' result is too long.");
+  }
+  if (x->type == LVAL_ERR) { free(b.data); return x; }
+  lval_del(x);
+  lval* r = lval_str_len(b.data ? b.data : "", b.len);
+  free(b.data);
+  return r;
+}
+
+
+lval* builtin_error(lenv* e, lval* a) {
+  LASSERT_NUM("error", a, 1);
+  LASSERT_TYPE("error", a, 0, LVAL_STR);
+
+  lval* err = lval_err(lval_cstr(a->cell[0]));
+
+  lval_del(a);
+  return err;
+}
+
+/* index of the first place at or after from where the n bytes of
+   needle appear in the len bytes of s, or -1. on x86 sixteen
+   positions are tested at once for the needle's first and last
+   bytes, and only those matching both are compared in full, with
+   memchr skipping stretches where the first byte doesn't appear.
+   elsewhere memchr finds each candidate first byte */
+long lstr_find(char* s, long len, char* needle, long n, long from) {
+  if (n == 0) { return from <= len ? from : -1; }
+  if (n > len - from) { return -1; }
+  if (n == 1) {
+    char* p = memchr(s + from, needle[0], len - from);
+    return p ? p - s : -1;
+  }
+
+  long i = from;
+  long last = len - n;
+#ifdef LVEC_X86
+  __m128i first = _mm_set1_epi8(needle[0]);
+  __m128i end = _mm_set1_epi8(needle[n-1]);
+  int misses = 0;
+  while (i + 16 <= last + 1) {
+    __m128i a = _mm_loadu_si128((__m128i*)(s + i));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, first));
+    /* once the first byte looks rare, memchr skips ahead faster */
+    if (!mask && ++misses >= 4) {
+      char* p = memchr(s + i + 16, needle[0], last - i - 15);
+      if (!p) { return -1; }
+      i = p - s;
+      misses = 0;
+      continue;
+    }
+    if (mask) { misses = 0; }
+    __m128i b = _mm_loadu_si128((__m128i*)(s + i + n - 1));
+    mask &= _mm_movemask_epi8(_mm_cmpeq_epi8(b, end));
+    while (mask) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(s + i + bit + 1, needle + 1, n - 2) == 0) { return i + bit; }
+      mask &= mask - 1;
+    }
+    i += 16;
+  }
+#endif
+  while (i <= last) {
+    char* p = memchr(s + i, needle[0], last - i + 1);
+    if (!p) { return -1; }
+    i = p - s;
+    if (memcmp(p + 1, needle + 1, n - 1) == 0) { return i; }
+    i++;
+  }
+  return -1;
+}
+
+/* check that a string argument isn't empty */
+#define LASSERT_STR_NOT_EMPTY(func, args, index) \
+  LASSERT(args, args->cell[index]->count != 0, \
+          "function '%s' passed an empty string for argument %i.", func, index)
+
+lval* builtin_str_len(lenv* e, lval* a) {
+  LASSERT_NUM("str-len", a, 1);
+  LASSERT_TYPE("str-len", a, 0, LVAL_STR);
+
+  lval* r = lval_num(a->cell[0]->count);
+  lval_del(a);
+  return r;
+}
+
+/* join any number of strings end to end. the rest are appended onto
+   the first, so a string built up by repeated concatenation is
+   extended in place rather than copied each time */
+lval* builtin_str_concat(lenv* e, lval* a) {
+  long len = 0;
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("str-concat", a, i, LVAL_STR);
+    len += a->cell[i]->count;
+  }
+  LASSERT(a, len <= INT_MAX, "function 'str-concat' result is too long.");
+  if (a->count == 0) { lval_del(a); return lval_str_len("", 0); }
+
+  lval* r = lval_pop(a, 0);
+  for (int i = 0; i < a->count; i++) {
+    lval_str_append(r, a->cell[i]->str, a->cell[i]->count);
+  }
+  lval_del(a);
+  return r;
+}
+
+/* (str-builder n), an empty string with room to grow to n bytes
+   before appending onto it has to move it */
+lval* builtin_str_builder(lenv* e, lval* a) {
+  LASSERT_NUM("str-builder", a, 1);
+  LASSERT_TYPE("str-builder", a, 0, LVAL_NUM);
+  long cap = a->cell[0]->num;
+  LASSERT(a, cap >= 0 && cap <= INT_MAX,
+          "function 'str-builder' passed invalid size %li.", cap);
+
+  lval_del(a);
+  return lval_str_cap(cap);
+}
+
+/* (substr s start) or (substr s start len), the bytes of s from start */
+lval* builtin_substr(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "function substr passed incorrect number of arguments. "
+          "got %i, expected 2 or 3", a->count);
+  LASSERT_TYPE("substr", a, 0, LVAL_STR);
+  for (int i = 1; i < a->count; i++) { LASSERT_TYPE("substr", a, i, LVAL_NUM); }
+
+  long size = a->cell[0]->count;
+  long start = a->cell[1]->num;
+  /* check start before working out anything from it, so that nothing
+     here can overflow */
+  LASSERT(a, start >= 0 && start <= size,
+          "function 'substr' passed start %li out of range for length %li.",
+          start, size);
+  long len = a->count == 3 ? a->cell[2]->num : size - start;
+  LASSERT(a, len >= 0 && len <= size - start,
+          "function 'substr' passed length %li from %li out of range for length %li.",
+          len, start, size);
+
+  lval* r = lval_str_len(a->cell[0]->str + start, len);
+  lval_del(a);
+  return r;
+}
+
+/* (str-find s needle) or (str-find s needle from), the index of the
+   first needle in s, or -1 */
+lval* builtin_str_find(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+          "function str-find passed incorrect number of arguments. "
+          "got %i, expected 2 or 3", a->count);
+  LASSERT_TYPE("str-find", a, 0, LVAL_STR);
+  LASSERT_TYPE("str-find", a, 1, LVAL_STR);
+  if (a->count == 3) { LASSERT_TYPE("str-find", a, 2, LVAL_NUM); }
+
+  lval* s = a->cell[0];
+  long from = a->count == 3 ? a->cell[2]->num : 0;
+  LASSERT(a, from >= 0 && from <= s->count,
+          "function 'str-find' passed index %li out of range for length %i.",
+          from, s->count);
+
+  long i = lstr_find(s->str, s->count, a->cell[1]->str, a->cell[1]->count, from);
+  lval_del(a);
+  return lval_num(i);
+}
+
+/* split a string at every occurrence of a separator */
+lval* builtin_str_split(lenv* e, lval* a) {
+  LASSERT_NUM("str-split", a, 2);
+  LASSERT_TYPE("str-split", a, 0, LVAL_STR);
+  LASSERT_TYPE("str-split", a, 1, LVAL_STR);
+  LASSERT_STR_NOT_EMPTY("str-split", a, 1);
+
+  lval* s = a->cell[0];
+  lval* sep = a->cell[1];
+  lval* r = lval_qexpr();
+  long i = 0, j;
+  while ((j = lstr_find(s->str, s->count, sep->str, sep->count, i)) >= 0) {
+    lval_add(r, lval_str_len(s->str + i, j - i));
+    i = j + sep->count;
+  }
+  lval_add(r, lval_str_len(s->str + i, s->count - i));
+  lval_del(a);
+  return r;
+}
+
+/* (str-join l) or (str-join l sep), the strings of a list joined
+   together with sep between each */
+lval* builtin_str_join(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+          "function str-join passed incorrect number of arguments. "
+          "got %i, expected 1 or 2", a->count);
+  LASSERT_TYPE("str-join", a, 0, LVAL_QEXPR);
+  if (a->count == 2) { LASSERT_TYPE("str-join", a, 1, LVAL_STR); }
+
+  lval* l = lval_unpack(a->cell[0]);
+  lval* sep = a->count == 2 ? a->cell[1] : NULL;
+  long len = 0;
+  for (int i = 0; i < l->count; i++) {
+    LASSERT(a, l->cell[i]->type == LVAL_STR,
+            "function 'str-join' passed a list holding %s, expected %s.",
+            ltype_name(l->cell[i]->type), ltype_name(LVAL_STR));
+    len += l->cell[i]->count + (i && sep ? sep->count : 0);
+  }
+  LASSERT(a, len <= INT_MAX, "function 'str-join' result is too long.");
+
+  lval* r = lval_str_cap(len);
+  for (int i = 0; i < l->count; i++) {
+    if (i && sep) { lval_str_append(r, sep->str, sep->count); }
+    lval_str_append(r, l->cell[i]->str, l->cell[i]->count);
+  }
+  lval_del(a);
+  return r;
+}
+
+/* replace every occurrence of one string in another */
+lval* builtin_str_replace(lenv* e, lval* a) {
+  LASSERT_NUM("str-replace", a, 3);
+  for (int i = 0; i < 3; i++) { LASSERT_TYPE("str-replace", a, i, LVAL_STR); }
+  LASSERT_STR_NOT_EMPTY("str-replace", a, 1);
+
+  lval* s = a->cell[0];
+  lval* from = a->cell[1];
+  lval* to = a->cell[2];
+
+  /* count the matches first so the result is allocated once */
+  long n = 0;
+  for (long j = 0; (j = lstr_find(s->str, s->count, from->str, from->count, j)) >= 0;
+       j += from->count) {
+    n++;
+  }
+  if (n == 0) { return lval_take(a, 0); }
+  long len = s->count + n * (to->count - from->count);
+  LASSERT(a, len <= INT_MAX, "function 'str-replace' result is too long.");
+
+  lval* r = lval_str_cap(len);
+  long i = 0, j;
+  while ((j = lstr_find(s->str, s->count, from->str, from->count, i)) >= 0) {
+    lval_str_append(r, s->str + i, j - i);
+    lval_str_append(r, to->str, to->count);
+    i = j + from->count;
+  }
+  lval_str_append(r, s->str + i, s->count - i);
+  lval_del(a);
+  return r;
+}
+
+/* regular expressions use the syntax of mpc_re, but rather than
+   building a tree of backtracking parsers they are compiled to the
+   program of a thompson nfa. this is run as a dfa, built lazily one
+   state and transition at a time as the input needs them, so matching
+   takes time linear in the input. matches are leftmost-longest */
+
+enum { LRE_CLASS, LRE_SPLIT, LRE_JUMP, LRE_ASSERT, LRE_MATCH };
+enum { LRE_BOI, LRE_EOI, LRE_WORDB, LRE_NWORDB };
+
+/* what lies either side of a position, for the assertions, and
+   whether a state is searching for a match starting anywhere */
+enum { LRE_START = 1, LRE_PREV_WORD = 2, LRE_NEXT_WORD = 4, LRE_END = 8,
+       LRE_SEARCH = 16 };
+
+/* limits on the size of a program, the count of a repeat, and the
+   number of dfa states kept before they are thrown away and rebuilt */
+#define LRE_MAX_INSTS 65536
+#define LRE_MAX_REPEAT 1000
+#define LRE_MAX_STATES 512
+/* positions between the states kept by the backward pass of a scan */
+#define LRE_BLOCK 4096
+
+typedef struct {
+  int op;
+  /* jump target, or the first target of a split, or assertion kind */
+  int x;
+  /* second target of a split */
+  int y;
+  /* for classes, a bitmap of the bytes accepted */
+  uint32_t set[8];
+} lre_inst;
+
+/* a dfa state is the set of instructions waiting to run, in order,
+   along with what the byte before it was */
+typedef struct lre_state {
+  unsigned long hash;
+  int flags;
+  int n;
+  /* whether a match ends here, when followed by a word byte,
+     another byte, or the end of the input */
+  char accept[3];
+  struct lre_state* chain;
+  /* for states of the backward pass of a scan, bitmaps of the
+     instructions from which a match can be reached, after a word byte,
+     another byte, and at the start of the input. NULL otherwise */
+  uint32_t* live;
+  /* the state after each byte, or NULL until first needed */
+  struct lre_state* next[256];
+  int insts[];
+} lre_state;
+
+typedef struct {
+  int n;
+  lre_inst* prog;
+  int nstates;
+  lre_state* buckets[LRE_MAX_STATES];
+  /* start states at the start of the input, after a word byte,
+     and after any other byte, then the same again for searching */
+  lre_state* start[6];
+  /* incremented each time the states are thrown away */
+  int flushes;
+  /* scratch space for following empty transitions */
+  int gen;
+  int* mark;
+  int* stack;
+  int* list;
+  int* out;
+  /* states of the backward pass of a scan, which are not flushed but
+     cleared between scans once they fill half the room, and the
+     instructions with an empty transition to each instruction */
+  int nback;
+  lre_state* back[LRE_MAX_STATES];
+  int* pred_at;
+  int* preds;
+} lre;
+
+/* syntax tree of a pattern, used only while compiling it */
+enum { LRE_N_EMPTY, LRE_N_SET, LRE_N_ASSERT, LRE_N_CAT, LRE_N_ALT, LRE_N_REPEAT };
+
+typedef struct lre_node {
+  int kind;
+  /* for repeats the bounds, max -1 when unbounded. for assertions
+     the kind in min */
+  int min;
+  int max;
+  uint32_t set[8];
+  struct lre_node* a;
+  struct lre_node* b;
+} lre_node;
+
+typedef struct {
+  char* s;
+  int len;
+  int i;
+  char* err;
+} lre_parser;
+
+int lre_word(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+      || (c >= '0' && c <= '9') || c == '_';
+}
+
+void lre_set_add(uint32_t* set, unsigned char c) { set[c >> 5] |= 1u << (c & 31); }
+int lre_set_has(uint32_t* set, unsigned char c) { return (set[c >> 5] >> (c & 31)) & 1; }
+
+/* add the bytes of an escape class, \d \s or \w, or their inverses */
+int lre_set_escape(uint32_t* set, char d) {
+  uint32_t t[8] = {0};
+  switch (d) {
+    case 'd': case 'D':
+      for (int c = '0'; c <= '9'; c++) { lre_set_add(t, c); } break;
+    case 's': case 'S':
+      for (char* c = " \f\n\r\t\v"; *c; c++) { lre_set_add(t, *c); } break;
+    case 'w': case 'W':
+      for (int c = 0; c < 256; c++) { if (lre_word(c)) { lre_set_add(t, c); } } break;
+    default: return 0;
+  }
+  int inv = d == 'D' || d == 'S' || d == 'W';
+  for (int i = 0; i < 8; i++) { set[i] |= inv ? ~t[i] : t[i]; }
+  return 1;
+}
+
+/* the byte an escaped character stands for */
+unsigned char lre_escape_char(char d) {
+  switch (d) {
+    case 'a': return '\a';
+    case 'f': return '\f';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 't': return '\t';
+    case 'v': return '\v';
+    default: return d;
+  }
+}
+
+lre_node* lre_node_new(int kind, lre_node* a, lre_node* b) {
+  lre_node* n = calloc(1, sizeof(lre_node));
+  n->kind = kind;
+  n->a = a;
+  n->b = b;
+  return n;
+}
+
+void lre_node_del(lre_node* n) {
+  if (!n) { return; }
+  lre_node_del(n->a);
+  lre_node_del(n->b);
+  free(n);
+}
+
+lre_node* lre_parse_regex(lre_parser* p);
+
+/* a bracketed class, after the opening [ */
+lre_node* lre_parse_class(lre_parser* p) {
+  lre_node* n = lre_node_new(LRE_N_SET, NULL, NULL);
+  int inv = p->i < p->len && p->s[p->i] == '^';
+  int start = p->i += inv;
+  int prev = -1;
+  while (p->i < p->len && p->s[p->i] != ']') {
+    unsigned char c = p->s[p->i++];
+    if (c == '\\' && p->i < p->len) {
+      char d = p->s[p->i++];
+      if (lre_set_escape(n->set, d)) { prev = -1; continue; }
+      c = d == 'b' ? '\b' : lre_escape_char(d);
+    } else if (c == '-' && prev >= 0 && p->i < p->len && p->s[p->i] != ']') {
+      unsigned char end = p->s[p->i++];
+      if (end == '\\' && p->i < p->len) { end = lre_escape_char(p->s[p->i++]); }
+      for (int x = prev; x <= end; x++) { lre_set_add(n->set, x); }
+      prev = -1;
+      continue;
+    }
+    lre_set_add(n->set, c);
+    prev = c;
+  }
+  if (p->i == p->len) { p->err = "missing ]"; }
+  else if (p->i == start) { p->err = "empty []"; }
+  if (p->err) { lre_node_del(n); return NULL; }
+  p->i++;
+  if (inv) { for (int i = 0; i < 8; i++) { n->set[i] = ~n->set[i]; } }
+  return n;
+}
+
+/* a single character, escape, class or parenthesized regex */
+lre_node* lre_parse_base(lre_parser* p) {
+  unsigned char c = p->s[p->i++];
+  lre_node* n;
+  switch (c) {
+    case '(':
+      n = lre_parse_regex(p);
+      if (!n) { return NULL; }
+      if (p->i == p->len) { p->err = "missing )"; lre_node_del(n); return NULL; }
+      p->i++;
+      return n;
+    case '[':
+      return lre_parse_class(p);
+    case '^': case '$':
+      n = lre_node_new(LRE_N_ASSERT, NULL, NULL);
+      n->min = c == '^' ? LRE_BOI : LRE_EOI;
+      return n;
+    case '.':
+      n = lre_node_new(LRE_N_SET, NULL, NULL);
+      for (int i = 0; i < 8; i++) { n->set[i] = ~0u; }
+      n->set['\n' >> 5] &= ~(1u << ('\n' & 31));
+      return n;
+    case '\\':
+      if (p->i == p->len) { p->err = "trailing \\"; return NULL; }
+      c = p->s[p->i++];
+      if (c == 'b' || c == 'B' || c == 'A' || c == 'Z') {
+        n = lre_node_new(LRE_N_ASSERT, NULL, NULL);
+        n->min = c == 'b' ? LRE_WORDB : c == 'B' ? LRE_NWORDB : c == 'A' ? LRE_BOI : LRE_EOI;
+        return n;
+      }
+      n = lre_node_new(LRE_N_SET, NULL, NULL);
+      if (!lre_set_escape(n->set, c)) { lre_set_add(n->set, lre_escape_char(c)); }
+      return n;
+    default:
+      n = lre_node_new(LRE_N_SET, NULL, NULL);
+      lre_set_add(n->set, c);
+      return n;
+  }
+}
+
+/* read a repeat count, returning -1 if there isn't one */
+int lre_parse_count(lre_parser* p) {
+  if (p->i == p->len || p->s[p->i] < '0' || p->s[p->i] > '9') { return -1; }
+  long n = 0;
+  while (p->i < p->len && p->s[p->i] >= '0' && p->s[p->i] <= '9') {
+    if (n <= LRE_MAX_REPEAT) { n = n * 10 + (p->s[p->i] - '0'); }
+    p->i++;
+  }
+  return n;
+}
+
+/* a base followed by any number of *, +, ?, {n}, {n,} or {n,m} */
+lre_node* lre_parse_factor(lre_parser* p) {
+  lre_node* n = lre_parse_base(p);
+  while (n && p->i < p->len) {
+    char c = p->s[p->i];
+    int min, max;
+    if (c == '*') { min = 0; max = -1; p->i++; }
+    else if (c == '+') { min = 1; max = -1; p->i++; }
+    else if (c == '?') { min = 0; max = 1; p->i++; }
+    else if (c == '{') {
+      /* anything not a valid count is left to be read literally */
+      int at = p->i++;
+      min = max = lre_parse_count(p);
+      if (min >= 0 && p->i < p->len && p->s[p->i] == ',') {
+        p->i++;
+        max = lre_parse_count(p);
+      }
+      if (min < 0 || p->i == p->len || p->s[p->i] != '}') { p->i = at; break; }
+      p->i++;
+      if (min > LRE_MAX_REPEAT || max > LRE_MAX_REPEAT) {
+        p->err = "repeat count too large";
+      } else if (max >= 0 && max < min) {
+        p->err = "repeat bounds out of order";
+      }
+      if (p->err) { lre_node_del(n); return NULL; }
+    } else {
+      break;
+    }
+    n = lre_node_new(LRE_N_REPEAT, n, NULL);
+    n->min = min;
+    n->max = max;
+  }
+  return n;
+}
+
+/* a sequence of factors, up to the next | or ) */
+lre_node* lre_parse_term(lre_parser* p) {
+  lre_node* n = lre_node_new(LRE_N_EMPTY, NULL, NULL);
+  while (p->i < p->len && p->s[p->i] != '|' && p->s[p->i] != ')') {
+    lre_node* f = lre_parse_factor(p);
+    if (!f) { lre_node_del(n); return NULL; }
+    n = n->kind == LRE_N_EMPTY ? (free(n), f) : lre_node_new(LRE_N_CAT, n, f);
+  }
+  return n;
+}
+
+/* terms separated by | */
+lre_node* lre_parse_regex(lre_parser* p) {
+  lre_node* n = lre_parse_term(p);
+  while (n && p->i < p->len && p->s[p->i] == '|') {
+    p->i++;
+    lre_node* t = lre_parse_term(p);
+    if (!t) { lre_node_del(n); return NULL; }
+    n = lre_node_new(LRE_N_ALT, n, t);
+  }
+  return n;
+}
+
+/* number of instructions needed for a tree, saturating past the limit */
+long lre_size(lre_node* n) {
+  long s;
+  switch (n->kind) {
+    case LRE_N_EMPTY: return 0;
+    case LRE_N_SET: case LRE_N_ASSERT: return 1;
+    case LRE_N_CAT: s = lre_size(n->a) + lre_size(n->b); break;
+    case LRE_N_ALT: s = lre_size(n->a) + lre_size(n->b) + 2; break;
+    default:
+      s = lre_size(n->a);
+      s = s * n->min + (n->max < 0 ? s + 2 : (n->max - n->min) * (s + 1));
+  }
+  return s > LRE_MAX_INSTS ? LRE_MAX_INSTS + 1 : s;
+}
+
+/* write the instructions for a tree from pc, returning the pc after */
+int lre_emit(lre_inst* prog, lre_node* n, int pc) {
+  switch (n->kind) {
+    case LRE_N_EMPTY: return pc;
+    case LRE_N_SET:
+      prog[pc].op = LRE_CLASS;
+      memcpy(prog[pc].set, n->set, sizeof(n->set));
+      return pc + 1;
+    case LRE_N_ASSERT:
+      prog[pc].op = LRE_ASSERT;
+      prog[pc].x = n->min;
+      return pc + 1;
+    case LRE_N_CAT:
+      return lre_emit(prog, n->b, lre_emit(prog, n->a, pc));
+    case LRE_N_ALT: {
+      int j = lre_emit(prog, n->a, pc + 1);
+      int end = lre_emit(prog, n->b, j + 1);
+      prog[pc].op = LRE_SPLIT;
+      prog[pc].x = pc + 1;
+      prog[pc].y = j + 1;
+      prog[j].op = LRE_JUMP;
+      prog[j].x = end;
+      return end;
+    }
+  }
+  for (int i = 0; i < n->min; i++) { pc = lre_emit(prog, n->a, pc); }
+  if (n->max < 0) {
+    int j = lre_emit(prog, n->a, pc + 1);
+    prog[pc].op = LRE_SPLIT;
+    prog[pc].x = pc + 1;
+    prog[pc].y = j + 1;
+    prog[j].op = LRE_JUMP;
+    prog[j].x = pc;
+    return j + 1;
+  }
+  /* each optional copy may be skipped straight to the end */
+  int end = pc + (n->max - n->min) * (lre_size(n->a) + 1);
+  for (int i = n->min; i < n->max; i++) {
+    prog[pc].op = LRE_SPLIT;
+    prog[pc].x = pc + 1;
+    prog[pc].y = end;
+    pc = lre_emit(prog, n->a, pc + 1);
+  }
+  return pc;
+}
+
+/* compile a pattern, returning NULL and setting err if it is invalid */
+lre* lre_compile(char* s, int len, char** err) {
+  lre_parser p = { s, len, 0, NULL };
+  lre_node* n = lre_parse_regex(&p);
+  if (n && p.i < len) { p.err = "unmatched )"; lre_node_del(n); n = NULL; }
+  if (!n) { *err = p.err; return NULL; }
+  long size = lre_size(n);
+  if (size > LRE_MAX_INSTS) {
+    lre_node_del(n);
+    *err = "pattern too large";
+    return NULL;
+  }
+
+  lre* re = calloc(1, sizeof(lre));
+  re->n = size + 1;
+  re->prog = calloc(re->n, sizeof(lre_inst));
+  lre_emit(re->prog, n, 0);
+  re->prog[size].op = LRE_MATCH;
+  lre_node_del(n);
+
+  re->mark = calloc(re->n, sizeof(int));
+  re->stack = malloc(sizeof(int) * (3 * re->n + 1));
+  re->list = malloc(sizeof(int) * re->n);
+  re->out = malloc(sizeof(int) * re->n);
+  return re;
+}
+
+/* throw away every dfa state */
+void lre_flush(lre* re) {
+  for (int i = 0; i < LRE_MAX_STATES; i++) {
+    lre_state* x = re->buckets[i];
+    while (x) {
+      lre_state* chain = x->chain;
+      free(x);
+      x = chain;
+    }
+    re->buckets[i] = NULL;
+  }
+  memset(re->start, 0, sizeof(re->start));
+  re->nstates = 0;
+  re->flushes++;
+}
+
+/* throw away every state of the backward pass */
+void lre_back_clear(lre* re) {
+  for (int i = 0; i < re->nback; i++) {
+    free(re->back[i]->live);
+    free(re->back[i]);
+  }
+  re->nback = 0;
+}
+
+void lre_del(lre* re) {
+  lre_flush(re);
+  lre_back_clear(re);
+  free(re->pred_at);
+  free(re->preds);
+  free(re->prog);
+  free(re->mark);
+  free(re->stack);
+  free(re->list);
+  free(re->out);
+  free(re);
+}
+
+int lre_holds(int kind, int ctx) {
+  switch (kind) {
+    case LRE_BOI: return (ctx & LRE_START) != 0;
+    case LRE_EOI: return (ctx & LRE_END) != 0;
+    case LRE_WORDB: return !(ctx & LRE_PREV_WORD) != !(ctx & LRE_NEXT_WORD);
+    default: return !(ctx & LRE_PREV_WORD) == !(ctx & LRE_NEXT_WORD);
+  }
+}
+
+/* follow the empty transitions out of a set of instructions, given
+   what lies either side of the current position, collecting the
+   classes reached into out. returns whether the match was reached */
+int lre_closure(lre* re, int* in, int n, int ctx, int* nout) {
+  if (++re->gen == INT_MAX) {
+    memset(re->mark, 0, sizeof(int) * re->n);
+    re->gen = 1;
+  }
+  int sp = 0, matched = 0;
+  *nout = 0;
+  for (int i = n - 1; i >= 0; i--) { re->stack[sp++] = in[i]; }
+  while (sp) {
+    int pc = re->stack[--sp];
+    if (re->mark[pc] == re->gen) { continue; }
+    re->mark[pc] = re->gen;
+    lre_inst* x = &re->prog[pc];
+    switch (x->op) {
+      case LRE_CLASS: re->out[(*nout)++] = pc; break;
+      case LRE_MATCH: matched = 1; break;
+      case LRE_JUMP: re->stack[sp++] = x->x; break;
+      case LRE_SPLIT:
+        re->stack[sp++] = x->y;
+        re->stack[sp++] = x->x;
+        break;
+      case LRE_ASSERT:
+        if (lre_holds(x->x, ctx)) { re->stack[sp++] = pc + 1; }
+        break;
+    }
+  }
+  return matched;
+}
+
+/* find or make the state for a sorted set of instructions */
+lre_state* lre_intern(lre* re, int* insts, int n, int flags) {
+  unsigned long hash = lhash_bytes(flags, (char*)insts, sizeof(int) * n);
+  lre_state** b = &re->buckets[hash & (LRE_MAX_STATES-1)];
+  for (lre_state* x = *b; x; x = x->chain) {
+    if (x->hash == hash && x->flags == flags && x->n == n
+        && memcmp(x->insts, insts, sizeof(int) * n) == 0) {
+      return x;
+    }
+  }
+  if (re->nstates == LRE_MAX_STATES) {
+    lre_flush(re);
+    b = &re->buckets[hash & (LRE_MAX_STATES-1)];
+  }
+
+  lre_state* x = malloc(sizeof(lre_state) + sizeof(int) * n);
+  x->hash = hash;
+  x->flags = flags;
+  x->n = n;
+  x->live = NULL;
+  memset(x->next, 0, sizeof(x->next));
+  memcpy(x->insts, insts, sizeof(int) * n);
+  int m;
+  x->accept[0] = lre_closure(re, insts, n, flags | LRE_NEXT_WORD, &m);
+  x->accept[1] = lre_closure(re, insts, n, flags, &m);
+  x->accept[2] = lre_closure(re, insts, n, flags | LRE_END, &m);
+  x->chain = *b;
+  *b = x;
+  re->nstates++;
+  return x;
+}
+
+int lre_cmp_int(const void* a, const void* b) {
+  return *(const int*)a - *(const int*)b;
+}
+
+/* the state after reading a byte, built the first time it's needed */
+lre_state* lre_step(lre* re, lre_state* s, unsigned char c) {
+  if (s->next[c]) { return s->next[c]; }
+  int m, k = 0;
+  lre_closure(re, s->insts, s->n, s->flags | (lre_word(c) ? LRE_NEXT_WORD : 0), &m);
+  /* a search starts a new match after every byte */
+  if (s->flags & LRE_SEARCH) { re->list[k++] = 0; }
+  for (int i = 0; i < m; i++) {
+    int pc = re->out[i];
+    if (lre_set_has(re->prog[pc].set, c)) { re->list[k++] = pc + 1; }
+  }
+  qsort(re->list, k, sizeof(int), lre_cmp_int);
+
+  /* s is gone if the states were thrown away to make room */
+  int flushes = re->flushes;
+  int flags = (s->flags & LRE_SEARCH) | (lre_word(c) ? LRE_PREV_WORD : 0);
+  lre_state* t = lre_intern(re, re->list, k, flags);
+  if (flushes == re->flushes) { s->next[c] = t; }
+  return t;
+}
+
+/* the state to begin matching at i, or searching from i */
+lre_state* lre_start(lre* re, char* s, long i, int search) {
+  int k = (i == 0 ? 0 : lre_word(s[i-1]) ? 1 : 2) + (search ? 3 : 0);
+  if (!re->start[k]) {
+    int pc = 0;
+    int flags = i == 0 ? LRE_START : lre_word(s[i-1]) ? LRE_PREV_WORD : 0;
+    lre_state* x = lre_intern(re, &pc, 1, flags | (search ? LRE_SEARCH : 0));
+    re->start[k] = x;
+  }
+  return re->start[k];
+}
+
+/* the end of the longest match starting at i, or -1 */
+long lre_longest(lre* re, char* s, long len, long i) {
+  lre_state* x = lre_start(re, s, i, 0);
+  long end = -1;
+  for (long j = i; ; j++) {
+    if (j == len) {
+      if (x->accept[2]) { end = j; }
+      break;
+    }
+    unsigned char c = s[j];
+    if (x->accept[lre_word(c) ? 0 : 1]) { end = j; }
+    x = lre_step(re, x, c);
+    if (x->n == 0) { break; }
+  }
+  return end;
+}
+
+/* the earliest end of any match starting at or after i, or -1 */
+long lre_earliest(lre* re, char* s, long len, long i) {
+  lre_state* x = lre_start(re, s, i, 1);
+  for (long j = i; j < len; j++) {
+    unsigned char c = s[j];
+    if (x->accept[lre_word(c) ? 0 : 1]) { return j; }
+    x = lre_step(re, x, c);
+  }
+  return x->accept[2] ? len : -1;
+}
+
+/* the start of the leftmost match at or after from, setting its
+   end, or -1 if there is none. a search first finds where the
+   earliest match ends, so when there are none left the rest of the
+   input is read just once, and the leftmost match must start at or
+   before that end */
+long lre_find(lre* re, char* s, long len, long from, long* end) {
+  long first = lre_earliest(re, s, len, from);
+  if (first < 0) { return -1; }
+  for (long i = from; i <= first; i++) {
+    if ((*end = lre_longest(re, s, len, i)) >= 0) { return i; }
+  }
+  return -1;
+}
+
+/* a scan finds every match in a string in one sweep from left to
+   right, where lre_find would extend a match from each start as far
+   as its threads live, which for a pattern like a*b|a is the rest of
+   the input every time. a first pass runs backwards over the whole
+   string as a dfa over the sets of instructions from which the rest
+   of the input reaches a match. its states show where a match can
+   begin, so starts need no search, and when no thread of a match has
+   a way left to a longer one, so extending stops just past its end.
+   the pass keeps its state at every LRE_BLOCK'th position, and those
+   in between are rebuilt a block at a time as the sweep reaches them */
+typedef struct {
+  lre* re;
+  char* s;
+  long len;
+  /* whether the backward pass fit in the states allowed. if not,
+     matches are found one at a time with lre_find */
+  int ok;
+  /* backward states at each multiple of LRE_BLOCK, and at the end */
+  lre_state** marks;
+  lre_state* last;
+  /* backward states for each position of the block numbered block */
+  long block;
+  lre_state** states;
+} lre_scan;
+
+/* the instructions with an empty transition to each instruction,
+   built the first time a scan needs them */
+void lre_preds(lre* re) {
+  if (re->pred_at) { return; }
+  re->pred_at = calloc(re->n + 1, sizeof(int));
+  for (int pass = 0; pass < 2; pass++) {
+    int* at = pass ? re->list : re->pred_at + 1;
+    if (pass) {
+      for (int i = 0; i < re->n; i++) { re->pred_at[i+1] += re->pred_at[i]; }
+      re->preds = malloc(sizeof(int) * (re->pred_at[re->n] + 1));
+      memcpy(at, re->pred_at, sizeof(int) * re->n);
+    }
+    for (int pc = 0; pc < re->n; pc++) {
+      lre_inst* x = &re->prog[pc];
+      int to[2], k = 0;
+      if (x->op == LRE_JUMP) { to[k++] = x->x; }
+      if (x->op == LRE_SPLIT) { to[k++] = x->x; to[k++] = x->y; }
+      if (x->op == LRE_ASSERT) { to[k++] = pc + 1; }
+      for (int i = 0; i < k; i++) {
+        if (pass) { re->preds[at[to[i]]++] = pc; } else { at[to[i]]++; }
+      }
+    }
+  }
+}
+
+/* mark every instruction from which one of a set is reached by empty
+   transitions, given what lies either side of the current position */
+void lre_back_closure(lre* re, int* in, int n, int ctx) {
+  if (++re->gen == INT_MAX) {
+    memset(re->mark, 0, sizeof(int) * re->n);
+    re->gen = 1;
+  }
+  int sp = 0;
+  for (int i = 0; i < n; i++) {
+    re->mark[in[i]] = re->gen;
+    re->stack[sp++] = in[i];
+  }
+  while (sp) {
+    int pc = re->stack[--sp];
+    for (int k = re->pred_at[pc]; k < re->pred_at[pc+1]; k++) {
+      int p = re->preds[k];
+      if (re->mark[p] == re->gen) { continue; }
+      if (re->prog[p].op == LRE_ASSERT && !lre_holds(re->prog[p].x, ctx)) {
+        continue;
+      }
+      re->mark[p] = re->gen;
+      re->stack[sp++] = p;
+    }
+  }
+}
+
+/* find or make the backward state for a sorted set of instructions
+   with a path to a match from the next byte on, or NULL if there is
+   no room left for another */
+lre_state* lre_back_intern(lre* re, int* insts, int n, int flags) {
+  unsigned long hash = lhash_bytes(flags, (char*)insts, sizeof(int) * n);
+  for (int i = 0; i < re->nback; i++) {
+    lre_state* x = re->back[i];
+    if (x->hash == hash && x->flags == flags && x->n == n
+        && memcmp(x->insts, insts, sizeof(int) * n) == 0) {
+      return x;
+    }
+  }
+  if (re->nback == LRE_MAX_STATES) { return NULL; }
+
+  lre_state* x = malloc(sizeof(lre_state) + sizeof(int) * n);
+  x->hash = hash;
+  x->flags = flags;
+  x->n = n;
+  x->chain = NULL;
+  memset(x->next, 0, sizeof(x->next));
+  memcpy(x->insts, insts, sizeof(int) * n);
+  int words = (re->n + 31) / 32;
+  x->live = calloc(3 * words, sizeof(uint32_t));
+  for (int k = 0; k < 3; k++) {
+    int ctx = flags | (k == 0 ? LRE_PREV_WORD : k == 2 ? LRE_START : 0);
+    lre_back_closure(re, insts, n, ctx);
+    uint32_t* live = x->live + k * words;
+    for (int pc = 0; pc < re->n; pc++) {
+      if (re->mark[pc] == re->gen) { live[pc >> 5] |= 1u << (pc & 31); }
+    }
+    /* whether a match can begin here */
+    x->accept[k] = live[0] & 1;
+  }
+  re->back[re->nback++] = x;
+  return x;
+}
+
+/* the backward state before the byte c, given the state after it */
+lre_state* lre_back_step(lre* re, lre_state* b, unsigned char c) {
+  if (b->next[c]) { return b->next[c]; }
+  lre_back_closure(re, b->insts, b->n, b->flags | (lre_word(c) ? LRE_PREV_WORD : 0));
+  int k = 0;
+  for (int pc = 0; pc < re->n; pc++) {
+    lre_inst* x = &re->prog[pc];
+    if (x->op == LRE_MATCH || (x->op == LRE_CLASS && lre_set_has(x->set, c)
+                               && re->mark[pc+1] == re->gen)) {
+      re->list[k++] = pc;
+    }
+  }
+  b->next[c] = lre_back_intern(re, re->list, k, lre_word(c) ? LRE_NEXT_WORD : 0);
+  return b->next[c];
+}
+
+/* which of the start states, or accept flags, apply at i */
+int lre_before(char* s, long i) {
+  return i == 0 ? 2 : lre_word(s[i-1]) ? 0 : 1;
+}
+
+/* run the backward pass over a string, ready to find its matches */
+void lre_scan_init(lre_scan* sc, lre* re, char* s, long len) {
+  sc->re = re;
+  sc->s = s;
+  sc->len = len;
+  sc->block = -1;
+  sc->marks = malloc(sizeof(lre_state*) * (len / LRE_BLOCK + 1));
+  sc->states = NULL;
+
+  if (re->nback > LRE_MAX_STATES / 2) { lre_back_clear(re); }
+  lre_preds(re);
+  int match = re->n - 1;
+  lre_state* b = lre_back_intern(re, &match, 1, LRE_END);
+  sc->last = b;
+  for (long i = len; b; i--) {
+    if (i % LRE_BLOCK == 0) { sc->marks[i / LRE_BLOCK] = b; }
+    if (i == 0) { break; }
+    b = lre_back_step(re, b, sc->s[i-1]);
+  }
+  sc->ok = b != NULL;
+}
+
+void lre_scan_free(lre_scan* sc) {
+  free(sc->marks);
+  free(sc->states);
+}
+
+/* the backward state at position i, rebuilding its block if need be.
+   every transition was made by the first pass, so none can fail */
+lre_state* lre_scan_back(lre_scan* sc, long i) {
+  long block = i / LRE_BLOCK;
+  if (block != sc->block) {
+    if (!sc->states) { sc->states = malloc(sizeof(lre_state*) * LRE_BLOCK); }
+    long base = block * LRE_BLOCK;
+    long top = base + LRE_BLOCK;
+    lre_state* b;
+    if (top <= sc->len) {
+      b = sc->marks[top / LRE_BLOCK];
+    } else {
+      top = sc->len;
+      b = sc->states[top - base] = sc->last;
+    }
+    for (long j = top - 1; j >= base; j--) {
+      b = sc->states[j - base] = lre_back_step(sc->re, b, sc->s[j]);
+    }
+    sc->block = block;
+  }
+  return sc->states[i - block * LRE_BLOCK];
+}
+
+/* whether any thread of a forward state can still reach a match,
+   given the backward state at the same position */
+int lre_live(lre* re, lre_state* x, lre_state* b, int before) {
+  uint32_t* live = b->live + before * ((re->n + 31) / 32);
+  for (int i = 0; i < x->n; i++) {
+    int pc = x->insts[i];
+    if ((live[pc >> 5] >> (pc & 31)) & 1) { return 1; }
+  }
+  return 0;
+}
+
+/* the start of the leftmost match at or after from, setting its end,
+   or -1 if there is none, as lre_find but within a scan */
+long lre_scan_next(lre_scan* sc, long from, long* end) {
+  if (!sc->ok) { return lre_find(sc->re, sc->s, sc->len, from, end); }
+  lre* re = sc->re;
+  char* s = sc->s;
+  for (long i = from; i <= sc->len; i++) {
+    if (!lre_scan_back(sc, i)->accept[lre_before(s, i)]) { continue; }
+
+    /* a match begins here. extend it while a longer one is possible */
+    lre_state* x = lre_start(re, s, i, 0);
+    *end = -1;
+    for (long j = i; lre_live(re, x, lre_scan_back(sc, j), lre_before(s, j)); j++) {
+      if (j == sc->len) {
+        if (x->accept[2]) { *end = j; }
+        break;
+      }
+      unsigned char c = s[j];
+      if (x->accept[lre_word(c) ? 0 : 1]) { *end = j; }
+      x = lre_step(re, x, c);
+    }
+    if (*end >= 0) { return i; }
+  }
+  return -1;
+}
+
+/* compiled patterns are cached by their text, so a pattern used
+   over and over, say in a function passed to map, is compiled once */
+typedef struct lre_entry {
+  unsigned long hash;
+  lval* pattern;
+  lre* re;
+  struct lre_entry* next;
+  struct lre_entry* newer;
+  struct lre_entry* older;
+} lre_entry;
+
+#define LRE_CACHE_CAP 64
+
+struct {
+  int count;
+  lre_entry* buckets[LRE_CACHE_CAP];
+  lre_entry* newest;
+  lre_entry* oldest;
+} lre_cache;
+
+/* unlink an entry from the least-recently-used list */
+void lre_cache_unlink(lre_entry* x) {
+  if (x->newer) { x->newer->older = x->older; } else { lre_cache.newest = x->older; }
+  if (x->older) { x->older->newer = x->newer; } else { lre_cache.oldest = x->newer; }
+}
+
+/* link an entry in as the most recently used */
+void lre_cache_push(lre_entry* x) {
+  x->newer = NULL;
+  x->older = lre_cache.newest;
+  if (lre_cache.newest) { lre_cache.newest->newer = x; } else { lre_cache.oldest = x; }
+  lre_cache.newest = x;
+}
+
+/* remove the least recently used pattern from the cache */
+void lre_cache_evict(void) {
+  lre_entry* x = lre_cache.oldest;
+  lre_entry** p = &lre_cache.buckets[x->hash & (LRE_CACHE_CAP-1)];
+  while (*p != x) { p = &(*p)->next; }
+  *p = x->next;
+  lre_cache_unlink(x);
+  lval_del(x->pattern);
+  lre_del(x->re);
+  free(x);
+  lre_cache.count--;
+}
+
+/* the compiled regex for a pattern string, from the cache if it's
+   there. returns NULL and sets err if the pattern is invalid */
+lre* lre_get(lval* pattern, char** err) {
+  unsigned long hash = lhash_bytes(0, pattern->str, pattern->count);
+  lre_entry** b = &lre_cache.buckets[hash & (LRE_CACHE_CAP-1)];
+  for (lre_entry* x = *b; x; x = x->next) {
+    if (x->hash == hash && lval_eq(x->pattern, pattern)) {
+      lre_cache_unlink(x);
+      lre_cache_push(x);
+      return x->re;
+    }
+  }
+
+  lre* re = lre_compile(pattern->str, pattern->count, err);
+  if (!re) { return NULL; }
+  if (lre_cache.count == LRE_CACHE_CAP) { lre_cache_evict(); }
+  lre_entry* x = malloc(sizeof(lre_entry));
+  x->hash = hash;
+  x->pattern = lval_copy(pattern);
+  x->re = re;
+  x->next = *b;
+  *b = x;
+  lre_cache_push(x);
+  lre_cache.count++;
+  return re;
+}
+
+/* check the arguments of a regex builtin are all strings, and
+   compile the pattern in the first */
+#define LASSERT_REGEX(func, args, num, re) \
+  LASSERT_NUM(func, args, num); \
+  for (int i = 0; i < num; i++) { LASSERT_TYPE(func, args, i, LVAL_STR); } \
+  char* re##_err; \
+  lre* re = lre_get(args->cell[0], &re##_err); \
+  LASSERT(args, re, "function '%s' passed invalid regex. %s.", func, re##_err)
+
+/* (re-match re s), whether the whole of s matches re */
+lval* builtin_re_match(lenv* e, lval* a) {
+  LASSERT_REGEX("re-match", a, 2, re);
+
+  lval* s = a->cell[1];
+  lval* r = lval_num(lre_longest(re, s->str, s->count, 0) == s->count);
+  lval_del(a);
+  return r;
+}
+
+/* (re-find-all re s), a list of every match of re in s, from left
+   to right without overlapping */
+lval* builtin_re_find_all(lenv* e, lval* a) {
+  LASSERT_REGEX("re-find-all", a, 2, re);
+
+  lval* s = a->cell[1];
+  lval* r = lval_qexpr();
+  lre_scan sc;
+  lre_scan_init(&sc, re, s->str, s->count);
+  long i = 0, start, end;
+  while (i <= s->count && (start = lre_scan_next(&sc, i, &end)) >= 0) {
+    lval_add(r, lval_str_len(s->str + start, end - start));
+    i = end > start ? end : end + 1;
+  }
+  lre_scan_free(&sc);
+  lval_del(a);
+  return r;
+}
+
+/* (re-replace re s to), s with every match of re replaced by to */
+lval* builtin_re_replace(lenv* e, lval* a) {
+  LASSERT_REGEX("re-replace", a, 3, re);
+
+  lval* s = a->cell[1];
+  lval* to = a->cell[2];
+  lval* r = lval_str_cap(s->count);
+  lre_scan sc;
+  lre_scan_init(&sc, re, s->str, s->count);
+  long i = 0, last = 0, start, end;
+  while (i <= s->count && (start = lre_scan_next(&sc, i, &end)) >= 0) {
+    if (r->count + (start - last) + to->count + 1L > INT_MAX) {
+      lre_scan_free(&sc);
+      lval_del(r);
+      lval_del(a);
+      return lval_err("function 're-replace' result is too long.");
+    }
+    lval_str_append(r, s->str + last, start - last);
+    lval_str_append(r, to->str, to->count);
+    /* an empty match keeps the byte after it */
+    if (end == start && end < s->count) { lval_str_append(r, s->str + end, 1); }
+    i = last = end > start ? end : end + 1;
+  }
+  if (last < s->count) { lval_str_append(r, s->str + last, s->count - last); }
+  lre_scan_free(&sc);
+  lval_del(a);
+  return r;
+}
+
+/* grammars written in the language of mpca_lang, compiled once into
+   a parser for each rule. shared, reference counted, between every
+   copy of the grammar, and deleted with the last of them */
+#define LGRAM_MAX_RULES 32
+
+struct lgram {
+  int refs;
+  /* the rules, in the order they are defined, the first being the
+     one input is parsed with. unused slots are NULL */
+  int count;
+  mpc_parser_t* rules[LGRAM_MAX_RULES];
+  /* the first rule, which must match the whole of the input */
+  mpc_parser_t* total;
+};
+
+lgram* lgram_retain(lgram* g) {
+  g->refs++;
+  return g;
+}
+
+void lgram_release(lgram* g) {
+  if (--g->refs > 0) { return; }
+  if (g->total) { mpc_delete(g->total); }
+  /* rules refer to each other, so all are undefined before any is deleted */
+  for (int i = 0; i < g->count; i++) { mpc_undefine(g->rules[i]); }
+  for (int i = 0; i < g->count; i++) { mpc_delete(g->rules[i]); }
+  free(g);
+}
+
+/* drop the newline mpc ends its error messages with */
+void lgram_chomp(char* msg) {
+  size_t n = strlen(msg);
+  if (n && msg[n-1] == '\n') { msg[n-1] = '\0'; }
+}
+
+/* make a parser for the rule named at the start of each statement of
+   a grammar, skipping over string, character and regex literals.
+   returns the number of rules, -1 if there are too many, or -2 if
+   the last statement is missing its ; */
+int lgram_rules(lgram* g, char* s) {
+  int start = 1;
+  while (*s) {
+    if (*s == '"' || *s == '\'' || *s == '/') {
+      char q = *s++;
+      while (*s && *s != q) { s += s[0] == '\\' && s[1] ? 2 : 1; }
+      if (*s) { s++; }
+      start = 0;
+    } else if (*s == ';') {
+      start = 1;
+      s++;
+    } else if (start && (isalpha((unsigned char)*s) || *s == '_')) {
+      char name[64];
+      int n = 0;
+      while (isalnum((unsigned char)*s) || *s == '_') {
+        if (n < 63) { name[n++] = *s; }
+        s++;
+      }
+      name[n] = '\0';
+      if (g->count == LGRAM_MAX_RULES) { return -1; }
+      g->rules[g->count++] = mpc_new(name);
+      start = 0;
+    } else {
+      if (!isspace((unsigned char)*s)) { start = 0; }
+      s++;
+    }
+  }
+  return start ? g->count : -2;
+}
+
+/* convert a parse tree into nested Q-Expressions, each node becoming
+   {tag contents children...} */
+lval* lgram_ast(mpc_ast_t* t) {
+  lval* x = lval_qexpr();
+  lval_add(x, lval_str(t->tag));
+  lval_add(x, lval_str(t->contents));
+  for (int i = 0; i < t->children_num; i++) {
+    lval_add(x, lgram_ast(t->children[i]));
+  }
+  return x;
+}
+
+lval* lval_gram(lgram* g) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_GRAMMAR;
+  v->gram = g;
+  return v;
+}
+
+/* (grammar src) compiles the rules of a grammar, in the language of
+   mpca_lang, into a grammar which can then parse any number of inputs */
+lval* builtin_grammar(lenv* e, lval* a) {
+  LASSERT_NUM("grammar", a, 1);
+  LASSERT_TYPE("grammar", a, 0, LVAL_STR);
+
+  lgram* g = calloc(1, sizeof(lgram));
+  g->refs = 1;
+  char* src = lval_cstr(a->cell[0]);
+  int n = lgram_rules(g, src);
+  if (n <= 0) {
+    lgram_release(g);
+    lval_del(a);
+    return n == -1 ? lval_err("function 'grammar' passed more than %i rules.", LGRAM_MAX_RULES)
+         : n == -2 ? lval_err("function 'grammar' passed a rule missing its ';'.")
+         : lval_err("function 'grammar' passed no rules.");
+  }
+
+  mpc_parser_t** r = g->rules;
+  mpc_err_t* err = mpca_lang(MPCA_LANG_DEFAULT, src,
+    r[0],  r[1],  r[2],  r[3],  r[4],  r[5],  r[6],  r[7],
+    r[8],  r[9],  r[10], r[11], r[12], r[13], r[14], r[15],
+    r[16], r[17], r[18], r[19], r[20], r[21], r[22], r[23],
+    r[24], r[25], r[26], r[27], r[28], r[29], r[30], r[31], NULL);
+  if (err) {
+    char* msg = mpc_err_string(err);
+    mpc_err_delete(err);
+    lgram_chomp(msg);
+    lval* x = lval_err("function 'grammar' passed invalid grammar. %s", msg);
+    free(msg);
+    lgram_release(g);
+    lval_del(a);
+    return x;
+  }
+  for (int i = 0; i < n; i++) { mpc_optimise(g->rules[i]); }
+  g->total = mpca_total(g->rules[0]);
+  mpc_optimise(g->total);
+
+  lval_del(a);
+  return lval_gram(g);
+}
+
+/* turn the result of a parse into a tree of Q-Expressions or an error */
+lval* lgram_result(char* func, int ok, mpc_result_t* r) {
+  if (!ok) {
+    char* msg = mpc_err_string(r->error);
+    mpc_err_delete(r->error);
+    lgram_chomp(msg);
+    lval* x = lval_err("function '%s' could not parse input. %s", func, msg);
+    free(msg);
+    return x;
+  }
+  lval* x = lgram_ast(r->output);
+  mpc_ast_delete(r->output);
+  return x;
+}
+
+/* (parse g s), the parse tree of a string, all of which must match
+   the first rule of g */
+lval* builtin_parse(lenv* e, lval* a) {
+  LASSERT_NUM("parse", a, 2);
+  LASSERT_TYPE("parse", a, 0, LVAL_GRAMMAR);
+  LASSERT_TYPE("parse", a, 1, LVAL_STR);
+
+  mpc_result_t r;
+  int ok = mpc_parse("<string>", lval_cstr(a->cell[1]), a->cell[0]->gram->total, &r);
+  lval_del(a);
+  return lgram_result("parse", ok, &r);
+}
+
+/* (parse-file g filename), the parse tree of the contents of a file */
+lval* builtin_parse_file(lenv* e, lval* a) {
+  LASSERT_NUM("parse-file", a, 2);
+  LASSERT_TYPE("parse-file", a, 0, LVAL_GRAMMAR);
+  LASSERT_TYPE("parse-file", a, 1, LVAL_STR);
+
+  mpc_result_t r;
+  int ok = mpc_parse_contents(lval_cstr(a->cell[1]), a->cell[0]->gram->total, &r);
+  lval_del(a);
+  return lgram_result("parse-file", ok, &r);
+}
+
+/* a single cached call, linked into both its hash
+   bucket and the least-recently-used ordering */
+typedef struct lmemo_entry {
+  unsigned long hash;
+  lval* args;
+  lval* result;
+  struct lmemo_entry* next;
+  struct lmemo_entry* newer;
+  struct lmemo_entry* older;
+} lmemo_entry;
+
+/* result cache for a memoized function. shared, reference
+   counted, between every copy of the memoized function */
+struct lmemo {
+  int refs;
+  /* the wrapped function */
+  lval* fun;
+  /* maximum and current number of cached calls */
+  int cap;
+  int count;
+  /* hash buckets, always a power of two in size, grown as entries are
+     added until there are as many buckets as the cap allows */
+  int nbuckets;
+  lmemo_entry** buckets;
+  /* least-recently-used list, oldest entries are evicted first */
+  lmemo_entry* newest;
+  lmemo_entry* oldest;
+  /* statistics reported by memo-stats */
+  long hits;
+  long misses;
+  long evictions;
+};
+
+/* default number of calls remembered by a memoized function */
+#define LMEMO_DEFAULT_CAP 4096
+
+lmemo* lmemo_new(lval* fun, int cap) {
+  lmemo* m = malloc(sizeof(lmemo));
+  m->refs = 1;
+  m->fun = fun;
+  m->cap = cap;
+  m->count = 0;
+  m->nbuckets = 16;
+  m->buckets = calloc(m->nbuckets, sizeof(lmemo_entry*));
+  m->newest = NULL;
+  m->oldest = NULL;
+  m->hits = 0;
+  m->misses = 0;
+  m->evictions = 0;
+  return m;
+}
+
+lmemo* lmemo_retain(lmemo* m) {
+  m->refs++;
+  return m;
+}
+
+/* delete the cache once the last function referencing it is deleted */
+void lmemo_release(lmemo* m) {
+  if (--m->refs > 0) { return; }
+  lmemo_entry* x = m->newest;
+  while (x) {
+    lmemo_entry* older = x->older;
+    lval_del(x->args);
+    lval_del(x->result);
+    free(x);
+    x = older;
+  }
+  free(m->buckets);
+  lval_del(m->fun);
+  free(m);
+}
+
+/* unlink an entry from the least-recently-used list */
+void lmemo_unlink(lmemo* m, lmemo_entry* x) {
+  if (x->newer) { x->newer->older = x->older; } else { m->newest = x->older; }
+  if (x->older) { x->older->newer = x->newer; } else { m->oldest = x->newer; }
+}
+
+/* link an entry in as the most recently used */
+void lmemo_push(lmemo* m, lmemo_entry* x) {
+  x->newer = NULL;
+  x->older = m->newest;
+  if (m->newest) { m->newest->newer = x; } else { m->oldest = x; }
+  m->newest = x;
+}
+
+/* find the cached result for a list of arguments, or NULL */
+lmemo_entry* lmemo_find(lmemo* m, lval* a, unsigned long hash) {
+  lmemo_entry* x = m->buckets[hash & (m->nbuckets-1)];
+  while (x) {
+    if (x->hash == hash && lval_eq(x->args, a)) { return x; }
+    x = x->next;
+  }
+  return NULL;
+}
+
+/* remove the least recently used entry from the cache */
+void lmemo_evict(lmemo* m) {
+  lmemo_entry* x = m->oldest;
+  lmemo_entry** p = &m->buckets[x->hash & (m->nbuckets-1)];
+  while (*p != x) { p = &(*p)->next; }
+  *p = x->next;
+  lmemo_unlink(m, x);
+  lval_del(x->args);
+  lval_del(x->result);
+  free(x);
+  m->count--;
+  m->evictions++;
+}
+
+/* double the hash buckets, relinking every entry through the
+   least-recently-used list */
+void lmemo_grow(lmemo* m) {
+  m->nbuckets *= 2;
+  free(m->buckets);
+  m->buckets = calloc(m->nbuckets, sizeof(lmemo_entry*));
+  for (lmemo_entry* x = m->newest; x; x = x->older) {
+    x->next = m->buckets[x->hash & (m->nbuckets-1)];
+    m->buckets[x->hash & (m->nbuckets-1)] = x;
+  }
+}
+
+/* forward declare function calls for use in calling the wrapped function */
+lval* lval_call(lenv* e, lval* f, lval* a);
+
+/* call a memoized function, answering from the cache when possible */
+lval* lmemo_call(lenv* e, lmemo* m, lval* a) {
+  a->type = LVAL_SEXPR;
+  unsigned long hash = lval_hash(a);
+
+  lmemo_entry* x = lmemo_find(m, a, hash);
+  if (x) {
+    m->hits++;
+    lmemo_unlink(m, x);
+    lmemo_push(m, x);
+    lval_del(a);
+    return lval_copy(x->result);
+  }
+  m->misses++;
+
+  /* calling consumes both the arguments and the function, so keep
+     a copy of the arguments to use as the key */
+  lval* args = lval_copy(a);
+  lval* f = lval_copy(m->fun);
+  lval* r = lval_call(e, f, a);
+  lval_del(f);
+
+  /* errors are not remembered, and recursive calls may have
+     filled in the same arguments while evaluating this one */
+  if (r->type == LVAL_ERR || lmemo_find(m, args, hash)) {
+    lval_del(args);
+    return r;
+  }
+
+  if (m->count == m->cap) { lmemo_evict(m); }
+  if (m->count == m->nbuckets && m->nbuckets < m->cap) { lmemo_grow(m); }
+  x = malloc(sizeof(lmemo_entry));
+  x->hash = hash;
+  x->args = args;
+  x->result = lval_copy(r);
+  x->next = m->buckets[hash & (m->nbuckets-1)];
+  m->buckets[hash & (m->nbuckets-1)] = x;
+  lmemo_push(m, x);
+  m->count++;
+  return r;
+}
+
+/* wrap a pure function in a cache keyed on its arguments */
+lval* builtin_memo(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+    "function memo passed incorrect number of arguments. "
+    "got %i, expected 1 or 2", a->count);
+  LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+
+  int cap = LMEMO_DEFAULT_CAP;
+  if (a->count == 2) {
+    LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+    LASSERT(a, a->cell[1]->num > 0 && a->cell[1]->num <= (1 << 24),
+            "function memo passed invalid cache size %li.", a->cell[1]->num);
+    cap = a->cell[1]->num;
+  }
+
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_FUN;
+  v->builtin = NULL;
+  v->opt = NULL;
+  v->memo = lmemo_new(lval_pop(a, 0), cap);
+  lval_del(a);
+  return v;
+}
+
+/* report {hits misses size evictions} for a memoized function */
+lval* builtin_memo_stats(lenv* e, lval* a) {
+  LASSERT_NUM("memo-stats", a, 1);
+  LASSERT_TYPE("memo-stats", a, 0, LVAL_FUN);
+  LASSERT(a, a->cell[0]->memo != NULL,
+          "function memo-stats passed a function which is not memoized.");
+
+  lmemo* m = a->cell[0]->memo;
+  lval* x = lval_qexpr();
+  lval_add(x, lval_num(m->hits));
+  lval_add(x, lval_num(m->misses));
+  lval_add(x, lval_num(m->count));
+  lval_add(x, lval_num(m->evictions));
+  lval_del(a);
+  return x;
+}
+
+/* the item at index i of a list as first gives it, which evaluates
+   the item on its own as an expression */
+lval* llist_item(lenv* e, lval* l, int i) {
+  if (l->packed) { return lval_num(l->packed[i]); }
+  return lval_eval(e, lval_copy(l->cell[i]));
+}
+
+/* call a function with the given arguments. calling binds the
+   formals of the function it is given, so it works on a copy */
+lval* llist_apply(lenv* e, lval* f, lval* args) {
+  lval* g = lval_copy(f);
+  lval* r = lrecur_escaped(lval_call(e, g, args));
+  lval_del(g);
+  return r;
+}
+
+/* lazy sequences are pipelines of stages, each an immutable node
+   shared by every copy of the sequence. nothing is computed until a
+   consumer such as realize, foldl or sum walks the pipeline with an
+   iterator, which holds all of the mutable state and pulls one item
+   at a time through every stage */
+enum { LSEQ_RANGE, LSEQ_LIST, LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE, LSEQ_DROP,
+       LSEQ_LINES };
+
+struct lseq {
+  int refs;
+  int kind;
+  /* set if walking the sequence would never end */
+  int infinite;
+  /* for ranges the first item, the step and the bound to stop
+     before. for take and drop, the count in start */
+  long start;
+  long step;
+  long end;
+  /* the list or vector of a list source, or the function of a map
+     or filter stage */
+  lval* val;
+  /* the mapped file of a lines source */
+  lmap* map;
+  /* the stage items are pulled from */
+  lseq* src;
+  /* set for a stage put in place of map or filter by fusion */
+  int fused;
+};
+
+/* a stage is built on top of src, taking over the reference to it */
+lseq* lseq_new(int kind, lseq* src) {
+  lseq* s = calloc(1, sizeof(lseq));
+  s->refs = 1;
+  s->kind = kind;
+  s->src = src;
+  s->infinite = src && src->infinite;
+  return s;
+}
+
+lseq* lseq_retain(lseq* s) {
+  s->refs++;
+  return s;
+}
+
+void lseq_release(lseq* s) {
+  while (s && --s->refs == 0) {
+    lseq* src = s->src;
+    if (s->val) { lval_del(s->val); }
+    if (s->map) { lmap_release(s->map); }
+    free(s);
+    s = src;
+  }
+}
+
+int lseq_eq(lseq* x, lseq* y) {
+  if (x == y) { return 1; }
+  if (!x || !y) { return 0; }
+  return x->kind == y->kind && x->infinite == y->infinite
+    && x->start == y->start && x->step == y->step && x->end == y->end
+    && (x->val ? y->val && lval_eq(x->val, y->val) : !y->val)
+    && x->map == y->map
+    && lseq_eq(x->src, y->src);
+}
+
+unsigned long lseq_hash(lseq* s) {
+  unsigned long h = 0;
+  for (; s; s = s->src) {
+    h = lhash_mix(h ^ (unsigned long)s->kind);
+    h = lhash_mix(h ^ (unsigned long)s->start);
+    h = lhash_mix(h ^ (unsigned long)s->step ^ ((unsigned long)s->end << 1));
+    if (s->val) { h = lhash_mix(h ^ lval_hash(s->val)); }
+    if (s->map) { h = lhash_mix(h ^ (unsigned long)s->map); }
+  }
+  return h;
+}
+
+lval* lval_seq(lseq* s) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_SEQ;
+  v->seq = s;
+  return v;
+}
+
+/* the position of a walk through one stage of a sequence */
+typedef struct lseq_iter {
+  lseq* s;
+  /* the next item of a range, the index into a list, the offset of
+     the next line of a file, or the number of items taken or dropped
+     so far */
+  long i;
+  /* set once a finite range has stepped past the largest long */
+  int done;
+  /* the next item of an infinite range once it has stepped past the
+     largest long, as a big number */
+  lval* big;
+  struct lseq_iter* src;
+} lseq_iter;
+
+lseq_iter* lseq_iter_new(lseq* s) {
+  lseq_iter* it = malloc(sizeof(lseq_iter));
+  it->s = s;
+  it->i = s->kind == LSEQ_RANGE ? s->start : 0;
+  it->done = 0;
+  it->big = NULL;
+  it->src = s->src ? lseq_iter_new(s->src) : NULL;
+  return it;
+}
+
+void lseq_iter_del(lseq_iter* it) {
+  while (it) {
+    lseq_iter* src = it->src;
+    if (it->big) { lval_del(it->big); }
+    free(it);
+    it = src;
+  }
+}
+
+/* has a walk through a range passed its end */
+int lseq_range_end(lseq_iter* it) {
+  lseq* s = it->s;
+  return it->done
+    || (!s->infinite && (s->step > 0 ? it->i >= s->end : it->i <= s->end));
+}
+
+/* move a walk through a range on by its step. a finite range is done
+   once it steps past the largest or smallest long, as its end lies
+   within them, but an infinite one carries on in big numbers */
+void lseq_range_step(lenv* e, lseq_iter* it) {
+  lseq* s = it->s;
+  if (!it->big) {
+    long i = it->i;
+    if (!__builtin_add_overflow(i, s->step, &it->i)) { return; }
+    if (!s->infinite) {
+      it->done = 1;
+      return;
+    }
+    it->big = lval_num(i);
+  }
+  lval* a = lval_add(lval_sexpr(), it->big);
+  it->big = builtin_add(e, lval_add(a, lval_num(s->step)));
+}
+
+lval* lseq_next(lenv* e, lseq_iter* it);
+
+/* move a walk over the lines of a file past the next one, pointing
+   line at its first byte. returns its length without the newline, or
+   -1 at the end of the file */
+long lseq_line(lseq_iter* it, char** line) {
+  lmap* m = it->s->map;
+  if ((size_t)it->i >= m->len) { return -1; }
+  char* p = m->data + it->i;
+  size_t left = m->len - it->i;
+  /* as in lstr_find, memchr is the vectorized search for one byte */
+  char* nl = memchr(p, '\n', left);
+  long n = nl ? nl - p : (long)left;
+  it->i += n + (nl != NULL);
+  lmap_advance(m, it->i);
+  *line = p;
+  return n;
+}
+
+/* move past the next item of a sequence, without computing it where
+   no stage needs to see it. returns 0 at the end, or if computing
+   the item failed, with the error put in err */
+int lseq_skip(lenv* e, lseq_iter* it, lval** err) {
+  lseq* s = it->s;
+  switch (s->kind) {
+    case LSEQ_RANGE:
+      if (lseq_range_end(it)) { return 0; }
+      lseq_range_step(e, it);
+      return 1;
+    case LSEQ_LIST:
+      if (it->i >= s->val->count) { return 0; }
+      it->i++;
+      return 1;
+    case LSEQ_LINES: {
+      char* line;
+      return lseq_line(it, &line) >= 0;
+    }
+    /* maps give one item for each item of their source */
+    case LSEQ_MAP:
+      return lseq_skip(e, it->src, err);
+    case LSEQ_TAKE:
+      if (it->i >= s->start) { return 0; }
+      it->i++;
+      return lseq_skip(e, it->src, err);
+  }
+
+  /* filters have to see the item to know whether it counts */
+  lval* x = lseq_next(e, it);
+  if (!x) { return 0; }
+  if (x->type == LVAL_ERR) {
+    *err = x;
+    return 0;
+  }
+  lval_del(x);
+  return 1;
+}
+
+/* pull the next item through a sequence. returns NULL at the end, or
+   an error if computing the item failed */
+lval* lseq_next(lenv* e, lseq_iter* it) {
+  lseq* s = it->s;
+  lval* x;
+  switch (s->kind) {
+    case LSEQ_RANGE:
+      if (lseq_range_end(it)) { return NULL; }
+      x = it->big ? lval_copy(it->big) : lval_num(it->i);
+      lseq_range_step(e, it);
+      return x;
+
+    case LSEQ_LIST:
+      if (it->i >= s->val->count) { return NULL; }
+      if (s->val->type == LVAL_VEC) {
+        x = s->val->dvec ? lval_dbl(s->val->dvec[it->i])
+                         : lval_num(s->val->ivec[it->i]);
+        it->i++;
+        return x;
+      }
+      return llist_item(e, s->val, it->i++);
+
+    case LSEQ_LINES: {
+      char* line;
+      long n = lseq_line(it, &line);
+      if (n < 0) { return NULL; }
+      if (n > INT_MAX) { return lval_err("file has a line that is too long."); }
+      return lval_str_view(s->map, line, n);
+    }
+
+    case LSEQ_MAP:
+      x = lseq_next(e, it->src);
+      if (!x || x->type == LVAL_ERR) { return x; }
+      return llist_apply(e, s->val, lval_add(lval_sexpr(), x));
+
+    case LSEQ_FILTER:
+      while ((x = lseq_next(e, it->src)) && x->type != LVAL_ERR) {
+        lval* keep = llist_apply(e, s->val, lval_add(lval_sexpr(), lval_copy(x)));
+        if (keep->type != LVAL_NUM) {
+          lval* err = keep->type == LVAL_ERR ? keep : lval_err(
+            "function '%s' passed a function returning %s, expected %s.",
+            s->fused ? "filter" : "lazy-filter",
+            ltype_name(keep->type), ltype_name(LVAL_NUM));
+          if (err != keep) { lval_del(keep); }
+          lval_del(x);
+          return err;
+        }
+        int kept = keep->num != 0;
+        lval_del(keep);
+        if (kept) { return x; }
+        lval_del(x);
+      }
+      return x;
+
+    case LSEQ_TAKE:
+      if (it->i >= s->start) { return NULL; }
+      it->i++;
+      return lseq_next(e, it->src);
+
+    case LSEQ_DROP:
+      while (it->i < s->start) {
+        it->i++;
+        lval* err = NULL;
+        if (!lseq_skip(e, it->src, &err)) { return err; }
+      }
+      return lseq_next(e, it->src);
+  }
+  return NULL;
+}
+
+/* fold every item of a sequence into acc, which is consumed, either by
+   calling f or, when f is NULL, with an arithmetic kernel. plain
+   numbers are combined in place while they fit in a long */
+lval* lseq_fold(lenv* e, lseq* s, lval* acc, lval* f, char* op, lkernel kernel) {
+  lseq_iter* it = lseq_iter_new(s);
+  lval* x;
+  while (acc->type != LVAL_ERR && (x = lseq_next(e, it))) {
+    if (x->type == LVAL_ERR) {
+      lval_del(acc);
+      acc = x;
+      break;
+    }
+    if (!f && acc->type == LVAL_NUM && x->type == LVAL_NUM) {
+      long r;
+      int overflow = kernel == lkernel_add
+        ? __builtin_add_overflow(acc->num, x->num, &r)
+        : __builtin_mul_overflow(acc->num, x->num, &r);
+      if (!overflow) {
+        acc->num = r;
+        lval_del(x);
+        continue;
+      }
+    }
+    lval* args = lval_sexpr();
+    lval_add(args, acc);
+    lval_add(args, x);
+    acc = f ? llist_apply(e, f, args) : builtin_op(e, args, op, kernel);
+  }
+  lseq_iter_del(it);
+  return acc;
+}
+
+/* check that a sequence argument can be walked to its end */
+#define LASSERT_FINITE(func, args, index) \
+  LASSERT(args, !args->cell[index]->seq->infinite, \
+          "function '%s' passed an infinite sequence for argument %i.", \
+          func, index)
+
+/* cut a list down to its first n items, in place */
+lval* llist_truncate(lval* l, int n) {
+  if (!l->packed) {
+    for (int i = n; i < l->count; i++) { lval_del(l->cell[i]); }
+  }
+  l->count = n;
+  return l;
+}
+
+/* remove the first n items of a list, in place */
+lval* llist_drop(lval* l, int n) {
+  /* an empty list may have no cells to move at all */
+  if (n == 0 || l->count == 0) { return l; }
+  if (l->packed) {
+    memmove(l->packed, l->packed + n, sizeof(long) * (l->count - n));
+  } else {
+    for (int i = 0; i < n; i++) { lval_del(l->cell[i]); }
+    memmove(l->cell, l->cell + n, sizeof(lval*) * (l->count - n));
+  }
+  l->count -= n;
+  return l;
+}
+
+/* check the count argument of take, drop or split */
+#define LASSERT_COUNT(func, args) \
+  LASSERT(args, args->cell[0]->num >= 0 \
+          && args->cell[0]->num <= args->cell[1]->count, \
+          "function '%s' passed count %li out of range for length %i.", \
+          func, args->cell[0]->num, args->cell[1]->count)
+
+/* the list builtins were once functions in the standard library, and
+   take partial application as those did. given fewer arguments than
+   it takes, a builtin returns a lambda waiting for the rest. its
+   formals can't be written as symbols, so nothing evaluated by the
+   builtin can see them through the dynamic scope */
+lval* lbuiltin_partial(lenv* e, lbuiltin f, lval* a, int n) {
+  if (a->count == 0) { lval_del(a); return lval_builtin(f); }
+  lval* formals = lval_qexpr();
+  lval* body = lval_add(lval_qexpr(), lval_builtin(f));
+  for (int i = 0; i < n; i++) {
+    char name[16];
+    snprintf(name, sizeof(name), "%%%i", i);
+    lval_add(formals, lval_sym(name));
+    lval_add(body, lval_sym(name));
+  }
+  lval* g = lval_lambda(formals, body);
+  lval* r = lval_call(e, g, a);
+  lval_del(g);
+  return r;
+}
+
+/* hand a call given too few arguments to lbuiltin_partial */
+#define LPARTIAL(builtin, args, num) \
+  if (args->count < num) { return lbuiltin_partial(e, builtin, args, num); }
+
+lval* builtin_len(lenv* e, lval* a) {
+  LPARTIAL(builtin_len, a, 1);
+  LASSERT_NUM("len", a, 1);
+  LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
+
+  lval* r = lval_num(a->cell[0]->count);
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+  LPARTIAL(builtin_nth, a, 2);
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  LASSERT_TYPE("nth", a, 1, LVAL_QEXPR);
+
+  long i = a->cell[0]->num;
+  LASSERT(a, i >= 0 && i < a->cell[1]->count,
+          "function 'nth' passed index %li out of range for length %i.",
+          i, a->cell[1]->count);
+  lval* r = llist_item(e, a->cell[1], i);
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_last(lenv* e, lval* a) {
+  LPARTIAL(builtin_last, a, 1);
+  LASSERT_NUM("last", a, 1);
+  LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("last", a, 0);
+
+  lval* r = llist_item(e, a->cell[0], a->cell[0]->count - 1);
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+  LPARTIAL(builtin_take, a, 2);
+  LASSERT_NUM("take", a, 2);
+  LASSERT_TYPE("take", a, 0, LVAL_NUM);
+  LASSERT_TYPE("take", a, 1, LVAL_QEXPR);
+  LASSERT_COUNT("take", a);
+
+  int n = a->cell[0]->num;
+  return llist_truncate(lval_take(a, 1), n);
+}
+
+lval* builtin_drop(lenv* e, lval* a) {
+  LPARTIAL(builtin_drop, a, 2);
+  LASSERT_NUM("drop", a, 2);
+  LASSERT_TYPE("drop", a, 0, LVAL_NUM);
+  LASSERT_TYPE("drop", a, 1, LVAL_QEXPR);
+  LASSERT_COUNT("drop", a);
+
+  int n = a->cell[0]->num;
+  return llist_drop(lval_take(a, 1), n);
+}
+
+/* split a list at index n into {first-n-items rest} */
+lval* builtin_split(lenv* e, lval* a) {
+  LPARTIAL(builtin_split, a, 2);
+  LASSERT_NUM("split", a, 2);
+  LASSERT_TYPE("split", a, 0, LVAL_NUM);
+  LASSERT_TYPE("split", a, 1, LVAL_QEXPR);
+  LASSERT_COUNT("split", a);
+
+  int n = a->cell[0]->num;
+  lval* rest = lval_take(a, 1);
+  lval* front = llist_truncate(lval_copy(rest), n);
+  lval* r = lval_qexpr();
+  lval_add(r, front);
+  lval_add(r, llist_drop(rest, n));
+  return r;
+}
+
+lval* builtin_contains(lenv* e, lval* a) {
+  LPARTIAL(builtin_contains, a, 2);
+  LASSERT_NUM("contains", a, 2);
+  LASSERT_TYPE("contains", a, 1, LVAL_QEXPR);
+
+  lval* x = a->cell[0];
+  lval* l = a->cell[1];
+  int found = 0;
+  if (l->packed && x->type == LVAL_NUM) {
+    for (int i = 0; i < l->count && !found; i++) {
+      found = l->packed[i] == x->num;
+    }
+  } else {
+    for (int i = 0; i < l->count && !found; i++) {
+      lval* y = llist_item(e, l, i);
+      if (y->type == LVAL_ERR) { lval_del(a); return y; }
+      found = lval_same(x, y);
+      lval_del(y);
+    }
+  }
+  lval_del(a);
+  return lval_num(found);
+}
+
+/* apply a function to each item of a list */
+lval* builtin_map(lenv* e, lval* a) {
+  LPARTIAL(builtin_map, a, 2);
+  LASSERT_NUM("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUN);
+  LASSERT_TYPE("map", a, 1, LVAL_QEXPR);
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  lval* r = lval_qexpr();
+  for (int i = 0; i < l->count; i++) {
+    lval* y = llist_item(e, l, i);
+    if (y->type != LVAL_ERR) {
+      y = llist_apply(e, f, lval_add(lval_sexpr(), y));
+    }
+    if (y->type == LVAL_ERR) {
+      lval_del(r); lval_del(a);
+      return y;
+    }
+    lval_add(r, y);
+  }
+  lval_del(a);
+  return r;
+}
+
+/* keep the items of a list for which a function returns true. the
+   list is owned by the call, so it is compacted in place */
+lval* builtin_filter(lenv* e, lval* a) {
+  LPARTIAL(builtin_filter, a, 2);
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+  LASSERT_TYPE("filter", a, 1, LVAL_QEXPR);
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[1];
+  int kept = 0;
+  for (int i = 0; i < l->count; i++) {
+    lval* y = llist_item(e, l, i);
+    if (y->type != LVAL_ERR) {
+      y = llist_apply(e, f, lval_add(lval_sexpr(), y));
+    }
+    if (y->type != LVAL_NUM) {
+      lval* err = y->type == LVAL_ERR ? y : lval_err(
+        "function 'filter' passed a function returning %s, expected %s.",
+        ltype_name(y->type), ltype_name(LVAL_NUM));
+      if (err != y) { lval_del(y); }
+      /* the items already moved down are all that's left to free */
+      if (!l->packed) {
+        for (int j = i; j < l->count; j++) { lval_del(l->cell[j]); }
+      }
+      l->count = kept;
+      lval_del(a);
+      return err;
+    }
+
+    int keep = y->num != 0;
+    lval_del(y);
+    if (l->packed) {
+      if (keep) { l->packed[kept++] = l->packed[i]; }
+    } else if (keep) {
+      l->cell[kept++] = l->cell[i];
+    } else {
+      lval_del(l->cell[i]);
+    }
+  }
+  l->count = kept;
+  return lval_take(a, 1);
+}
+
+/* fold the items of a list into an accumulator, from the left */
+lval* builtin_foldl(lenv* e, lval* a) {
+  LPARTIAL(builtin_foldl, a, 3);
+  LASSERT_NUM("foldl", a, 3);
+  LASSERT_TYPE("foldl", a, 0, LVAL_FUN);
+  if (a->cell[2]->type == LVAL_SEQ) {
+    LASSERT_FINITE("foldl", a, 2);
+    lval* acc = lval_pop(a, 1);
+    lval* r = lseq_fold(e, a->cell[1]->seq, acc, a->cell[0], NULL, NULL);
+    lval_del(a);
+    return r;
+  }
+  LASSERT_TYPE("foldl", a, 2, LVAL_QEXPR);
+
+  lval* f = a->cell[0];
+  lval* l = a->cell[2];
+  lval* acc = lval_pop(a, 1);
+  for (int i = 0; i < l->count && acc->type != LVAL_ERR; i++) {
+    lval* y = llist_item(e, l, i);
+    if (y->type == LVAL_ERR) {
+      lval_del(acc);
+      acc = y;
+      break;
+    }
+    lval* args = lval_sexpr();
+    lval_add(args, acc);
+    lval_add(args, y);
+    acc = llist_apply(e, f, args);
+  }
+  lval_del(a);
+  return acc;
+}
+
+/* add or multiply together every item of a list or sequence. a packed
+   list is reduced directly, anything else, or an overflow, goes
+   through the arithmetic builtins starting from the identity */
+lval* builtin_list_reduce(lenv* e, lval* a, char* func, char* op,
+                          lkernel kernel, long identity) {
+  LASSERT_NUM(func, a, 1);
+  if (a->cell[0]->type == LVAL_SEQ) {
+    LASSERT_FINITE(func, a, 0);
+    lval* r = lseq_fold(e, a->cell[0]->seq, lval_num(identity), NULL, op, kernel);
+    lval_del(a);
+    return r;
+  }
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+
+  lval* l = a->cell[0];
+  if (l->packed) {
+    long r = identity;
+    int overflow = 0;
+    if (kernel == lkernel_add) {
+      overflow = lvec_k->isum(&r, l->packed, l->count);
+    } else {
+      for (int i = 0; i < l->count && !overflow; i++) {
+        overflow = __builtin_mul_overflow(r, l->packed[i], &r);
+      }
+    }
+    if (!overflow) {
+      lval_del(a);
+      return lval_num(r);
+    }
+  }
+
+  lval* args = lval_add(lval_sexpr(), lval_num(identity));
+  for (int i = 0; i < l->count; i++) {
+    lval* y = llist_item(e, l, i);
+    if (y->type == LVAL_ERR) {
+      lval_del(args); lval_del(a);
+      return y;
+    }
+    lval_add(args, y);
+  }
+  lval_del(a);
+  return builtin_op(e, args, op, kernel);
+}
+
+lval* builtin_sum(lenv* e, lval* a) {
+  LPARTIAL(builtin_sum, a, 1);
+  return builtin_list_reduce(e, a, "sum", "+", lkernel_add, 0);
+}
+
+lval* builtin_product(lenv* e, lval* a) {
+  LPARTIAL(builtin_product, a, 1);
+  return builtin_list_reduce(e, a, "product", "*", lkernel_mul, 1);
+}
+
+/* the sequence of a sequence, list or vector argument, which is
+   taken out of the arguments */
+lseq* lseq_of(lval* a, int i) {
+  lval* v = lval_pop(a, i);
+  if (v->type == LVAL_SEQ) {
+    lseq* s = lseq_retain(v->seq);
+    lval_del(v);
+    return s;
+  }
+  lseq* s = lseq_new(LSEQ_LIST, NULL);
+  s->val = v;
+  return s;
+}
+
+/* check that an argument can be read as a sequence */
+#define LASSERT_SEQ(func, args, index) \
+  LASSERT(args, args->cell[index]->type == LVAL_SEQ \
+          || args->cell[index]->type == LVAL_QEXPR \
+          || args->cell[index]->type == LVAL_VEC, \
+    "function '%s' passed incorrect type for argument %i. got %s, expected %s.", \
+          func, index, ltype_name(args->cell[index]->type), ltype_name(LVAL_SEQ))
+
+/* (range end), (range start end) or (range start end step), the
+   numbers from start up to but not including end */
+lval* builtin_range(lenv* e, lval* a) {
+  LASSERT(a, a->count >= 1 && a->count <= 3,
+          "function range passed incorrect number of arguments. "
+          "got %i, expected 1 to 3", a->count);
+  for (int i = 0; i < a->count; i++) { LASSERT_TYPE("range", a, i, LVAL_NUM); }
+
+  lseq* s = lseq_new(LSEQ_RANGE, NULL);
+  s->start = a->count == 1 ? 0 : a->cell[0]->num;
+  s->end = a->cell[a->count == 1 ? 0 : 1]->num;
+  s->step = a->count == 3 ? a->cell[2]->num : 1;
+  lval_del(a);
+  if (s->step == 0) {
+    lseq_release(s);
+    return lval_err("function 'range' passed a step of zero.");
+  }
+  return lval_seq(s);
+}
+
+/* (range-from start) or (range-from start step), counting forever */
+lval* builtin_range_from(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+          "function range-from passed incorrect number of arguments. "
+          "got %i, expected 1 or 2", a->count);
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("range-from", a, i, LVAL_NUM);
+  }
+
+  lseq* s = lseq_new(LSEQ_RANGE, NULL);
+  s->infinite = 1;
+  s->start = a->cell[0]->num;
+  s->step = a->count == 2 ? a->cell[1]->num : 1;
+  lval_del(a);
+  return lval_seq(s);
+}
+
+/* a lazy sequence over the items of a list or vector */
+lval* builtin_lazy(lenv* e, lval* a) {
+  LASSERT_NUM("lazy", a, 1);
+  LASSERT_SEQ("lazy", a, 0);
+
+  lval* r = lval_seq(lseq_of(a, 0));
+  lval_del(a);
+  return r;
+}
+
+/* a map or filter stage calling a function on every item */
+lval* builtin_lazy_call(lenv* e, lval* a, char* func, int kind) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  LASSERT_SEQ(func, a, 1);
+
+  lseq* s = lseq_new(kind, lseq_of(a, 1));
+  s->val = lval_take(a, 0);
+  return lval_seq(s);
+}
+
+lval* builtin_lazy_map(lenv* e, lval* a) {
+  return builtin_lazy_call(e, a, "lazy-map", LSEQ_MAP);
+}
+
+lval* builtin_lazy_filter(lenv* e, lval* a) {
+  return builtin_lazy_call(e, a, "lazy-filter", LSEQ_FILTER);
+}
+
+/* a stage put in place of a call to map or filter by fusion. it
+   checks its arguments as that builtin does, taking the list it was
+   passed or else the stage fused before it, and reports errors under
+   that builtin's name */
+lval* builtin_fused_call(lenv* e, lval* a, char* func, int kind) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  if (a->cell[1]->type != LVAL_SEQ || !a->cell[1]->seq->fused) {
+    LASSERT_TYPE(func, a, 1, LVAL_QEXPR);
+  }
+
+  lval* r = builtin_lazy_call(e, a, func, kind);
+  r->seq->fused = 1;
+  return r;
+}
+
+lval* builtin_fused_map(lenv* e, lval* a) {
+  return builtin_fused_call(e, a, "map", LSEQ_MAP);
+}
+
+lval* builtin_fused_filter(lenv* e, lval* a) {
+  return builtin_fused_call(e, a, "filter", LSEQ_FILTER);
+}
+
+/* a take or drop stage counting off the first n items */
+lval* builtin_lazy_count(lenv* e, lval* a, char* func, int kind) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_NUM);
+  LASSERT_SEQ(func, a, 1);
+  LASSERT(a, a->cell[0]->num >= 0,
+          "function '%s' passed negative count %li.", func, a->cell[0]->num);
+
+  lseq* s = lseq_new(kind, lseq_of(a, 1));
+  s->start = a->cell[0]->num;
+  if (kind == LSEQ_TAKE) { s->infinite = 0; }
+  lval_del(a);
+  return lval_seq(s);
+}
+
+lval* builtin_lazy_take(lenv* e, lval* a) {
+  return builtin_lazy_count(e, a, "lazy-take", LSEQ_TAKE);
+}
+
+lval* builtin_lazy_drop(lenv* e, lval* a) {
+  return builtin_lazy_count(e, a, "lazy-drop", LSEQ_DROP);
+}
+
+/* map the file named by argument 0, or put an error in err */
+lmap* lmap_arg(char* func, lval* a, lval** err) {
+  char* name = lval_cstr(a->cell[0]);
+  lmap* m = lmap_open(name);
+  if (!m) {
+    *err = lval_err("function '%s' could not open '%s'. %s", func, name, strerror(errno));
+  }
+  return m;
+}
+
+/* (read-file filename), the contents of a file as a string viewing
+   the mapped file, so nothing is copied until it is changed */
+lval* builtin_read_file(lenv* e, lval* a) {
+  LASSERT_NUM("read-file", a, 1);
+  LASSERT_TYPE("read-file", a, 0, LVAL_STR);
+
+  lval* err = NULL;
+  lmap* m = lmap_arg("read-file", a, &err);
+  lval_del(a);
+  if (!m) { return err; }
+  if (m->len > INT_MAX) {
+    lmap_release(m);
+    return lval_err("function 'read-file' passed a file too long for a string.");
+  }
+  lval* r = m->len ? lval_str_view(m, m->data, m->len) : lval_str("");
+  lmap_release(m);
+  return r;
+}
+
+/* the lines of the file named by argument 0 as a lazy sequence */
+lseq* lseq_lines(char* func, lval* a, lval** err) {
+  lmap* m = lmap_arg(func, a, err);
+  if (!m) { return NULL; }
+  lseq* s = lseq_new(LSEQ_LINES, NULL);
+  s->map = m;
+  return s;
+}
+
+/* (file-lines filename), a lazy sequence of the lines of a file
+   without their newlines, each a string viewing the mapped file */
+lval* builtin_file_lines(lenv* e, lval* a) {
+  LASSERT_NUM("file-lines", a, 1);
+  LASSERT_TYPE("file-lines", a, 0, LVAL_STR);
+
+  lval* err = NULL;
+  lseq* s = lseq_lines("file-lines", a, &err);
+  lval_del(a);
+  return s ? lval_seq(s) : err;
+}
+
+/* (fold-lines f acc filename) folds f over the lines of a file as
+   foldl does, without building a list of them. the pages of the file
+   are handed back as the fold moves through it */
+lval* builtin_fold_lines(lenv* e, lval* a) {
+  LASSERT_NUM("fold-lines", a, 3);
+  LASSERT_TYPE("fold-lines", a, 0, LVAL_FUN);
+  LASSERT_TYPE("fold-lines", a, 2, LVAL_STR);
+
+  lval* err = NULL;
+  lval* f = lval_pop(a, 0);
+  lval* acc = lval_pop(a, 0);
+  lseq* s = lseq_lines("fold-lines", a, &err);
+  lval_del(a);
+  if (!s) {
+    lval_del(f);
+    lval_del(acc);
+    return err;
+  }
+  lval* r = lseq_fold(e, s, acc, f, NULL, NULL);
+  lseq_release(s);
+  lval_del(f);
+  return r;
+}
+
+/* compute every item of a sequence into a q-expression */
+lval* builtin_realize(lenv* e, lval* a) {
+  LASSERT_NUM("realize", a, 1);
+  LASSERT_SEQ("realize", a, 0);
+  if (a->cell[0]->type != LVAL_SEQ) { return lval_take(a, 0); }
+  LASSERT_FINITE("realize", a, 0);
+
+  lval* r = lval_qexpr();
+  lseq_iter* it = lseq_iter_new(a->cell[0]->seq);
+  lval* x;
+  while ((x = lseq_next(e, it))) {
+    if (x->type == LVAL_ERR) {
+      lval_del(r);
+      r = x;
+      break;
+    }
+    lval_add(r, x);
+  }
+  lseq_iter_del(it);
+  lval_del(a);
+  return r;
+}
+
+/* hash maps are open addressed tables with linear probing, shared
+   between every copy of a hash map lval. the persistent builtins copy
+   a table before changing it if anything else shares it, while the
+   ! builtins change it in place for every copy to see */
+typedef struct {
+  unsigned long hash;
+  /* NULL for an empty slot */
+  lval* key;
+  lval* val;
+} ltable_slot;
+
+struct ltable {
+  int refs;
+  int count;
+  /* number of slots, always a power of two */
+  int cap;
+  ltable_slot* slots;
+};
+
+ltable* ltable_new(int cap) {
+  ltable* t = malloc(sizeof(ltable));
+  t->refs = 1;
+  t->count = 0;
+  t->cap = 8;
+  while (t->cap * 3 < cap * 4) { t->cap *= 2; }
+  t->slots = calloc(t->cap, sizeof(ltable_slot));
+  return t;
+}
+
+ltable* ltable_retain(ltable* t) {
+  t->refs++;
+  return t;
+}
+
+/* delete the table once the last hash map referencing it is deleted */
+void ltable_release(ltable* t) {
+  if (--t->refs > 0) { return; }
+  for (int i = 0; i < t->cap; i++) {
+    if (t->slots[i].key) {
+      lval_del(t->slots[i].key);
+      lval_del(t->slots[i].val);
+    }
+  }
+  free(t->slots);
+  free(t);
+}
+
+/* slot holding key, or -1 */
+int ltable_find(ltable* t, lval* key, unsigned long hash) {
+  int mask = t->cap - 1;
+  for (int i = hash & mask; t->slots[i].key; i = (i + 1) & mask) {
+    if (t->slots[i].hash == hash && lval_eq(t->slots[i].key, key)) { return i; }
+  }
+  return -1;
+}
+
+/* place an entry known not to be in the table */
+void ltable_place(ltable* t, unsigned long hash, lval* key, lval* val) {
+  int mask = t->cap - 1;
+  int i = hash & mask;
+  while (t->slots[i].key) { i = (i + 1) & mask; }
+  t->slots[i].hash = hash;
+  t->slots[i].key = key;
+  t->slots[i].val = val;
+  t->count++;
+}
+
+/* set key to val, taking ownership of both. the table is kept
+   at most three quarters full so probe sequences stay short */
+void ltable_put(ltable* t, lval* key, lval* val) {
+  unsigned long hash = lval_hash(key);
+  int i = ltable_find(t, key, hash);
+  if (i >= 0) {
+    lval_del(key);
+    lval_del(t->slots[i].val);
+    t->slots[i].val = val;
+    return;
+  }
+
+  if ((t->count + 1) * 4 > t->cap * 3) {
+    ltable_slot* old = t->slots;
+    int n = t->cap;
+    t->cap *= 2;
+    t->slots = calloc(t->cap, sizeof(ltable_slot));
+    t->count = 0;
+    for (int j = 0; j < n; j++) {
+      if (old[j].key) { ltable_place(t, old[j].hash, old[j].key, old[j].val); }
+    }
+    free(old);
+  }
+  ltable_place(t, hash, key, val);
+}
+
+/* remove key, returning whether it was there. later entries in the
+   same probe run are shifted back over the hole, so lookups never
+   need to step over deleted slots */
+int ltable_remove(ltable* t, lval* key) {
+  int i = ltable_find(t, key, lval_hash(key));
+  if (i < 0) { return 0; }
+  lval_del(t->slots[i].key);
+  lval_del(t->slots[i].val);
+  t->count--;
+
+  int mask = t->cap - 1;
+  for (int j = (i + 1) & mask; t->slots[j].key; j = (j + 1) & mask) {
+    /* an entry can fill the hole if that is no earlier than its home */
+    int home = t->slots[j].hash & mask;
+    if (((j - home) & mask) >= ((j - i) & mask)) {
+      t->slots[i] = t->slots[j];
+      i = j;
+    }
+  }
+  t->slots[i].key = NULL;
+  return 1;
+}
+
+ltable* ltable_clone(ltable* t) {
+  ltable* c = malloc(sizeof(ltable));
+  c->refs = 1;
+  c->count = t->count;
+  c->cap = t->cap;
+  c->slots = calloc(t->cap, sizeof(ltable_slot));
+  for (int i = 0; i < t->cap; i++) {
+    if (t->slots[i].key) {
+      c->slots[i].hash = t->slots[i].hash;
+      c->slots[i].key = lval_copy(t->slots[i].key);
+      c->slots[i].val = lval_copy(t->slots[i].val);
+    }
+  }
+  return c;
+}
+
+/* give a hash map a table of its own to change */
+ltable* ltable_own(lval* m) {
+  if (m->table->refs > 1) {
+    ltable* c = ltable_clone(m->table);
+    ltable_release(m->table);
+    m->table = c;
+  }
+  return m->table;
+}
+
+/* hash maps are equal when they hold equal values under equal keys */
+int ltable_eq(ltable* x, ltable* y) {
+  if (x == y) { return 1; }
+  if (x->count != y->count) { return 0; }
+  for (int i = 0; i < x->cap; i++) {
+    ltable_slot* s = &x->slots[i];
+    if (!s->key) { continue; }
+    int j = ltable_find(y, s->key, s->hash);
+    if (j < 0 || !lval_eq(s->val, y->slots[j].val)) { return 0; }
+  }
+  return 1;
+}
+
+/* combine entry hashes by addition so the order of slots doesn't matter */
+unsigned long ltable_hash(ltable* t) {
+  unsigned long h = t->count;
+  for (int i = 0; i < t->cap; i++) {
+    if (t->slots[i].key) {
+      h += lhash_mix(t->slots[i].hash ^ (lval_hash(t->slots[i].val) << 1));
+    }
+  }
+  return h;
+}
+
+/* write a hash map as #{key value key value} */
+void lval_write_table(lbuf* b, lval* v) {
+  lbuf_puts(b, "#{");
+  int first = 1;
+  for (int i = 0; i < v->table->cap; i++) {
+    ltable_slot* s = &v->table->slots[i];
+    if (!s->key) { continue; }
+    if (!first) { lbuf_putc(b, ' '); }
+    lval_write(b, s->key);
+    lbuf_putc(b, ' ');
+    lval_write(b, s->val);
+    first = 0;
+  }
+  lbuf_putc(b, '}');
+}
+
+lval* lval_table(ltable* t) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_TABLE;
+  v->table = t;
+  return v;
+}
+
+/* builtin method to build a hash map from a q-expression of
+   alternating keys and values */
+lval* builtin_hash(lenv* e, lval* a) {
+  LASSERT_NUM("hash", a, 1);
+  LASSERT_TYPE("hash", a, 0, LVAL_QEXPR);
+  LASSERT(a, a->cell[0]->count % 2 == 0,
+          "function 'hash' passed a key without a value.");
+
+  lval* q = lval_unpack(a->cell[0]);
+  ltable* t = ltable_new(q->count / 2);
+  for (int i = 0; i < q->count; i += 2) {
+    ltable_put(t, q->cell[i], q->cell[i+1]);
+  }
+  /* the keys and values now belong to the table */
+  q->count = 0;
+  lval_del(a);
+  return lval_table(t);
+}
+
+/* builtin method to look up a key, with an optional default
+   for when it is missing */
+lval* builtin_hash_get(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+    "function hash-get passed incorrect number of arguments. "
+    "got %i, expected 2 or 3", a->count);
+  LASSERT_TYPE("hash-get", a, 0, LVAL_TABLE);
+
+  ltable* t = a->cell[0]->table;
+  int i = ltable_find(t, a->cell[1], lval_hash(a->cell[1]));
+  if (i >= 0) {
+    lval* r = lval_copy(t->slots[i].val);
+    lval_del(a);
+    return r;
+  }
+  LASSERT(a, a->count == 3, "function hash-get passed a missing key.");
+  return lval_take(a, 2);
+}
+
+lval* builtin_hash_set_as(lenv* e, lval* a, char* func, int in_place) {
+  LASSERT_NUM(func, a, 3);
+  LASSERT_TYPE(func, a, 0, LVAL_TABLE);
+
+  lval* m = lval_pop(a, 0);
+  lval* key = lval_pop(a, 0);
+  lval* val = lval_pop(a, 0);
+  lval_del(a);
+  ltable_put(in_place ? m->table : ltable_own(m), key, val);
+  return m;
+}
+
+lval* builtin_hash_set(lenv* e, lval* a) {
+  return builtin_hash_set_as(e, a, "hash-set", 0);
+}
+
+lval* builtin_hash_set_in_place(lenv* e, lval* a) {
+  return builtin_hash_set_as(e, a, "hash-set!", 1);
+}
+
+lval* builtin_hash_del_as(lenv* e, lval* a, char* func, int in_place) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_TABLE);
+
+  lval* m = lval_pop(a, 0);
+  ltable* t = m->table;
+  /* only copy a shared table if there is something to remove */
+  if (!in_place && ltable_find(t, a->cell[0], lval_hash(a->cell[0])) >= 0) {
+    t = ltable_own(m);
+  }
+  ltable_remove(t, a->cell[0]);
+  lval_del(a);
+  return m;
+}
+
+lval* builtin_hash_del(lenv* e, lval* a) {
+  return builtin_hash_del_as(e, a, "hash-del", 0);
+}
+
+lval* builtin_hash_del_in_place(lenv* e, lval* a) {
+  return builtin_hash_del_as(e, a, "hash-del!", 1);
+}
+
+/* builtin method to list the keys of a hash map, in no particular order */
+lval* builtin_hash_keys(lenv* e, lval* a) {
+  LASSERT_NUM("hash-keys", a, 1);
+  LASSERT_TYPE("hash-keys", a, 0, LVAL_TABLE);
+
+  ltable* t = a->cell[0]->table;
+  lval* q = lval_qexpr();
+  for (int i = 0; i < t->cap; i++) {
+    if (t->slots[i].key) { lval_add(q, lval_copy(t->slots[i].key)); }
+  }
+  lval_del(a);
+  return q;
+}
+
+lval* builtin_hash_count(lenv* e, lval* a) {
+  LASSERT_NUM("hash-count", a, 1);
+  LASSERT_TYPE("hash-count", a, 0, LVAL_TABLE);
+  lval* r = lval_num(a->cell[0]->table->count);
+  lval_del(a);
+  return r;
+}
+
+/* persistent maps and sets are hash array mapped tries. a node is
+   never changed once built: an update copies the nodes on the path
+   from the root to the changed leaf and shares all the others, so
+   each version costs O(log32 n) new nodes and copies of a map or
+   set share every node */
+enum { LHAMT_LEAF, LHAMT_BRANCH, LHAMT_COLLIDE };
+
+/* bits of the hash used at each level of a branch */
+#define LHAMT_BITS 5
+
+struct lhamt {
+  int kind;
+  int refs;
+  /* leaves hold one entry, with no value for sets. collision nodes
+     keep the hash their leaves share */
+  unsigned long hash;
+  lval* key;
+  lval* val;
+  /* branches hold a child for each bit set in bitmap, in bit order.
+     collision nodes hold leaves whose whole hashes are equal */
+  uint32_t bitmap;
+  int n;
+  lhamt** kids;
+};
+
+lhamt* lhamt_leaf(unsigned long hash, lval* key, lval* val) {
+  lhamt* t = malloc(sizeof(lhamt));
+  t->kind = LHAMT_LEAF;
+  t->refs = 1;
+  t->hash = hash;
+  t->key = key;
+  t->val = val;
+  t->n = 0;
+  t->kids = NULL;
+  return t;
+}
+
+lhamt* lhamt_node(int kind, unsigned long hash, uint32_t bitmap, int n) {
+  lhamt* t = malloc(sizeof(lhamt));
+  t->kind = kind;
+  t->refs = 1;
+  t->hash = hash;
+  t->key = NULL;
+  t->val = NULL;
+  t->bitmap = bitmap;
+  t->n = n;
+  t->kids = malloc(sizeof(lhamt*) * n);
+  return t;
+}
+
+lhamt* lhamt_retain(lhamt* t) {
+  if (t) { t->refs++; }
+  return t;
+}
+
+void lhamt_release(lhamt* t) {
+  if (!t || --t->refs > 0) { return; }
+  if (t->kind == LHAMT_LEAF) {
+    lval_del(t->key);
+    if (t->val) { lval_del(t->val); }
+  }
+  for (int i = 0; i < t->n; i++) { lhamt_release(t->kids[i]); }
+  free(t->kids);
+  free(t);
+}
+
+/* index in a branch's kids of the child for a hash */
+int lhamt_pos(lhamt* t, unsigned long hash, int shift) {
+  uint32_t bit = 1u << ((hash >> shift) & 31);
+  return (t->bitmap & bit) ? __builtin_popcount(t->bitmap & (bit - 1)) : -1;
+}
+
+/* copy of a node sharing its children, with room for one more */
+lhamt* lhamt_dup(lhamt* t, int extra) {
+  lhamt* c = lhamt_node(t->kind, t->hash, t->bitmap, t->n + extra);
+  for (int i = 0; i < t->n; i++) { c->kids[i] = lhamt_retain(t->kids[i]); }
+  c->n = t->n;
+  return c;
+}
+
+/* find the leaf for a key in a subtrie starting shift bits into
+   the hash, or NULL */
+lhamt* lhamt_find(lhamt* t, lval* key, unsigned long hash, int shift) {
+  for (; t; shift += LHAMT_BITS) {
+    if (t->kind == LHAMT_LEAF) {
+      return t->hash == hash && lval_eq(t->key, key) ? t : NULL;
+    }
+    if (t->kind == LHAMT_COLLIDE) {
+      if (t->hash != hash) { return NULL; }
+      for (int i = 0; i < t->n; i++) {
+        if (lval_eq(t->kids[i]->key, key)) { return t->kids[i]; }
+      }
+      return NULL;
+    }
+    int i = lhamt_pos(t, hash, shift);
+    t = i < 0 ? NULL : t->kids[i];
+  }
+  return NULL;
+}
+
+lhamt* lhamt_get(lhamt* t, lval* key, unsigned long hash) {
+  return lhamt_find(t, key, hash, 0);
+}
+
+/* join two subtries with different keys found at the same place,
+   taking over a reference to each */
+lhamt* lhamt_pair(lhamt* a, lhamt* b, int shift) {
+  if (shift >= 64) {
+    lhamt* c = lhamt_node(LHAMT_COLLIDE, a->hash, 0, 2);
+    c->kids[0] = a;
+    c->kids[1] = b;
+    return c;
+  }
+  int ia = (a->hash >> shift) & 31;
+  int ib = (b->hash >> shift) & 31;
+  if (ia == ib) {
+    lhamt* t = lhamt_node(LHAMT_BRANCH, 0, 1u << ia, 1);
+    t->kids[0] = lhamt_pair(a, b, shift + LHAMT_BITS);
+    return t;
+  }
+  lhamt* t = lhamt_node(LHAMT_BRANCH, 0, (1u << ia) | (1u << ib), 2);
+  t->kids[ia < ib ? 0 : 1] = a;
+  t->kids[ia < ib ? 1 : 0] = b;
+  return t;
+}
+
+/* the trie t with leaf added, replacing any leaf with the same key.
+   t is left unchanged and the new leaf is taken over. sets added
+   if the key was not already present */
+lhamt* lhamt_assoc(lhamt* t, lhamt* leaf, int shift, int* added) {
+  if (!t) {
+    *added = 1;
+    return leaf;
+  }
+
+  if (t->kind == LHAMT_LEAF) {
+    if (t->hash == leaf->hash && lval_eq(t->key, leaf->key)) {
+      *added = 0;
+      return leaf;
+    }
+    *added = 1;
+    return lhamt_pair(lhamt_retain(t), leaf, shift);
+  }
+
+  if (t->kind == LHAMT_COLLIDE) {
+    if (t->hash != leaf->hash) {
+      *added = 1;
+      return lhamt_pair(lhamt_retain(t), leaf, shift);
+    }
+    for (int i = 0; i < t->n; i++) {
+      if (lval_eq(t->kids[i]->key, leaf->key)) {
+        *added = 0;
+        lhamt* c = lhamt_dup(t, 0);
+        lhamt_release(c->kids[i]);
+        c->kids[i] = leaf;
+        return c;
+      }
+    }
+    *added = 1;
+    lhamt* c = lhamt_dup(t, 1);
+    c->kids[c->n++] = leaf;
+    return c;
+  }
+
+  int i = lhamt_pos(t, leaf->hash, shift);
+  if (i >= 0) {
+    lhamt* kid = lhamt_assoc(t->kids[i], leaf, shift + LHAMT_BITS, added);
+    lhamt* c = lhamt_dup(t, 0);
+    lhamt_release(c->kids[i]);
+    c->kids[i] = kid;
+    return c;
+  }
+
+  /* a new child, inserted in bit order */
+  *added = 1;
+  uint32_t bit = 1u << ((leaf->hash >> shift) & 31);
+  i = __builtin_popcount(t->bitmap & (bit - 1));
+  lhamt* c = lhamt_node(LHAMT_BRANCH, 0, t->bitmap | bit, t->n + 1);
+  for (int j = 0; j < t->n; j++) {
+    c->kids[j < i ? j : j + 1] = lhamt_retain(t->kids[j]);
+  }
+  c->kids[i] = leaf;
+  return c;
+}
+
+/* the trie t without key, leaving t unchanged. sets removed if the
+   key was present. a branch left holding a single leaf or collision
+   node is replaced by it, keeping the trie as shallow as it can be */
+lhamt* lhamt_dissoc(lhamt* t, lval* key, unsigned long hash, int shift, int* removed) {
+  *removed = 0;
+  if (!t) { return NULL; }
+
+  if (t->kind == LHAMT_LEAF) {
+    if (t->hash == hash && lval_eq(t->key, key)) {
+      *removed = 1;
+      return NULL;
+    }
+    return lhamt_retain(t);
+  }
+
+  if (t->kind == LHAMT_COLLIDE) {
+    int i = 0;
+    while (i < t->n && !(t->hash == hash && lval_eq(t->kids[i]->key, key))) { i++; }
+    if (i == t->n) { return lhamt_retain(t); }
+    *removed = 1;
+    if (t->n == 2) { return lhamt_retain(t->kids[1 - i]); }
+    lhamt* c = lhamt_node(LHAMT_COLLIDE, t->hash, 0, t->n - 1);
+    for (int j = 0, k = 0; j < t->n; j++) {
+      if (j != i) { c->kids[k++] = lhamt_retain(t->kids[j]); }
+    }
+    return c;
+  }
+
+  int i = lhamt_pos(t, hash, shift);
+  if (i < 0) { return lhamt_retain(t); }
+  lhamt* kid = lhamt_dissoc(t->kids[i], key, hash, shift + LHAMT_BITS, removed);
+  if (!*removed) {
+    lhamt_release(kid);
+    return lhamt_retain(t);
+  }
+
+  if (!kid) {
+    if (t->n == 1) { return NULL; }
+    if (t->n == 2 && t->kids[1 - i]->kind != LHAMT_BRANCH) {
+      return lhamt_retain(t->kids[1 - i]);
+    }
+    uint32_t bit = 1u << ((hash >> shift) & 31);
+    lhamt* c = lhamt_node(LHAMT_BRANCH, 0, t->bitmap & ~bit, t->n - 1);
+    for (int j = 0, k = 0; j < t->n; j++) {
+      if (j != i) { c->kids[k++] = lhamt_retain(t->kids[j]); }
+    }
+    return c;
+  }
+  if (t->n == 1 && kid->kind != LHAMT_BRANCH) { return kid; }
+  lhamt* c = lhamt_dup(t, 0);
+  lhamt_release(c->kids[i]);
+  c->kids[i] = kid;
+  return c;
+}
+
+/* add copies of every key, or key and value, in a trie to q */
+void lhamt_collect(lhamt* t, lval* q, int vals) {
+  if (!t) { return; }
+  if (t->kind == LHAMT_LEAF) {
+    lval_add(q, lval_copy(t->key));
+    if (vals) { lval_add(q, lval_copy(t->val)); }
+    return;
+  }
+  for (int i = 0; i < t->n; i++) { lhamt_collect(t->kids[i], q, vals); }
+}
+
+/* is every entry of a found with an equal value in b, where both
+   are the subtries at the same place. shared nodes are skipped whole */
+int lhamt_sub(lhamt* a, lhamt* b, int shift) {
+  if (a == b || !a) { return 1; }
+  if (a->kind == LHAMT_LEAF) {
+    lhamt* x = lhamt_find(b, a->key, a->hash, shift);
+    return x && (!a->val || lval_eq(a->val, x->val));
+  }
+
+  /* branches are compared child by child */
+  if (a->kind == LHAMT_BRANCH && b && b->kind == LHAMT_BRANCH) {
+    uint32_t m = a->bitmap;
+    for (int i = 0; i < a->n; i++, m &= m - 1) {
+      uint32_t bit = m & -m;
+      if (!(b->bitmap & bit)) { return 0; }
+      int k = __builtin_popcount(b->bitmap & (bit - 1));
+      if (!lhamt_sub(a->kids[i], b->kids[k], shift + LHAMT_BITS)) { return 0; }
+    }
+    return 1;
+  }
+
+  /* otherwise each entry of a is looked up in b */
+  for (int i = 0; i < a->n; i++) {
+    if (!lhamt_sub(a->kids[i], b, shift)) { return 0; }
+  }
+  return 1;
+}
+
+/* combine entry hashes by addition so the shape of the trie doesn't matter */
+unsigned long lhamt_hash(lhamt* t) {
+  if (!t) { return 0; }
+  if (t->kind == LHAMT_LEAF) {
+    return lhash_mix(t->hash ^ (t->val ? lval_hash(t->val) << 1 : 0));
+  }
+  unsigned long h = 0;
+  for (int i = 0; i < t->n; i++) { h += lhamt_hash(t->kids[i]); }
+  return h;
+}
+
+void lhamt_write(lbuf* b, lhamt* t, int* first) {
+  if (!t) { return; }
+  if (t->kind != LHAMT_LEAF) {
+    for (int i = 0; i < t->n; i++) { lhamt_write(b, t->kids[i], first); }
+    return;
+  }
+  if (!*first) { lbuf_putc(b, ' '); }
+  *first = 0;
+  lval_write(b, t->key);
+  if (t->val) {
+    lbuf_putc(b, ' ');
+    lval_write(b, t->val);
+  }
+}
+
+/* write a map as #dict{key value ...} and a set as #set{key ...} */
+void lval_write_hamt(lbuf* b, lval* v) {
+  int first = 1;
+  lbuf_puts(b, v->type == LVAL_MAP ? "#dict{" : "#set{");
+  lhamt_write(b, v->hamt, &first);
+  lbuf_putc(b, '}');
+}
+
+lval* lval_hamt(int type, lhamt* root, int count) {
+  lval* v = malloc(sizeof(lval));
+  v->type = type;
+  v->hamt = root;
+  v->count = count;
+  return v;
+}
+
+/* a new version of a map or set with key set to val,
+   taking over both. v itself is unchanged */
+lval* lhamt_put(lval* v, lval* key, lval* val) {
+  int added;
+  lhamt* leaf = lhamt_leaf(lval_hash(key), key, val);
+  lhamt* root = lhamt_assoc(v->hamt, leaf, 0, &added);
+  return lval_hamt(v->type, root, v->count + added);
+}
+
+/* builtin methods to build a map from a q-expression of alternating
+   keys and values, or a set from a q-expression of keys */
+lval* builtin_hamt_of(lenv* e, lval* a, char* func, int type) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+  LASSERT(a, type == LVAL_SET || a->cell[0]->count % 2 == 0,
+          "function '%s' passed a key without a value.", func);
+
+  lval* q = lval_unpack(a->cell[0]);
+  lval* v = lval_hamt(type, NULL, 0);
+  for (int i = 0; i < q->count; i += type == LVAL_MAP ? 2 : 1) {
+    lval* x = lhamt_put(v, lval_copy(q->cell[i]),
+                        type == LVAL_MAP ? lval_copy(q->cell[i+1]) : NULL);
+    lval_del(v);
+    v = x;
+  }
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_dict(lenv* e, lval* a) {
+  return builtin_hamt_of(e, a, "dict", LVAL_MAP);
+}
+
+lval* builtin_set(lenv* e, lval* a) {
+  return builtin_hamt_of(e, a, "set", LVAL_SET);
+}
+
+/* builtin method for a new map with a key set */
+lval* builtin_assoc(lenv* e, lval* a) {
+  LASSERT_NUM("assoc", a, 3);
+  LASSERT_TYPE("assoc", a, 0, LVAL_MAP);
+  lval* val = lval_pop(a, 2);
+  lval* key = lval_pop(a, 1);
+  lval* r = lhamt_put(a->cell[0], key, val);
+  lval_del(a);
+  return r;
+}
+
+/* builtin method for a new set with a key added */
+lval* builtin_set_add(lenv* e, lval* a) {
+  LASSERT_NUM("set-add", a, 2);
+  LASSERT_TYPE("set-add", a, 0, LVAL_SET);
+  lval* r = lhamt_put(a->cell[0], lval_pop(a, 1), NULL);
+  lval_del(a);
+  return r;
+}
+
+/* builtin methods for a new map or set without a key */
+lval* builtin_hamt_without(lenv* e, lval* a, char* func, int type) {
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, type);
+
+  lval* v = a->cell[0];
+  int removed;
+  lhamt* root = lhamt_dissoc(v->hamt, a->cell[1], lval_hash(a->cell[1]), 0, &removed);
+  lval* r = lval_hamt(type, root, v->count - removed);
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_dissoc(lenv* e, lval* a) {
+  return builtin_hamt_without(e, a, "dissoc", LVAL_MAP);
+}
+
+lval* builtin_set_del(lenv* e, lval* a) {
+  return builtin_hamt_without(e, a, "set-del", LVAL_SET);
+}
+
+/* builtin method to look up a key in a map, with an optional
+   default for when it is missing */
+lval* builtin_lookup(lenv* e, lval* a) {
+  LASSERT(a, a->count == 2 || a->count == 3,
+    "function lookup passed incorrect number of arguments. "
+    "got %i, expected 2 or 3", a->count);
+  LASSERT_TYPE("lookup", a, 0, LVAL_MAP);
+
+  lhamt* x = lhamt_get(a->cell[0]->hamt, a->cell[1], lval_hash(a->cell[1]));
+  if (x) {
+    lval* r = lval_copy(x->val);
+    lval_del(a);
+    return r;
+  }
+  LASSERT(a, a->count == 3, "function lookup passed a missing key.");
+  return lval_take(a, 2);
+}
+
+lval* builtin_set_has(lenv* e, lval* a) {
+  LASSERT_NUM("set-has", a, 2);
+  LASSERT_TYPE("set-has", a, 0, LVAL_SET);
+  lval* r = lval_num(lhamt_get(a->cell[0]->hamt, a->cell[1], lval_hash(a->cell[1])) != NULL);
+  lval_del(a);
+  return r;
+}
+
+/* builtin methods listing the keys of a map or elements of a set,
+   in no particular order */
+lval* builtin_hamt_list(lenv* e, lval* a, char* func, int type) {
+  LASSERT_NUM(func, a, 1);
+  LASSERT_TYPE(func, a, 0, type);
+  lval* q = lval_qexpr();
+  lhamt_collect(a->cell[0]->hamt, q, 0);
+  lval_del(a);
+  return q;
+}
+
+lval* builtin_dict_keys(lenv* e, lval* a) {
+  return builtin_hamt_list(e, a, "dict-keys", LVAL_MAP);
+}
+
+lval* builtin_set_list(lenv* e, lval* a) {
+  return builtin_hamt_list(e, a, "set-list", LVAL_SET);
+}
+
+lval* builtin_hamt_count(lenv* e, lval* a) {
+  LASSERT_NUM("count", a, 1);
+  LASSERT(a, a->cell[0]->type == LVAL_MAP || a->cell[0]->type == LVAL_SET,
+    "function 'count' passed incorrect type for argument 0. "
+    "got %s, expected %s or %s.", ltype_name(a->cell[0]->type),
+    ltype_name(LVAL_MAP), ltype_name(LVAL_SET));
+  lval* r = lval_num(a->cell[0]->count);
+  lval_del(a);
+  return r;
+}
+
+/* json is read straight into lvals. numbers become numbers, big
+   numbers or floats, strings become strings, arrays q-expressions and
+   objects hash maps. true and false read as 1 and 0, and null as {} */
+
+/* deeper nesting than this is refused rather than recursed into */
+#define LJSON_DEPTH 512
+
+/* forward declare reading big numbers, for integers too large for a long */
+lval* lval_read_big(char* s);
+
+typedef struct {
+  char* s;
+  long len;
+  long pos;
+  char* func;
+  int depth;
+  /* when reading a string lval, its buffer. strings without escapes
+     share it as substrings do, rather than being copied out */
+  lstrbuf* share;
+  /* set when more input may follow s, so running off its end is
+     not yet an error */
+  int more;
+  /* set when reading failed by running off the end of s */
+  int short_input;
+  /* how far into the whole input s starts, for errors */
+  long base;
+} ljson;
+
+lval* ljson_err(ljson* j, char* what) {
+  if (j->pos >= j->len) { j->short_input = 1; }
+  return lval_err("function '%s' passed invalid json at byte %li. %s",
+                  j->func, j->base + j->pos, what);
+}
+
+/* the length of the run of bytes from s which json writes as they
+   are: anything but a quote, a backslash or a control character.
+   sixteen bytes are checked at a time where sse2 is available */
+long ljson_plain(char* s, long n) {
+  long i = 0;
+#ifdef LVEC_X86
+  __m128i quote = _mm_set1_epi8('"');
+  __m128i slash = _mm_set1_epi8('\\');
+  __m128i ctrl = _mm_set1_epi8(0x1f);
+  for (; i + 16 <= n; i += 16) {
+    __m128i c = _mm_loadu_si128((__m128i*)(s + i));
+    __m128i hit = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(c, quote), _mm_cmpeq_epi8(c, slash)),
+      _mm_cmpeq_epi8(_mm_min_epu8(c, ctrl), c));
+    unsigned mask = _mm_movemask_epi8(hit);
+    if (mask) { return i + __builtin_ctz(mask); }
+  }
+#endif
+  while (i < n && s[i] != '"' && s[i] != '\\' && (unsigned char)s[i] >= 0x20) { i++; }
+  return i;
+}
+
+void ljson_space(ljson* j) {
+  while (j->pos < j->len) {
+    char c = j->s[j->pos];
+    if (c != ' ' && c != '\n' && c != '\r' && c != '\t') { return; }
+    j->pos++;
+  }
+}
+
+/* the four hex digits of a \u escape, or -1 */
+long ljson_hex4(ljson* j) {
+  if (j->len - j->pos < 4) { return -1; }
+  long u = 0;
+  for (int i = 0; i < 4; i++) {
+    char c = j->s[j->pos + i];
+    int d = c >= '0' && c <= '9' ? c - '0'
+      : c >= 'a' && c <= 'f' ? c - 'a' + 10
+      : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+    if (d < 0) { return -1; }
+    u = u * 16 + d;
+  }
+  j->pos += 4;
+  return u;
+}
+
+/* append code point u to a string as utf-8 */
+void lval_str_utf8(lval* v, long u) {
+  char c[4];
+  int n;
+  if (u < 0x80) {
+    c[0] = u; n = 1;
+  } else if (u < 0x800) {
+    c[0] = 0xc0 | (u >> 6); c[1] = 0x80 | (u & 0x3f); n = 2;
+  } else if (u < 0x10000) {
+    c[0] = 0xe0 | (u >> 12); c[1] = 0x80 | ((u >> 6) & 0x3f);
+    c[2] = 0x80 | (u & 0x3f); n = 3;
+  } else {
+    c[0] = 0xf0 | (u >> 18); c[1] = 0x80 | ((u >> 12) & 0x3f);
+    c[2] = 0x80 | ((u >> 6) & 0x3f); c[3] = 0x80 | (u & 0x3f); n = 4;
+  }
+  lval_str_append(v, c, n);
+}
+
+/* read a \u escape, pairing up surrogates. a surrogate without its
+   other half becomes the replacement character */
+lval* ljson_unicode(ljson* j, lval* v) {
+  long u = ljson_hex4(j);
+  /* an escape, or the low half of a pair, cut off by the end of the
+     input may be completed by more of it */
+  if ((u < 0 && j->len - j->pos < 4)
+      || (u >= 0xd800 && u < 0xdc00 && j->len - j->pos < 6 && j->more)) {
+    j->pos = j->len;
+  }
+  if (u < 0 || j->pos == j->len) {
+    lval_del(v);
+    return ljson_err(j, "invalid \\u escape.");
+  }
+  if (u >= 0xd800 && u < 0xdc00 && j->len - j->pos >= 6
+      && j->s[j->pos] == '\\' && j->s[j->pos + 1] == 'u') {
+    long save = j->pos;
+    j->pos += 2;
+    long lo = ljson_hex4(j);
+    if (lo >= 0xdc00 && lo < 0xe000) {
+      u = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+    } else {
+      j->pos = save;
+    }
+  }
+  if (u >= 0xd800 && u < 0xe000) { u = 0xfffd; }
+  lval_str_utf8(v, u);
+  return v;
+}
+
+lval* ljson_string(ljson* j) {
+  j->pos++;
+  long run = ljson_plain(j->s + j->pos, j->len - j->pos);
+  if (run > INT_MAX) { return ljson_err(j, "string is too long."); }
+
+  /* most strings have no escapes, and are taken as they are */
+  if (j->pos + run < j->len && j->s[j->pos + run] == '"') {
+    char* start = j->s + j->pos;
+    j->pos += run + 1;
+    if (!j->share) { return lval_str_len(start, run); }
+    lval* v = malloc(sizeof(lval));
+    v->type = LVAL_STR;
+    v->count = run;
+    v->sbuf = j->share;
+    v->sbuf->refs++;
+    v->str = start;
+    return v;
+  }
+
+  lval* v = lval_str_cap(run + 16);
+  for (;;) {
+    run = ljson_plain(j->s + j->pos, j->len - j->pos);
+    if ((long)v->count + run > INT_MAX) {
+      lval_del(v);
+      return ljson_err(j, "string is too long.");
+    }
+    lval_str_append(v, j->s + j->pos, run);
+    j->pos += run;
+    if (j->pos >= j->len) {
+      lval_del(v);
+      return ljson_err(j, "unterminated string.");
+    }
+    char c = j->s[j->pos];
+    if (c == '"') { j->pos++; return v; }
+    if (c != '\\') {
+      lval_del(v);
+      return ljson_err(j, "control character in string.");
+    }
+    if (++j->pos >= j->len) {
+      lval_del(v);
+      return ljson_err(j, "unterminated string.");
+    }
+    c = j->s[j->pos++];
+    char* esc = strchr("\"\\/bfnrt", c);
+    if (c && esc) {
+      lval_str_append(v, &"\"\\/\b\f\n\r\t"[esc - "\"\\/bfnrt"], 1);
+    } else if (c == 'u') {
+      v = ljson_unicode(j, v);
+      if (v->type == LVAL_ERR) { return v; }
+    } else {
+      j->pos--;
+      lval_del(v);
+      return ljson_err(j, "invalid escape in string.");
+    }
+  }
+}
+
+int ljson_digit(ljson* j, long i) {
+  return i < j->len && j->s[i] >= '0' && j->s[i] <= '9';
+}
+
+lval* ljson_number(ljson* j) {
+  long i = j->pos;
+  int flt = 0;
+  if (j->s[i] == '-') { i++; }
+  if (!ljson_digit(j, i)) { j->pos = i; return ljson_err(j, "invalid number."); }
+  if (j->s[i] == '0') { i++; } else { while (ljson_digit(j, i)) { i++; } }
+  if (i < j->len && j->s[i] == '.') {
+    flt = 1;
+    if (!ljson_digit(j, ++i)) { j->pos = i; return ljson_err(j, "invalid number."); }
+    while (ljson_digit(j, i)) { i++; }
+  }
+  if (i < j->len && (j->s[i] == 'e' || j->s[i] == 'E')) {
+    flt = 1;
+    i++;
+    if (i < j->len && (j->s[i] == '+' || j->s[i] == '-')) { i++; }
+    if (!ljson_digit(j, i)) { j->pos = i; return ljson_err(j, "invalid number."); }
+    while (ljson_digit(j, i)) { i++; }
+  }
+  /* the number may go on in input yet to come */
+  if (i == j->len && j->more) { j->pos = i; return ljson_err(j, "unfinished number."); }
+
+  /* strtod and strtol need the digits null terminated */
+  long n = i - j->pos;
+  char tmp[64];
+  char* digits = n < (long)sizeof(tmp) ? tmp : malloc(n + 1);
+  memcpy(digits, j->s + j->pos, n);
+  digits[n] = '\0';
+  j->pos = i;
+
+  lval* v;
+  if (flt) {
+    v = lval_dbl(strtod(digits, NULL));
+  } else {
+    errno = 0;
+    long x = strtol(digits, NULL, 10);
+    v = errno != ERANGE ? lval_num(x) : lval_read_big(digits);
+  }
+  if (digits != tmp) { free(digits); }
+  return v;
+}
+
+/* true, false or null, standing for v */
+lval* ljson_word(ljson* j, char* word, lval* v) {
+  long n = strlen(word);
+  long have = j->len - j->pos < n ? j->len - j->pos : n;
+  if (memcmp(j->s + j->pos, word, have) == 0 && have == n) {
+    j->pos += n;
+    return v;
+  }
+  lval_del(v);
+  /* a prefix of the word at the end of the input may be completed */
+  if (memcmp(j->s + j->pos, word, have) == 0) { j->pos = j->len; }
+  return ljson_err(j, "expected a value.");
+}
+
+lval* ljson_value(ljson* j);
+
+lval* ljson_array(ljson* j) {
+  j->pos++;
+  lval* q = lval_qexpr();
+  ljson_space(j);
+  if (j->pos < j->len && j->s[j->pos] == ']') { j->pos++; return q; }
+  for (;;) {
+    lval* x = ljson_value(j);
+    if (x->type == LVAL_ERR) { lval_del(q); return x; }
+    lval_add(q, x);
+    ljson_space(j);
+    if (j->pos < j->len && j->s[j->pos] == ']') { j->pos++; return q; }
+    if (j->pos >= j->len || j->s[j->pos] != ',') {
+      lval_del(q);
+      return ljson_err(j, "expected ',' or ']'.");
+    }
+    j->pos++;
+  }
+}
+
+lval* ljson_object(ljson* j) {
+  j->pos++;
+  ltable* t = ltable_new(0);
+  lval* err = NULL;
+  ljson_space(j);
+  if (j->pos < j->len && j->s[j->pos] == '}') { j->pos++; return lval_table(t); }
+  for (;;) {
+    if (j->pos >= j->len || j->s[j->pos] != '"') {
+      err = ljson_err(j, "expected a string key.");
+      break;
+    }
+    lval* key = ljson_string(j);
+    if (key->type == LVAL_ERR) { err = key; break; }
+    ljson_space(j);
+    if (j->pos >= j->len || j->s[j->pos] != ':') {
+      lval_del(key);
+      err = ljson_err(j, "expected ':'.");
+      break;
+    }
+    j->pos++;
+    lval* val = ljson_value(j);
+    if (val->type == LVAL_ERR) { lval_del(key); err = val; break; }
+    ltable_put(t, key, val);
+    ljson_space(j);
+    if (j->pos < j->len && j->s[j->pos] == '}') { j->pos++; return lval_table(t); }
+    if (j->pos >= j->len || j->s[j->pos] != ',') {
+      err = ljson_err(j, "expected ',' or '}'.");
+      break;
+    }
+    j->pos++;
+    ljson_space(j);
+  }
+  ltable_release(t);
+  return err;
+}
+
+lval* ljson_value(ljson* j) {
+  ljson_space(j);
+  if (j->pos >= j->len) { return ljson_err(j, "expected a value."); }
+  char c = j->s[j->pos];
+  if (c == '"') { return ljson_string(j); }
+  if (c == '-' || (c >= '0' && c <= '9')) { return ljson_number(j); }
+  if (c == 't') { return ljson_word(j, "true", lval_num(1)); }
+  if (c == 'f') { return ljson_word(j, "false", lval_num(0)); }
+  if (c == 'n') { return ljson_word(j, "null", lval_qexpr()); }
+  if (c != '[' && c != '{') { return ljson_err(j, "expected a value."); }
+
+  if (j->depth >= LJSON_DEPTH) { return ljson_err(j, "nested too deeply."); }
+  j->depth++;
+  lval* v = c == '[' ? ljson_array(j) : ljson_object(j);
+  j->depth--;
+  return v;
+}
+
+/* write a string with json escapes, copying the runs between them */
+void ljson_write_str(lbuf* b, char* s, long n) {
+  static const char hex[] = "0123456789abcdef";
+  lbuf_putc(b, '"');
+  long i = 0;
+  while (i < n) {
+    long run = ljson_plain(s + i, n - i);
+    lbuf_write(b, s + i, run);
+    i += run;
+    if (i == n) { break; }
+    unsigned char c = s[i++];
+    char* esc = strchr("\"\\\b\f\n\r\t", c);
+    if (c && esc) {
+      char out[2] = { '\\', "\"\\bfnrt"[esc - "\"\\\b\f\n\r\t"] };
+      lbuf_write(b, out, 2);
+    } else {
+      char out[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+      lbuf_write(b, out, 6);
+    }
+  }
+  lbuf_putc(b, '"');
+}
+
+lval* ljson_write(lbuf* b, lval* v, char* func, int depth);
+
+/* write the entries of a map, or the keys of a set, as json */
+lval* ljson_write_hamt(lbuf* b, lhamt* t, int* first, char* func, int depth) {
+  if (!t) { return NULL; }
+  if (t->kind != LHAMT_LEAF) {
+    for (int i = 0; i < t->n; i++) {
+      lval* err = ljson_write_hamt(b, t->kids[i], first, func, depth);
+      if (err) { return err; }
+    }
+    return NULL;
+  }
+  if (!*first) { lbuf_putc(b, ','); }
+  *first = 0;
+  if (!t->val) { return ljson_write(b, t->key, func, depth); }
+  if (t->key->type != LVAL_STR) {
+    return lval_err("function '%s' passed a map with a %s key. "
+                    "json keys must be strings.", func, ltype_name(t->key->type));
+  }
+  ljson_write_str(b, t->key->str, t->key->count);
+  lbuf_putc(b, ':');
+  return ljson_write(b, t->val, func, depth);
+}
+
+/* write v as json, returning NULL, or an error for a value json has
+   no way to write */
+lval* ljson_write(lbuf* b, lval* v, char* func, int depth) {
+  if (depth >= LJSON_DEPTH) {
+    return lval_err("function '%s' passed a value nested too deeply.", func);
+  }
+  char buf[32];
+  lval* err = NULL;
+  int first = 1;
+  switch (v->type) {
+    case LVAL_NUM: lbuf_long(b, v->num); return NULL;
+    case LVAL_BIG: lval_write_big(b, v); return NULL;
+    case LVAL_DBL:
+      if (!isfinite(v->dbl)) {
+        return lval_err("function '%s' passed %s, which json can't hold.",
+                        func, isnan(v->dbl) ? "nan" : "infinity");
+      }
+      ldbl_format(v->dbl, buf);
+      lbuf_puts(b, buf);
+      return NULL;
+    case LVAL_STR: ljson_write_str(b, v->str, v->count); return NULL;
+
+    case LVAL_QEXPR:
+      lbuf_putc(b, '[');
+      for (int i = 0; i < v->count && !err; i++) {
+        if (i) { lbuf_putc(b, ','); }
+        if (v->packed) { lbuf_long(b, v->packed[i]); }
+        else { err = ljson_write(b, v->cell[i], func, depth + 1); }
+      }
+      lbuf_putc(b, ']');
+      return err;
+
+    case LVAL_VEC:
+      lbuf_putc(b, '[');
+      for (int i = 0; i < v->count; i++) {
+        if (i) { lbuf_putc(b, ','); }
+        if (v->dvec) {
+          if (!isfinite(v->dvec[i])) {
+            return lval_err("function '%s' passed a vector holding %s, which "
+                            "json can't hold.", func, isnan(v->dvec[i]) ? "nan" : "infinity");
+          }
+          ldbl_format(v->dvec[i], buf);
+          lbuf_puts(b, buf);
+        } else {
+          lbuf_long(b, v->ivec[i]);
+        }
+      }
+      lbuf_putc(b, ']');
+      return NULL;
+
+    case LVAL_TABLE:
+      lbuf_putc(b, '{');
+      for (int i = 0; i < v->table->cap && !err; i++) {
+        ltable_slot* s = &v->table->slots[i];
+        if (!s->key) { continue; }
+        if (s->key->type != LVAL_STR) {
+          return lval_err("function '%s' passed a hash map with a %s key. "
+                          "json keys must be strings.", func, ltype_name(s->key->type));
+        }
+        if (!first) { lbuf_putc(b, ','); }
+        first = 0;
+        ljson_write_str(b, s->key->str, s->key->count);
+        lbuf_putc(b, ':');
+        err = ljson_write(b, s->val, func, depth + 1);
+      }
+      lbuf_putc(b, '}');
+      return err;
+
+    case LVAL_MAP:
+    case LVAL_SET:
+      lbuf_putc(b, v->type == LVAL_MAP ? '{' : '[');
+      err = ljson_write_hamt(b, v->hamt, &first, func, depth + 1);
+      lbuf_putc(b, v->type == LVAL_MAP ? '}' : ']');
+      return err;
+  }
+  return lval_err("function '%s' passed %s, which has no json form.",
+                  func, ltype_name(v->type));
+}
+
+/* (json-parse s), the value of a string holding one json value */
+lval* builtin_json_parse(lenv* e, lval* a) {
+  LASSERT_NUM("json-parse", a, 1);
+  LASSERT_TYPE("json-parse", a, 0, LVAL_STR);
+
+  lval* s = a->cell[0];
+  ljson j = { s->str, s->count, 0, "json-parse", 0, s->sbuf, 0, 0, 0 };
+  lval* v = ljson_value(&j);
+  ljson_space(&j);
+  if (v->type != LVAL_ERR && j.pos < j.len) {
+    lval_del(v);
+    v = ljson_err(&j, "unexpected text after the value.");
+  }
+  lval_del(a);
+  return v;
+}
+
+/* (json-fold f acc source) reads a stream of json values one after
+   another, as in newline delimited json, from a string or an input
+   port, folding f over them as foldl does. a port is read a buffer at
+   a time, so the stream is never held in memory all at once */
+lval* builtin_json_fold(lenv* e, lval* a) {
+  LASSERT_NUM("json-fold", a, 3);
+  LASSERT_TYPE("json-fold", a, 0, LVAL_FUN);
+  if (a->cell[2]->type != LVAL_STR) { LASSERT_PORT("json-fold", a, 2, LPORT_IN); }
+
+  lval* f = a->cell[0];
+  lval* src = a->cell[2];
+  lport* p = src->type == LVAL_PORT ? src->port : NULL;
+  lval* acc = lval_pop(a, 1);
+  /* how much of the input has been read */
+  long offset = 0;
+  while (acc->type != LVAL_ERR) {
+    ljson j = p
+      ? (ljson){ p->data + p->pos, p->len - p->pos, 0, "json-fold", 0,
+                 NULL, !p->eof, 0, offset }
+      : (ljson){ src->str + offset, src->count - offset, 0, "json-fold", 0,
+                 src->sbuf, 0, 0, offset };
+    ljson_space(&j);
+    if (j.pos == j.len) {
+      if (p && lport_fill(p)) { continue; }
+      break;
+    }
+    lval* v = ljson_value(&j);
+    if (v->type == LVAL_ERR) {
+      /* a value cut off by the end of the buffer is read again once
+         the rest of it is in */
+      if (j.short_input && p && !p->eof) {
+        lval_del(v);
+        lport_fill(p);
+        continue;
+      }
+      lval_del(acc);
+      acc = v;
+      break;
+    }
+    if (p) { p->pos += j.pos; }
+    offset += j.pos;
+    lval* args = lval_sexpr();
+    lval_add(args, acc);
+    lval_add(args, v);
+    acc = llist_apply(e, f, args);
+  }
+  lval_del(a);
+  return acc;
+}
+
+/* (json-stringify v), the json text of a value */
+lval* builtin_json_stringify(lenv* e, lval* a) {
+  LASSERT_NUM("json-stringify", a, 1);
+
+  lbuf b = { NULL, 0, 0, NULL, -1, 0 };
+  lval* err = ljson_write(&b, a->cell[0], "json-stringify", 0);
+  lval_del(a);
+  if (!err && b.len > INT_MAX) {
+    err = lval_err("function 'json-stringify' result is too long.");
+  }
+  if (err) { free(b.data); return err; }
+  lval* r = lval_str_len(b.data, b.len);
+  free(b.data);
+  return r;
+}
+
+/* lvals are serialized as the header "ald" and a version byte, then
+   the value. each value is a tag byte followed by
+     number       a zigzag varint
+     big number   a varint limb count and each limb as a varint
+     float        eight bytes, least significant first
+     string       a varint length and the bytes
+     symbol       a varint length and the bytes, the first time it is
+                  written. after that, its index among the symbols in
+                  the order they were first written
+     list         a varint count and the items, or a zigzag varint
+                  for each number of a packed q-expression
+     vector       a varint count and zigzag varints or floats
+     hash map     a varint count and the keys and values
+     set          a varint count and the keys */
+enum { LDATA_NUM, LDATA_BIG, LDATA_NEG_BIG, LDATA_DBL, LDATA_STR,
+       LDATA_SYM, LDATA_SYM_REF, LDATA_QEXPR, LDATA_SEXPR, LDATA_PACKED,
+       LDATA_IVEC, LDATA_DVEC, LDATA_TABLE, LDATA_MAP, LDATA_SET };
+
+#define LDATA_VERSION 1
+
+/* deeper nesting than this is refused rather than recursed into */
+#define LDATA_DEPTH 4096
+
+void lbuf_varint(lbuf* b, unsigned long u) {
+  while (u >= 0x80) {
+    lbuf_putc(b, (u & 0x7f) | 0x80);
+    u >>= 7;
+  }
+  lbuf_putc(b, u);
+}
+
+/* numbers near zero of either sign take few bytes as zigzag varints */
+void lbuf_zigzag(lbuf* b, long n) {
+  lbuf_varint(b, ((unsigned long)n << 1) ^ (unsigned long)(n >> 63));
+}
+
+void lbuf_double(lbuf* b, double x) {
+  uint64_t u;
+  memcpy(&u, &x, sizeof(double));
+  for (int i = 0; i < 8; i++) { lbuf_putc(b, u >> (8 * i)); }
+}
+
+lval* ldata_write(lbuf* b, lval* v, ltable* syms, char* func, int depth);
+
+/* write the entries of a map, or the keys of a set */
+lval* ldata_write_hamt(lbuf* b, lhamt* t, ltable* syms, char* func, int depth) {
+  if (!t) { return NULL; }
+  if (t->kind != LHAMT_LEAF) {
+    for (int i = 0; i < t->n; i++) {
+      lval* err = ldata_write_hamt(b, t->kids[i], syms, func, depth);
+      if (err) { return err; }
+    }
+    return NULL;
+  }
+  lval* err = ldata_write(b, t->key, syms, func, depth);
+  return err || !t->val ? err : ldata_write(b, t->val, syms, func, depth);
+}
+
+/* write v in the binary format, returning NULL, or an error for a
+   value with no serialized form. syms maps each symbol written so
+   far to its index */
+lval* ldata_write(lbuf* b, lval* v, ltable* syms, char* func, int depth) {
+  if (depth >= LDATA_DEPTH) {
+    return lval_err("function '%s' passed a value nested too deeply.", func);
+  }
+  lval* err = NULL;
+  switch (v->type) {
+    case LVAL_NUM:
+      lbuf_putc(b, LDATA_NUM);
+      lbuf_zigzag(b, v->num);
+      return NULL;
+    case LVAL_BIG:
+      lbuf_putc(b, v->num < 0 ? LDATA_NEG_BIG : LDATA_BIG);
+      lbuf_varint(b, v->count);
+      for (int i = 0; i < v->count; i++) { lbuf_varint(b, v->limbs[i]); }
+      return NULL;
+    case LVAL_DBL:
+      lbuf_putc(b, LDATA_DBL);
+      lbuf_double(b, v->dbl);
+      return NULL;
+    case LVAL_STR:
+      lbuf_putc(b, LDATA_STR);
+      lbuf_varint(b, v->count);
+      lbuf_write(b, v->str, v->count);
+      return NULL;
+
+    case LVAL_SYM: {
+      int i = ltable_find(syms, v, lval_hash(v));
+      if (i >= 0) {
+        lbuf_putc(b, LDATA_SYM_REF);
+        lbuf_varint(b, syms->slots[i].val->num);
+        return NULL;
+      }
+      ltable_put(syms, lval_copy(v), lval_num(syms->count));
+      long n = strlen(v->sym);
+      lbuf_putc(b, LDATA_SYM);
+      lbuf_varint(b, n);
+      lbuf_write(b, v->sym, n);
+      return NULL;
+    }
+
+    case LVAL_QEXPR:
+    case LVAL_SEXPR:
+      if (v->packed) {
+        lbuf_putc(b, LDATA_PACKED);
+        lbuf_varint(b, v->count);
+        for (int i = 0; i < v->count; i++) { lbuf_zigzag(b, v->packed[i]); }
+        return NULL;
+      }
+      lbuf_putc(b, v->type == LVAL_QEXPR ? LDATA_QEXPR : LDATA_SEXPR);
+      lbuf_varint(b, v->count);
+      for (int i = 0; i < v->count && !err; i++) {
+        err = ldata_write(b, v->cell[i], syms, func, depth + 1);
+      }
+      return err;
+
+    case LVAL_VEC:
+      lbuf_putc(b, v->dvec ? LDATA_DVEC : LDATA_IVEC);
+      lbuf_varint(b, v->count);
+      for (int i = 0; i < v->count; i++) {
+        if (v->dvec) { lbuf_double(b, v->dvec[i]); }
+        else { lbuf_zigzag(b, v->ivec[i]); }
+      }
+      return NULL;
+
+    case LVAL_TABLE:
+      lbuf_putc(b, LDATA_TABLE);
+      lbuf_varint(b, v->table->count);
+      for (int i = 0; i < v->table->cap && !err; i++) {
+        ltable_slot* s = &v->table->slots[i];
+        if (!s->key) { continue; }
+        err = ldata_write(b, s->key, syms, func, depth + 1);
+        if (!err) { err = ldata_write(b, s->val, syms, func, depth + 1); }
+      }
+      return err;
+
+    case LVAL_MAP:
+    case LVAL_SET:
+      lbuf_putc(b, v->type == LVAL_MAP ? LDATA_MAP : LDATA_SET);
+      lbuf_varint(b, v->count);
+      return ldata_write_hamt(b, v->hamt, syms, func, depth + 1);
+  }
+  return lval_err("function '%s' passed %s, which has no serialized form.",
+                  func, ltype_name(v->type));
+}
+
+/* the state of reading a value back out of the binary format */
+typedef struct {
+  unsigned char* s;
+  long len;
+  long pos;
+  char* func;
+  /* strings are read as views of the bytes, into the buffer of the
+     string being read or the file mapping being read */
+  lstrbuf* share;
+  lmap* map;
+  /* a q-expression of the symbols read so far, in order */
+  lval* syms;
+} ldata;
+
+lval* ldata_err(ldata* d, char* what) {
+  return lval_err("function '%s' passed malformed data at byte %li. %s",
+                  d->func, d->pos, what);
+}
+
+int ldata_varint(ldata* d, unsigned long* u) {
+  *u = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (d->pos >= d->len) { return 0; }
+    unsigned char c = d->s[d->pos++];
+    *u |= (unsigned long)(c & 0x7f) << shift;
+    if (!(c & 0x80)) { return 1; }
+  }
+  return 0;
+}
+
+int ldata_zigzag(ldata* d, long* n) {
+  unsigned long u;
+  if (!ldata_varint(d, &u)) { return 0; }
+  *n = (long)(u >> 1) ^ -(long)(u & 1);
+  return 1;
+}
+
+/* read a count of things taking at least size bytes each, so a
+   corrupt count is caught before anything is allocated for it */
+int ldata_count(ldata* d, int* n, long size) {
+  unsigned long u;
+  if (!ldata_varint(d, &u) || u > INT_MAX
+      || u > (unsigned long)(d->len - d->pos) / size) { return 0; }
+  *n = u;
+  return 1;
+}
+
+double ldata_double(ldata* d) {
+  uint64_t u = 0;
+  for (int i = 0; i < 8; i++) { u |= (uint64_t)d->s[d->pos++] << (8 * i); }
+  double x;
+  memcpy(&x, &u, sizeof(double));
+  return x;
+}
+
+lval* ldata_read(ldata* d, int depth);
+
+/* read count items into a list, or pairs into a hash map, map or set */
+lval* ldata_read_items(ldata* d, int tag, int count, int depth) {
+  lval* v;
+  if (tag == LDATA_QEXPR || tag == LDATA_SEXPR) {
+    v = tag == LDATA_QEXPR ? lval_qexpr() : lval_sexpr();
+    v->cell = malloc(sizeof(lval*) * (count ? count : 1));
+    for (int i = 0; i < count; i++) {
+      lval* x = ldata_read(d, depth + 1);
+      if (x->type == LVAL_ERR) { lval_del(v); return x; }
+      v->cell[v->count++] = x;
+    }
+    return v;
+  }
+
+  v = tag == LDATA_TABLE ? lval_table(ltable_new(count))
+    : lval_hamt(tag == LDATA_MAP ? LVAL_MAP : LVAL_SET, NULL, 0);
+  for (int i = 0; i < count; i++) {
+    lval* key = ldata_read(d, depth + 1);
+    lval* val = tag == LDATA_SET || key->type == LVAL_ERR
+      ? NULL : ldata_read(d, depth + 1);
+    lval* err = key->type == LVAL_ERR ? key : val && val->type == LVAL_ERR ? val : NULL;
+    if (err) {
+      if (err != key) { lval_del(key); }
+      lval_del(v);
+      return err;
+    }
+    if (tag == LDATA_TABLE) {
+      ltable_put(v->table, key, val);
+    } else {
+      lval* x = lhamt_put(v, key, val);
+      lval_del(v);
+      v = x;
+    }
+  }
+  return v;
+}
+
+lval* ldata_read(ldata* d, int depth) {
+  if (depth >= LDATA_DEPTH) { return ldata_err(d, "nested too deeply."); }
+  if (d->pos >= d->len) { return ldata_err(d, "unexpected end of data."); }
+  int tag = d->s[d->pos++];
+  unsigned long u;
+  long n;
+  int count;
+  lval* v;
+  switch (tag) {
+    case LDATA_NUM:
+      if (!ldata_zigzag(d, &n)) { return ldata_err(d, "bad number."); }
+      return lval_num(n);
+
+    case LDATA_BIG:
+    case LDATA_NEG_BIG:
+      if (!ldata_count(d, &count, 1) || count == 0) {
+        return ldata_err(d, "bad big number.");
+      }
+      v = lval_big(tag == LDATA_NEG_BIG ? -1 : 1, count);
+      for (int i = 0; i < count; i++) {
+        if (!ldata_varint(d, &u) || u >= 1000000000) {
+          lval_del(v);
+          return ldata_err(d, "bad big number.");
+        }
+        v->limbs[i] = u;
+      }
+      return lbig_norm(v);
+
+    case LDATA_DBL:
+      if (d->len - d->pos < 8) { return ldata_err(d, "unexpected end of data."); }
+      return lval_dbl(ldata_double(d));
+
+    case LDATA_STR: {
+      if (!ldata_count(d, &count, 1)) { return ldata_err(d, "bad string length."); }
+      char* s = (char*)d->s + d->pos;
+      d->pos += count;
+      if (d->map) { return lval_str_view(d->map, s, count); }
+      if (!d->share) { return lval_str_len(s, count); }
+      v = malloc(sizeof(lval));
+      v->type = LVAL_STR;
+      v->count = count;
+      v->sbuf = d->share;
+      v->sbuf->refs++;
+      v->str = s;
+      return v;
+    }
+
+    case LDATA_SYM: {
+      if (!ldata_count(d, &count, 1) || count == 0
+          || memchr(d->s + d->pos, '\0', count)) {
+        return ldata_err(d, "bad symbol.");
+      }
+      char* name = malloc(count + 1);
+      memcpy(name, d->s + d->pos, count);
+      name[count] = '\0';
+      d->pos += count;
+      v = lval_sym(name);
+      free(name);
+      lval_add(d->syms, lval_copy(v));
+      return v;
+    }
+
+    case LDATA_SYM_REF:
+      if (!ldata_varint(d, &u) || u >= (unsigned long)d->syms->count) {
+        return ldata_err(d, "bad symbol reference.");
+      }
+      return lval_copy(d->syms->cell[u]);
+
+    case LDATA_PACKED:
+      if (!ldata_count(d, &count, 1)) { return ldata_err(d, "bad list length."); }
+      v = lval_qexpr();
+      v->packed = malloc(sizeof(long) * (count ? count : 1));
+      for (; v->count < count; v->count++) {
+        if (!ldata_zigzag(d, &v->packed[v->count])) {
+          lval_del(v);
+          return ldata_err(d, "bad number.");
+        }
+      }
+      return v;
+
+    case LDATA_IVEC:
+    case LDATA_DVEC:
+      if (!ldata_count(d, &count, tag == LDATA_DVEC ? 8 : 1)) {
+        return ldata_err(d, "bad vector length.");
+      }
+      v = lval_vec(tag == LDATA_DVEC, count);
+      for (int i = 0; i < count; i++) {
+        if (v->dvec) {
+          v->dvec[i] = ldata_double(d);
+        } else if (!ldata_zigzag(d, &v->ivec[i])) {
+          lval_del(v);
+          return ldata_err(d, "bad number.");
+        }
+      }
+      return v;
+
+    case LDATA_QEXPR:
+    case LDATA_SEXPR:
+    case LDATA_TABLE:
+    case LDATA_MAP:
+    case LDATA_SET:
+      if (!ldata_count(d, &count, tag == LDATA_TABLE || tag == LDATA_MAP ? 2 : 1)) {
+        return ldata_err(d, "bad length.");
+      }
+      return ldata_read_items(d, tag, count, depth);
+  }
+  d->pos--;
+  return ldata_err(d, "unknown tag.");
+}
+
+/* read the whole of s as a serialized value */
+lval* ldata_decode(char* s, long len, char* func, lstrbuf* share, lmap* map) {
+  ldata d = { (unsigned char*)s, len, 0, func, share, map, lval_qexpr() };
+  lval* v;
+  if (len < 4 || memcmp(s, "ald", 3) != 0) {
+    v = ldata_err(&d, "not serialized data.");
+  } else if (s[3] != LDATA_VERSION) {
+    d.pos = 3;
+    v = ldata_err(&d, "unknown version.");
+  } else {
+    d.pos = 4;
+    v = ldata_read(&d, 0);
+    if (v->type != LVAL_ERR && d.pos < d.len) {
+      lval_del(v);
+      v = ldata_err(&d, "unexpected bytes after the value.");
+    }
+  }
+  lval_del(d.syms);
+  return v;
+}
+
+/* (serialize v), a string of the bytes of v in the binary format */
+lval* builtin_serialize(lenv* e, lval* a) {
+  LASSERT_NUM("serialize", a, 1);
+
+  lbuf b = { NULL, 0, 0, NULL, -1, 0 };
+  lbuf_puts(&b, "ald");
+  lbuf_putc(&b, LDATA_VERSION);
+  ltable* syms = ltable_new(0);
+  lval* err = ldata_write(&b, a->cell[0], syms, "serialize", 0);
+  ltable_release(syms);
+  lval_del(a);
+  if (!err && b.len > INT_MAX) {
+    err = lval_err("function 'serialize' result is too long.");
+  }
+  if (err) { free(b.data); return err; }
+  lval* r = lval_str_len(b.data, b.len);
+  free(b.data);
+  return r;
+}
+
+/* (deserialize s), the value serialized in a string. strings in it
+   are read as substrings of s rather than copied out */
+lval* builtin_deserialize(lenv* e, lval* a) {
+  LASSERT_NUM("deserialize", a, 1);
+  LASSERT_TYPE("deserialize", a, 0, LVAL_STR);
+
+  lval* s = a->cell[0];
+  lval* v = ldata_decode(s->str, s->count, "deserialize", s->sbuf, NULL);
+  lval_del(a);
+  return v;
+}
+
+/* (load-data filename), the value serialized in a file, as written
+   out with serialize. the file is mapped and strings in it are read
+   as views of the mapping */
+lval* builtin_load_data(lenv* e, lval* a) {
+  LASSERT_NUM("load-data", a, 1);
+  LASSERT_TYPE("load-data", a, 0, LVAL_STR);
+
+  lval* err = NULL;
+  lmap* m = lmap_arg("load-data", a, &err);
+  lval_del(a);
+  if (!m) { return err; }
+  lval* v = ldata_decode(m->data, m->len, "load-data", NULL, m);
+  lmap_release(m);
+  return v;
+}
+
+/* frames are tables held a column at a time. each column is a
+   contiguous array of longs or doubles, or of codes into the
+   distinct strings of a string column, so filtering and aggregating
+   are tight loops over plain arrays */
+enum { LCOL_INT, LCOL_DBL, LCOL_STR };
+
+/* the distinct strings of a string column, shared with the columns
+   gathered from it */
+typedef struct {
+  int refs;
+  /* a q-expression of strings, indexed by code */
+  lval* strs;
+} ldict;
+
+/* columns never change once built, so frames share them */
+typedef struct {
+  int refs;
+  int kind;
+  char* name;
+  int rows;
+  /* one value for each row, in the array for the kind */
+  long* ints;
+  double* dbls;
+  int* codes;
+  ldict* dict;
+} lcol;
+
+struct lframe {
+  int refs;
+  int rows;
+  int ncols;
+  lcol** cols;
+};
+
+void ldict_release(ldict* d) {
+  if (--d->refs > 0) { return; }
+  lval_del(d->strs);
+  free(d);
+}
+
+lcol* lcol_new(int kind, char* name, int rows) {
+  lcol* c = calloc(1, sizeof(lcol));
+  c->refs = 1;
+  c->kind = kind;
+  c->name = strcpy(malloc(strlen(name) + 1), name);
+  c->rows = rows;
+  size_t n = rows ? rows : 1;
+  if (kind == LCOL_INT) { c->ints = malloc(sizeof(long) * n); }
+  if (kind == LCOL_DBL) { c->dbls = malloc(sizeof(double) * n); }
+  if (kind == LCOL_STR) { c->codes = malloc(sizeof(int) * n); }
+  return c;
+}
+
+void lcol_release(lcol* c) {
+  if (--c->refs > 0) { return; }
+  free(c->name);
+  free(c->ints);
+  free(c->dbls);
+  free(c->codes);
+  if (c->dict) { ldict_release(c->dict); }
+  free(c);
+}
+
+/* a new column of the rows of c picked out by idx, in order */
+lcol* lcol_gather(lcol* c, char* name, int* idx, int n) {
+  lcol* r = lcol_new(c->kind, name, n);
+  switch (c->kind) {
+    case LCOL_INT: for (int i = 0; i < n; i++) { r->ints[i] = c->ints[idx[i]]; } break;
+    case LCOL_DBL: for (int i = 0; i < n; i++) { r->dbls[i] = c->dbls[idx[i]]; } break;
+    case LCOL_STR:
+      for (int i = 0; i < n; i++) { r->codes[i] = c->codes[idx[i]]; }
+      r->dict = c->dict;
+      r->dict->refs++;
+      break;
+  }
+  return r;
+}
+
+/* the value of one row of a column */
+lval* lcol_item(lcol* c, int i) {
+  switch (c->kind) {
+    case LCOL_INT: return lval_num(c->ints[i]);
+    case LCOL_DBL: return lval_dbl(c->dbls[i]);
+  }
+  return lval_copy(c->dict->strs->cell[c->codes[i]]);
+}
+
+lframe* lframe_new(int rows, int ncols) {
+  lframe* f = malloc(sizeof(lframe));
+  f->refs = 1;
+  f->rows = rows;
+  f->ncols = ncols;
+  f->cols = calloc(ncols > 0 ? ncols : 1, sizeof(lcol*));
+  return f;
+}
+
+lframe* lframe_retain(lframe* f) {
+  f->refs++;
+  return f;
+}
+
+void lframe_release(lframe* f) {
+  if (--f->refs > 0) { return; }
+  for (int i = 0; i < f->ncols; i++) {
+    if (f->cols[i]) { lcol_release(f->cols[i]); }
+  }
+  free(f->cols);
+  free(f);
+}
+
+lval* lval_frame(lframe* f) {
+  lval* v = malloc(sizeof(lval));
+  v->type = LVAL_FRAME;
+  v->frame = f;
+  return v;
+}
+
+/* the index of the column named by a string, or -1 */
+int lframe_find(lframe* f, lval* name) {
+  for (int i = 0; i < f->ncols; i++) {
+    char* n = f->cols[i]->name;
+    if ((int)strlen(n) == name->count && memcmp(n, name->str, name->count) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/* check argument index names a column of the frame in argument 0 */
+#define LASSERT_COLUMN(func, args, index) \
+  LASSERT_TYPE(func, args, index, LVAL_STR); \
+  LASSERT(args, lframe_find(args->cell[0]->frame, args->cell[index]) >= 0, \
+          "function '%s' passed unknown column '%s'.", \
+          func, lval_cstr(args->cell[index]))
+
+/* strings are interned into codes through an open addressed table of
+   the codes, which owns a copy of each distinct string */
+typedef struct {
+  int count;
+  int size;
+  char** strs;
+  int* lens;
+  unsigned long* hashes;
+  /* number of slots, a power of two, each 0 or a code plus one */
+  int cap;
+  int* slots;
+} lintern;
+
+void lintern_free(lintern* t) {
+  for (int i = 0; i < t->count; i++) { free(t->strs[i]); }
+  free(t->strs);
+  free(t->lens);
+  free(t->hashes);
+  free(t->slots);
+}
+
+/* the code of a string with hash h, or -1 if it is not interned */
+int lintern_find(lintern* t, char* s, int n, unsigned long h) {
+  if (!t->cap) { return -1; }
+  for (int i = h & (t->cap - 1); t->slots[i]; i = (i + 1) & (t->cap - 1)) {
+    int c = t->slots[i] - 1;
+    if (t->hashes[c] == h && t->lens[c] == n && memcmp(t->strs[c], s, n) == 0) {
+      return c;
+    }
+  }
+  return -1;
+}
+
+int lintern_add(lintern* t, char* s, int n) {
+  unsigned long h = lhash_bytes(0, s, n);
+  int found = lintern_find(t, s, n, h);
+  if (found >= 0) { return found; }
+
+  /* kept at most half full */
+  if ((t->count + 1) * 2 > t->cap) {
+    free(t->slots);
+    t->cap = t->cap ? t->cap * 2 : 64;
+    t->slots = calloc(t->cap, sizeof(int));
+    for (int c = 0; c < t->count; c++) {
+      int i = t->hashes[c] & (t->cap - 1);
+      while (t->slots[i]) { i = (i + 1) & (t->cap - 1); }
+      t->slots[i] = c + 1;
+    }
+  }
+  if (t->count == t->size) {
+    t->size = t->size ? t->size * 2 : 64;
+    t->strs = realloc(t->strs, sizeof(char*) * t->size);
+    t->lens = realloc(t->lens, sizeof(int) * t->size);
+    t->hashes = realloc(t->hashes, sizeof(unsigned long) * t->size);
+  }
+  int c = t->count++;
+  t->strs[c] = memcpy(malloc(n ? n : 1), s, n);
+  t->lens[c] = n;
+  t->hashes[c] = h;
+  int i = h & (t->cap - 1);
+  while (t->slots[i]) { i = (i + 1) & (t->cap - 1); }
+  t->slots[i] = c + 1;
+  return c;
+}
+
+/* the interned strings as the dictionary of a string column */
+ldict* lintern_dict(lintern* t) {
+  ldict* d = malloc(sizeof(ldict));
+  d->refs = 1;
+  d->strs = lval_qexpr();
+  d->strs->cell = malloc(sizeof(lval*) * (t->count ? t->count : 1));
+  for (int i = 0; i < t->count; i++) {
+    d->strs->cell[d->strs->count++] = lval_str_len(t->strs[i], t->lens[i]);
+  }
+  return d;
+}
+
+/* csv files are loaded in two passes over the mapped file, each split
+   across threads by rows. the first finds the kind of each column,
+   the most general of int, float and string its fields need, and the
+   second parses every field into its place in the column */
+
+/* the start of the next comma or newline, sixteen bytes at a time
+   where sse2 is available */
+char* lcsv_delim(char* p, char* end) {
+#ifdef LVEC_X86
+  __m128i comma = _mm_set1_epi8(',');
+  __m128i newline = _mm_set1_epi8('\n');
+  while (end - p >= 16) {
+    __m128i c = _mm_loadu_si128((__m128i*)p);
+    unsigned mask = _mm_movemask_epi8(
+      _mm_or_si128(_mm_cmpeq_epi8(c, comma), _mm_cmpeq_epi8(c, newline)));
+    if (mask) { return p + __builtin_ctz(mask); }
+    p += 16;
+  }
+#endif
+  while (p < end && *p != ',' && *p != '\n') { p++; }
+  return p;
+}
+
+/* read the field at p, pointing s at its contents and setting n to
+   their length. a quoted field with doubled quotes in it is unescaped
+   into tmp. returns where the next field starts, setting last if the
+   field ended its row */
+char* lcsv_field(char* p, char* end, char** s, long* n, int* last, lbuf* tmp) {
+  if (p < end && *p == '"') {
+    char* from = ++p;
+    int escaped = 0;
+    tmp->len = 0;
+    for (;;) {
+      char* quote = memchr(p, '"', end - p);
+      if (!quote) { quote = end; }
+      if (quote + 1 < end && quote[1] == '"') {
+        lbuf_write(tmp, p, quote + 1 - p);
+        p = quote + 2;
+        escaped = 1;
+        continue;
+      }
+      if (escaped) {
+        lbuf_write(tmp, p, quote - p);
+        *s = tmp->data;
+        *n = tmp->len;
+      } else {
+        *s = from;
+        *n = quote - from;
+      }
+      p = quote < end ? quote + 1 : end;
+      break;
+    }
+    /* anything between the closing quote and the comma is dropped */
+    p = lcsv_delim(p, end);
+  } else {
+    char* q = lcsv_delim(p, end);
+    *s = p;
+    *n = q - p;
+    if (q < end && *q == '\n' && *n > 0 && p[*n - 1] == '\r') { (*n)--; }
+    p = q;
+  }
+  *last = p >= end || *p == '\n';
+  return p < end ? p + 1 : end;
+}
+
+/* the number a csv field holds, LCOL_INT or LCOL_DBL with the value
+   in i or d, or LCOL_STR if it is not a number */
+int lcsv_number(char* s, long n, long* i, double* d) {
+  static const double pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+    1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+    1e20, 1e21, 1e22 };
+  char* p = s;
+  char* end = s + n;
+  int neg = 0;
+  if (p < end && (*p == '-' || *p == '+')) { neg = *p++ == '-'; }
+
+  /* up to nineteen significant digits are kept in m, and the power
+     of ten to scale them by in e */
+  unsigned long m = 0;
+  int sig = 0, digits = 0, frac = 0;
+  long e = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+    if (sig < 19) { m = m * 10 + (*p - '0'); sig += m != 0; } else { e++; }
+  }
+  if (p < end && *p == '.') {
+    frac = 1;
+    for (p++; p < end && *p >= '0' && *p <= '9'; p++, digits++) {
+      if (sig < 19) { m = m * 10 + (*p - '0'); sig += m != 0; e--; }
+    }
+  }
+  if (!digits) { return LCOL_STR; }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    frac = 1;
+    int eneg = 0;
+    if (++p < end && (*p == '-' || *p == '+')) { eneg = *p++ == '-'; }
+    if (p == end || *p < '0' || *p > '9') { return LCOL_STR; }
+    long x = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) { if (x < 100000) { x = x * 10 + (*p - '0'); } }
+    e += eneg ? -x : x;
+  }
+  if (p != end) { return LCOL_STR; }
+
+  if (!frac && e == 0 && m <= (unsigned long)LONG_MAX + neg) {
+    *i = neg ? (long)(0 - m) : (long)m;
+    return LCOL_INT;
+  }
+  /* exact when the digits and the power of ten are both exact doubles */
+  if (sig <= 15 && e >= -22 && e <= 22) {
+    double x = e < 0 ? (double)m / pow10[-e] : (double)m * pow10[e];
+    *d = neg ? -x : x;
+    return LCOL_DBL;
+  }
+  char tmp[64];
+  char* copy = n < (long)sizeof(tmp) ? tmp : malloc(n + 1);
+  memcpy(copy, s, n);
+  copy[n] = '\0';
+  *d = strtod(copy, NULL);
+  if (copy != tmp) { free(copy); }
+  return LCOL_DBL;
+}
+
+/* the work of one thread over one chunk of rows */
+typedef struct {
+  char* start;
+  char* end;
+  int ncols;
+  int pass;
+  /* the first pass finds the number of rows and the kind of each
+     column, or -1 where every field is empty */
+  int rows;
+  int* kinds;
+  /* the second pass fills rows from row0 of cols, interning strings
+     into a table for each column */
+  int row0;
+  lcol** cols;
+  lintern* interns;
+  /* the start of a row with the wrong number of fields */
+  char* bad;
+  int bad_fields;
+  lbuf tmp;
+} lcsv_job;
+
+void* lcsv_run(void* arg) {
+  lcsv_job* j = arg;
+  char* p = j->start;
+  int row = 0;
+  while (p < j->end) {
+    /* blank lines are skipped */
+    if (*p == '\n' || (*p == '\r' && p + 1 < j->end && p[1] == '\n')) {
+      p += *p == '\r' ? 2 : 1;
+      continue;
+    }
+    char* start = p;
+    int col = 0;
+    int last = 0;
+    while (!last) {
+      char* s;
+      long n;
+      long iv;
+      double dv;
+      p = lcsv_field(p, j->end, &s, &n, &last, &j->tmp);
+      if (col >= j->ncols) { col++; continue; }
+      if (j->pass == 1) {
+        if (n && j->kinds[col] != LCOL_STR) {
+          int k = lcsv_number(s, n, &iv, &dv);
+          if (k > j->kinds[col]) { j->kinds[col] = k; }
+        }
+      } else {
+        lcol* c = j->cols[col];
+        int r = j->row0 + row;
+        if (c->kind == LCOL_STR) {
+          c->codes[r] = lintern_add(&j->interns[col], s, n);
+        } else if (!n) {
+          if (c->kind == LCOL_INT) { c->ints[r] = 0; } else { c->dbls[r] = NAN; }
+        } else if (lcsv_number(s, n, &iv, &dv) == LCOL_INT) {
+          if (c->kind == LCOL_INT) { c->ints[r] = iv; } else { c->dbls[r] = iv; }
+        } else {
+          c->dbls[r] = dv;
+        }
+      }
+      col++;
+    }
+    if (col != j->ncols) {
+      j->bad = start;
+      j->bad_fields = col;
+      return NULL;
+    }
+    if (j->pass == 1 && row == INT_MAX) {
+      j->bad = start;
+      j->bad_fields = -1;
+      return NULL;
+    }
+    row++;
+  }
+  if (j->pass == 1) { j->rows = row; }
+  return NULL;
+}
+
+/* run the jobs, one on this thread and the rest on threads of their
+   own. windows runs them one after another */
+void lcsv_run_all(lcsv_job* jobs, int n) {
+#ifdef _WIN32
+  for (int i = 0; i < n; i++) { lcsv_run(&jobs[i]); }
+#else
+  pthread_t* threads = malloc(sizeof(pthread_t) * n);
+  int* started = calloc(n, sizeof(int));
+  for (int i = 1; i < n; i++) {
+    started[i] = pthread_create(&threads[i], NULL, lcsv_run, &jobs[i]) == 0;
+    if (!started[i]) { lcsv_run(&jobs[i]); }
+  }
+  lcsv_run(&jobs[0]);
+  for (int i = 1; i < n; i++) {
+    if (started[i]) { pthread_join(threads[i], NULL); }
+  }
+  free(threads);
+  free(started);
+#endif
+}
+
+/* split the rows from p to end into n chunks of about the same size.
+   newlines inside quoted fields don't end rows, so the quotes up to
+   each split are counted to know whether it falls inside one */
+void lcsv_split(char* p, char* end, int n, char** starts) {
+  starts[0] = p;
+  int quoted = 0;
+  char* at = p;
+  for (int k = 1; k < n; k++) {
+    char* target = p + (end - p) / n * k;
+    if (target > at) {
+      char* q;
+      while ((q = memchr(at, '"', target - at))) {
+        quoted ^= 1;
+        at = q + 1;
+      }
+      at = target;
+    }
+    while (at < end && (*at != '\n' || quoted)) {
+      if (*at == '"') { quoted ^= 1; }
+      at++;
+    }
+    if (at < end) { at++; }
+    starts[k] = at;
+  }
+  starts[n] = end;
+}
+
+/* the number of threads to load a file of len bytes with, one for
+   each processor but none for less than a megabyte */
+int lcsv_threads(size_t len) {
+#ifdef _WIN32
+  long cpus = 1;
+#else
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+  long n = len / (1 << 20) + 1;
+  if (n > cpus) { n = cpus; }
+  if (n > 64) { n = 64; }
+  return n < 1 ? 1 : n;
+}
+
+/* load a csv file with a header row of column names into a frame */
+lval* lframe_load_csv(char* data, size_t len) {
+  char* end = data + len;
+  lbuf tmp = { NULL, 0, 0, NULL, -1, 0 };
+
+  /* the header row names the columns */
+  lval* names = lval_qexpr();
+  char* p = data;
+  int last = len == 0;
+  while (!last) {
+    char* s;
+    long n;
+    p = lcsv_field(p, end, &s, &n, &last, &tmp);
+    lval_add(names, lval_str_len(s, n));
+  }
+  free(tmp.data);
+  int ncols = names->count;
+
+  int nt = lcsv_threads(end - p);
+  lcsv_job* jobs = calloc(nt, sizeof(lcsv_job));
+  char** starts = malloc(sizeof(char*) * (nt + 1));
+  lcsv_split(p, end, nt, starts);
+  for (int i = 0; i < nt; i++) {
+    jobs[i].start = starts[i];
+    jobs[i].end = starts[i + 1];
+    jobs[i].ncols = ncols;
+    jobs[i].pass = 1;
+    jobs[i].kinds = malloc(sizeof(int) * (ncols ? ncols : 1));
+    for (int c = 0; c < ncols; c++) { jobs[i].kinds[c] = -1; }
+    jobs[i].tmp = (lbuf){ NULL, 0, 0, NULL, -1, 0 };
+  }
+  free(starts);
+  lcsv_run_all(jobs, nt);
+
+  /* the rows of each chunk follow on from the chunk before */
+  lval* err = NULL;
+  long rows = 0;
+  for (int i = 0; i < nt && !err; i++) {
+    if (jobs[i].bad) {
+      long line = 1;
+      for (char* q = data; (q = memchr(q, '\n', jobs[i].bad - q)); q++) { line++; }
+      err = jobs[i].bad_fields < 0
+        ? lval_err("function 'read-csv' passed a file with too many rows.")
+        : lval_err("function 'read-csv' passed a file with %i fields on line %li, "
+                   "expected %i.", jobs[i].bad_fields, line, ncols);
+    }
+    jobs[i].row0 = rows;
+    rows += jobs[i].rows;
+  }
+  if (!err && rows > INT_MAX) {
+    err = lval_err("function 'read-csv' passed a file with too many rows.");
+  }
+
+  lframe* f = NULL;
+  if (!err) {
+    f = lframe_new(rows, ncols);
+    for (int c = 0; c < ncols; c++) {
+      int kind = -1;
+      for (int i = 0; i < nt; i++) {
+        if (jobs[i].kinds[c] > kind) { kind = jobs[i].kinds[c]; }
+      }
+      /* a column with nothing in it is a column of empty strings */
+      f->cols[c] = lcol_new(kind < 0 ? LCOL_STR : kind, lval_cstr(names->cell[c]), rows);
+    }
+    for (int i = 0; i < nt; i++) {
+      jobs[i].pass = 2;
+      jobs[i].cols = f->cols;
+      jobs[i].interns = calloc(ncols ? ncols : 1, sizeof(lintern));
+    }
+    lcsv_run_all(jobs, nt);
+
+    /* merge the strings each thread interned, renumbering its codes */
+    for (int c = 0; c < ncols; c++) {
+      lcol* col = f->cols[c];
+      if (col->kind != LCOL_STR) { continue; }
+      lintern all = { 0 };
+      for (int i = 0; i < nt; i++) {
+        lintern* t = &jobs[i].interns[c];
+        int* code = malloc(sizeof(int) * (t->count ? t->count : 1));
+        for (int k = 0; k < t->count; k++) { code[k] = lintern_add(&all, t->strs[k], t->lens[k]); }
+        int* r = col->codes + jobs[i].row0;
+        for (int k = 0; k < jobs[i].rows; k++) { r[k] = code[r[k]]; }
+        free(code);
+      }
+      col->dict = lintern_dict(&all);
+      lintern_free(&all);
+    }
+  }
+
+  for (int i = 0; i < nt; i++) {
+    free(jobs[i].kinds);
+    free(jobs[i].tmp.data);
+    if (jobs[i].interns) {
+      for (int c = 0; c < ncols; c++) { lintern_free(&jobs[i].interns[c]); }
+      free(jobs[i].interns);
+    }
+  }
+  free(jobs);
+  lval_del(names);
+  return err ? err : lval_frame(f);
+}
+
+/* (read-csv filename) loads a csv file with a header row into a frame.
+   columns of whole numbers are read as ints, columns of numbers as
+   floats, and anything else as strings. empty fields read as 0, nan
+   or an empty string */
+lval* builtin_read_csv(lenv* e, lval* a) {
+  LASSERT_NUM("read-csv", a, 1);
+  LASSERT_TYPE("read-csv", a, 0, LVAL_STR);
+
+  lval* err = NULL;
+  lmap* m = lmap_arg("read-csv", a, &err);
+  lval_del(a);
+  if (!m) { return err; }
+  lval* r = lframe_load_csv(m->data, m->len);
+  lmap_release(m);
+  return r;
+}
+
+/* (frame {name column ...}), a frame of columns given as vectors or
+   q-expressions of strings, all the same length */
+lval* builtin_frame(lenv* e, lval* a) {
+  LASSERT_NUM("frame", a, 1);
+  LASSERT_TYPE("frame", a, 0, LVAL_QEXPR);
+  lval* q = lval_unpack(a->cell[0]);
+  LASSERT(a, q->count % 2 == 0, "function 'frame' passed a column name without a column.");
+
+  int rows = q->count ? q->cell[1]->count : 0;
+  for (int i = 0; i < q->count; i += 2) {
+    lval* name = q->cell[i];
+    lval* col = q->cell[i+1];
+    LASSERT(a, name->type == LVAL_STR,
+            "function 'frame' passed %s for a column name, expected %s.",
+            ltype_name(name->type), ltype_name(LVAL_STR));
+    LASSERT(a, col->type == LVAL_VEC || col->type == LVAL_QEXPR,
+            "function 'frame' passed %s for column '%s', expected %s or %s.",
+            ltype_name(col->type), lval_cstr(name), ltype_name(LVAL_VEC),
+            ltype_name(LVAL_QEXPR));
+    LASSERT(a, col->count == rows,
+            "function 'frame' passed column '%s' of length %i, expected %i.",
+            lval_cstr(name), col->count, rows);
+    if (col->type == LVAL_QEXPR) {
+      lval_unpack(col);
+      for (int r = 0; r < rows; r++) {
+        LASSERT(a, col->cell[r]->type == LVAL_STR,
+                "function 'frame' passed a list holding %s for column '%s'. "
+                "lists are columns of strings, vectors of numbers.",
+                ltype_name(col->cell[r]->type), lval_cstr(name));
+      }
+    }
+  }
+
+  lframe* f = lframe_new(rows, q->count / 2);
+  for (int i = 0; i < q->count; i += 2) {
+    lval* col = q->cell[i+1];
+    int kind = col->type == LVAL_QEXPR ? LCOL_STR : col->dvec ? LCOL_DBL : LCOL_INT;
+    lcol* c = f->cols[i / 2] = lcol_new(kind, lval_cstr(q->cell[i]), rows);
+    if (kind == LCOL_INT) { memcpy(c->ints, col->ivec, sizeof(long) * rows); }
+    if (kind == LCOL_DBL) { memcpy(c->dbls, col->dvec, sizeof(double) * rows); }
+    if (kind == LCOL_STR) {
+      lintern t = { 0 };
+      for (int r = 0; r < rows; r++) {
+        c->codes[r] = lintern_add(&t, col->cell[r]->str, col->cell[r]->count);
+      }
+      c->dict = lintern_dict(&t);
+      lintern_free(&t);
+    }
+  }
+  lval_del(a);
+  return lval_frame(f);
+}
+
+lval* builtin_frame_rows(lenv* e, lval* a) {
+  LASSERT_NUM("frame-rows", a, 1);
+  LASSERT_TYPE("frame-rows", a, 0, LVAL_FRAME);
+  lval* r = lval_num(a->cell[0]->frame->rows);
+  lval_del(a);
+  return r;
+}
+
+/* the names of the columns of a frame, as a q-expression of strings */
+lval* builtin_frame_names(lenv* e, lval* a) {
+  LASSERT_NUM("frame-names", a, 1);
+  LASSERT_TYPE("frame-names", a, 0, LVAL_FRAME);
+  lframe* f = a->cell[0]->frame;
+  lval* r = lval_qexpr();
+  for (int i = 0; i < f->ncols; i++) { lval_add(r, lval_str(f->cols[i]->name)); }
+  lval_del(a);
+  return r;
+}
+
+/* (frame-col f name), a column as a vector, or a q-expression of
+   strings for a column of strings */
+lval* builtin_frame_col(lenv* e, lval* a) {
+  LASSERT_NUM("frame-col", a, 2);
+  LASSERT_TYPE("frame-col", a, 0, LVAL_FRAME);
+  LASSERT_COLUMN("frame-col", a, 1);
+
+  lframe* f = a->cell[0]->frame;
+  lcol* c = f->cols[lframe_find(f, a->cell[1])];
+  lval* r;
+  if (c->kind == LCOL_STR) {
+    r = lval_qexpr();
+    r->cell = malloc(sizeof(lval*) * (c->rows ? c->rows : 1));
+    for (int i = 0; i < c->rows; i++) { r->cell[r->count++] = lcol_item(c, i); }
+  } else {
+    r = lval_vec(c->kind == LCOL_DBL, c->rows);
+    if (c->ints) { memcpy(r->ivec, c->ints, sizeof(long) * c->rows); }
+    if (c->dbls) { memcpy(r->dvec, c->dbls, sizeof(double) * c->rows); }
+  }
+  lval_del(a);
+  return r;
+}
+
+/* (frame-row f i), the values of row i as a q-expression */
+lval* builtin_frame_row(lenv* e, lval* a) {
+  LASSERT_NUM("frame-row", a, 2);
+  LASSERT_TYPE("frame-row", a, 0, LVAL_FRAME);
+  LASSERT_TYPE("frame-row", a, 1, LVAL_NUM);
+  lframe* f = a->cell[0]->frame;
+  long i = a->cell[1]->num;
+  LASSERT(a, i >= 0 && i < f->rows,
+          "function 'frame-row' passed index %li out of range for %i rows.", i, f->rows);
+
+  lval* r = lval_qexpr();
+  for (int c = 0; c < f->ncols; c++) { lval_add(r, lcol_item(f->cols[c], i)); }
+  lval_del(a);
+  return r;
+}
+
+/* (frame-select f {names}), a frame of just the named columns, which
+   it shares with f */
+lval* builtin_frame_select(lenv* e, lval* a) {
+  LASSERT_NUM("frame-select", a, 2);
+  LASSERT_TYPE("frame-select", a, 0, LVAL_FRAME);
+  LASSERT_TYPE("frame-select", a, 1, LVAL_QEXPR);
+  lval* names = lval_unpack(a->cell[1]);
+  lframe* f = a->cell[0]->frame;
+  for (int i = 0; i < names->count; i++) {
+    LASSERT(a, names->cell[i]->type == LVAL_STR,
+            "function 'frame-select' passed %s for a column name, expected %s.",
+            ltype_name(names->cell[i]->type), ltype_name(LVAL_STR));
+    LASSERT(a, lframe_find(f, names->cell[i]) >= 0,
+            "function 'frame-select' passed unknown column '%s'.",
+            lval_cstr(names->cell[i]));
+  }
+
+  lframe* r = lframe_new(f->rows, names->count);
+  for (int i = 0; i < names->count; i++) {
+    r->cols[i] = f->cols[lframe_find(f, names->cell[i])];
+    r->cols[i]->refs++;
+  }
+  lval_del(a);
+  return lval_frame(r);
+}
+
+enum { LCMP_LT, LCMP_LE, LCMP_GT, LCMP_GE, LCMP_EQ, LCMP_NE };
+
+/* the index of rows whose values compare true against x, written
+   without branches so the loop runs at the speed of the array */
+#define LCMP_SCAN(vals, x) \
+  switch (op) { \
+    case LCMP_LT: for (int i = 0; i < n; i++) { idx[k] = i; k += vals[i] <  x; } break; \
+    case LCMP_LE: for (int i = 0; i < n; i++) { idx[k] = i; k += vals[i] <= x; } break; \
+    case LCMP_GT: for (int i = 0; i < n; i++) { idx[k] = i; k += vals[i] >  x; } break; \
+    case LCMP_GE: for (int i = 0; i < n; i++) { idx[k] = i; k += vals[i] >= x; } break; \
+    case LCMP_EQ: for (int i = 0; i < n; i++) { idx[k] = i; k += vals[i] == x; } break; \
+    case LCMP_NE: for (int i = 0; i < n; i++) { idx[k] = i; k += vals[i] != x; } break; \
+  }
+
+/* (frame-where f name op x), the rows of f whose value in the named
+   column compares true against x, for op one of < <= > >= == != */
+lval* builtin_frame_where(lenv* e, lval* a) {
+  static char* ops[] = { "<", "<=", ">", ">=", "==", "!=" };
+  LASSERT_NUM("frame-where", a, 4);
+  LASSERT_TYPE("frame-where", a, 0, LVAL_FRAME);
+  LASSERT_COLUMN("frame-where", a, 1);
+  LASSERT_TYPE("frame-where", a, 2, LVAL_STR);
+  int op = -1;
+  for (int i = 0; i < 6; i++) {
+    if (strcmp(lval_cstr(a->cell[2]), ops[i]) == 0) { op = i; }
+  }
+  LASSERT(a, op >= 0, "function 'frame-where' passed unknown comparison '%s'. "
+          "expected < <= > >= == or !=", lval_cstr(a->cell[2]));
+
+  lframe* f = a->cell[0]->frame;
+  lcol* c = f->cols[lframe_find(f, a->cell[1])];
+  lval* x = a->cell[3];
+  if (c->kind == LCOL_STR) {
+    LASSERT(a, x->type == LVAL_STR,
+            "function 'frame-where' passed %s to compare with column '%s' of strings.",
+            ltype_name(x->type), c->name);
+  } else {
+    LASSERT(a, x->type == LVAL_NUM || x->type == LVAL_DBL,
+            "function 'frame-where' passed %s to compare with column '%s' of numbers.",
+            ltype_name(x->type), c->name);
+  }
+
+  int n = f->rows;
+  int k = 0;
+  int* idx = malloc(sizeof(int) * (n + 1));
+  if (c->kind == LCOL_STR) {
+    /* compare each distinct string once, then scan the codes */
+    lval* strs = c->dict->strs;
+    char* keep = malloc(strs->count + 1);
+    for (int s = 0; s < strs->count; s++) {
+      lval* y = strs->cell[s];
+      int m = y->count < x->count ? y->count : x->count;
+      int cmp = memcmp(y->str, x->str, m);
+      if (cmp == 0) { cmp = (y->count > x->count) - (y->count < x->count); }
+      keep[s] = op == LCMP_LT ? cmp < 0 : op == LCMP_LE ? cmp <= 0
+        : op == LCMP_GT ? cmp > 0 : op == LCMP_GE ? cmp >= 0
+        : op == LCMP_EQ ? cmp == 0 : cmp != 0;
+    }
+    for (int i = 0; i < n; i++) { idx[k] = i; k += keep[c->codes[i]]; }
+    free(keep);
+  } else if (c->kind == LCOL_INT && x->type == LVAL_NUM) {
+    long v = x->num;
+    long* vals = c->ints;
+    LCMP_SCAN(vals, v);
+  } else if (c->kind == LCOL_INT) {
+    double v = x->dbl;
+    long* vals = c->ints;
+    LCMP_SCAN(vals, v);
+  } else {
+    double v = x->type == LVAL_NUM ? (double)x->num : x->dbl;
+    double* vals = c->dbls;
+    LCMP_SCAN(vals, v);
+  }
+
+  lframe* r = lframe_new(k, f->ncols);
+  for (int i = 0; i < f->ncols; i++) {
+    r->cols[i] = lcol_gather(f->cols[i], f->cols[i]->name, idx, k);
+  }
+  free(idx);
+  lval_del(a);
+  return lval_frame(r);
+}
+
+enum { LAGG_COUNT, LAGG_SUM, LAGG_MEAN, LAGG_MIN, LAGG_MAX };
+
+/* run body for every row i of n, with g the group of the row, or
+   group 0 for every row when there is no grouping */
+#define LGROUP_EACH(gid, n, body) \
+  if (gid) { for (int i = 0; i < n; i++) { int g = gid[i]; body } } \
+  else     { for (int i = 0; i < n; i++) { int g = 0; body } }
+
+/* the agg of column c over groups, with row i in group gid[i], or
+   every row in one group when gid is NULL. returns a column of one
+   row a group, or NULL with an error in err */
+lcol* lcol_aggregate(lcol* c, int agg, int* gid, int groups, char* name,
+                     char* func, lval** err) {
+  int n = c->rows;
+  if (c->kind == LCOL_STR && agg != LAGG_COUNT) {
+    *err = lval_err("function '%s' can only count column '%s' of strings.", func, c->name);
+    return NULL;
+  }
+  if (n == 0 && groups > 0 && (agg == LAGG_MIN || agg == LAGG_MAX) && c->kind == LCOL_INT) {
+    *err = lval_err("function '%s' passed no rows to find the %s of.",
+                    func, agg == LAGG_MIN ? "min" : "max");
+    return NULL;
+  }
+
+  int kind = agg == LAGG_COUNT ? LCOL_INT : agg == LAGG_MEAN ? LCOL_DBL : c->kind;
+  lcol* r = lcol_new(kind, name, groups);
+  long* counts = calloc(groups ? groups : 1, sizeof(long));
+  LGROUP_EACH(gid, n, counts[g]++;)
+  if (agg == LAGG_COUNT) {
+    memcpy(r->ints, counts, sizeof(long) * groups);
+    free(counts);
+    return r;
+  }
+
+  int overflow = 0;
+  if (c->kind == LCOL_INT) {
+    long* v = c->ints;
+    long* out = r->ints;
+    if (agg == LAGG_MEAN) {
+      double* sum = r->dbls;
+      for (int g = 0; g < groups; g++) { sum[g] = 0; }
+      LGROUP_EACH(gid, n, sum[g] += v[i];)
+    } else if (agg == LAGG_SUM) {
+      for (int g = 0; g < groups; g++) { out[g] = 0; }
+      LGROUP_EACH(gid, n, overflow |= __builtin_add_overflow(out[g], v[i], &out[g]);)
+    } else {
+      long first = agg == LAGG_MIN ? LONG_MAX : LONG_MIN;
+      for (int g = 0; g < groups; g++) { out[g] = first; }
+      if (agg == LAGG_MIN) { LGROUP_EACH(gid, n, if (v[i] < out[g]) { out[g] = v[i]; }) }
+      else                 { LGROUP_EACH(gid, n, if (v[i] > out[g]) { out[g] = v[i]; }) }
+    }
+  } else {
+    double* v = c->dbls;
+    double* out = r->dbls;
+    if (agg == LAGG_SUM || agg == LAGG_MEAN) {
+      for (int g = 0; g < groups; g++) { out[g] = 0; }
+      LGROUP_EACH(gid, n, out[g] += v[i];)
+    } else {
+      for (int g = 0; g < groups; g++) { out[g] = NAN; }
+      if (agg == LAGG_MIN) { LGROUP_EACH(gid, n, if (!(v[i] >= out[g])) { out[g] = v[i]; }) }
+      else                 { LGROUP_EACH(gid, n, if (!(v[i] <= out[g])) { out[g] = v[i]; }) }
+    }
+  }
+  if (agg == LAGG_MEAN) {
+    for (int g = 0; g < groups; g++) { r->dbls[g] /= counts[g]; }
+  }
+  free(counts);
+  if (overflow) {
+    lcol_release(r);
+    *err = lval_err("function '%s' overflowed summing column '%s'.", func, c->name);
+    return NULL;
+  }
+  return r;
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a, "-");
+/* the aggregate named by a string, or -1 */
+int lagg_of(lval* name) {
+  static char* aggs[] = { "count", "sum", "mean", "min", "max" };
+  for (int i = 0; i < 5; i++) {
+    if (strcmp(lval_cstr(name), aggs[i]) == 0) { return i; }
+  }
+  return -1;
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a, "*");
+/* (frame-aggregate f name agg) the count, sum, mean, min or max of a
+   column */
+lval* builtin_frame_aggregate(lenv* e, lval* a) {
+  LASSERT_NUM("frame-aggregate", a, 3);
+  LASSERT_TYPE("frame-aggregate", a, 0, LVAL_FRAME);
+  LASSERT_COLUMN("frame-aggregate", a, 1);
+  LASSERT_TYPE("frame-aggregate", a, 2, LVAL_STR);
+  int agg = lagg_of(a->cell[2]);
+  LASSERT(a, agg >= 0, "function 'frame-aggregate' passed unknown aggregate '%s'. "
+          "expected count, sum, mean, min or max", lval_cstr(a->cell[2]));
+
+  lframe* f = a->cell[0]->frame;
+  lcol* c = f->cols[lframe_find(f, a->cell[1])];
+  lval* err = NULL;
+  lcol* r = lcol_aggregate(c, agg, NULL, 1, c->name, "frame-aggregate", &err);
+  lval_del(a);
+  if (!r) { return err; }
+  lval* x = lcol_item(r, 0);
+  lcol_release(r);
+  return x;
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a, "/");
+/* (frame-group-by f key {name agg ...}), a frame with a row for each
+   distinct value of the key column, in order of first appearance,
+   and a column "name-agg" for each aggregate asked for */
+lval* builtin_frame_group_by(lenv* e, lval* a) {
+  LASSERT_NUM("frame-group-by", a, 3);
+  LASSERT_TYPE("frame-group-by", a, 0, LVAL_FRAME);
+  LASSERT_COLUMN("frame-group-by", a, 1);
+  LASSERT_TYPE("frame-group-by", a, 2, LVAL_QEXPR);
+  lframe* f = a->cell[0]->frame;
+  lcol* key = f->cols[lframe_find(f, a->cell[1])];
+  LASSERT(a, key->kind != LCOL_DBL,
+          "function 'frame-group-by' passed column '%s' of floats to group by.", key->name);
+  lval* spec = lval_unpack(a->cell[2]);
+  LASSERT(a, spec->count % 2 == 0,
+          "function 'frame-group-by' passed a column without an aggregate.");
+  for (int i = 0; i < spec->count; i++) {
+    LASSERT(a, spec->cell[i]->type == LVAL_STR,
+            "function 'frame-group-by' passed %s in its aggregates, expected %s.",
+            ltype_name(spec->cell[i]->type), ltype_name(LVAL_STR));
+  }
+  for (int i = 0; i < spec->count; i += 2) {
+    LASSERT(a, lframe_find(f, spec->cell[i]) >= 0,
+            "function 'frame-group-by' passed unknown column '%s'.", lval_cstr(spec->cell[i]));
+    LASSERT(a, lagg_of(spec->cell[i+1]) >= 0,
+            "function 'frame-group-by' passed unknown aggregate '%s'. "
+            "expected count, sum, mean, min or max", lval_cstr(spec->cell[i+1]));
+  }
+
+  /* number the groups in order of first appearance, remembering the
+     first row of each. string keys are numbered through their codes,
+     and int keys through an open addressed table */
+  int n = f->rows;
+  int* gid = malloc(sizeof(int) * (n ? n : 1));
+  int* first = malloc(sizeof(int) * (n ? n : 1));
+  int groups = 0;
+  if (key->kind == LCOL_STR) {
+    int* group_of = malloc(sizeof(int) * (key->dict->strs->count + 1));
+    for (int s = 0; s < key->dict->strs->count; s++) { group_of[s] = -1; }
+    for (int i = 0; i < n; i++) {
+      int* g = &group_of[key->codes[i]];
+      if (*g < 0) { first[groups] = i; *g = groups++; }
+      gid[i] = *g;
+    }
+    free(group_of);
+  } else {
+    int cap = 16;
+    while (cap < n * 2) { cap *= 2; }
+    int* slots = malloc(sizeof(int) * cap);
+    for (int s = 0; s < cap; s++) { slots[s] = -1; }
+    for (int i = 0; i < n; i++) {
+      long v = key->ints[i];
+      int s = lhash_mix(v) & (cap - 1);
+      while (slots[s] >= 0 && key->ints[first[slots[s]]] != v) { s = (s + 1) & (cap - 1); }
+      if (slots[s] < 0) { first[groups] = i; slots[s] = groups++; }
+      gid[i] = slots[s];
+    }
+    free(slots);
+  }
+
+  lframe* r = lframe_new(groups, 1 + spec->count / 2);
+  r->cols[0] = lcol_gather(key, key->name, first, groups);
+  lval* err = NULL;
+  for (int i = 0; i < spec->count && !err; i += 2) {
+    lcol* c = f->cols[lframe_find(f, spec->cell[i])];
+    char* agg = lval_cstr(spec->cell[i+1]);
+    char* name = malloc(strlen(c->name) + strlen(agg) + 2);
+    sprintf(name, "%s-%s", c->name, agg);
+    r->cols[1 + i / 2] = lcol_aggregate(c, lagg_of(spec->cell[i+1]), gid, groups,
+                                        name, "frame-group-by", &err);
+    free(name);
+  }
+  free(gid);
+  free(first);
+  lval_del(a);
+  if (err) {
+    lframe_release(r);
+    return err;
+  }
+  return lval_frame(r);
 }
 
-/* method to add a new variable to the environment */
-lval* builtin_var(lenv* e, lval* a, char* func) {
-  /* if input isn't a q-expression the compiler will attempt
-     to evaluate it immediately, so confirm input is q-expression */
-  LASSERT_TYPE(func, a, 0, LVAL_QEXPR);
+/* switches for each optimizer pass, toggled with the optimize builtin.
+   they apply to lambdas defined after they are changed */
+int lopt_fold = 1;
+int lopt_inline = 1;
+int lopt_branches = 1;
+int lopt_escape = 1;
+int lopt_fuse = 1;
+
+/* counts of optimizations performed, reported by optimize-stats */
+long lopt_folded = 0;
+long lopt_inlined = 0;
+long lopt_pruned = 0;
+/* intermediate lists no longer built by fused pipelines */
+long lopt_fused = 0;
+
+/* largest function body, in nodes, which will be inlined */
+#define LOPT_INLINE_SIZE 24
+/* how many levels of inlined bodies are themselves inlined into */
+#define LOPT_INLINE_DEPTH 4
+
+/* every name ever bound outside the global environment, as a formal,
+   a loop or dotimes variable, or a local made with =. scoping is
+   dynamic, so inside a call any of these may shadow the global of the
+   same name, and the optimizer never relies on their global binding */
+lintern lopt_locals = { 0 };
+
+/* note a name as bound locally. the first time, optimized bodies
+   recheck their bindings, as one may have relied on that name */
+void lopt_local(lval* k) {
+  int n = lopt_locals.count;
+  lintern_add(&lopt_locals, k->sym, strlen(k->sym));
+  if (lopt_locals.count != n) { lenv_generation++; }
+}
 
-  /* after definition, must be followed by a symbol list */
-  lval* syms = a->cell[0];
+/* has a name ever been bound locally */
+int lopt_shadowed(char* sym) {
+  int n = strlen(sym);
+  return lintern_find(&lopt_locals, sym, n, lhash_bytes(0, sym, n)) >= 0;
+}
 
-  /* ensure all elements in first symbol list are symbols */
-  for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-            "function '%s' cannot define non-symbol. "
-            "got %s, expected %s",
-            func, ltype_name(LVAL_SYM), ltype_name(syms->cell[i]->type));
-  }
+/* kept alongside an optimized lambda, shared between all its copies.
+   the optimized body is only valid while every global binding it
+   relied on is unchanged and unshadowed, otherwise the original body
+   is used */
+struct lopt {
+  int refs;
+  /* set once a relied upon binding is found to have changed */
+  int stale;
+  /* value of lenv_generation when the bindings were last checked */
+  long gen;
+  lenv* globals;
+  /* body as written, or NULL for a loop body, kept by its lloop */
+  lval* orig;
+  /* q-expression of {symbol value} pairs relied upon */
+  lval* deps;
+};
 
-  /* ensure that the method receives count-1
-     inputs, where the -1 comes from removing the
-     method name */
-  LASSERT(a, (syms->count == a->count-1),
-          "function '%s' passed wrong number of arguments. "
-          "got %i, expected %i",
-          func, a->count-1, syms->count);
+lopt* lopt_retain(lopt* o) {
+  o->refs++;
+  return o;
+}
 
-  /* assign variable names for each value in a */
-  for (int i = 0; i < syms->count; i++) {
-    /* if 'def' define globally, if 'put' define locally */
-    if (strcmp(func, "def") == 0) {
-      lenv_def(e, syms->cell[i], a->cell[i+1]);
-    }
-    if (strcmp(func, "=") == 0) {
-      lenv_put(e, syms->cell[i], a->cell[i+1]);
+void lopt_release(lopt* o) {
+  if (--o->refs > 0) { return; }
+  if (o->orig) { lval_del(o->orig); }
+  lval_del(o->deps);
+  free(o);
+}
+
+/* check that the bindings an optimized body relied on still hold */
+int lopt_valid(lopt* o) {
+  if (o->stale) { return 0; }
+  if (o->gen == lenv_generation) { return 1; }
+
+  for (int i = 0; i < o->deps->count; i++) {
+    lval* dep = o->deps->cell[i];
+    lval* v = lenv_peek(o->globals, dep->cell[0]);
+    if (!v || !lval_eq(v, dep->cell[1]) || lopt_shadowed(dep->cell[0]->sym)) {
+      o->stale = 1;
+      return 0;
     }
   }
+  o->gen = lenv_generation;
+  return 1;
+}
 
-  /* clean up */
-  lval_del(a);
-  /* return an empty s-expression on success */
-  return lval_sexpr();
+/* state for optimizing a single lambda body */
+typedef struct {
+  /* environment the lambda is defined in */
+  lenv* env;
+  lval* formals;
+  /* {symbol value} pairs relied upon so far */
+  lval* deps;
+  /* for escape analysis, uses of each formal seen in code positions
+     and the number of last uses marked */
+  int uses[64];
+  int marks;
+  /* set once a call which could look up a formal has been seen.
+     the walk is backwards, so this is a call evaluated later */
+  int opaque;
+} lopt_ctx;
+
+/* count occurrences of a symbol anywhere inside an lval */
+int lval_mentions(lval* v, char* sym) {
+  if (v->type == LVAL_SYM) { return strcmp(v->sym, sym) == 0; }
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return 0; }
+  if (v->packed) { return 0; }
+  int n = 0;
+  for (int i = 0; i < v->count; i++) { n += lval_mentions(v->cell[i], sym); }
+  return n;
 }
 
-/* builtin method to put a variable to the global scope */
-lval* builtin_def(lenv* e, lval* a) {
-  return builtin_var(e, a, "def");
+/* count occurrences of a symbol outside of any q-expression */
+int lopt_uses(lval* v, char* sym) {
+  if (v->type == LVAL_SYM) { return strcmp(v->sym, sym) == 0; }
+  if (v->type != LVAL_SEXPR) { return 0; }
+  int n = 0;
+  for (int i = 0; i < v->count; i++) { n += lopt_uses(v->cell[i], sym); }
+  return n;
 }
 
-/* builtin method to put a variable to the local scope */
-lval* builtin_put(lenv* e, lval* a) {
-  return builtin_var(e, a, "=");
+/* number of nodes in an lval */
+int lval_size(lval* v) {
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return 1; }
+  if (v->packed) { return 1 + v->count; }
+  int n = 1;
+  for (int i = 0; i < v->count; i++) { n += lval_size(v->cell[i]); }
+  return n;
 }
 
-/* method to compare numbers */
-lval* builtin_ord(lenv* e, lval* a, char* op) {
-  LASSERT_NUM(op, a, 2);
-  LASSERT_TYPE(op, a, 0, LVAL_NUM);
-  LASSERT_TYPE(op, a, 1, LVAL_NUM);
+/* look up a symbol the optimizer may rely on. only bindings in the
+   global environment qualify, and only for names never bound locally,
+   since a caller's formal or local of that name would be seen instead */
+lval* lopt_resolve(lopt_ctx* c, lval* k) {
+  if (k->type != LVAL_SYM || lopt_shadowed(k->sym)) { return NULL; }
 
-  int r;
-  if (strcmp(op, ">") == 0) {
-    r = (a->cell[0]->num > a->cell[1]->num);
-  }
-  if (strcmp(op, "<") == 0) {
-    r = (a->cell[0]->num < a->cell[1]->num);
-  }
-  if (strcmp(op, ">=") == 0) {
-    r = (a->cell[0]->num >= a->cell[1]->num);
+  lenv* e = c->env;
+  while (e->par) { e = e->par; }
+  return lenv_peek(e, k);
+}
+
+/* record that the optimized body relies on the binding of k */
+void lopt_depend(lopt_ctx* c, lval* k, lval* v) {
+  for (int i = 0; i < c->deps->count; i++) {
+    if (strcmp(c->deps->cell[i]->cell[0]->sym, k->sym) == 0) { return; }
   }
-  if (strcmp(op, "<=") == 0) {
-    r = (a->cell[0]->num <= a->cell[1]->num);
+  lval* dep = lval_qexpr();
+  lval_add(dep, lval_copy(k));
+  lval_add(dep, lval_copy(v));
+  lval_add(c->deps, dep);
+}
+
+/* replace formals with the matching arguments of a call,
+   outside of any q-expression */
+void lopt_subst(lval* v, lval* formals, lval* call) {
+  for (int i = 0; i < v->count; i++) {
+    lval* x = v->cell[i];
+    if (x->type == LVAL_SEXPR) { lopt_subst(x, formals, call); }
+    if (x->type != LVAL_SYM) { continue; }
+    for (int j = 0; j < formals->count; j++) {
+      if (strcmp(x->sym, formals->cell[j]->sym) == 0) {
+        v->cell[i] = lval_copy(call->cell[j+1]);
+        lval_del(x);
+        break;
+      }
+    }
   }
-  lval_del(a);
-  return lval_num(r);
 }
 
-/* builtins for comparison operators */
-lval* builtin_gt(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">");
+lval* lopt_expr(lopt_ctx* c, lval* x, int depth);
+
+/* optimize a q-expression which will be evaluated as code */
+lval* lopt_block(lopt_ctx* c, lval* q, int depth) {
+  lval_unpack(q)->type = LVAL_SEXPR;
+  lval* x = lopt_expr(c, q, depth);
+  if (x->type == LVAL_SEXPR) {
+    x->type = LVAL_QEXPR;
+    return x;
+  }
+  return lval_add(lval_qexpr(), x);
 }
 
-lval* builtin_lt(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<");
+/* optimize each element of a q-expression as its own expression */
+void lopt_arms(lopt_ctx* c, lval* q, int depth) {
+  lval_unpack(q);
+  for (int i = 0; i < q->count; i++) {
+    q->cell[i] = lopt_expr(c, q->cell[i], depth);
+  }
 }
 
+/* drop the branch of an if whose condition is a constant */
+lval* lopt_if(lopt_ctx* c, lval* x, lval* f, int depth) {
+  if (x->count != 4) { return x; }
+  for (int i = 2; i < 4; i++) {
+    if (x->cell[i]->type == LVAL_QEXPR) {
+      x->cell[i] = lopt_block(c, x->cell[i], depth);
+    }
+  }
+  lopt_depend(c, x->cell[0], f);
+
+  if (!lopt_branches || x->cell[1]->type != LVAL_NUM) { return x; }
+  int i = x->cell[1]->num ? 2 : 3;
+  if (x->cell[i]->type != LVAL_QEXPR) { return x; }
 
-lval* builtin_ge(lenv* e, lval* a) {
-  return builtin_ord(e, a, ">=");
+  lval* b = lval_unpack(lval_take(x, i));
+  b->type = LVAL_SEXPR;
+  lopt_pruned++;
+  return b->count == 1 ? lval_take(b, 0) : b;
 }
 
-lval* builtin_le(lenv* e, lval* a) {
-  return builtin_ord(e, a, "<=");
+/* evaluate a call to a pure builtin whose arguments are all constants */
+lval* lopt_fold_call(lopt_ctx* c, lval* x, lval* f) {
+  if (!lopt_fold || x->count < 2) { return x; }
+  int any = f->builtin == builtin_eq || f->builtin == builtin_ne;
+  for (int i = 1; i < x->count; i++) {
+    int t = x->cell[i]->type;
+    if (!(t == LVAL_NUM || t == LVAL_DBL
+          || (any && (t == LVAL_STR || t == LVAL_QEXPR)))) {
+      return x;
+    }
+  }
+
+  lval* args = lval_copy(x);
+  lval_del(lval_pop(args, 0));
+  lval* r = f->builtin(c->env, args);
+
+  /* leave errors such as division by zero to happen at runtime */
+  if (r->type == LVAL_ERR) {
+    lval_del(r);
+    return x;
+  }
+  lopt_depend(c, x->cell[0], f);
+  lval_del(x);
+  lopt_folded++;
+  return r;
 }
 
-/* builtin method to compare equality between two lvals */
-lval* builtin_cmp(lenv* e, lval* a, char* op) {
-  /* ensure two inputs to compare equality for */
-  LASSERT_NUM(op, a, 2);
-  int r;
-  if (strcmp(op, "==") == 0) {
-    r = lval_eq(a->cell[0], a->cell[1]);
+/* substitute the body of a small, non-recursive global function
+   for a call to it. each formal must either be used exactly once
+   or be passed a constant or symbol, so no argument expression is
+   duplicated or dropped by the substitution */
+lval* lopt_inline_call(lopt_ctx* c, lval* x, lval* g, int depth) {
+  if (!lopt_inline || depth >= LOPT_INLINE_DEPTH) { return x; }
+  if (g->builtin || g->memo || g->env->count != 0) { return x; }
+
+  lval* formals = g->formals;
+  lval* body = lval_unpack(g->opt ? g->opt->orig : g->body);
+  if (formals->count != x->count-1) { return x; }
+  if (lval_size(body) > LOPT_INLINE_SIZE) { return x; }
+  if (lval_mentions(body, "=") || lval_mentions(body, x->cell[0]->sym)) {
+    return x;
   }
-  if (strcmp(op, "!=") == 0) {
-    r = !lval_eq(a->cell[0], a->cell[1]);
+
+  for (int i = 0; i < formals->count; i++) {
+    char* sym = formals->cell[i]->sym;
+    if (strcmp(sym, "&") == 0) { return x; }
+    int uses = 0;
+    for (int j = 0; j < body->count; j++) { uses += lopt_uses(body->cell[j], sym); }
+    if (uses != lval_mentions(body, sym)) { return x; }
+    if (uses != 1 && x->cell[i+1]->type == LVAL_SEXPR) { return x; }
   }
-  lval_del(a);
-  return lval_num(r);
+
+  lval* b = lval_copy(body);
+  b->type = LVAL_SEXPR;
+  lopt_subst(b, formals, x);
+  lopt_depend(c, x->cell[0], g);
+  lval_del(x);
+  lopt_inlined++;
+  return lopt_expr(c, b, depth+1);
 }
 
-/* builtins for equals and not equals */
-lval* builtin_eq(lenv* e, lval* a) {
-  return builtin_cmp(e, a, "==");
+/* is x a call to the builtin b with argc arguments */
+int lopt_calls(lopt_ctx* c, lval* x, lbuiltin b, int argc) {
+  if (x->type != LVAL_SEXPR || x->count != argc+1) { return 0; }
+  lval* f = lopt_resolve(c, x->cell[0]);
+  return f && f->type == LVAL_FUN && f->builtin == b;
 }
 
-lval* builtin_ne(lenv* e, lval* a) {
-  return builtin_cmp(e, a, "!=");
+/* does a name still refer to the builtin b where the lambda is defined */
+int lopt_has(lopt_ctx* c, char* name, lbuiltin b) {
+  lval* k = lval_sym(name);
+  lval* f = lopt_resolve(c, k);
+  lval_del(k);
+  return f && f->type == LVAL_FUN && f->builtin == b;
 }
 
-/* method to add builtin method to the environment */
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+/* a symbol naming a builtin for rewritten code to call, relying on it */
+lval* lopt_use(lopt_ctx* c, char* name) {
   lval* k = lval_sym(name);
-  lval* v = lval_builtin(func);
-  lenv_put(e, k, v);
-  lval_del(k); lval_del(v);
+  lopt_depend(c, k, lopt_resolve(c, k));
+  return k;
 }
 
-lval* builtin_if(lenv* e, lval* a) {
-  /* verify that there are three inputs, a number 0 or 1 */
-  /* and two possible q-expressions to evaluat */
-  LASSERT_NUM("if", a, 3);
-  LASSERT_TYPE("if", a, 0, LVAL_NUM);
-  LASSERT_TYPE("if", a, 1, LVAL_QEXPR);
-  LASSERT_TYPE("if", a, 2, LVAL_QEXPR);
-  /* mark both expressions as s-expressions to make them evaluable */
-  lval* x;
-  a->cell[1]->type = LVAL_SEXPR;
-  a->cell[2]->type = LVAL_SEXPR;
+/* is x a call to a stage put in place of map or filter by fusion */
+int lopt_fused_stage(lval* x) {
+  if (x->type != LVAL_SEXPR || x->count != 3) { return 0; }
+  lval* f = x->cell[0];
+  return f->type == LVAL_FUN && (f->builtin == builtin_fused_map
+                                 || f->builtin == builtin_fused_filter);
+}
 
-  /* if the boolean is true, evaluate the first expression,
-     otherwise evaluate the second */
-  if (a->cell[0]->num) {
-    x = lval_eval(e, lval_pop(a, 1));
+/* fuse a map, filter, foldl, sum or product with the map or filter
+   which builds its list, so that the items are pulled through both
+   at once as a lazy sequence. inner calls are fused first, so a whole
+   pipeline ends up as one chain of stages, realized into a list only
+   if the outermost call is a map or filter itself. the stages are the
+   builtins themselves rather than symbols, as they have no name */
+lval* lopt_fuse_call(lopt_ctx* c, lval* x, lval* f) {
+  int stage = f->builtin == builtin_map || f->builtin == builtin_filter;
+  int n = f->builtin == builtin_foldl ? 3 : stage ? 2 : 1;
+  if (!lopt_fuse || x->count != n+1) { return x; }
+
+  lval* src = x->cell[n];
+  int realized = lopt_calls(c, src, builtin_realize, 1)
+    && lopt_fused_stage(src->cell[1]);
+  int mapped = lopt_calls(c, src, builtin_map, 2);
+  if (!realized && !mapped && !lopt_calls(c, src, builtin_filter, 2)) {
+    return x;
+  }
+  if (!lopt_has(c, "realize", builtin_realize)) { return x; }
+
+  /* an already fused pipeline is used without realizing it,
+     otherwise the source becomes the stage before this one */
+  if (realized) {
+    x->cell[n] = lval_take(src, 1);
   } else {
-    x = lval_eval(e, lval_pop(a, 2));
+    lopt_depend(c, src->cell[0], lopt_resolve(c, src->cell[0]));
+    lval_del(src->cell[0]);
+    src->cell[0] = lval_builtin(mapped ? builtin_fused_map : builtin_fused_filter);
   }
-  lval_del(a);
+  lopt_depend(c, x->cell[0], f);
+  lopt_fused++;
+  if (!stage) { return x; }
+
+  lval_del(x->cell[0]);
+  x->cell[0] = lval_builtin(f->builtin == builtin_map
+                            ? builtin_fused_map : builtin_fused_filter);
+  return lval_add(lval_add(lval_sexpr(), lopt_use(c, "realize")), x);
+}
+
+/* optimize a single expression, consuming it and returning the result */
+lval* lopt_expr(lopt_ctx* c, lval* x, int depth) {
+  if (x->type != LVAL_SEXPR) { return x; }
+  for (int i = 0; i < x->count; i++) {
+    x->cell[i] = lopt_expr(c, x->cell[i], depth);
+  }
+
+  /* a single expression evaluates to itself */
+  if (x->count == 1) { return lval_take(x, 0); }
+  if (x->count == 0) { return x; }
+
+  lval* f = lopt_resolve(c, x->cell[0]);
+  if (!f || f->type != LVAL_FUN) { return x; }
+
+  /* q-expressions passed to special forms are code as well */
+  if (f->builtin == builtin_if) { return lopt_if(c, x, f, depth); }
+  if (f->builtin == builtin_select || f->builtin == builtin_case
+      || f->builtin == builtin_let) {
+    for (int i = 1; i < x->count; i++) {
+      if (x->cell[i]->type != LVAL_QEXPR) { continue; }
+      if (f->builtin == builtin_let) {
+        x->cell[i] = lopt_block(c, x->cell[i], depth);
+      } else {
+        lopt_arms(c, x->cell[i], depth);
+      }
+    }
+    lopt_depend(c, x->cell[0], f);
+    return x;
+  }
+
+  if (f->builtin == builtin_add || f->builtin == builtin_sub
+      || f->builtin == builtin_mul || f->builtin == builtin_div
+      || f->builtin == builtin_gt || f->builtin == builtin_lt
+      || f->builtin == builtin_ge || f->builtin == builtin_le
+      || f->builtin == builtin_eq || f->builtin == builtin_ne) {
+    return lopt_fold_call(c, x, f);
+  }
+
+  if (f->builtin == builtin_map || f->builtin == builtin_filter
+      || f->builtin == builtin_foldl || f->builtin == builtin_sum
+      || f->builtin == builtin_product) {
+    return lopt_fuse_call(c, x, f);
+  }
+
+  if (!f->builtin) { return lopt_inline_call(c, x, f, depth); }
   return x;
 }
 
-lval* lval_read(mpc_ast_t* t);
+/* index of the formal named by a symbol, or -1 */
+int lesc_formal(lopt_ctx* c, lval* k) {
+  if (strcmp(k->sym, "&") == 0) { return -1; }
+  for (int i = 0; i < c->formals->count; i++) {
+    if (strcmp(c->formals->cell[i]->sym, k->sym) == 0) { return i; }
+  }
+  return -1;
+}
 
-/* load and evaluate a file */
-lval* builtin_load(lenv* e, lval* a) {
-  LASSERT_NUM("load", a, 1);
-  LASSERT_TYPE("load", a, 0, LVAL_STR);
+unsigned long lesc_live(lopt_ctx* c, lval* x, unsigned long live);
 
-  /* parse file given by string name */
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, aLisp, &r)) {
+/* liveness of a q-expression which will be evaluated as code */
+unsigned long lesc_live_block(lopt_ctx* c, lval* q, unsigned long live) {
+  lval_unpack(q)->type = LVAL_SEXPR;
+  live = lesc_live(c, q, live);
+  q->type = LVAL_QEXPR;
+  return live;
+}
 
-    /* read file contents */
-    lval* expr = lval_read(r.output);
-    mpc_ast_delete(r.output);
+/* are all the arguments from i on {expression expression} pairs */
+int lesc_arms(lval* x, int i) {
+  for (; i < x->count; i++) {
+    if (x->cell[i]->type != LVAL_QEXPR || x->cell[i]->count < 2) { return 0; }
+    lval_unpack(x->cell[i]);
+  }
+  return 1;
+}
 
-    /* evaluate each expression */
-    while (expr->count) {
-      lval* x = lval_eval(e, lval_pop(expr, 0));
-      /* print any errors encountered */
-      if (x->type == LVAL_ERR) { lval_println(x); }
-      lval_del(x);
+/* builtins which never evaluate code of the caller's, so a call to one
+   can't look up a formal through the dynamic scope. anything else
+   called, such as a user function, may read a formal after its last
+   use in the body */
+int lesc_pure(lopt_ctx* c, lval* k) {
+  lval* f = lopt_resolve(c, k);
+  if (!f || f->type != LVAL_FUN) { return 0; }
+  lbuiltin b = f->builtin;
+  int pure = b == builtin_add || b == builtin_sub || b == builtin_mul
+    || b == builtin_div || b == builtin_gt || b == builtin_lt
+    || b == builtin_ge || b == builtin_le || b == builtin_eq
+    || b == builtin_ne || b == builtin_list || b == builtin_head
+    || b == builtin_tail || b == builtin_join || b == builtin_len
+    || b == builtin_take || b == builtin_drop || b == builtin_split
+    || b == builtin_do;
+  if (pure) { lopt_depend(c, k, f); }
+  return pure;
+}
+
+/* liveness analysis, walking a function body in reverse order of
+   evaluation. takes the set of formals which may be used after x
+   and returns the set which may be used from x on. any use of a
+   formal which is not live after it is marked as its last use, so
+   long as no call made later in the body could still look it up */
+unsigned long lesc_live(lopt_ctx* c, lval* x, unsigned long live) {
+  if (x->type == LVAL_SYM) {
+    int i = lesc_formal(c, x);
+    if (i < 0) { return live; }
+    c->uses[i]++;
+    if (!(live & (1UL << i)) && !c->opaque) {
+      x->last_use = 1;
+      c->marks++;
     }
+    return live | (1UL << i);
+  }
+  if (x->type != LVAL_SEXPR || x->count == 0) { return live; }
+
+  /* only one branch of an if is evaluated */
+  lval* f = lopt_resolve(c, x->cell[0]);
+  if (f && f->type == LVAL_FUN && f->builtin == builtin_if && x->count == 4
+      && x->cell[2]->type == LVAL_QEXPR && x->cell[3]->type == LVAL_QEXPR) {
+    lopt_depend(c, x->cell[0], f);
+    live = lesc_live_block(c, x->cell[2], live)
+         | lesc_live_block(c, x->cell[3], live);
+    return lesc_live(c, x->cell[1], live);
+  }
 
-    /* cleanup */
-    lval_del(expr);
-    lval_del(a);
+  /* each arm's condition or key is evaluated in turn, and
+     either its expression is evaluated or the next arm is tried */
+  if (f && f->type == LVAL_FUN && (f->builtin == builtin_select
+      || f->builtin == builtin_case)) {
+    int first = f->builtin == builtin_case ? 2 : 1;
+    if (x->count >= first && lesc_arms(x, first)) {
+      lopt_depend(c, x->cell[0], f);
+      unsigned long next = live;
+      for (int i = x->count-1; i >= first; i--) {
+        lval* arm = x->cell[i];
+        next = lesc_live(c, arm->cell[0],
+                         lesc_live(c, arm->cell[1], live) | next);
+      }
+      return first == 2 ? lesc_live(c, x->cell[1], next) : next;
+    }
+  }
 
-    return lval_sexpr();
+  if (f && f->type == LVAL_FUN && f->builtin == builtin_let
+      && x->count == 2 && x->cell[1]->type == LVAL_QEXPR) {
+    lopt_depend(c, x->cell[0], f);
+    return lesc_live_block(c, x->cell[1], live);
+  }
 
-  } else {
-    /* get parse error as a string */
-    char* err_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
+  /* otherwise every element is evaluated once, left to right, and
+     then the call is made. a lone element is not called */
+  if (x->count > 1 && !lesc_pure(c, x->cell[0])) { c->opaque = 1; }
+  for (int i = x->count-1; i >= 0; i--) {
+    live = lesc_live(c, x->cell[i], live);
+  }
+  return live;
+}
 
-    /* create a new error message using the parse error */
-    lval* err = lval_err("could not load Library %s", err_msg);
-    free(err_msg);
-    lval_del(a);
+/* clear the last use marks on a symbol throughout an lval */
+int lesc_unmark(lval* v, char* sym) {
+  if (v->type == LVAL_SYM) {
+    int marked = v->last_use && strcmp(v->sym, sym) == 0;
+    if (marked) { v->last_use = 0; }
+    return marked;
+  }
+  if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return 0; }
+  if (v->packed) { return 0; }
+  int n = 0;
+  for (int i = 0; i < v->count; i++) { n += lesc_unmark(v->cell[i], sym); }
+  return n;
+}
 
-    return err;
+/* escape analysis over a lambda body. a formal which only appears in
+   code positions never escapes the call, so its last use on each path
+   through the body can take its value instead of copying it. a formal
+   appearing inside quoted data may be evaluated any number of times
+   later, so it is left alone. returns the number of uses marked */
+int lesc_mark(lopt_ctx* c, lval* body) {
+  if (c->formals->count > 64) { return 0; }
+  for (int i = 0; i < c->formals->count; i++) { c->uses[i] = 0; }
+  c->marks = 0;
+  c->opaque = 0;
+
+  lesc_live_block(c, body, 0);
+
+  for (int i = 0; i < c->formals->count; i++) {
+    char* sym = c->formals->cell[i]->sym;
+    if (c->uses[i] != lval_mentions(body, sym)) {
+      c->marks -= lesc_unmark(body, sym);
+    }
   }
+  return c->marks;
 }
 
-lval* builtin_print(lenv* e, lval* a) {
-  for (int i = 0; i < a->count; i++) {
-    lval_print(a->cell[i]); putchar(' ');
+/* optimize the body of a newly defined lambda. the original is kept
+   in case any global binding the optimized body relies on changes */
+void lopt_lambda(lenv* e, lval* f) {
+  /* local definitions could shadow anything the optimizer resolves */
+  if (lval_mentions(f->body, "=")) { return; }
+
+  long before = lopt_folded + lopt_inlined + lopt_pruned + lopt_fused;
+  lopt_ctx c;
+  c.env = e;
+  c.formals = f->formals;
+  c.deps = lval_qexpr();
+  lval* body = lopt_block(&c, lval_copy(f->body), 0);
+  int marks = lopt_escape ? lesc_mark(&c, body) : 0;
+
+  /* nothing changed, so there's no need to keep anything */
+  if (lopt_folded + lopt_inlined + lopt_pruned + lopt_fused == before
+      && marks == 0) {
+    lval_del(body);
+    lval_del(c.deps);
+    return;
   }
 
-  putchar('\n');
-  lval_del(a);
+  lopt* o = malloc(sizeof(lopt));
+  o->refs = 1;
+  o->stale = 0;
+  o->gen = lenv_generation;
+  o->globals = e;
+  while (o->globals->par) { o->globals = o->globals->par; }
+  o->orig = f->body;
+  o->deps = c.deps;
+
+  f->body = body;
+  f->opt = o;
+}
 
-  return lval_sexpr();
+/* resolve the builtins a loop body calls, and the numbers bound to
+   global names it reads, as lopt_resolve allows, noting the value on
+   each symbol. only code the loop walker runs itself is looked at,
+   which is calls and the literal branches of if, while code handed
+   to any other special form is left as it is */
+void lopt_heads(lopt_ctx* c, lval* x) {
+  lval_unpack(x);
+  if (x->count == 0) { return; }
+
+  lval* f = lopt_resolve(c, x->cell[0]);
+  if (f && lval_is_special(f)
+      && f->builtin != builtin_if && f->builtin != builtin_do) {
+    return;
+  }
+  int branches = f && f->type == LVAL_FUN && f->builtin == builtin_if;
+
+  for (int i = 0; i < x->count; i++) {
+    lval* y = x->cell[i];
+    if (y->type == LVAL_SEXPR || (branches && i >= 2 && y->type == LVAL_QEXPR)) {
+      lopt_heads(c, y);
+      continue;
+    }
+    lval* v = lopt_resolve(c, y);
+    if (!v || y->bound) { continue; }
+    if ((i == 0 && v->type == LVAL_FUN && v->builtin)
+        || (i > 0 && v->type == LVAL_NUM)) {
+      lopt_depend(c, y, v);
+      y->bound = lval_copy(v);
+    }
+  }
 }
 
-lval* builtin_error(lenv* e, lval* a) {
-  LASSERT_NUM("error", a, 1);
-  LASSERT_TYPE("error", a, 0, LVAL_STR);
+/* prepare a loop body to be walked again and again, returning the
+   prepared copy as an s-expression. it is only valid along with *o */
+lval* lopt_loop(lenv* e, lval* body, lopt** o) {
+  lopt_ctx c;
+  memset(&c, 0, sizeof(c));
+  c.env = e;
+  c.deps = lval_qexpr();
+  lval* x = lval_copy(body);
+  x->type = LVAL_SEXPR;
+  lopt_heads(&c, x);
+
+  lopt* p = malloc(sizeof(lopt));
+  p->refs = 1;
+  p->stale = 0;
+  p->gen = lenv_generation;
+  p->globals = e;
+  while (p->globals->par) { p->globals = p->globals->par; }
+  p->orig = NULL;
+  p->deps = c.deps;
+  *o = p;
+  return x;
+}
 
-  lval* err = lval_err(a->cell[0]->str);
+/* toggle an optimizer pass by name, returning its previous setting */
+lval* builtin_optimize(lenv* e, lval* a) {
+  LASSERT_NUM("optimize", a, 2);
+  LASSERT_TYPE("optimize", a, 0, LVAL_STR);
+  LASSERT_TYPE("optimize", a, 1, LVAL_NUM);
+
+  char* name = lval_cstr(a->cell[0]);
+  int* pass = NULL;
+  if (strcmp(name, "fold") == 0)     { pass = &lopt_fold; }
+  if (strcmp(name, "inline") == 0)   { pass = &lopt_inline; }
+  if (strcmp(name, "branches") == 0) { pass = &lopt_branches; }
+  if (strcmp(name, "escape") == 0)   { pass = &lopt_escape; }
+  if (strcmp(name, "fuse") == 0)     { pass = &lopt_fuse; }
+  LASSERT(a, pass != NULL,
+          "function optimize passed unknown pass '%s'. "
+          "expected fold, inline, branches, escape or fuse", name);
+
+  int prev = *pass;
+  *pass = a->cell[1]->num != 0;
+  lval_del(a);
+  return lval_num(prev);
+}
 
+/* report {folded inlined pruned fused} counts of optimizations performed,
+   where fused is the number of intermediate lists fusion removed.
+   takes a single ignored argument, so it can be called as (optimize-stats ()) */
+lval* builtin_optimize_stats(lenv* e, lval* a) {
+  LASSERT_NUM("optimize-stats", a, 1);
   lval_del(a);
-  return err;
+
+  lval* x = lval_qexpr();
+  lval_add(x, lval_num(lopt_folded));
+  lval_add(x, lval_num(lopt_inlined));
+  lval_add(x, lval_num(lopt_pruned));
+  lval_add(x, lval_num(lopt_fused));
+  return x;
+}
+
+/* report {bound moved cells}: arguments moved into environments,
+   last uses moved out of them, and the top level lvals those moves
+   avoided copying. takes a single ignored argument like optimize-stats */
+lval* builtin_escape_stats(lenv* e, lval* a) {
+  LASSERT_NUM("escape-stats", a, 1);
+  lval_del(a);
+
+  lval* x = lval_qexpr();
+  lval_add(x, lval_num(lesc_bound));
+  lval_add(x, lval_num(lesc_moved));
+  lval_add(x, lval_num(lesc_cells));
+  return x;
+}
+
+/* bind a name to one of the standard ports */
+void lenv_add_port(lenv* e, char* name, lport* p) {
+  lval* k = lval_sym(name);
+  lval* v = lval_port(p);
+  lenv_put(e, k, v);
+  lval_del(k); lval_del(v);
 }
 
 /* method to add the basic functions to a newly initialized environment */
 void lenv_add_builtins(lenv* e) {
   /* list functions */
-  lenv_add_builtin(e, "list", builtin_list);
-  lenv_add_builtin(e, "head", builtin_head);
-  lenv_add_builtin(e, "tail", builtin_tail);
-  lenv_add_builtin(e, "eval", builtin_eval);
-  lenv_add_builtin(e, "join", builtin_join);
+  lenv_add_builtin(e, "list",     builtin_list);
+  lenv_add_builtin(e, "head",     builtin_head);
+  lenv_add_builtin(e, "tail",     builtin_tail);
+  lenv_add_builtin(e, "eval",     builtin_eval);
+  lenv_add_builtin(e, "join",     builtin_join);
+  lenv_add_builtin(e, "len",      builtin_len);
+  lenv_add_builtin(e, "nth",      builtin_nth);
+  lenv_add_builtin(e, "last",     builtin_last);
+  lenv_add_builtin(e, "take",     builtin_take);
+  lenv_add_builtin(e, "drop",     builtin_drop);
+  lenv_add_builtin(e, "split",    builtin_split);
+  lenv_add_builtin(e, "contains", builtin_contains);
+  lenv_add_builtin(e, "map",      builtin_map);
+  lenv_add_builtin(e, "filter",   builtin_filter);
+  lenv_add_builtin(e, "foldl",    builtin_foldl);
+  lenv_add_builtin(e, "sum",      builtin_sum);
+  lenv_add_builtin(e, "product",  builtin_product);
+
+  /* lazy sequence functions */
+  lenv_add_builtin(e, "range",       builtin_range);
+  lenv_add_builtin(e, "range-from",  builtin_range_from);
+  lenv_add_builtin(e, "lazy",        builtin_lazy);
+  lenv_add_builtin(e, "lazy-map",    builtin_lazy_map);
+  lenv_add_builtin(e, "lazy-filter", builtin_lazy_filter);
+  lenv_add_builtin(e, "lazy-take",   builtin_lazy_take);
+  lenv_add_builtin(e, "lazy-drop",   builtin_lazy_drop);
+  lenv_add_builtin(e, "realize",     builtin_realize);
+
+  /* mapped file functions */
+  lenv_add_builtin(e, "read-file",  builtin_read_file);
+  lenv_add_builtin(e, "file-lines", builtin_file_lines);
+  lenv_add_builtin(e, "fold-lines", builtin_fold_lines);
 
   /* mathematical functions */
   lenv_add_builtin(e, "+", builtin_add);
@@ -895,8 +9870,78 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "*", builtin_mul);
   lenv_add_builtin(e, "/", builtin_div);
 
+  /* vector functions */
+  lenv_add_builtin(e, "vec",         builtin_vec);
+  lenv_add_builtin(e, "vec-list",    builtin_vec_list);
+  lenv_add_builtin(e, "vec-range",   builtin_vec_range);
+  lenv_add_builtin(e, "vec-len",     builtin_vec_len);
+  lenv_add_builtin(e, "vec-nth",     builtin_vec_nth);
+  lenv_add_builtin(e, "vec-sum",     builtin_vec_sum);
+  lenv_add_builtin(e, "vec-product", builtin_vec_product);
+  lenv_add_builtin(e, "vec-min",     builtin_vec_min);
+  lenv_add_builtin(e, "vec-max",     builtin_vec_max);
+  lenv_add_builtin(e, "vec-dot",     builtin_vec_dot);
+  lenv_add_builtin(e, "vec-isa",     builtin_vec_isa);
+
+  /* hash map functions */
+  lenv_add_builtin(e, "hash",       builtin_hash);
+  lenv_add_builtin(e, "hash-get",   builtin_hash_get);
+  lenv_add_builtin(e, "hash-set",   builtin_hash_set);
+  lenv_add_builtin(e, "hash-set!",  builtin_hash_set_in_place);
+  lenv_add_builtin(e, "hash-del",   builtin_hash_del);
+  lenv_add_builtin(e, "hash-del!",  builtin_hash_del_in_place);
+  lenv_add_builtin(e, "hash-keys",  builtin_hash_keys);
+  lenv_add_builtin(e, "hash-count", builtin_hash_count);
+
+  /* persistent map and set functions */
+  lenv_add_builtin(e, "dict",      builtin_dict);
+  lenv_add_builtin(e, "assoc",     builtin_assoc);
+  lenv_add_builtin(e, "dissoc",    builtin_dissoc);
+  lenv_add_builtin(e, "lookup",    builtin_lookup);
+  lenv_add_builtin(e, "dict-keys", builtin_dict_keys);
+  lenv_add_builtin(e, "set",       builtin_set);
+  lenv_add_builtin(e, "set-add",   builtin_set_add);
+  lenv_add_builtin(e, "set-del",   builtin_set_del);
+  lenv_add_builtin(e, "set-has",   builtin_set_has);
+  lenv_add_builtin(e, "set-list",  builtin_set_list);
+  lenv_add_builtin(e, "count",     builtin_hamt_count);
+
+  /* json functions */
+  lenv_add_builtin(e, "json-parse",     builtin_json_parse);
+  lenv_add_builtin(e, "json-fold",      builtin_json_fold);
+  lenv_add_builtin(e, "json-stringify", builtin_json_stringify);
+
+  /* serialization functions */
+  lenv_add_builtin(e, "serialize",   builtin_serialize);
+  lenv_add_builtin(e, "deserialize", builtin_deserialize);
+  lenv_add_builtin(e, "load-data",   builtin_load_data);
+
+  /* frame functions */
+  lenv_add_builtin(e, "read-csv",        builtin_read_csv);
+  lenv_add_builtin(e, "frame",           builtin_frame);
+  lenv_add_builtin(e, "frame-rows",      builtin_frame_rows);
+  lenv_add_builtin(e, "frame-names",     builtin_frame_names);
+  lenv_add_builtin(e, "frame-col",       builtin_frame_col);
+  lenv_add_builtin(e, "frame-row",       builtin_frame_row);
+  lenv_add_builtin(e, "frame-select",    builtin_frame_select);
+  lenv_add_builtin(e, "frame-where",     builtin_frame_where);
+  lenv_add_builtin(e, "frame-aggregate", builtin_frame_aggregate);
+  lenv_add_builtin(e, "frame-group-by",  builtin_frame_group_by);
+
+  /* conditional and sequencing functions */
+  lenv_add_builtin(e, "if",     builtin_if);
+  lenv_add_builtin(e, "select", builtin_select);
+  lenv_add_builtin(e, "case",   builtin_case);
+  lenv_add_builtin(e, "do",     builtin_do);
+  lenv_add_builtin(e, "let",    builtin_let);
+
+  /* iteration functions */
+  lenv_add_builtin(e, "while",   builtin_while);
+  lenv_add_builtin(e, "dotimes", builtin_dotimes);
+  lenv_add_builtin(e, "loop",    builtin_loop);
+  lenv_add_builtin(e, "recur",   builtin_recur);
+
   /* comparison functions */
-  lenv_add_builtin(e, "if", builtin_if);
   lenv_add_builtin(e, "==", builtin_eq);
   lenv_add_builtin(e, "!=", builtin_ne);
   lenv_add_builtin(e, ">",  builtin_gt);
@@ -909,10 +9954,50 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "=",   builtin_put);
   lenv_add_builtin(e, "\\",  builtin_lambda);
 
+  /* memoization functions */
+  lenv_add_builtin(e, "memo",       builtin_memo);
+  lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+
+  /* optimizer functions */
+  lenv_add_builtin(e, "optimize",       builtin_optimize);
+  lenv_add_builtin(e, "optimize-stats", builtin_optimize_stats);
+  lenv_add_builtin(e, "escape-stats",   builtin_escape_stats);
+
   /* string functions */
-  lenv_add_builtin(e, "load",  builtin_load);
-  lenv_add_builtin(e, "error", builtin_error);
-  lenv_add_builtin(e, "print", builtin_print);
+  lenv_add_builtin(e, "load",        builtin_load);
+  lenv_add_builtin(e, "error",       builtin_error);
+  lenv_add_builtin(e, "print",       builtin_print);
+  lenv_add_builtin(e, "flush",       builtin_flush);
+  lenv_add_builtin(e, "to-string",   builtin_to_string);
+  lenv_add_builtin(e, "str-len",     builtin_str_len);
+  lenv_add_builtin(e, "str-concat",  builtin_str_concat);
+  lenv_add_builtin(e, "substr",      builtin_substr);
+  lenv_add_builtin(e, "str-find",    builtin_str_find);
+  lenv_add_builtin(e, "str-split",   builtin_str_split);
+  lenv_add_builtin(e, "str-join",    builtin_str_join);
+  lenv_add_builtin(e, "str-replace", builtin_str_replace);
+  lenv_add_builtin(e, "str-builder", builtin_str_builder);
+
+  /* regex functions */
+  lenv_add_builtin(e, "re-match",    builtin_re_match);
+  lenv_add_builtin(e, "re-find-all", builtin_re_find_all);
+  lenv_add_builtin(e, "re-replace",  builtin_re_replace);
+
+  /* grammar functions */
+  lenv_add_builtin(e, "grammar",    builtin_grammar);
+  lenv_add_builtin(e, "parse",      builtin_parse);
+  lenv_add_builtin(e, "parse-file", builtin_parse_file);
+
+  /* port functions */
+  lenv_add_builtin(e, "open",                  builtin_open);
+  lenv_add_builtin(e, "open-string",           builtin_open_string);
+  lenv_add_builtin(e, "read-line",             builtin_read_line);
+  lenv_add_builtin(e, "read-bytes",            builtin_read_bytes);
+  lenv_add_builtin(e, "write",                 builtin_write);
+  lenv_add_builtin(e, "close",                 builtin_close);
+  lenv_add_builtin(e, "with-output-to-string", builtin_with_output_to_string);
+  lenv_add_port(e, "stdin",  lport_new(LPORT_IN, 0));
+  lenv_add_port(e, "stdout", lport_new(LPORT_OUT, 1));
 }
 
 /* method to call functions */
@@ -920,6 +10005,9 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
   /* if builtin, just call */
   if (f->builtin) { return f->builtin(e, a); }
 
+  /* memoized functions go through their cache */
+  if (f->memo) { return lrecur_escaped(lmemo_call(e, f->memo, a)); }
+
   /* record argument counts */
   int given = a->count;
   int total = f->formals->count;
@@ -945,17 +10033,25 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
                         "symbol '&' not followed by a single symbol.");
       }
 
-      /* bind next formal to the remaining arguments */
+      /* bind next formal to the remaining arguments, handing the
+         list over to the environment and leaving an empty one behind */
       lval* nsym = lval_pop(f->formals, 0);
-      lenv_put(f->env, nsym, builtin_list(e, a));
+      lesc_bound++;
+      lesc_cells += lesc_cells_of(a);
+      lenv_bind(f->env, nsym, builtin_list(e, a));
+      a = lval_sexpr();
       lval_del(sym); lval_del(nsym);
       break;
     }
+    /* arguments are owned by the call, so they are moved into
+       the environment rather than copied */
     lval* val = lval_pop(a, 0);
-    lenv_put(f->env, sym, val);
+    lesc_bound++;
+    lesc_cells += lesc_cells_of(val);
+    lenv_bind(f->env, sym, val);
 
     /* clean up */
-    lval_del(sym); lval_del(val);
+    lval_del(sym);
   }
   /* argument list is now bound, so can be cleaned up */
   lval_del(a);
@@ -981,7 +10077,12 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
   /* evaluated function, otherwise evaluate */
   if (f->formals->count == 0) {
     f->env->par = e;
-    return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+    /* fall back to the body as written if anything
+       the optimizer relied on has been redefined */
+    lval* body = f->opt && !lopt_valid(f->opt) ? f->opt->orig : f->body;
+    /* a recur can't reach a loop outside the function */
+    return lrecur_escaped(
+      builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(body))));
   } else {
     return lval_copy(f);
   }
@@ -989,13 +10090,30 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
 
 /* method to evaluate an s-expression */
 lval* lval_eval_sexpr(lenv* e, lval* v) {
+  /* if the head names a special form, hand over the unevaluated
+     arguments. a user definition of the same name shadows it */
+  if (v->count > 0 && v->cell[0]->type == LVAL_SYM) {
+    lval* f = lenv_peek(e, v->cell[0]);
+    if (f && lval_is_special(f)) {
+      lbuiltin special = f->builtin;
+      lval_del(lval_pop(v, 0));
+      return special(e, v);
+    }
+  }
+
   /* evaluate children */
   for (int i = 0; i < v->count; i++) {
     v->cell[i] = lval_eval(e, v->cell[i]);
   }
+  return lval_call_sexpr(e, v);
+}
 
-  /* check for errors */
+/* call the function at the head of an s-expression whose children
+   have all been evaluated */
+lval* lval_call_sexpr(lenv* e, lval* v) {
+  /* check for errors. a recur passed as an argument is one too */
   for (int i = 0; i < v->count; i++) {
+    if (v->count > 1) { v->cell[i] = lrecur_escaped(v->cell[i]); }
     if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
   }
 
@@ -1026,7 +10144,17 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
 lval* lval_eval(lenv* e, lval* v) {
   /* check to see if symbol is defined, if not, return an error */
   if (v->type == LVAL_SYM) {
-    lval* x = lenv_get(e, v);
+    lval* x;
+    /* the last use of a parameter takes its value rather than a copy */
+    if (v->last_use) {
+      x = lenv_move(e, v);
+      if (x->type != LVAL_ERR) {
+        lesc_moved++;
+        lesc_cells += lesc_cells_of(x);
+      }
+    } else {
+      x = lenv_get(e, v);
+    }
     lval_del(v);
     return x;
   }
@@ -1036,11 +10164,48 @@ lval* lval_eval(lenv* e, lval* v) {
   return v;
 }
 
+/* read a number too large for a long, nine digits to a limb */
+lval* lval_read_big(char* s) {
+  long sign = 1;
+  if (*s == '-') { sign = -1; s++; }
+  int len = strlen(s);
+  lval* v = lval_big(sign, (len + 8) / 9);
+
+  /* fill limbs from the least significant end of the string */
+  for (int i = 0; i < v->count; i++) {
+    int end = len - 9*i;
+    int start = end > 9 ? end - 9 : 0;
+    uint32_t limb = 0;
+    for (int j = start; j < end; j++) { limb = limb * 10 + (s[j] - '0'); }
+    v->limbs[i] = limb;
+  }
+  return lbig_norm(v);
+}
+
 /* defines how to read a number and convert to an lval */
 lval* lval_read_num(mpc_ast_t* t) {
+  /* anything with a decimal point or exponent is a float */
+  if (strpbrk(t->contents, ".eE")) { return lval_dbl(strtod(t->contents, NULL)); }
   errno = 0;
   long x = strtol(t->contents, NULL, 10);
-  return errno != ERANGE ? lval_num(x) : lval_err("invalid number");
+  return errno != ERANGE ? lval_num(x) : lval_read_big(t->contents);
+}
+
+/* defines how to read a vector literal, which is a vector of floats
+   if any element is written as a float */
+lval* lval_read_vec(mpc_ast_t* t) {
+  lval* q = lval_qexpr();
+  for (int i = 0; i < t->children_num; i++) {
+    if (strstr(t->children[i]->tag, "number")) {
+      lval_add(q, lval_read_num(t->children[i]));
+    }
+  }
+  lval* v = builtin_vec(NULL, lval_add(lval_sexpr(), q));
+  if (v->type == LVAL_ERR) {
+    lval_del(v);
+    return lval_err("vector literal elements must fit in 64 bits");
+  }
+  return v;
 }
 
 /* defines how to read a string to convert to an lval */
@@ -1064,6 +10229,7 @@ lval* lval_read(mpc_ast_t* t) {
   if (strstr(t->tag, "number")) { return lval_read_num(t); }
   if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
   if (strstr(t->tag, "string")) { return lval_read_str(t); }
+  if (strstr(t->tag, "vector")) { return lval_read_vec(t); }
 
   /* if root, or s-expr then create an empty list */
   lval* x = NULL;
@@ -1093,28 +10259,40 @@ int main(int argc, char** argv) {
   Comment = mpc_new("comment");
   Sexpr   = mpc_new("sexpr");
   Qexpr   = mpc_new("qexpr");
+  Vector  = mpc_new("vector");
   Expr    = mpc_new("expr");
   aLisp   = mpc_new("aLisp");
 
   /* define the parsers with the following language */
   mpca_lang(MPCA_LANG_DEFAULT,
   "                                                         \
-    number  : /-?[0-9]+/ ;                                  \
+    number  : /-?([0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?|inf\\.0|nan\\.0)/ ; \
     symbol  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;            \
     string  : /\"(\\\\.|[^\"])*\"/ ;                        \
     comment : /;[^\\r\\n]*/ ;                               \
     sexpr   : '(' <expr>* ')' ;                             \
     qexpr   : '{' <expr>* '}' ;                             \
+    vector  : \"#[\" <number>* ']' ;                        \
     expr    : <number>  | <symbol> | <string>               \
-            | <comment> | <sexpr>  | <qexpr> ;              \
+            | <comment> | <sexpr>  | <qexpr>  | <vector> ;  \
     aLisp  : /^/ <expr>* /$/ ;                              \
   ",
-  Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, aLisp);
+  Number, Symbol, String, Comment, Sexpr, Qexpr, Vector, Expr, aLisp);
+  /* buffer standard output, a line at a time for a terminal */
+  lout.cap = LBUF_SIZE;
+  lout.data = malloc(LBUF_SIZE);
+  lout.file = stdout;
+  lout.fd = -1;
+  lout.line = isatty(fileno(stdout));
+
   /* print version and instructions */
   puts("lisp: by ayyjohn");
   puts("aLisp Version 0.0.0.0.14");
   puts("Press Ctrl+c to Exit\n");
 
+  /* pick the fastest vector kernels the cpu supports */
+  lvec_init();
+
   /* set up environment */
   lenv* e = lenv_new();
   /* add base methods */
@@ -1126,10 +10304,13 @@ int main(int argc, char** argv) {
 
     /* load standard library */
     lval* x = builtin_load(e, lval_add(lval_sexpr(), lval_str("stdlib.al")));
-    if (x->type == LVAL_ERR) { puts("could not load standard library"); }
+    if (x->type == LVAL_ERR) { lbuf_puts(&lout, "could not load standard library\n"); }
     lval_del(x);
     while (1) {
 
+      /* write out any output before prompting */
+      lbuf_flush(&lout);
+
       /* prompt user */
       char* input = readline("aLisp> ");
 
@@ -1140,12 +10321,13 @@ int main(int argc, char** argv) {
       mpc_result_t r;
       if (mpc_parse("<stdin>", input, aLisp, &r)) {
         /* on success evaluate the AST */
-        lval* x = lval_eval(e, lval_read(r.output));
+        lval* x = lrecur_escaped(lval_eval(e, lval_read(r.output)));
         lval_println(x);
         lval_del(x);
         mpc_ast_delete(r.output);
       } else {
         /* otherwise print the error */
+        lbuf_flush(&lout);
         mpc_err_print(r.error);
         mpc_err_delete(r.error);
       }
@@ -1173,9 +10355,11 @@ int main(int argc, char** argv) {
     }
   }
   lenv_del(e);
+  lbuf_flush(&lout);
+  free(lout.data);
   /* clean up parsers */
-  mpc_cleanup(8,
+  mpc_cleanup(9,
               Number, Symbol, String, Comment,
-              Sexpr, Qexpr, Expr, aLisp);
+              Sexpr, Qexpr, Vector, Expr, aLisp);
   return 0;
 }
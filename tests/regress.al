@@ -0,0 +1,71 @@
+; regression checks, run from the top of the tree with
+; ./aLisp tests/regress.al
+; each check prints "ok" and its name, or "FAIL" with what it got
+
+(load "stdlib.al")
+
+(fun {check name got want} {
+  if (== got want)
+    {print "ok" name}
+    {print "FAIL" name "got" got "expected" want}
+})
+
+; blocks of numbers are stored packed, and must be unpacked to run
+(check "with-output-to-string numeric block"
+  (with-output-to-string {1}) "")
+(check "with-output-to-string float block"
+  (with-output-to-string {2.5}) "")
+(check "with-output-to-string prints"
+  (with-output-to-string {print 1 2}) "1 2 \n")
+
+; strings without escapes are slices of the text parsed, and
+; appending to one must not write over the bytes after it
+(def {json-strs} (json-parse "[\"hello\", \"world\"]"))
+(check "json slice append"
+  (str-concat (eval (head json-strs)) "XY") "helloXY")
+(check "json slice append leaves source"
+  (eval (head (tail json-strs))) "world")
+
+; deserialized strings are slices of the data too
+(def {data-strs} (deserialize (serialize {"hello" "world"})))
+(check "serialize round trip" data-strs {"hello" "world"})
+(check "deserialized slice append"
+  (str-concat (eval (head data-strs)) "XY") "helloXY")
+(check "deserialized slice append leaves source"
+  (eval (head (tail data-strs))) "world")
+(check "json round trip"
+  (json-parse (json-stringify {"hello" "world"})) {"hello" "world"})
+
+; nth evaluates the item it picks in the caller's scope, where a call
+; may read a formal after its last use in the body
+(fun {regress-g _} {len x})
+(fun {regress-f x} {do (len x) (nth 0 {(regress-g 1)})})
+(check "nth reads formal after last use" (regress-f {1 2 3}) 3)
+
+; the list builtins take partial application as the stdlib versions did
+(check "partial take" ((take 2) {1 2 3}) {1 2})
+(def {regress-sqall} (map (\ {x} {* x x})))
+(check "partial map" (regress-sqall {1 2 3}) {1 4 9})
+(check "partial foldl" ((foldl + 10) {1 2}) 13)
+(check "partial filter" ((filter (\ {x} {> x 1})) {1 2 3}) {2 3})
+
+; case compares as == does
+(check "case matches float and integer"
+  (case 1.0 {1 "one"} {otherwise "other"}) "one")
+
+; loop bodies are walked in place, rebinding numbers without boxing
+(check "counting loop"
+  (loop {i 0 acc 0} {if (< i 1000) {recur (+ i 1) (+ acc i)} {acc}}) 499500)
+(check "loop recur overflows into a big number"
+  (loop {i 9223372036854775806 k 0} {if (< k 2) {recur (+ i 1) (+ k 1)} {(- i 9223372036854775800)}}) 8)
+(def {regress-step} 1)
+(check "loop sees a global redefined by its body"
+  (loop {i 0} {if (< i 9) {do (if (== i 1) {def {regress-step} 3} {()}) (recur (+ i regress-step))} {i}}) 10)
+
+; an infinite range carries on past the largest long in big numbers
+(check "range-from past the largest long"
+  (realize (lazy-take 3 (range-from 9223372036854775806)))
+  {9223372036854775806 9223372036854775807 9223372036854775808})
+(check "range-from past the smallest long"
+  (realize (lazy-take 3 (range-from -9223372036854775807 -1)))
+  {-9223372036854775807 -9223372036854775808 -9223372036854775809})